@@ -263,7 +263,7 @@ struct mbim_device {
 	size_t segment_bytes_remaining;
 	void *segment;
 	struct l_queue *pending_commands;
-	struct l_queue *sent_commands;
+	struct l_hashmap *sent_commands;
 	struct l_queue *notifications;
 	struct message_assembly *assembly;
 	struct l_idle *close_io;
@@ -316,9 +316,10 @@ static void pending_command_free(void *pending)
 	l_free(pending);
 }
 
-static void pending_command_cancel_by_gid(void *data, void *user_data)
+static void pending_command_cancel_by_gid(const void *key, void *value,
+							void *user_data)
 {
-	struct pending_command *pending = data;
+	struct pending_command *pending = value;
 	uint32_t gid = L_PTR_TO_UINT(user_data);
 
 	if (pending->gid != gid)
@@ -500,12 +501,13 @@ static bool command_write_handler(struct l_io *io, void *user_data)
 				"fragment me");
 	}
 
-	l_queue_push_tail(device->sent_commands, pending);
+	l_hashmap_insert(device->sent_commands,
+				L_UINT_TO_PTR(pending->tid), pending);
 
 	if (l_queue_isempty(device->pending_commands))
 		return false;
 
-	if (l_queue_length(device->sent_commands) >= device->max_outstanding)
+	if (l_hashmap_size(device->sent_commands) >= device->max_outstanding)
 		return false;
 
 	/* Only continue sending messages if the connection is ready */
@@ -519,8 +521,7 @@ static void dispatch_command_done(struct mbim_device *device,
 			_mbim_message_get_header(message, NULL);
 	struct pending_command *pending;
 
-	pending = l_queue_remove_if(device->sent_commands,
-					pending_command_match_tid,
+	pending = l_hashmap_remove(device->sent_commands,
 					L_UINT_TO_PTR(L_LE32_TO_CPU(hdr->tid)));
 	if (!pending)
 		goto done;
@@ -917,7 +918,7 @@ struct mbim_device *mbim_device_new(int fd, uint32_t max_segment_size)
 	l_io_set_write_handler(device->io, open_write_handler, device, NULL);
 
 	device->pending_commands = l_queue_new();
-	device->sent_commands = l_queue_new();
+	device->sent_commands = l_hashmap_new();
 	device->notifications = l_queue_new();
 	device->assembly = message_assembly_new();
 
@@ -958,7 +959,7 @@ void mbim_device_unref(struct mbim_device *device)
 		device->disconnect_destroy(device->disconnect_data);
 
 	l_queue_destroy(device->pending_commands, pending_command_free);
-	l_queue_destroy(device->sent_commands, pending_command_free);
+	l_hashmap_destroy(device->sent_commands, pending_command_free);
 	l_queue_destroy(device->notifications, notification_free);
 	message_assembly_free(device->assembly);
 	l_free(device);
@@ -1075,7 +1076,7 @@ uint32_t mbim_device_send(struct mbim_device *device, uint32_t gid,
 	if (!device->is_ready)
 		goto done;
 
-	if (l_queue_length(device->sent_commands) >= device->max_outstanding)
+	if (l_hashmap_size(device->sent_commands) >= device->max_outstanding)
 		goto done;
 
 	l_io_set_write_handler(device->io, command_write_handler,
@@ -1099,9 +1100,7 @@ bool mbim_device_cancel(struct mbim_device *device, uint32_t tid)
 		return true;
 	}
 
-	pending = l_queue_find(device->sent_commands,
-					pending_command_match_tid,
-					L_UINT_TO_PTR(tid));
+	pending = l_hashmap_lookup(device->sent_commands, L_UINT_TO_PTR(tid));
 
 	if (!pending)
 		return false;
@@ -1119,7 +1118,7 @@ bool mbim_device_cancel_group(struct mbim_device *device, uint32_t gid)
 					pending_command_free_by_gid,
 					L_UINT_TO_PTR(gid));
 
-	l_queue_foreach(device->sent_commands,
+	l_hashmap_foreach(device->sent_commands,
 					pending_command_cancel_by_gid,
 					L_UINT_TO_PTR(gid));
 
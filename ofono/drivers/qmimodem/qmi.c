@@ -40,6 +40,8 @@
 #include "qmi.h"
 #include "ctl.h"
 
+#define QMI_READ_SIZE 4096
+
 typedef void (*qmi_message_func_t)(uint16_t message, uint16_t length,
 					const void *buffer, void *user_data);
 
@@ -59,11 +61,12 @@ struct qmi_device {
 	int fd;
 	GIOChannel *io;
 	bool close_on_unref;
+	GByteArray *read_buf;
 	guint read_watch;
 	guint write_watch;
 	GQueue *req_queue;
-	GQueue *control_queue;
-	GQueue *service_queue;
+	GHashTable *control_pending;
+	GHashTable *service_pending;
 	GQueue *discovery_queue;
 	uint8_t next_control_tid;
 	uint16_t next_service_tid;
@@ -220,6 +223,11 @@ static void __request_free(gpointer data, gpointer user_data)
 	g_free(req);
 }
 
+static void __request_destroy(gpointer data)
+{
+	__request_free(data, NULL);
+}
+
 static gint __request_compare(gconstpointer a, gconstpointer b)
 {
 	const struct qmi_request *req = a;
@@ -666,9 +674,11 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 	hdr = req->buf;
 
 	if (hdr->service == QMI_SERVICE_CONTROL)
-		g_queue_push_tail(device->control_queue, req);
+		g_hash_table_insert(device->control_pending,
+					GUINT_TO_POINTER(req->tid), req);
 	else
-		g_queue_push_tail(device->service_queue, req);
+		g_hash_table_insert(device->service_pending,
+					GUINT_TO_POINTER(req->tid), req);
 
 	g_free(req->buf);
 	req->buf = NULL;
@@ -696,6 +706,56 @@ static void wakeup_writer(struct qmi_device *device)
 				can_write_data, device, write_watch_destroy);
 }
 
+static bool __tid_in_use(struct qmi_device *device, GHashTable *pending,
+								uint16_t tid)
+{
+	if (g_hash_table_contains(pending, GUINT_TO_POINTER(tid)))
+		return true;
+
+	return g_queue_find_custom(device->req_queue, GUINT_TO_POINTER(tid),
+						__request_compare) != NULL;
+}
+
+/*
+ * Control transactions use 1..255, service transactions 256..65535.
+ * Ids still waiting for a response are skipped when the counter wraps
+ * around, 0 is returned if every id is taken.
+ */
+static uint16_t __control_tid_alloc(struct qmi_device *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < 255; i++) {
+		uint8_t tid = device->next_control_tid++;
+
+		if (device->next_control_tid == 0)
+			device->next_control_tid = 1;
+
+		if (!__tid_in_use(device, device->control_pending, tid))
+			return tid;
+	}
+
+	return 0;
+}
+
+static uint16_t __service_tid_alloc(struct qmi_device *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < 65536 - 256; i++) {
+		uint16_t tid = device->next_service_tid++;
+
+		if (device->next_service_tid < 256)
+			device->next_service_tid = 256;
+
+		if (!__tid_in_use(device, device->service_pending, tid))
+			return tid;
+	}
+
+	return 0;
+}
+
+/* Returns the transaction id, or 0 after freeing req if none is free */
 static uint16_t __request_submit(struct qmi_device *device,
 				struct qmi_request *req)
 {
@@ -706,20 +766,23 @@ static uint16_t __request_submit(struct qmi_device *device,
 	if (mux->service == QMI_SERVICE_CONTROL) {
 		struct qmi_control_hdr *hdr;
 
+		req->tid = __control_tid_alloc(device);
+		if (!req->tid)
+			goto error;
+
 		hdr = req->buf + QMI_MUX_HDR_SIZE;
 		hdr->type = 0x00;
-		hdr->transaction = device->next_control_tid++;
-		if (device->next_control_tid == 0)
-			device->next_control_tid = 1;
-		req->tid = hdr->transaction;
+		hdr->transaction = req->tid;
 	} else {
 		struct qmi_service_hdr *hdr;
+
+		req->tid = __service_tid_alloc(device);
+		if (!req->tid)
+			goto error;
+
 		hdr = req->buf + QMI_MUX_HDR_SIZE;
 		hdr->type = 0x00;
-		hdr->transaction = device->next_service_tid++;
-		if (device->next_service_tid < 256)
-			device->next_service_tid = 256;
-		req->tid = hdr->transaction;
+		hdr->transaction = GUINT16_TO_LE(req->tid);
 	}
 
 	g_queue_push_tail(device->req_queue, req);
@@ -727,6 +790,12 @@ static uint16_t __request_submit(struct qmi_device *device,
 	wakeup_writer(device);
 
 	return req->tid;
+
+error:
+	__debug_device(device, "no free transaction id");
+	__request_free(req, NULL);
+
+	return 0;
 }
 
 static void service_notify(gpointer key, gpointer value, gpointer user_data)
@@ -788,7 +857,6 @@ static void handle_packet(struct qmi_device *device,
 		const struct qmi_control_hdr *control = buf;
 		const struct qmi_message_hdr *msg;
 		unsigned int tid;
-		GList *list;
 
 		/* Ignore control messages with client identifier */
 		if (hdr->client != 0x00)
@@ -809,19 +877,17 @@ static void handle_packet(struct qmi_device *device,
 			return;
 		}
 
-		list = g_queue_find_custom(device->control_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
+		req = g_hash_table_lookup(device->control_pending,
+						GUINT_TO_POINTER(tid));
+		if (!req)
 			return;
 
-		req = list->data;
-
-		g_queue_delete_link(device->control_queue, list);
+		g_hash_table_steal(device->control_pending,
+						GUINT_TO_POINTER(tid));
 	} else {
 		const struct qmi_service_hdr *service = buf;
 		const struct qmi_message_hdr *msg;
 		unsigned int tid;
-		GList *list;
 
 		msg = buf + QMI_SERVICE_HDR_SIZE;
 
@@ -838,14 +904,13 @@ static void handle_packet(struct qmi_device *device,
 			return;
 		}
 
-		list = g_queue_find_custom(device->service_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
+		req = g_hash_table_lookup(device->service_pending,
+						GUINT_TO_POINTER(tid));
+		if (!req)
 			return;
 
-		req = list->data;
-
-		g_queue_delete_link(device->service_queue, list);
+		g_hash_table_steal(device->service_pending,
+						GUINT_TO_POINTER(tid));
 	}
 
 	if (req->callback)
@@ -854,44 +919,46 @@ static void handle_packet(struct qmi_device *device,
 	__request_free(req, NULL);
 }
 
-static gboolean received_data(GIOChannel *channel, GIOCondition cond,
-							gpointer user_data)
+/*
+ * Returns the number of bytes consumed.  A frame that has not been fully
+ * received yet is left in the buffer for the next read.
+ */
+static gsize process_frames(struct qmi_device *device,
+					const unsigned char *buf, gsize size)
 {
-	struct qmi_device *device = user_data;
-	struct qmi_mux_hdr *hdr;
-	unsigned char buf[2048];
-	ssize_t bytes_read;
-	uint16_t offset;
-
-	if (cond & G_IO_NVAL)
-		return FALSE;
-
-	bytes_read = read(device->fd, buf, sizeof(buf));
-	if (bytes_read < 0)
-		return TRUE;
-
-	__hexdump('<', buf, bytes_read,
-				device->debug_func, device->debug_data);
+	const struct qmi_mux_hdr *hdr;
+	gsize offset = 0;
 
-	offset = 0;
+	while (offset < size) {
+		uint32_t len;
 
-	while (offset < bytes_read) {
-		uint16_t len;
+		/* Resync on the next frame byte if the stream got garbled */
+		if (buf[offset] != 0x01) {
+			offset += 1;
+			continue;
+		}
 
 		/* Check if QMI mux header fits into packet */
-		if (bytes_read - offset < QMI_MUX_HDR_SIZE)
+		if (size - offset < QMI_MUX_HDR_SIZE)
 			break;
 
-		hdr = (void *) (buf + offset);
+		hdr = (const void *) (buf + offset);
 
 		/* Check for fixed frame and flags value */
-		if (hdr->frame != 0x01 || hdr->flags != 0x80)
-			break;
+		if (hdr->flags != 0x80) {
+			offset += 1;
+			continue;
+		}
 
 		len = GUINT16_FROM_LE(hdr->length) + 1;
 
-		/* Check that packet size matches frame size */
-		if (bytes_read - offset < len)
+		if (len < QMI_MUX_HDR_SIZE) {
+			offset += 1;
+			continue;
+		}
+
+		/* Wait for the rest of the frame */
+		if (size - offset < len)
 			break;
 
 		__debug_msg(' ', buf + offset, len,
@@ -902,6 +969,54 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 		offset += len;
 	}
 
+	return offset;
+}
+
+static gboolean received_data(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct qmi_device *device = user_data;
+	GByteArray *rbuf = device->read_buf;
+	guint pending = rbuf->len;
+	gsize want = QMI_READ_SIZE;
+	ssize_t bytes_read;
+	gsize consumed;
+
+	if (cond & G_IO_NVAL)
+		return FALSE;
+
+	/* Make room for all of a large frame we have the header of */
+	if (pending >= QMI_MUX_HDR_SIZE) {
+		const struct qmi_mux_hdr *hdr = (const void *) rbuf->data;
+		gsize len = GUINT16_FROM_LE(hdr->length) + 1;
+
+		if (len > pending + want)
+			want = len - pending;
+	}
+
+	g_byte_array_set_size(rbuf, pending + want);
+
+	bytes_read = read(device->fd, rbuf->data + pending, want);
+	if (bytes_read <= 0) {
+		g_byte_array_set_size(rbuf, pending);
+		return TRUE;
+	}
+
+	g_byte_array_set_size(rbuf, pending + bytes_read);
+
+	__hexdump('<', rbuf->data + pending, bytes_read,
+				device->debug_func, device->debug_data);
+
+	/* Handlers may drop the last reference to the device */
+	qmi_device_ref(device);
+
+	consumed = process_frames(device, rbuf->data, rbuf->len);
+
+	if (consumed > 0)
+		g_byte_array_remove_range(rbuf, 0, consumed);
+
+	qmi_device_unref(device);
+
 	return TRUE;
 }
 
@@ -966,6 +1081,8 @@ struct qmi_device *qmi_device_new(int fd)
 		}
 	}
 
+	device->read_buf = g_byte_array_sized_new(QMI_READ_SIZE);
+
 	device->io = g_io_channel_unix_new(device->fd);
 
 	g_io_channel_set_encoding(device->io, NULL, NULL);
@@ -978,8 +1095,10 @@ struct qmi_device *qmi_device_new(int fd)
 	g_io_channel_unref(device->io);
 
 	device->req_queue = g_queue_new();
-	device->control_queue = g_queue_new();
-	device->service_queue = g_queue_new();
+	device->control_pending = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, __request_destroy);
+	device->service_pending = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, __request_destroy);
 	device->discovery_queue = g_queue_new();
 
 	device->service_list = g_hash_table_new_full(g_direct_hash,
@@ -1011,11 +1130,8 @@ void qmi_device_unref(struct qmi_device *device)
 
 	__debug_device(device, "device %p free", device);
 
-	g_queue_foreach(device->control_queue, __request_free, NULL);
-	g_queue_free(device->control_queue);
-
-	g_queue_foreach(device->service_queue, __request_free, NULL);
-	g_queue_free(device->service_queue);
+	g_hash_table_destroy(device->control_pending);
+	g_hash_table_destroy(device->service_pending);
 
 	g_queue_foreach(device->req_queue, __request_free, NULL);
 	g_queue_free(device->req_queue);
@@ -1040,6 +1156,8 @@ void qmi_device_unref(struct qmi_device *device)
 	g_free(device->version_str);
 	g_free(device->version_list);
 
+	g_byte_array_free(device->read_buf, TRUE);
+
 	if (device->shutting_down)
 		device->destroyed = true;
 	else
@@ -1263,14 +1381,11 @@ static gboolean discover_reply(gpointer user_data)
 			req = list->data;
 			g_queue_delete_link(device->req_queue, list);
 		} else {
-			list = g_queue_find_custom(device->control_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-
-			if (list) {
-				req = list->data;
-				g_queue_delete_link(device->control_queue,
-								list);
-			}
+			req = g_hash_table_lookup(device->control_pending,
+							GUINT_TO_POINTER(tid));
+			if (req)
+				g_hash_table_steal(device->control_pending,
+							GUINT_TO_POINTER(tid));
 		}
 	}
 
@@ -1316,6 +1431,10 @@ bool qmi_device_discover(struct qmi_device *device, qmi_discover_func_t func,
 			NULL, 0, discover_callback, data);
 
 	tid = __request_submit(device, req);
+	if (!tid) {
+		g_free(data);
+		return false;
+	}
 
 	data->tid = tid;
 
@@ -1337,7 +1456,8 @@ static void release_client(struct qmi_device *device,
 			release_req, sizeof(release_req),
 			func, user_data);
 
-	__request_submit(device, req);
+	if (!__request_submit(device, req))
+		func(QMI_CTL_RELEASE_CLIENT_ID, 0, NULL, user_data);
 }
 
 static void shutdown_destroy(gpointer user_data)
@@ -1431,7 +1551,10 @@ bool qmi_device_sync(struct qmi_device *device,
 			NULL, 0,
 			qmi_device_sync_callback, func_data);
 
-	__request_submit(device, req);
+	if (!__request_submit(device, req)) {
+		g_free(func_data);
+		return false;
+	}
 
 	return true;
 }
@@ -2062,7 +2185,10 @@ static bool service_create(struct qmi_device *device,
 			client_req, sizeof(client_req),
 			service_create_callback, data);
 
-	__request_submit(device, req);
+	if (!__request_submit(device, req)) {
+		g_free(data);
+		return false;
+	}
 
 	data->timeout = g_timeout_add_seconds(8, service_create_reply, data);
 	__qmi_device_discovery_started(device, &data->super);
@@ -2309,6 +2435,8 @@ uint16_t qmi_service_send(struct qmi_service *service,
 	qmi_param_free(param);
 
 	tid = __request_submit(device, req);
+	if (!tid)
+		g_free(data);
 
 	return tid;
 }
@@ -2337,14 +2465,13 @@ bool qmi_service_cancel(struct qmi_service *service, uint16_t id)
 
 		g_queue_delete_link(device->req_queue, list);
 	} else {
-		list = g_queue_find_custom(device->service_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
+		req = g_hash_table_lookup(device->service_pending,
+						GUINT_TO_POINTER(tid));
+		if (!req)
 			return false;
 
-		req = list->data;
-
-		g_queue_delete_link(device->service_queue, list);
+		g_hash_table_steal(device->service_pending,
+						GUINT_TO_POINTER(tid));
 	}
 
 	service_send_free(req->user_data);
@@ -2385,6 +2512,20 @@ static GQueue *remove_client(GQueue *queue, uint8_t client)
 	return new_queue;
 }
 
+static gboolean remove_pending_client(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct qmi_request *req = value;
+	uint8_t client = GPOINTER_TO_UINT(user_data);
+
+	if (!req->client || req->client != client)
+		return FALSE;
+
+	service_send_free(req->user_data);
+
+	return TRUE;
+}
+
 bool qmi_service_cancel_all(struct qmi_service *service)
 {
 	struct qmi_device *device;
@@ -2402,8 +2543,9 @@ bool qmi_service_cancel_all(struct qmi_service *service)
 	device->req_queue = remove_client(device->req_queue,
 						service->client_id);
 
-	device->service_queue = remove_client(device->service_queue,
-							service->client_id);
+	g_hash_table_foreach_remove(device->service_pending,
+					remove_pending_client,
+					GUINT_TO_POINTER(service->client_id));
 
 	return true;
 }
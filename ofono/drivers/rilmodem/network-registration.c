@@ -548,14 +548,14 @@ static void ril_cops_list_cb(struct ril_msg *message, gpointer user_data)
 		 * valid values currently.
 		 */
 		if (g_ril_vendor(nd->ril) == OFONO_RIL_VENDOR_MTK) {
-			char *t = parcel_r_string(&rilp);
+			char buf[8];
+			const char *t = parcel_r_string_buf(&rilp, buf,
+								sizeof(buf));
 
-			if (strcmp(t, "3G") == 0)
+			if (g_strcmp0(t, "3G") == 0)
 				tech = ACCESS_TECHNOLOGY_UTRAN;
 			else
 				tech = ACCESS_TECHNOLOGY_GSM;
-
-			g_free(t);
 		}
 
 		if (lalpha == NULL && salpha == NULL)
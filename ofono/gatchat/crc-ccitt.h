@@ -31,3 +31,5 @@ static inline guint16 crc_ccitt_byte(guint16 crc, const guint8 c)
 {
 	return (crc >> 8) ^ crc_ccitt_table[(crc ^ c) & 0xff];
 }
+
+guint16 crc_ccitt(guint16 crc, const guint8 *buf, gsize len);
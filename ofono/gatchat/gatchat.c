@@ -70,9 +70,28 @@ struct at_notify_node {
 typedef gboolean (*node_remove_func)(struct at_notify_node *node,
 					gpointer user_data);
 
+struct at_notify_trie;
+
 struct at_notify {
 	GSList *nodes;
 	gboolean pdu;
+	struct at_notify_trie *trie;		/* Index node for our prefix */
+};
+
+/*
+ * Prefix trie indexing the registered unsolicited notifications, so that
+ * an incoming line is matched in O(prefix length) instead of checking
+ * every registered prefix.  Children are kept in a singly-linked sibling
+ * list, nodes are only pruned outside of notify dispatch.  The root stands
+ * for the empty prefix, which is rejected on registration, so it never
+ * carries a notification and matching starts at its children.
+ */
+struct at_notify_trie {
+	char c;
+	struct at_notify *notify;
+	struct at_notify_trie *parent;
+	struct at_notify_trie *children;
+	struct at_notify_trie *next;
 };
 
 struct at_chat {
@@ -84,6 +103,7 @@ struct at_chat {
 	GQueue *command_queue;			/* Command queue */
 	guint cmd_bytes_written;		/* bytes written from cmd */
 	GHashTable *notify_list;		/* List of notification reg */
+	struct at_notify_trie notify_trie;	/* Prefix index of notify_list */
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	guint read_so_far;			/* Number of bytes processed */
@@ -91,6 +111,8 @@ struct at_chat {
 	GAtDebugFunc debugf;			/* debugging output function */
 	gpointer debug_data;			/* Data to pass to debug func */
 	char *pdu_notify;			/* Unsolicited Resp w/ PDU */
+	char *line_buf;				/* Lines wrapping the rbuf */
+	gsize line_buf_size;			/* Size of line_buf */
 	GSList *response_lines;			/* char * lines of the response */
 	char *wakeup;				/* command sent to wakeup modem */
 	gint timeout_source;
@@ -147,10 +169,76 @@ static void at_notify_node_destroy(gpointer data, gpointer user_data)
 	g_free(node);
 }
 
+static struct at_notify_trie *at_notify_trie_child(struct at_notify_trie *t,
+							char c)
+{
+	struct at_notify_trie *child;
+
+	for (child = t->children; child; child = child->next)
+		if (child->c == c)
+			return child;
+
+	return NULL;
+}
+
+static void at_notify_trie_prune(struct at_notify_trie *t)
+{
+	struct at_notify_trie *parent;
+	struct at_notify_trie **pp;
+
+	while (t->parent && t->notify == NULL && t->children == NULL) {
+		parent = t->parent;
+
+		for (pp = &parent->children; *pp != t; pp = &(*pp)->next)
+			;
+
+		*pp = t->next;
+		g_free(t);
+
+		t = parent;
+	}
+}
+
+static struct at_notify_trie *at_notify_trie_insert(struct at_notify_trie *t,
+							const char *prefix)
+{
+	struct at_notify_trie *child;
+
+	/* The root is never matched against, see above */
+	if (*prefix == '\0')
+		return NULL;
+
+	for (; *prefix; prefix++) {
+		child = at_notify_trie_child(t, *prefix);
+
+		if (child == NULL) {
+			child = g_try_new0(struct at_notify_trie, 1);
+			if (child == NULL) {
+				at_notify_trie_prune(t);
+				return NULL;
+			}
+
+			child->c = *prefix;
+			child->parent = t;
+			child->next = t->children;
+			t->children = child;
+		}
+
+		t = child;
+	}
+
+	return t;
+}
+
 static void at_notify_destroy(gpointer user_data)
 {
 	struct at_notify *notify = user_data;
 
+	if (notify->trie) {
+		notify->trie->notify = NULL;
+		at_notify_trie_prune(notify->trie);
+	}
+
 	g_slist_foreach(notify->nodes, at_notify_node_destroy, NULL);
 	g_slist_free(notify->nodes);
 	g_free(notify);
@@ -338,6 +426,10 @@ static void chat_cleanup(struct at_chat *chat)
 		chat->pdu_notify = NULL;
 	}
 
+	g_free(chat->line_buf);
+	chat->line_buf = NULL;
+	chat->line_buf_size = 0;
+
 	if (chat->wakeup) {
 		g_free(chat->wakeup);
 		chat->wakeup = NULL;
@@ -384,30 +476,42 @@ static void at_notify_call_callback(gpointer data, gpointer user_data)
 
 static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 {
-	GHashTableIter iter;
+	struct at_notify_trie *t = &chat->notify_trie;
 	struct at_notify *notify;
-	gpointer key, value;
+	const char *c;
 	gboolean ret = FALSE;
 	GAtResult result;
 
-	g_hash_table_iter_init(&iter, chat->notify_list);
 	result.lines = 0;
 	result.final_or_pdu = 0;
 
 	chat->in_notify = TRUE;
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		notify = value;
+	/*
+	 * Every node on the path spelled by the line is a registered prefix
+	 * of it.  Nodes are never freed while in_notify is set, so callbacks
+	 * registering or unregistering notifications cannot invalidate t.
+	 */
+	for (c = line; *c && (t = at_notify_trie_child(t, *c)); c++) {
+		notify = t->notify;
 
-		if (!g_str_has_prefix(line, key))
+		if (notify == NULL)
 			continue;
 
 		if (notify->pdu) {
-			chat->pdu_notify = line;
+			chat->in_notify = FALSE;
+			chat->pdu_notify = g_strdup(line);
 
 			if (chat->syntax->set_hint)
 				chat->syntax->set_hint(chat->syntax,
 							G_AT_SYNTAX_EXPECT_PDU);
+
+			if (ret) {
+				g_slist_free(result.lines);
+				at_chat_unregister_all(chat, FALSE,
+							node_is_destroyed, NULL);
+			}
+
 			return TRUE;
 		}
 
@@ -423,7 +527,6 @@ static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 
 	if (ret) {
 		g_slist_free(result.lines);
-		g_free(line);
 
 		at_chat_unregister_all(chat, FALSE, node_is_destroyed, NULL);
 	}
@@ -461,7 +564,6 @@ static void at_chat_finish_command(struct at_chat *p, gboolean ok, char *final)
 
 	g_slist_free_full(response_lines, g_free);
 
-	g_free(final);
 	at_command_destroy(cmd);
 }
 
@@ -551,7 +653,7 @@ out:
 		p->syntax->set_hint(p->syntax, hint);
 
 	if (cmd->listing && (cmd->flags & COMMAND_FLAG_EXPECT_PDU)) {
-		p->pdu_notify = line;
+		p->pdu_notify = g_strdup(line);
 		return TRUE;
 	}
 
@@ -564,13 +666,18 @@ out:
 		cmd->listing(&result, cmd->user_data);
 
 		g_slist_free(result.lines);
-		g_free(line);
 	} else
-		p->response_lines = g_slist_prepend(p->response_lines, line);
+		p->response_lines = g_slist_prepend(p->response_lines,
+							g_strdup(line));
 
 	return TRUE;
 }
 
+/*
+ * Lines are borrowed from the read buffer, or from line_buf if they wrap
+ * around its end, and are only valid until the next line is extracted.
+ * Anything kept across lines has to be copied.
+ */
 static void have_line(struct at_chat *p, char *str)
 {
 	/* We're not going to copy terminal <CR><LF> */
@@ -581,7 +688,7 @@ static void have_line(struct at_chat *p, char *str)
 
 	/* Check for echo, this should not happen, but lets be paranoid */
 	if (!strncmp(str, "AT", 2))
-		goto done;
+		return;
 
 	cmd = g_queue_peek_head(p->command_queue);
 
@@ -601,34 +708,23 @@ static void have_line(struct at_chat *p, char *str)
 			return;
 	}
 
-	if (at_chat_match_notify(p, str) == TRUE)
-		return;
-
-done:
 	/* No matches & no commands active, ignore line */
-	g_free(str);
+	at_chat_match_notify(p, str);
 }
 
 static void have_notify_pdu(struct at_chat *p, char *pdu, GAtResult *result)
 {
-	GHashTableIter iter;
+	struct at_notify_trie *t = &p->notify_trie;
 	struct at_notify *notify;
-	char *prefix;
-	gpointer key, value;
+	const char *c;
 	gboolean called = FALSE;
 
 	p->in_notify = TRUE;
 
-	g_hash_table_iter_init(&iter, p->notify_list);
-
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		prefix = key;
-		notify = value;
-
-		if (!g_str_has_prefix(p->pdu_notify, prefix))
-			continue;
+	for (c = p->pdu_notify; *c && (t = at_notify_trie_child(t, *c)); c++) {
+		notify = t->notify;
 
-		if (!notify->pdu)
+		if (notify == NULL || !notify->pdu)
 			continue;
 
 		g_slist_foreach(notify->nodes, at_notify_call_callback, result);
@@ -677,12 +773,31 @@ static void have_pdu(struct at_chat *p, char *pdu)
 error:
 	g_free(p->pdu_notify);
 	p->pdu_notify = NULL;
+}
+
+static char *chat_line_buf(struct at_chat *p, gsize size)
+{
+	gsize new_size = p->line_buf_size ? p->line_buf_size : 256;
+	char *buf;
+
+	if (size <= p->line_buf_size)
+		return p->line_buf;
 
-	if (pdu)
-		g_free(pdu);
+	while (new_size < size)
+		new_size <<= 1;
+
+	buf = g_try_realloc(p->line_buf, new_size);
+	if (buf == NULL)
+		return NULL;
+
+	p->line_buf = buf;
+	p->line_buf_size = new_size;
+
+	return buf;
 }
 
-static char *extract_line(struct at_chat *p, struct ring_buffer *rbuf)
+static void find_line(struct at_chat *p, struct ring_buffer *rbuf,
+			unsigned int *out_start, unsigned int *out_len)
 {
 	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
 	unsigned int pos = 0;
@@ -690,7 +805,6 @@ static char *extract_line(struct at_chat *p, struct ring_buffer *rbuf)
 	gboolean in_string = FALSE;
 	int strip_front = 0;
 	int line_length = 0;
-	char *line;
 
 	while (pos < p->read_so_far) {
 		if (in_string == FALSE && (*buf == '\r' || *buf == '\n')) {
@@ -712,17 +826,60 @@ static char *extract_line(struct at_chat *p, struct ring_buffer *rbuf)
 			buf = ring_buffer_read_ptr(rbuf, pos);
 	}
 
-	line = g_try_new(char, line_length + 1);
+	*out_start = strip_front;
+	*out_len = line_length;
+}
+
+static char *extract_line(struct at_chat *p, struct ring_buffer *rbuf)
+{
+	GAtSyntax *syntax = p->syntax;
+	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+	unsigned int start;
+	unsigned int end;
+	unsigned char *buf;
+	char *line;
+
+	/* Use the line position found by the syntax if we have one */
+	if (syntax->line_start >= 0 &&
+			syntax->line_start < (gssize) p->read_so_far &&
+			syntax->line_end < (gssize) p->read_so_far) {
+		start = syntax->line_start;
+		end = syntax->line_end >= 0 ? syntax->line_end :
+							p->read_so_far;
+	} else if (syntax->line_start == -1) {
+		start = 0;
+		end = 0;
+	} else {
+		find_line(p, rbuf, &start, &end);
+		end += start;
+	}
+
+	/*
+	 * The terminator following the line has been consumed already, so
+	 * the line can be terminated in place unless it wraps around.  The
+	 * buffer contents stay intact until the next read even though they
+	 * are drained here.
+	 */
+	if (end > start && end < p->read_so_far &&
+			(start >= wrap || end < wrap)) {
+		buf = ring_buffer_read_ptr(rbuf, start);
+		buf[end - start] = '\0';
+		ring_buffer_drain(rbuf, p->read_so_far);
+
+		return (char *) buf;
+	}
+
+	line = chat_line_buf(p, end - start + 1);
 	if (line == NULL) {
 		ring_buffer_drain(rbuf, p->read_so_far);
 		return NULL;
 	}
 
-	ring_buffer_drain(rbuf, strip_front);
-	ring_buffer_read(rbuf, line, line_length);
-	ring_buffer_drain(rbuf, p->read_so_far - strip_front - line_length);
+	ring_buffer_drain(rbuf, start);
+	ring_buffer_read(rbuf, line, end - start);
+	ring_buffer_drain(rbuf, p->read_so_far - end);
 
-	line[line_length] = '\0';
+	line[end - start] = '\0';
 
 	return line;
 }
@@ -1065,6 +1222,15 @@ static struct at_notify *at_notify_create(struct at_chat *chat,
 	}
 
 	notify->pdu = pdu;
+	notify->trie = at_notify_trie_insert(&chat->notify_trie, prefix);
+
+	if (notify->trie == NULL) {
+		g_free(notify);
+		g_free(key);
+		return 0;
+	}
+
+	notify->trie->notify = notify;
 
 	g_hash_table_insert(chat->notify_list, key, notify);
 
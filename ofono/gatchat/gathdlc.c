@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <glib.h>
 
 #include "crc-ccitt.h"
@@ -51,6 +52,11 @@
 
 #define HDLC_FCS(fcs, c) crc_ccitt_byte(fcs, c)
 
+#define WORD_ONES	0x0101010101010101ULL
+#define WORD_HIGHS	0x8080808080808080ULL
+#define WORD_HAS_ZERO(v) (((v) - WORD_ONES) & ~(v) & WORD_HIGHS)
+#define WORD_HAS_LESS(v, n) (((v) - WORD_ONES * (n)) & ~(v) & WORD_HIGHS)
+
 #define GUARD_TIMEOUT	1000	/* Pause time before and after '+++' sequence */
 
 struct _GAtHDLC {
@@ -76,6 +82,8 @@ struct _GAtHDLC {
 	GAtSuspendFunc suspend_func;
 	gpointer suspend_data;
 	guint suspend_source;
+	GAtDisconnectFunc write_done_func;
+	gpointer write_done_data;
 	GTimer *timer;
 	guint num_plus;
 };
@@ -242,6 +250,54 @@ static gboolean check_escape(GAtHDLC *hdlc, struct ring_buffer *rbuf)
 	return TRUE;
 }
 
+static inline gboolean is_clean(unsigned char c)
+{
+	return c >= 0x20 && c != HDLC_FLAG && c != HDLC_ESCAPE;
+}
+
+/*
+ * Returns the length of the leading run of bytes which are neither flags,
+ * escapes nor control characters and thus never need special handling.
+ * Control characters outside of the ACCM end the run too, the callers
+ * deal with them one at a time.
+ */
+static unsigned int clean_run(const unsigned char *buf, unsigned int len)
+{
+	unsigned int pos = 0;
+	guint64 v;
+
+	while (pos + sizeof(v) <= len) {
+		memcpy(&v, buf + pos, sizeof(v));
+
+		if (WORD_HAS_ZERO(v ^ (WORD_ONES * HDLC_FLAG)) |
+				WORD_HAS_ZERO(v ^ (WORD_ONES * HDLC_ESCAPE)) |
+				WORD_HAS_LESS(v, HDLC_TRANS))
+			break;
+
+		pos += sizeof(v);
+	}
+
+	while (pos < len && is_clean(buf[pos]))
+		pos++;
+
+	return pos;
+}
+
+static inline void decode_bytes(GAtHDLC *hdlc, const unsigned char *buf,
+							unsigned int len)
+{
+	/* Frame is too long, drop it and resync on the next flag */
+	if (hdlc->decode_offset + len > BUFFER_SIZE) {
+		hdlc->decode_offset = 0;
+		hdlc->decode_fcs = HDLC_INITFCS;
+		return;
+	}
+
+	memcpy(hdlc->decode_buffer + hdlc->decode_offset, buf, len);
+	hdlc->decode_offset += len;
+	hdlc->decode_fcs = crc_ccitt(hdlc->decode_fcs, buf, len);
+}
+
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
 	GAtHDLC *hdlc = user_data;
@@ -272,6 +328,8 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 	hdlc->in_read_handler = TRUE;
 
 	while (pos < len) {
+		unsigned int run = 1;
+
 		/*
 		 * We try to detect NO CARRIER conditions here.  We
 		 * (ab) use the fact that a HDLC_FLAG must be followed
@@ -285,10 +343,13 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 		if (hdlc->decode_escape == TRUE) {
 			unsigned char val = *buf ^ HDLC_TRANS;
 
-			hdlc->decode_buffer[hdlc->decode_offset++] = val;
-			hdlc->decode_fcs = HDLC_FCS(hdlc->decode_fcs, val);
+			decode_bytes(hdlc, &val, 1);
 
 			hdlc->decode_escape = FALSE;
+		} else if (is_clean(*buf)) {
+			/* Copy everything up to the next special byte at once */
+			run = clean_run(buf, (pos < wrap ? wrap : len) - pos);
+			decode_bytes(hdlc, buf, run);
 		} else if (*buf == HDLC_ESCAPE) {
 			hdlc->decode_escape = TRUE;
 		} else if (*buf == HDLC_FLAG) {
@@ -304,14 +365,12 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 
 			hdlc->decode_fcs = HDLC_INITFCS;
 			hdlc->decode_offset = 0;
-		} else if (*buf >= 0x20 ||
-					(hdlc->recv_accm & (1 << *buf)) == 0) {
-			hdlc->decode_buffer[hdlc->decode_offset++] = *buf;
-			hdlc->decode_fcs = HDLC_FCS(hdlc->decode_fcs, *buf);
+		} else if ((hdlc->recv_accm & (1 << *buf)) == 0) {
+			decode_bytes(hdlc, buf, 1);
 		}
 
-		buf++;
-		pos++;
+		buf += run;
+		pos += run;
 
 		if (pos == wrap) {
 			buf = ring_buffer_read_ptr(rbuf, pos);
@@ -440,7 +499,8 @@ void g_at_hdlc_unref(GAtHDLC *hdlc)
 
 	g_free(hdlc->decode_buffer);
 
-	g_timer_destroy(hdlc->timer);
+	if (hdlc->timer)
+		g_timer_destroy(hdlc->timer);
 
 	if (hdlc->in_read_handler)
 		hdlc->destroyed = TRUE;
@@ -491,19 +551,45 @@ static gboolean can_write_data(gpointer data)
 	/* All data in current buffer is written, free it
 	 * unless it's the last buffer in the queue.
 	 */
-	if ((ring_buffer_len(write_buffer) == 0) &&
-			(g_queue_get_length(hdlc->write_queue) > 1)) {
+	if (g_queue_get_length(hdlc->write_queue) > 1) {
 		write_buffer = g_queue_pop_head(hdlc->write_queue);
 		ring_buffer_free(write_buffer);
-		write_buffer = g_queue_peek_head(hdlc->write_queue);
 	}
 
+	/*
+	 * There is room for more frames now.  The callback may drop the
+	 * last reference to the HDLC, hold one until it returns.
+	 */
+	if (hdlc->write_done_func) {
+		gboolean destroyed;
+
+		g_at_hdlc_ref(hdlc);
+		hdlc->write_done_func(hdlc->write_done_data);
+		destroyed = g_atomic_int_get(&hdlc->ref_count) == 1;
+		g_at_hdlc_unref(hdlc);
+
+		if (destroyed)
+			return FALSE;
+	}
+
+	write_buffer = g_queue_peek_head(hdlc->write_queue);
+
 	if (ring_buffer_len(write_buffer) > 0)
 		return TRUE;
 
 	return FALSE;
 }
 
+void g_at_hdlc_set_write_done(GAtHDLC *hdlc, GAtDisconnectFunc func,
+							gpointer user_data)
+{
+	if (hdlc == NULL)
+		return;
+
+	hdlc->write_done_func = func;
+	hdlc->write_done_data = user_data;
+}
+
 void g_at_hdlc_set_xmit_accm(GAtHDLC *hdlc, guint32 accm)
 {
 	if (hdlc == NULL)
@@ -579,6 +665,23 @@ gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 	}
 
 	while (pos < avail && i < size) {
+		if (escape == FALSE && is_clean(data[i])) {
+			unsigned int room = (pos < wrap ? wrap : avail) - pos;
+			unsigned int run = clean_run(data + i, MIN(size - i, room));
+
+			memcpy(buf, data + i, run);
+			fcs = crc_ccitt(fcs, data + i, run);
+
+			i += run;
+			buf += run;
+			pos += run;
+
+			if (pos == wrap)
+				buf = ring_buffer_write_ptr(write_buffer, pos);
+
+			continue;
+		}
+
 		if (escape == TRUE) {
 			fcs = HDLC_FCS(fcs, data[i]);
 			*buf = data[i++] ^ HDLC_TRANS;
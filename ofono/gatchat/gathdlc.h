@@ -51,6 +51,10 @@ void g_at_hdlc_set_receive(GAtHDLC *hdlc, GAtReceiveFunc func,
 							gpointer user_data);
 gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size);
 
+/* Called whenever a write buffer has been sent out to the io */
+void g_at_hdlc_set_write_done(GAtHDLC *hdlc, GAtDisconnectFunc func,
+							gpointer user_data);
+
 void g_at_hdlc_set_recording(GAtHDLC *hdlc, const char *filename);
 
 GAtIO *g_at_hdlc_get_io(GAtHDLC *hdlc);
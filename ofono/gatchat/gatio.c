@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
@@ -36,6 +37,10 @@
 #include "gatio.h"
 #include "gatutil.h"
 
+#define BUFFER_SIZE		8192
+#define BUFFER_SIZE_MAX		65536
+#define BUFFER_IDLE_ROUNDS	16
+
 struct _GAtIO {
 	gint ref_count;				/* Ref count */
 	guint read_watch;			/* GSource read id, 0 if no */
@@ -44,6 +49,10 @@ struct _GAtIO {
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	struct ring_buffer *buf;		/* Current read buffer */
+	guint buf_min;				/* Smallest read buffer size */
+	guint buf_max;				/* Largest read buffer size */
+	guint idle_rounds;			/* Reads since buf was busy */
+	int fd;					/* fd for readv, -1 if none */
 	guint max_read_attempts;		/* max reads / select */
 	GAtIOReadFunc read_handler;		/* Read callback */
 	gpointer read_data;			/* Read callback userdata */
@@ -52,6 +61,9 @@ struct _GAtIO {
 	gpointer write_data;			/* Write callback userdata */
 	GAtDebugFunc debugf;			/* debugging output function */
 	gpointer debug_data;			/* Data to pass to debug func */
+	GAtIOStats stats;			/* Read statistics */
+	GAtIOStatsFunc statsf;			/* statistics function */
+	gpointer stats_data;			/* Data to pass to stats func */
 	GAtDisconnectFunc write_done_func;	/* tx empty notifier */
 	gpointer write_done_data;		/* tx empty data */
 	gboolean destroyed;			/* Re-entrancy guard */
@@ -67,66 +79,179 @@ static void read_watcher_destroy_notify(gpointer user_data)
 	io->debugf = NULL;
 	io->debug_data = NULL;
 
+	io->statsf = NULL;
+	io->stats_data = NULL;
+
 	io->read_watch = 0;
 	io->read_handler = NULL;
 	io->read_data = NULL;
 
 	io->channel = NULL;
 
-	if (io->destroyed)
+	if (io->destroyed && io->write_watch == 0)
 		g_free(io);
 	else if (io->user_disconnect)
 		io->user_disconnect(io->user_disconnect_data);
 }
 
+static gboolean resize_buffer(GAtIO *io, guint size)
+{
+	struct ring_buffer *buf;
+	unsigned int len = ring_buffer_len(io->buf);
+	unsigned int wrap = ring_buffer_len_no_wrap(io->buf);
+
+	if (size < len)
+		return FALSE;
+
+	buf = ring_buffer_new(size);
+	if (buf == NULL)
+		return FALSE;
+
+	/* Readers only keep offsets relative to the start of the data */
+	ring_buffer_write(buf, ring_buffer_read_ptr(io->buf, 0), wrap);
+	ring_buffer_write(buf, ring_buffer_read_ptr(io->buf, wrap), len - wrap);
+
+	ring_buffer_free(io->buf);
+	io->buf = buf;
+	io->stats.buffer_size = ring_buffer_capacity(buf);
+
+	return TRUE;
+}
+
+static gboolean grow_buffer(GAtIO *io)
+{
+	guint size = ring_buffer_capacity(io->buf);
+
+	if (size >= io->buf_max)
+		return FALSE;
+
+	return resize_buffer(io, MIN(size * 2, io->buf_max));
+}
+
+static void shrink_buffer(GAtIO *io, gsize last_read)
+{
+	guint size = ring_buffer_capacity(io->buf);
+
+	if (size <= io->buf_min || ring_buffer_len(io->buf) > 0 ||
+			last_read > size / 4) {
+		io->idle_rounds = 0;
+		return;
+	}
+
+	if (++io->idle_rounds < BUFFER_IDLE_ROUNDS)
+		return;
+
+	io->idle_rounds = 0;
+	resize_buffer(io, MAX(size / 2, io->buf_min));
+}
+
+static GIOStatus read_buffer(GAtIO *io, GIOChannel *channel, gsize *rbytes)
+{
+	struct iovec iov[2];
+	unsigned int avail = ring_buffer_avail(io->buf);
+	unsigned int i;
+	GIOStatus status;
+	ssize_t len;
+
+	iov[0].iov_base = ring_buffer_write_ptr(io->buf, 0);
+	iov[0].iov_len = ring_buffer_avail_no_wrap(io->buf);
+	iov[1].iov_base = ring_buffer_write_ptr(io->buf, iov[0].iov_len);
+	iov[1].iov_len = avail - iov[0].iov_len;
+
+	if (io->fd < 0) {
+		status = g_io_channel_read_chars(channel, iov[0].iov_base,
+						iov[0].iov_len, rbytes, NULL);
+		iov[0].iov_len = *rbytes;
+		iov[1].iov_len = 0;
+	} else {
+		/* Fill both halves of the ring with a single system call */
+		do {
+			len = readv(io->fd, iov, iov[1].iov_len ? 2 : 1);
+		} while (len < 0 && errno == EINTR);
+
+		if (len > 0) {
+			status = G_IO_STATUS_NORMAL;
+			*rbytes = len;
+		} else {
+			*rbytes = 0;
+
+			if (len == 0)
+				status = G_IO_STATUS_EOF;
+			else if (errno == EAGAIN)
+				status = G_IO_STATUS_AGAIN;
+			else
+				status = G_IO_STATUS_ERROR;
+		}
+
+		iov[0].iov_len = MIN(iov[0].iov_len, *rbytes);
+		iov[1].iov_len = *rbytes - iov[0].iov_len;
+	}
+
+	for (i = 0; i < 2; i++)
+		g_at_util_debug_chat(TRUE, iov[i].iov_base, iov[i].iov_len,
+					io->debugf, io->debug_data);
+
+	io->stats.read_calls += 1;
+	io->stats.bytes_read += *rbytes;
+
+	if (*rbytes > 0)
+		ring_buffer_write_advance(io->buf, *rbytes);
+
+	return status;
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 				gpointer data)
 {
-	unsigned char *buf;
 	GAtIO *io = data;
 	GIOStatus status;
 	gsize rbytes;
-	gsize toread;
 	gsize total_read = 0;
 	guint read_count = 0;
+	guint fill;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
+	io->stats.wakeups += 1;
+
 	/* Regardless of condition, try to read all the data available */
 	do {
-		toread = ring_buffer_avail_no_wrap(io->buf);
-
-		if (toread == 0)
+		if (ring_buffer_avail(io->buf) == 0 && !grow_buffer(io)) {
+			io->stats.stalls += 1;
 			break;
+		}
 
-		rbytes = 0;
-		buf = ring_buffer_write_ptr(io->buf, 0);
-
-		status = g_io_channel_read_chars(channel, (char *) buf,
-							toread, &rbytes, NULL);
-		g_at_util_debug_chat(TRUE, (char *)buf, rbytes,
-					io->debugf, io->debug_data);
+		status = read_buffer(io, channel, &rbytes);
 
 		read_count++;
 
 		total_read += rbytes;
-
-		if (rbytes > 0)
-			ring_buffer_write_advance(io->buf, rbytes);
-
 	} while (status == G_IO_STATUS_NORMAL && rbytes > 0 &&
 					read_count < io->max_read_attempts);
 
+	fill = ring_buffer_len(io->buf);
+	if (fill > io->stats.max_fill)
+		io->stats.max_fill = fill;
+
 	if (total_read > 0 && io->read_handler)
 		io->read_handler(io->buf, io->read_data);
 
+	if (io->statsf)
+		io->statsf(&io->stats, io->stats_data);
+
 	if (cond & (G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
 	if (read_count > 0 && rbytes == 0 && status != G_IO_STATUS_AGAIN)
 		return FALSE;
 
+	/* The reader is falling behind, give it some room */
+	if (ring_buffer_len(io->buf) > ring_buffer_capacity(io->buf) / 2)
+		grow_buffer(io);
+	else
+		shrink_buffer(io, total_read);
+
 	/* We're overflowing the buffer, shutdown the socket */
 	if (ring_buffer_avail(io->buf) == 0)
 		return FALSE;
@@ -166,6 +291,9 @@ static void write_watcher_destroy_notify(gpointer user_data)
 		io->write_done_func = NULL;
 		io->write_done_data = NULL;
 	}
+
+	if (io->destroyed && io->read_watch == 0)
+		g_free(io);
 }
 
 static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
@@ -184,6 +312,7 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 
 static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 {
+	GSource *source;
 	GAtIO *io;
 
 	if (channel == NULL)
@@ -199,24 +328,43 @@ static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 	if (flags & G_IO_FLAG_NONBLOCK) {
 		io->max_read_attempts = 3;
 		io->use_write_watch = TRUE;
+		io->buf_max = BUFFER_SIZE_MAX;
 	} else {
 		io->max_read_attempts = 1;
 		io->use_write_watch = FALSE;
+		io->buf_max = BUFFER_SIZE;
 	}
 
-	io->buf = ring_buffer_new(8192);
+	io->buf_min = BUFFER_SIZE;
+	io->buf = ring_buffer_new(io->buf_min);
 
 	if (!io->buf)
 		goto error;
 
+	io->stats.buffer_size = ring_buffer_capacity(io->buf);
+
 	if (!g_at_util_setup_io(channel, flags))
 		goto error;
 
+	source = g_io_create_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL);
+
+	/*
+	 * Only plain file descriptor channels can be read with readv,
+	 * others (e.g. multiplexer channels) bring their own watch type
+	 * and have to go through the GIOChannel.
+	 */
+	if (source->source_funcs == &g_io_watch_funcs)
+		io->fd = g_io_channel_unix_get_fd(channel);
+	else
+		io->fd = -1;
+
 	io->channel = channel;
-	io->read_watch = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT,
-				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				received_data, io,
+
+	g_source_set_callback(source, (GSourceFunc) received_data, io,
 				read_watcher_destroy_notify);
+	io->read_watch = g_source_attach(source, NULL);
+	g_source_unref(source);
 
 	return io;
 
@@ -280,6 +428,12 @@ gboolean g_at_io_set_write_handler(GAtIO *io, GAtIOWriteFunc write_handler,
 
 	if (io->write_watch > 0) {
 		if (write_handler == NULL) {
+			/*
+			 * From within the write handler the watch is only
+			 * destroyed once it returns, a NULL write_handler
+			 * marks it as already removed until then.
+			 */
+			io->write_handler = NULL;
 			g_source_remove(io->write_watch);
 			return TRUE;
 		}
@@ -324,7 +478,7 @@ static gboolean io_shutdown(GAtIO *io)
 	if (io->read_watch > 0)
 		g_source_remove(io->read_watch);
 
-	if (io->write_watch > 0)
+	if (io->write_watch > 0 && io->write_handler)
 		g_source_remove(io->write_watch);
 
 	return TRUE;
@@ -347,9 +501,10 @@ void g_at_io_unref(GAtIO *io)
 	/* glib delays the destruction of the watcher until it exits, this
 	 * means we can't free the data just yet, even though we've been
 	 * destroyed already.  We have to wait until the read_watcher
-	 * destroy function gets called
+	 * destroy function gets called, or the write watcher's one if we
+	 * are unreferenced from within the write handler
 	 */
-	if (io->read_watch > 0)
+	if (io->read_watch > 0 || io->write_watch > 0)
 		io->destroyed = TRUE;
 	else
 		g_free(io);
@@ -378,6 +533,51 @@ gboolean g_at_io_set_debug(GAtIO *io, GAtDebugFunc func, gpointer user_data)
 	return TRUE;
 }
 
+gboolean g_at_io_set_stats(GAtIO *io, GAtIOStatsFunc func, gpointer user_data)
+{
+	if (io == NULL)
+		return FALSE;
+
+	io->statsf = func;
+	io->stats_data = user_data;
+
+	return TRUE;
+}
+
+const GAtIOStats *g_at_io_get_stats(GAtIO *io)
+{
+	if (io == NULL)
+		return NULL;
+
+	return &io->stats;
+}
+
+gboolean g_at_io_set_buffer_size(GAtIO *io, guint min_size, guint max_size)
+{
+	guint size;
+
+	if (io == NULL || io->buf == NULL)
+		return FALSE;
+
+	if (min_size == 0 || min_size > max_size)
+		return FALSE;
+
+	size = ring_buffer_capacity(io->buf);
+
+	/* Fails if the data waiting to be read doesn't fit the new size */
+	if (size > max_size && !resize_buffer(io, max_size))
+		return FALSE;
+
+	if (size < min_size && !resize_buffer(io, min_size))
+		return FALSE;
+
+	io->buf_min = min_size;
+	io->buf_max = max_size;
+	io->idle_rounds = 0;
+
+	return TRUE;
+}
+
 void g_at_io_set_write_done(GAtIO *io, GAtDisconnectFunc func,
 				gpointer user_data)
 {
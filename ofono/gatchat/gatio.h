@@ -37,6 +37,19 @@ struct ring_buffer;
 typedef void (*GAtIOReadFunc)(struct ring_buffer *buffer, gpointer user_data);
 typedef gboolean (*GAtIOWriteFunc)(gpointer user_data);
 
+struct _GAtIOStats {
+	guint64 bytes_read;		/* Total bytes read */
+	guint read_calls;		/* Read system calls made */
+	guint wakeups;			/* Read watch dispatches */
+	guint max_fill;			/* Highest read buffer fill level */
+	guint stalls;			/* Reads stopped by a full buffer */
+	guint buffer_size;		/* Current read buffer size */
+};
+
+typedef struct _GAtIOStats GAtIOStats;
+
+typedef void (*GAtIOStatsFunc)(const GAtIOStats *stats, gpointer user_data);
+
 GAtIO *g_at_io_new(GIOChannel *channel);
 GAtIO *g_at_io_new_blocking(GIOChannel *channel);
 
@@ -61,6 +74,22 @@ gboolean g_at_io_set_disconnect_function(GAtIO *io,
 
 gboolean g_at_io_set_debug(GAtIO *io, GAtDebugFunc func, gpointer user_data);
 
+/*!
+ * If the function is not NULL, it is called with the read statistics of
+ * the GAtIO after every batch of data read from the channel
+ */
+gboolean g_at_io_set_stats(GAtIO *io, GAtIOStatsFunc func, gpointer user_data);
+const GAtIOStats *g_at_io_get_stats(GAtIO *io);
+
+/*!
+ * Sets the bounds of the read buffer.  The buffer grows up to max_size
+ * while the reader falls behind and shrinks back towards min_size when
+ * it's idle.  Passing the same value for both disables resizing.
+ * Returns FALSE, leaving the bounds unchanged, if the buffer can't be
+ * resized to them.
+ */
+gboolean g_at_io_set_buffer_size(GAtIO *io, guint min_size, guint max_size);
+
 #ifdef __cplusplus
 }
 #endif
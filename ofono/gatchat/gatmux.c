@@ -25,10 +25,12 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <alloca.h>
+#include <sys/uio.h>
 
 #pragma GCC diagnostic ignored "-Wpragmas"
 #pragma GCC diagnostic ignored "-Wcast-function-type"
@@ -54,7 +56,16 @@ typedef void (*GAtMuxWriteFrame)(GAtMux *mux, guint8 dlc, guint8 control,
 #define MAX_CHANNELS 61
 #define BITMAP_SIZE 8
 #define MUX_CHANNEL_BUFFER_SIZE 4096
-#define MUX_BUFFER_SIZE 4096
+#define MUX_BUFFER_SIZE 8192
+#define MUX_WRITE_BUFFER_SIZE 16384
+
+/*
+ * Payload a DLC may queue per write, so one busy DLC can delay the others
+ * by at most this much each round.  The headroom is what its frames can
+ * take up on the wire in the worst case, escaping included.
+ */
+#define MUX_DLC_BUDGET 1024
+#define MUX_DLC_HEADROOM (MUX_DLC_BUDGET * 2 + 256)
 
 struct _GAtMuxChannel
 {
@@ -64,6 +75,7 @@ struct _GAtMuxChannel
 	struct ring_buffer *buffer;
 	GSList *sources;
 	gboolean throttled;
+	gboolean flow_stopped;		/* Peer asked to hold off sending */
 	guint dlc;
 };
 
@@ -88,7 +100,11 @@ struct _GAtMux {
 	const GAtMuxDriver *driver;		/* Driver functions */
 	void *driver_data;			/* Driver data */
 	char buf[MUX_BUFFER_SIZE];		/* Buffer on the main mux */
+	int buf_start;				/* First byte not yet parsed */
 	int buf_used;				/* Bytes of buf being used */
+	struct ring_buffer *write_buf;		/* Frames not yet sent */
+	int next_dlc;				/* DLC to serve first */
+	gboolean flow_off;			/* Peer sent FCoff */
 	gboolean shutdown;
 };
 
@@ -237,6 +253,22 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 	debug(mux, "received data");
 
+	/*
+	 * Frames are parsed where they were read.  Only a partial frame
+	 * is ever left over, and it is moved to the front once the space
+	 * behind it runs short.  A full buffer without a single frame in
+	 * it can only be line noise, so it is dropped.
+	 */
+	if (mux->buf_start == 0 && mux->buf_used == sizeof(mux->buf)) {
+		debug(mux, "no frame in %d bytes, dropping them",
+				mux->buf_used);
+		mux->buf_used = 0;
+	} else if (sizeof(mux->buf) - mux->buf_used < MUX_BUFFER_SIZE / 4) {
+		mux->buf_used -= mux->buf_start;
+		memmove(mux->buf, mux->buf + mux->buf_start, mux->buf_used);
+		mux->buf_start = 0;
+	}
+
 	bytes_read = 0;
 	status = g_io_channel_read_chars(mux->channel, mux->buf + mux->buf_used,
 					sizeof(mux->buf) - mux->buf_used,
@@ -249,11 +281,14 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 		memset(mux->newdata, 0, BITMAP_SIZE);
 
-		nread = mux->driver->feed_data(mux, mux->buf, mux->buf_used);
-		mux->buf_used -= nread;
+		nread = mux->driver->feed_data(mux, mux->buf + mux->buf_start,
+					mux->buf_used - mux->buf_start);
+		mux->buf_start += nread;
 
-		if (mux->buf_used > 0)
-			memmove(mux->buf, mux->buf + nread, mux->buf_used);
+		if (mux->buf_start == mux->buf_used) {
+			mux->buf_start = 0;
+			mux->buf_used = 0;
+		}
 
 		for (i = 1; i <= MAX_CHANNELS; i++) {
 			int offset = i / 8;
@@ -275,9 +310,6 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN)
 		return FALSE;
 
-	if (mux->buf_used == sizeof(mux->buf))
-		return FALSE;
-
 	return TRUE;
 }
 
@@ -288,10 +320,44 @@ static void write_watcher_destroy_notify(gpointer user_data)
 	mux->write_watch = 0;
 }
 
+/* Sends as much of the queued frames as the channel takes, in one call */
+static gboolean flush_frames(GAtMux *mux)
+{
+	struct iovec iov[2];
+	int len = ring_buffer_len(mux->write_buf);
+	int no_wrap = ring_buffer_len_no_wrap(mux->write_buf);
+	ssize_t written;
+	int fd;
+
+	if (len == 0)
+		return TRUE;
+
+	iov[0].iov_base = ring_buffer_read_ptr(mux->write_buf, 0);
+	iov[0].iov_len = no_wrap;
+	iov[1].iov_base = ring_buffer_read_ptr(mux->write_buf, no_wrap);
+	iov[1].iov_len = len - no_wrap;
+
+	fd = g_io_channel_unix_get_fd(mux->channel);
+
+	do {
+		written = writev(fd, iov, len > no_wrap ? 2 : 1);
+	} while (written < 0 && errno == EINTR);
+
+	if (written < 0)
+		return errno == EAGAIN;
+
+	debug(mux, "wrote %zd of %d queued bytes", written, len);
+
+	ring_buffer_drain(mux->write_buf, written);
+
+	return TRUE;
+}
+
 static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
 	GAtMux *mux = data;
+	int served;
 	int dlc;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
@@ -299,8 +365,21 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 
 	debug(mux, "can write data");
 
-	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
-		GAtMuxChannel *channel = mux->dlcs[dlc];
+	/*
+	 * Give every DLC one write per round while there is room to queue
+	 * it, starting one further along each time so that no DLC is
+	 * always served first.
+	 */
+	for (served = 0; served < MAX_CHANNELS; served += 1) {
+		GAtMuxChannel *channel;
+
+		if (mux->flow_off)
+			break;
+
+		if (ring_buffer_avail(mux->write_buf) < MUX_DLC_HEADROOM)
+			break;
+
+		channel = mux->dlcs[(mux->next_dlc + served) % MAX_CHANNELS];
 
 		if (channel == NULL)
 			continue;
@@ -315,6 +394,21 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 		dispatch_sources(channel, G_IO_OUT);
 	}
 
+	/* Resume with whoever missed out, or with the next DLC */
+	if (served == MAX_CHANNELS)
+		served = 1;
+
+	mux->next_dlc = (mux->next_dlc + served) % MAX_CHANNELS;
+
+	if (!flush_frames(mux))
+		return FALSE;
+
+	if (ring_buffer_len(mux->write_buf) > 0)
+		return TRUE;
+
+	if (mux->flow_off)
+		return FALSE;
+
 	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
 		GAtMuxChannel *channel = mux->dlcs[dlc];
 		GSList *l;
@@ -351,15 +445,54 @@ static void wakeup_writer(GAtMux *mux)
 				write_watcher_destroy_notify);
 }
 
+/*
+ * Frames are queued and sent together once the channel is writable.  A
+ * frame is only ever queued whole, so one that does not fit even after
+ * flushing is dropped.
+ */
 int g_at_mux_raw_write(GAtMux *mux, const void *data, int towrite)
 {
-	gssize count = towrite;
-	gsize bytes_written;
+	if (ring_buffer_avail(mux->write_buf) < towrite)
+		flush_frames(mux);
+
+	if (ring_buffer_avail(mux->write_buf) < towrite) {
+		debug(mux, "write buffer full, dropping %d bytes", towrite);
+		return 0;
+	}
 
-	g_io_channel_write_chars(mux->channel, (gchar *) data,
-					count, &bytes_written, NULL);
+	ring_buffer_write(mux->write_buf, data, towrite);
+	wakeup_writer(mux);
 
-	return bytes_written;
+	return towrite;
+}
+
+/*
+ * Ask the peer to stop sending on a DLC once its buffer is three quarters
+ * full, and to resume once it has drained to a quarter.
+ */
+static void update_flow_control(GAtMuxChannel *channel)
+{
+	GAtMux *mux = channel->mux;
+	int capacity = ring_buffer_capacity(channel->buffer);
+	int len = ring_buffer_len(channel->buffer);
+	guint8 status = G_AT_MUX_DLC_STATUS_EA | G_AT_MUX_DLC_STATUS_RTC |
+						G_AT_MUX_DLC_STATUS_RTR;
+
+	if (mux->driver->set_status == NULL)
+		return;
+
+	if (!channel->flow_stopped && len >= capacity / 4 * 3) {
+		debug(mux, "dlc %u is full, asking peer to stop",
+				channel->dlc);
+		channel->flow_stopped = TRUE;
+		mux->driver->set_status(mux, channel->dlc,
+					status | G_AT_MUX_DLC_STATUS_FC);
+	} else if (channel->flow_stopped && len <= capacity / 4) {
+		debug(mux, "dlc %u has drained, asking peer to resume",
+				channel->dlc);
+		channel->flow_stopped = FALSE;
+		mux->driver->set_status(mux, channel->dlc, status);
+	}
 }
 
 void g_at_mux_feed_dlc_data(GAtMux *mux, guint8 dlc,
@@ -386,6 +519,12 @@ void g_at_mux_feed_dlc_data(GAtMux *mux, guint8 dlc,
 	if (written < 0)
 		return;
 
+	if (written < tofeed)
+		debug(mux, "dlc %hu overrun, dropping %d bytes",
+				dlc, tofeed - written);
+
+	update_flow_control(channel);
+
 	offset = dlc / 8;
 	bit = dlc % 8;
 
@@ -406,7 +545,8 @@ void g_at_mux_set_dlc_status(GAtMux *mux, guint8 dlc, int status)
 	if (channel == NULL)
 		return;
 
-	if (status & G_AT_MUX_DLC_STATUS_RTR) {
+	if ((status & G_AT_MUX_DLC_STATUS_RTR) &&
+			!(status & G_AT_MUX_DLC_STATUS_FC)) {
 		GSList *l;
 
 		mux->dlcs[dlc-1]->throttled = FALSE;
@@ -424,6 +564,27 @@ void g_at_mux_set_dlc_status(GAtMux *mux, guint8 dlc, int status)
 		mux->dlcs[dlc-1]->throttled = TRUE;
 }
 
+/* Aggregate flow control, FCon and FCoff hold or release every DLC */
+static void set_flow_off(GAtMux *mux, gboolean off)
+{
+	int i;
+
+	debug(mux, "aggregate flow %s", off ? "off" : "on");
+
+	mux->flow_off = off;
+
+	if (off)
+		return;
+
+	for (i = 0; i < MAX_CHANNELS; i++) {
+		if (mux->dlcs[i] == NULL || mux->dlcs[i]->throttled)
+			continue;
+
+		wakeup_writer(mux);
+		break;
+	}
+}
+
 void g_at_mux_set_data(GAtMux *mux, void *data)
 {
 	if (mux == NULL)
@@ -495,6 +656,9 @@ static GIOStatus channel_read(GIOChannel *channel, gchar *buf, gsize count,
 	if (*bytes_read == 0)
 		return G_IO_STATUS_AGAIN;
 
+	if (mux_channel->flow_stopped)
+		update_flow_control(mux_channel);
+
 	return G_IO_STATUS_NORMAL;
 }
 
@@ -504,6 +668,10 @@ static GIOStatus channel_write(GIOChannel *channel, const gchar *buf,
 	GAtMuxChannel *mux_channel = (GAtMuxChannel *) channel;
 	GAtMux *mux = mux_channel->mux;
 
+	/* The rest goes out in the next round, after the other DLCs */
+	if (count > MUX_DLC_BUDGET)
+		count = MUX_DLC_BUDGET;
+
 	if (mux->driver->write)
 		mux->driver->write(mux, mux_channel->dlc, buf, count);
 	*bytes_written = count;
@@ -607,6 +775,12 @@ GAtMux *g_at_mux_new(GIOChannel *channel, const GAtMuxDriver *driver)
 	if (mux == NULL)
 		return NULL;
 
+	mux->write_buf = ring_buffer_new(MUX_WRITE_BUFFER_SIZE);
+	if (mux->write_buf == NULL) {
+		g_free(mux);
+		return NULL;
+	}
+
 	mux->ref_count = 1;
 	mux->driver = driver;
 	mux->shutdown = TRUE;
@@ -637,11 +811,15 @@ void g_at_mux_unref(GAtMux *mux)
 	if (g_atomic_int_dec_and_test(&mux->ref_count)) {
 		g_at_mux_shutdown(mux);
 
+		if (mux->write_watch > 0)
+			g_source_remove(mux->write_watch);
+
 		g_io_channel_unref(mux->channel);
 
 		if (mux->driver->remove)
 			mux->driver->remove(mux);
 
+		ring_buffer_free(mux->write_buf);
 		g_free(mux);
 	}
 }
@@ -687,9 +865,6 @@ gboolean g_at_mux_shutdown(GAtMux *mux)
 	if (mux->read_watch > 0)
 		g_source_remove(mux->read_watch);
 
-	if (mux->write_watch > 0)
-		g_source_remove(mux->write_watch);
-
 	for (i = 0; i < MAX_CHANNELS; i++) {
 		if (mux->dlcs[i] == NULL)
 			continue;
@@ -700,6 +875,13 @@ gboolean g_at_mux_shutdown(GAtMux *mux)
 	if (mux->driver->shutdown)
 		mux->driver->shutdown(mux);
 
+	/* Last chance for the close frames to go out */
+	flush_frames(mux);
+	ring_buffer_reset(mux->write_buf);
+
+	if (mux->write_watch > 0)
+		g_source_remove(mux->write_watch);
+
 	mux->shutdown = TRUE;
 
 	return TRUE;
@@ -729,6 +911,18 @@ gboolean g_at_mux_set_debug(GAtMux *mux, GAtDebugFunc func, gpointer user_data)
 }
 
 GIOChannel *g_at_mux_create_channel(GAtMux *mux)
+{
+	return g_at_mux_create_channel_full(mux, MUX_CHANNEL_BUFFER_SIZE);
+}
+
+/*
+ * Creates a channel buffering up to buffer_size bytes received from the
+ * peer, rounded up to a power of two.  Channels carrying bulk data
+ * benefit from a larger buffer, as the peer is asked to stop sending
+ * while the buffer is mostly full.
+ */
+GIOChannel *g_at_mux_create_channel_full(GAtMux *mux,
+						unsigned int buffer_size)
 {
 	GAtMuxChannel *mux_channel;
 	GIOChannel *channel;
@@ -746,6 +940,12 @@ GIOChannel *g_at_mux_create_channel(GAtMux *mux)
 	if (mux_channel == NULL)
 		return NULL;
 
+	mux_channel->buffer = ring_buffer_new(buffer_size);
+	if (mux_channel->buffer == NULL) {
+		g_free(mux_channel);
+		return NULL;
+	}
+
 	if (mux->driver->open_dlc)
 		mux->driver->open_dlc(mux, i+1);
 
@@ -763,7 +963,6 @@ GIOChannel *g_at_mux_create_channel(GAtMux *mux)
 
 	mux_channel->mux = mux;
 	mux_channel->dlc = i+1;
-	mux_channel->buffer = ring_buffer_new(MUX_CHANNEL_BUFFER_SIZE);
 	mux_channel->throttled = FALSE;
 
 	mux->dlcs[i] = mux_channel;
@@ -982,6 +1181,16 @@ static gboolean gsm0710_packet(GAtMux *mux, int dlc, guint8 control,
 							GSM0710_STATUS_ACK,
 							data + 2, len - 2,
 							write_frame);
+			} else if (len >= 1 && (data[0] == GSM0710_FCON ||
+						data[0] == GSM0710_FCOFF)) {
+				unsigned char resp[2];
+
+				set_flow_off(mux, data[0] == GSM0710_FCOFF);
+
+				/* Respond with the C/R bit cleared */
+				resp[0] = data[0] & ~0x02;
+				resp[1] = 0x01;
+				write_frame(mux, 0, GSM0710_DATA, resp, 2);
 			} else if (len >= 2 && data[0] == 0x43) {
 				/* Test command from other side - send the same bytes back */
 				unsigned char *resp = alloca(len);
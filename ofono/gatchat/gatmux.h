@@ -36,10 +36,13 @@ typedef struct _GAtMuxDriver GAtMuxDriver;
 typedef enum _GAtMuxChannelStatus GAtMuxChannelStatus;
 typedef void (*GAtMuxSetupFunc)(GAtMux *mux, gpointer user_data);
 
+/* V.24 signals octet of the modem status command, 27.010 Section 5.4.6.3.7 */
 enum _GAtMuxDlcStatus {
-	G_AT_MUX_DLC_STATUS_RTC = 0x02,
-	G_AT_MUX_DLC_STATUS_RTR = 0x04,
-	G_AT_MUX_DLC_STATUS_IC = 0x08,
+	G_AT_MUX_DLC_STATUS_EA = 0x01,
+	G_AT_MUX_DLC_STATUS_FC = 0x02,
+	G_AT_MUX_DLC_STATUS_RTC = 0x04,
+	G_AT_MUX_DLC_STATUS_RTR = 0x08,
+	G_AT_MUX_DLC_STATUS_IC = 0x40,
 	G_AT_MUX_DLC_STATUS_DV = 0x80,
 };
 
@@ -70,6 +73,8 @@ gboolean g_at_mux_set_disconnect_function(GAtMux *mux,
 gboolean g_at_mux_set_debug(GAtMux *mux, GAtDebugFunc func, gpointer user_data);
 
 GIOChannel *g_at_mux_create_channel(GAtMux *mux);
+GIOChannel *g_at_mux_create_channel_full(GAtMux *mux,
+						unsigned int buffer_size);
 
 /*!
  * Multiplexer driver integration functions
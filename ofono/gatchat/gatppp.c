@@ -42,9 +42,6 @@
 
 #define DEFAULT_MTU	1500
 
-#define PPP_ADDR_FIELD	0xff
-#define PPP_CTRL	0x03
-
 #define GUARD_TIMEOUTS 1500
 
 enum ppp_phase {
@@ -244,13 +241,15 @@ static void ppp_receive(const unsigned char *buf, gsize len, void *data)
 	};
 }
 
-static void ppp_send_lcp_frame(GAtPPP *ppp, guint8 *packet, guint infolen)
+static gboolean ppp_send_lcp_frame(GAtPPP *ppp, guint8 *packet,
+					guint infolen)
 {
 	struct ppp_header *header = (struct ppp_header *) packet;
 	guint8 code;
 	guint32 xmit_accm = 0;
 	gboolean sta = FALSE;
 	gboolean lcp;
+	gboolean sent;
 
 	/*
 	 * all LCP Link Configuration, Link Termination, and Code-Reject
@@ -276,8 +275,9 @@ static void ppp_send_lcp_frame(GAtPPP *ppp, guint8 *packet, guint infolen)
 	header->address = PPP_ADDR_FIELD;
 	header->control = PPP_CTRL;
 
-	if (g_at_hdlc_send(ppp->hdlc, packet,
-			infolen + sizeof(*header)) == TRUE) {
+	sent = g_at_hdlc_send(ppp->hdlc, packet, infolen + sizeof(*header));
+
+	if (sent == TRUE) {
 		if (sta) {
 			GAtIO *io = g_at_hdlc_get_io(ppp->hdlc);
 
@@ -289,9 +289,11 @@ static void ppp_send_lcp_frame(GAtPPP *ppp, guint8 *packet, guint infolen)
 
 	if (lcp)
 		g_at_hdlc_set_xmit_accm(ppp->hdlc, xmit_accm);
+
+	return sent;
 }
 
-static void ppp_send_acfc_frame(GAtPPP *ppp, guint8 *packet,
+static gboolean ppp_send_acfc_frame(GAtPPP *ppp, guint8 *packet,
 					guint infolen)
 {
 	struct ppp_header *header = (struct ppp_header *) packet;
@@ -303,11 +305,15 @@ static void ppp_send_acfc_frame(GAtPPP *ppp, guint8 *packet,
 	/* We remove the only address and control field */
 	if (g_at_hdlc_send(ppp->hdlc, packet + offset,
 				infolen + sizeof(*header) - offset)
-			== FALSE)
+			== FALSE) {
 		DBG(ppp, "Failed to send a frame\n");
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
-static void ppp_send_acfc_pfc_frame(GAtPPP *ppp, guint8 *packet,
+static gboolean ppp_send_acfc_pfc_frame(GAtPPP *ppp, guint8 *packet,
 					guint infolen)
 {
 	struct ppp_header *header = (struct ppp_header *) packet;
@@ -326,8 +332,12 @@ static void ppp_send_acfc_pfc_frame(GAtPPP *ppp, guint8 *packet,
 
 	if (g_at_hdlc_send(ppp->hdlc, packet + offset,
 				infolen + sizeof(*header) - offset)
-			== FALSE)
+			== FALSE) {
 		DBG(ppp, "Failed to send a frame\n");
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 /*
@@ -335,23 +345,21 @@ static void ppp_send_acfc_pfc_frame(GAtPPP *ppp, guint8 *packet,
  *
  * infolen - length of the information part of the packet
  */
-void ppp_transmit(GAtPPP *ppp, guint8 *packet, guint infolen)
+gboolean ppp_transmit(GAtPPP *ppp, guint8 *packet, guint infolen)
 {
 	guint16 proto = ppp_proto(packet);
 
-	if (proto == LCP_PROTOCOL) {
-		ppp_send_lcp_frame(ppp, packet, infolen);
-		return;
-	}
+	if (proto == LCP_PROTOCOL)
+		return ppp_send_lcp_frame(ppp, packet, infolen);
 
 	/*
 	 * If the upper 8 bits of the protocol are 0, then send
 	 * with PFC if enabled
 	 */
 	if ((proto & 0xff00) == 0)
-		ppp_send_acfc_pfc_frame(ppp, packet, infolen);
-	else
-		ppp_send_acfc_frame(ppp, packet, infolen);
+		return ppp_send_acfc_pfc_frame(ppp, packet, infolen);
+
+	return ppp_send_acfc_frame(ppp, packet, infolen);
 }
 
 static inline void ppp_enter_phase(GAtPPP *ppp, enum ppp_phase phase)
@@ -541,6 +549,16 @@ static void ppp_proxy_suspend_net_interface(gpointer user_data)
 		ppp->suspend_func(ppp->suspend_data);
 }
 
+static void ppp_hdlc_write_done(gpointer user_data)
+{
+	GAtPPP *ppp = user_data;
+
+	if (ppp->net == NULL || ppp->suspended)
+		return;
+
+	ppp_net_write_done(ppp->net);
+}
+
 gboolean g_at_ppp_listen(GAtPPP *ppp, GAtIO *io)
 {
 	ppp->hdlc = g_at_hdlc_new_from_io(io);
@@ -549,6 +567,7 @@ gboolean g_at_ppp_listen(GAtPPP *ppp, GAtIO *io)
 
 	ppp->suspended = FALSE;
 	g_at_hdlc_set_receive(ppp->hdlc, ppp_receive, ppp);
+	g_at_hdlc_set_write_done(ppp->hdlc, ppp_hdlc_write_done, ppp);
 	g_at_hdlc_set_suspend_function(ppp->hdlc,
 					ppp_proxy_suspend_net_interface, ppp);
 	g_at_io_set_disconnect_function(io, io_disconnect, ppp);
@@ -567,6 +586,7 @@ gboolean g_at_ppp_open(GAtPPP *ppp, GAtIO *io)
 
 	ppp->suspended = FALSE;
 	g_at_hdlc_set_receive(ppp->hdlc, ppp_receive, ppp);
+	g_at_hdlc_set_write_done(ppp->hdlc, ppp_hdlc_write_done, ppp);
 	g_at_hdlc_set_suspend_function(ppp->hdlc,
 					ppp_proxy_suspend_net_interface, ppp);
 	g_at_hdlc_set_no_carrier_detect(ppp->hdlc, TRUE);
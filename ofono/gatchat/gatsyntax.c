@@ -59,6 +59,54 @@ enum GSM_PERMISSIVE_STATE {
 	GSM_PERMISSIVE_STATE_SHORT_PROMPT,
 };
 
+#define LINE_UNSET	(-1)
+#define LINE_UNKNOWN	(-2)
+
+/*
+ * Track the line the same way it would be extracted from the bytes fed
+ * since the last result: leading CR/LF are skipped and the line ends on
+ * the first CR or LF outside of a quoted string.
+ */
+static inline void line_track(GAtSyntax *syntax, gsize i, char byte)
+{
+	if (syntax->line_start == LINE_UNKNOWN ||
+			syntax->line_end != LINE_UNSET)
+		return;
+
+	if (syntax->line_start == LINE_UNSET) {
+		if (byte == '\r' || byte == '\n')
+			return;
+
+		syntax->line_start = syntax->fed + i;
+		syntax->line_quoted = FALSE;
+	}
+
+	if (byte == '"')
+		syntax->line_quoted = !syntax->line_quoted;
+	else if ((byte == '\r' || byte == '\n') && !syntax->line_quoted)
+		syntax->line_end = syntax->fed + i;
+}
+
+static inline void line_begin_feed(GAtSyntax *syntax)
+{
+	if (syntax->fed > 0)
+		return;
+
+	syntax->line_start = LINE_UNSET;
+	syntax->line_end = LINE_UNSET;
+}
+
+static inline GAtSyntaxResult line_end_feed(GAtSyntax *syntax, gsize len,
+						GAtSyntaxResult res)
+{
+	if (res == G_AT_SYNTAX_RESULT_UNSURE)
+		syntax->fed += len;
+	else
+		syntax->fed = 0;
+
+	return res;
+}
+
 static void gsmv1_hint(GAtSyntax *syntax, GAtSyntaxExpectHint hint)
 {
 	switch (hint) {
@@ -82,9 +130,13 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 	gsize i = 0;
 	GAtSyntaxResult res = G_AT_SYNTAX_RESULT_UNSURE;
 
+	line_begin_feed(syntax);
+
 	while (i < *len) {
 		char byte = bytes[i];
 
+		line_track(syntax, i, byte);
+
 		switch (syntax->state) {
 		case GSMV1_STATE_IDLE:
 			if (byte == '\r')
@@ -100,7 +152,8 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 				syntax->state = GSMV1_STATE_INITIAL_LF;
 			else if (byte == '\r') {
 				syntax->state = GSMV1_STATE_IDLE;
-				return G_AT_SYNTAX_RESULT_UNRECOGNIZED;
+				return line_end_feed(syntax, *len,
+					G_AT_SYNTAX_RESULT_UNRECOGNIZED);
 			} else
 				syntax->state = GSMV1_STATE_ECHO;
 			break;
@@ -208,7 +261,9 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 			}
 
 			syntax->state = GSMV1_STATE_RESPONSE;
-			return G_AT_SYNTAX_RESULT_UNSURE;
+			syntax->line_start = LINE_UNKNOWN;
+			return line_end_feed(syntax, *len,
+						G_AT_SYNTAX_RESULT_UNSURE);
 
 		case GSMV1_STATE_ECHO:
 			/* This handles the case of echo of the PDU terminated
@@ -250,7 +305,9 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 			}
 
 			syntax->state = GSMV1_STATE_RESPONSE;
-			return G_AT_SYNTAX_RESULT_UNSURE;
+			syntax->line_start = LINE_UNKNOWN;
+			return line_end_feed(syntax, *len,
+						G_AT_SYNTAX_RESULT_UNSURE);
 
 		default:
 			break;
@@ -261,7 +318,7 @@ static GAtSyntaxResult gsmv1_feed(GAtSyntax *syntax,
 
 out:
 	*len = i;
-	return res;
+	return line_end_feed(syntax, i, res);
 }
 
 static void gsm_permissive_hint(GAtSyntax *syntax, GAtSyntaxExpectHint hint)
@@ -278,9 +335,13 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 	gsize i = 0;
 	GAtSyntaxResult res = G_AT_SYNTAX_RESULT_UNSURE;
 
+	line_begin_feed(syntax);
+
 	while (i < *len) {
 		char byte = bytes[i];
 
+		line_track(syntax, i, byte);
+
 		switch (syntax->state) {
 		case GSM_PERMISSIVE_STATE_IDLE:
 			if (byte == '\r' || byte == '\n')
@@ -341,7 +402,9 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 			}
 
 			syntax->state = GSM_PERMISSIVE_STATE_RESPONSE;
-			return G_AT_SYNTAX_RESULT_UNSURE;
+			syntax->line_start = LINE_UNKNOWN;
+			return line_end_feed(syntax, *len,
+						G_AT_SYNTAX_RESULT_UNSURE);
 
 		case GSM_PERMISSIVE_STATE_GUESS_SHORT_PROMPT:
 			if (byte == '\n')
@@ -362,7 +425,9 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 			}
 
 			syntax->state = GSM_PERMISSIVE_STATE_RESPONSE;
-			return G_AT_SYNTAX_RESULT_UNSURE;
+			syntax->line_start = LINE_UNKNOWN;
+			return line_end_feed(syntax, *len,
+						G_AT_SYNTAX_RESULT_UNSURE);
 
 		default:
 			break;
@@ -373,7 +438,7 @@ static GAtSyntaxResult gsm_permissive_feed(GAtSyntax *syntax,
 
 out:
 	*len = i;
-	return res;
+	return line_end_feed(syntax, i, res);
 }
 
 GAtSyntax *g_at_syntax_new_full(GAtSyntaxFeedFunc feed,
@@ -388,6 +453,8 @@ GAtSyntax *g_at_syntax_new_full(GAtSyntaxFeedFunc feed,
 	syntax->set_hint = hint;
 	syntax->state = initial_state;
 	syntax->ref_count = 1;
+	syntax->line_start = LINE_UNKNOWN;
+	syntax->line_end = LINE_UNSET;
 
 	return syntax;
 }
@@ -53,11 +53,23 @@ typedef void (*GAtSyntaxSetHintFunc)(GAtSyntax *syntax,
 typedef GAtSyntaxResult (*GAtSyntaxFeedFunc)(GAtSyntax *syntax,
 						const char *bytes, gsize *len);
 
+/*
+ * The built-in syntaxes locate the line while parsing it.  Once a result
+ * is returned, line_start holds the offset of the line relative to the
+ * first byte fed since the previous result and line_end the offset of its
+ * terminator.  line_start is -1 for an empty line and -2 if the position
+ * is unknown, e.g. for syntaxes created with g_at_syntax_new_full.
+ * line_end is -1 if the line runs up to the last byte consumed.
+ */
 struct _GAtSyntax {
 	gint ref_count;
 	int state;
 	GAtSyntaxSetHintFunc set_hint;
 	GAtSyntaxFeedFunc feed;
+	gsize fed;
+	gssize line_start;
+	gssize line_end;
+	gboolean line_quoted;
 };
 
 
@@ -28,6 +28,8 @@
 #define IPV6CP_PROTO	0x8057
 #define PPP_IP_PROTO	0x0021
 #define PPP_IPV6_PROTO	0x0057
+#define PPP_ADDR_FIELD	0xff
+#define PPP_CTRL	0x03
 #define MD5		5
 
 #define DBG(p, fmt, arg...) do {				\
@@ -127,10 +129,11 @@ void ppp_net_free(struct ppp_net *net);
 gboolean ppp_net_set_mtu(struct ppp_net *net, guint16 mtu);
 void ppp_net_suspend_interface(struct ppp_net *net);
 void ppp_net_resume_interface(struct ppp_net *net);
+void ppp_net_write_done(struct ppp_net *net);
 
 /* PPP functions related to main GAtPPP object */
 void ppp_debug(GAtPPP *ppp, const char *str);
-void ppp_transmit(GAtPPP *ppp, guint8 *packet, guint infolen);
+gboolean ppp_transmit(GAtPPP *ppp, guint8 *packet, guint infolen);
 void ppp_set_auth(GAtPPP *ppp, const guint8 *auth_data);
 void ppp_auth_notify(GAtPPP *ppp, gboolean success);
 void ppp_ipcp_up_notify(GAtPPP *ppp, const char *local, const char *peer,
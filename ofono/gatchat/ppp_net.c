@@ -24,6 +24,7 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -39,14 +40,18 @@
 #include "ppp.h"
 
 #define MAX_PACKET 1500
+#define MAX_BATCH 32	/* Packets read from tun per wakeup */
 
 struct ppp_net {
 	GAtPPP *ppp;
 	char *if_name;
 	GIOChannel *channel;
+	int fd;
 	guint watch;
 	gint mtu;
 	struct ppp_header *ppp_packet;
+	gsize pending;		/* Packet HDLC had no room for yet */
+	guint write_errors;	/* Packets tun refused */
 };
 
 gboolean ppp_net_set_mtu(struct ppp_net *net, guint16 mtu)
@@ -80,8 +85,6 @@ gboolean ppp_net_set_mtu(struct ppp_net *net, guint16 mtu)
 void ppp_net_process_packet(struct ppp_net *net, const guint8 *packet,
 				gsize plen)
 {
-	GIOStatus status;
-	gsize bytes_written;
 	guint16 len;
 
 	if (plen < 4)
@@ -89,41 +92,110 @@ void ppp_net_process_packet(struct ppp_net *net, const guint8 *packet,
 
 	/* find the length of the packet to transmit */
 	len = get_host_short(&packet[2]);
-	status = g_io_channel_write_chars(net->channel, (gchar *) packet,
-						MIN(len, plen),
-						&bytes_written, NULL);
 
-	if (status != G_IO_STATUS_NORMAL)
-		return;
+	/* tun takes whole packets, a short or failed write just drops it */
+	while (write(net->fd, packet, MIN(len, plen)) < 0) {
+		char *str;
+
+		if (errno == EINTR)
+			continue;
+
+		net->write_errors += 1;
+
+		str = g_strdup_printf("Dropped packet for %s: %s (%u dropped)",
+					net->if_name, strerror(errno),
+					net->write_errors);
+		ppp_debug(net->ppp, str);
+		g_free(str);
+		break;
+	}
+}
+
+/*
+ * Hands the packet in ppp_packet to HDLC.  If its write queue is full
+ * the packet is kept and the tun watch removed; the packet is sent
+ * again and reading resumed once HDLC has written a buffer out.
+ */
+static gboolean ppp_net_transmit(struct ppp_net *net, gsize len)
+{
+	/* PFC framing shuffles the header in place, so reset it */
+	net->ppp_packet->address = PPP_ADDR_FIELD;
+	net->ppp_packet->control = PPP_CTRL;
+	net->ppp_packet->proto = htons(PPP_IP_PROTO);
+
+	if (ppp_transmit(net->ppp, (guint8 *) net->ppp_packet, len) == TRUE) {
+		net->pending = 0;
+		return TRUE;
+	}
+
+	net->pending = len;
+	ppp_net_suspend_interface(net);
+
+	return FALSE;
 }
 
 /*
  * packets received by the tun interface need to be written to
- * the modem.  So, just read a packet, write out to the modem
+ * the modem.  Packets are read straight into the space behind the PPP
+ * header and handed to the HDLC encoder from there.  Drain up to
+ * MAX_BATCH packets per wakeup so that a busy link does not pay for a
+ * main loop iteration per packet, nor starve the modem side.
  */
 static gboolean ppp_net_callback(GIOChannel *channel, GIOCondition cond,
 				gpointer userdata)
 {
 	struct ppp_net *net = (struct ppp_net *) userdata;
-	GIOStatus status;
-	gsize bytes_read;
-	gchar *buf = (gchar *) net->ppp_packet->info;
+	guint8 *buf = net->ppp_packet->info;
+	ssize_t bytes_read;
+	int i;
 
 	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto error;
+
+	if (!(cond & G_IO_IN))
+		return TRUE;
+
+	/* Resumed by g_at_ppp_resume while a packet was still waiting */
+	if (net->pending > 0 && ppp_net_transmit(net, net->pending) == FALSE)
 		return FALSE;
 
-	if (cond & G_IO_IN) {
-		/* leave space to add PPP protocol field */
-		status = g_io_channel_read_chars(channel, buf, net->mtu,
-							&bytes_read, NULL);
-		if (bytes_read > 0)
-			ppp_transmit(net->ppp, (guint8 *) net->ppp_packet,
-					bytes_read);
+	for (i = 0; i < MAX_BATCH; i++) {
+		bytes_read = read(net->fd, buf, net->mtu);
+
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 
-		if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN)
+			goto error;
+		}
+
+		if (bytes_read == 0)
+			goto error;
+
+		/* HDLC queue is full, the rest waits in the tun queue */
+		if (ppp_net_transmit(net, bytes_read) == FALSE)
 			return FALSE;
 	}
+
 	return TRUE;
+
+error:
+	net->watch = 0;
+	return FALSE;
+}
+
+void ppp_net_write_done(struct ppp_net *net)
+{
+	if (net->pending == 0)
+		return;
+
+	if (ppp_net_transmit(net, net->pending) == FALSE)
+		return;
+
+	ppp_net_resume_interface(net);
 }
 
 const char *ppp_net_get_interface(struct ppp_net *net)
@@ -181,12 +253,13 @@ struct ppp_net *ppp_net_new(GAtPPP *ppp, int fd)
 	if (channel == NULL)
 		goto error;
 
-	if (!g_at_util_setup_io(channel, 0))
+	if (!g_at_util_setup_io(channel, G_IO_FLAG_NONBLOCK))
 		goto error;
 
 	g_io_channel_set_buffered(channel, FALSE);
 
 	net->channel = channel;
+	net->fd = fd;
 	net->watch = g_io_add_watch(channel,
 			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
 			ppp_net_callback, net);
@@ -241,6 +314,9 @@ void ppp_net_resume_interface(struct ppp_net *net)
 	if (net == NULL || net->channel == NULL)
 		return;
 
+	if (net->watch > 0)
+		return;
+
 	net->watch = g_io_add_watch(net->channel,
 			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
 			ppp_net_callback, net);
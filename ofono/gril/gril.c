@@ -57,6 +57,7 @@ struct ril_request {
 	GRilResponseFunc callback;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GList *link;		/* In command_queue until fully written */
 };
 
 struct ril_notify_node {
@@ -80,13 +81,14 @@ struct ril_s {
 	guint next_notify_id;			/* Next notify id */
 	guint next_gid;				/* Next group id */
 	GRilIO *io;				/* GRil IO */
-	GQueue *command_queue;			/* Command queue */
-	GQueue *out_queue;			/* Commands sent/been sent */
+	GQueue *command_queue;			/* Commands not yet sent */
+	GHashTable *pending;			/* Serial to request map */
 	guint req_bytes_written;		/* bytes written from req */
 	GHashTable *notify_list;		/* List of notification reg */
 	GRilDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
-	guint read_so_far;			/* Number of bytes processed */
+	GByteArray *spill;			/* Record too big for the ring */
+	guint spill_len;			/* Size of that record */
 	gboolean suspended;			/* Are we suspended? */
 	gboolean debug;
 	gboolean trace;
@@ -302,6 +304,16 @@ static void ril_request_destroy(struct ril_request *req)
 	g_free(req);
 }
 
+static gboolean ril_steal_request(gpointer key, gpointer value,
+					gpointer user_data)
+{
+	GSList **list = user_data;
+
+	*list = g_slist_prepend(*list, value);
+
+	return TRUE;
+}
+
 static void ril_cleanup(struct ril_s *p)
 {
 	/* Cleanup pending commands */
@@ -311,9 +323,26 @@ static void ril_cleanup(struct ril_s *p)
 		p->command_queue = NULL;
 	}
 
-	if (p->out_queue) {
-		g_queue_free(p->out_queue);
-		p->out_queue = NULL;
+	if (p->spill) {
+		g_byte_array_free(p->spill, TRUE);
+		p->spill = NULL;
+	}
+
+	/*
+	 * Queued and sent requests are all in the pending table. Their
+	 * destroy notifies run once the table is gone, as they may well
+	 * try to send something.
+	 */
+	if (p->pending) {
+		GSList *requests = NULL;
+
+		g_hash_table_foreach_steal(p->pending, ril_steal_request,
+								&requests);
+		g_hash_table_destroy(p->pending);
+		p->pending = NULL;
+
+		g_slist_free_full(requests,
+				(GDestroyNotify) ril_request_destroy);
 	}
 
 	/* Cleanup registered notifications */
@@ -351,60 +380,40 @@ static void io_disconnect(gpointer user_data)
 
 static void handle_response(struct ril_s *p, struct ril_msg *message)
 {
-	guint count = g_queue_get_length(p->command_queue);
 	struct ril_request *req;
-	gboolean found = FALSE;
-	guint i, len;
-	gint id;
-
-	for (i = 0; i < count; i++) {
-		req = g_queue_peek_nth(p->command_queue, i);
-
-		if (req->id == message->serial_no) {
-			found = TRUE;
-			message->req = req->req;
 
-			if (message->error != RIL_E_SUCCESS)
-				RIL_TRACE(p, "[%d,%04d]< %s failed %s",
-					p->slot, message->serial_no,
-					request_id_to_string(p, message->req),
-					ril_error_to_string(message->error));
+	req = g_hash_table_lookup(p->pending,
+					GINT_TO_POINTER(message->serial_no));
 
-			req = g_queue_pop_nth(p->command_queue, i);
-			if (req->callback)
-				req->callback(message, req->user_data);
-
-			/* gril may have been destroyed in the request callback */
-			if (p->destroyed) {
-				ril_request_destroy(req);
-				return;
-			}
+	/* Only requests which have been fully written can be answered */
+	if (req == NULL || req->link != NULL) {
+		ofono_error("No matching request for reply: %s serial_no: %d!",
+			request_id_to_string(p, message->req),
+			message->serial_no);
+		return;
+	}
 
-			len = g_queue_get_length(p->out_queue);
+	g_hash_table_remove(p->pending, GINT_TO_POINTER(req->id));
 
-			for (i = 0; i < len; i++) {
-				id = GPOINTER_TO_INT(g_queue_peek_nth(
-							p->out_queue, i));
-				if (id == req->id) {
-					g_queue_pop_nth(p->out_queue, i);
-					break;
-				}
-			}
+	message->req = req->req;
 
-			ril_request_destroy(req);
+	if (message->error != RIL_E_SUCCESS)
+		RIL_TRACE(p, "[%d,%04d]< %s failed %s",
+			p->slot, message->serial_no,
+			request_id_to_string(p, message->req),
+			ril_error_to_string(message->error));
 
-			if (g_queue_peek_head(p->command_queue))
-				ril_wakeup_writer(p);
+	if (req->callback)
+		req->callback(message, req->user_data);
 
-			break;
-		}
-	}
+	ril_request_destroy(req);
 
-	if (found == FALSE)
-		ofono_error("No matching request for reply: %s serial_no: %d!",
-			request_id_to_string(p, message->req),
-			message->serial_no);
+	/* gril may have been destroyed in the request callback */
+	if (p->destroyed)
+		return;
 
+	if (g_queue_peek_head(p->command_queue))
+		ril_wakeup_writer(p);
 }
 
 static gboolean node_check_destroyed(struct ril_notify_node *node,
@@ -458,7 +467,6 @@ static void dispatch(struct ril_s *p, struct ril_msg *message)
 {
 	int32_t *unsolicited_field, *id_num_field;
 	gchar *bufp = message->buf;
-	gchar *datap;
 	gsize data_len;
 
 	/* This could be done with a struct/union... */
@@ -499,26 +507,13 @@ static void dispatch(struct ril_s *p, struct ril_msg *message)
 	bufp += 4;
 
 	/*
-	 * Now, use buffer for event data if present
+	 * The event data is handed out in place, the record buffer is
+	 * owned by the caller and outlives the callbacks
 	 */
 	if (data_len) {
-		datap = g_try_malloc(data_len);
-		if (datap == NULL)
-			goto error;
-
-		/* Copy event bytes from message->buf into new buffer */
-		memcpy(datap, bufp, data_len);
-
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
-		/* ...and replace with new buffer */
-		message->buf = datap;
+		message->buf = bufp;
 		message->buf_len = data_len;
 	} else {
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
 		/* To know if there was no data when parsing */
 		message->buf = NULL;
 		message->buf_len = 0;
@@ -528,108 +523,121 @@ static void dispatch(struct ril_s *p, struct ril_msg *message)
 		handle_unsol_req(p, message);
 	else
 		handle_response(p, message);
+}
 
-error:
-	g_free(message->buf);
-	g_free(message);
+/* Copies bytes out of the ring buffer without draining them */
+static void peek_bytes(struct ring_buffer *rbuf, unsigned int offset,
+				void *dest, unsigned int len)
+{
+	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+	unsigned int chunk = 0;
+
+	if (offset < wrap) {
+		chunk = MIN(len, wrap - offset);
+		memcpy(dest, ring_buffer_read_ptr(rbuf, offset), chunk);
+	}
+
+	if (chunk < len)
+		memcpy((guchar *) dest + chunk,
+			ring_buffer_read_ptr(rbuf, offset + chunk),
+			len - chunk);
 }
 
-static struct ril_msg *read_fixed_record(struct ril_s *p,
-						const guchar *bytes, gsize *len)
+static void dispatch_record(struct ril_s *p, gchar *buf, guint len)
 {
-	struct ril_msg *message;
-	unsigned message_len, plen;
+	struct ril_msg message;
 
-	/* First four bytes are length in TCP byte order (Big Endian) */
-	plen = ntohl(*((uint32_t *) (void *) bytes));
-	bytes += 4;
+	memset(&message, 0, sizeof(message));
+	message.buf = buf;
+	message.buf_len = len;
 
-	/*
-	 * TODO: Verify that 8k is the max message size from rild.
-	 *
-	 * This condition shouldn't happen.  If it does
-	 * there are three options:
-	 *
-	 * 1) Exit; ofono will restart via DBus (this is what we do now)
-	 * 2) Consume the bytes & continue
-	 * 3) force a disconnect
-	 */
-	if (plen > GRIL_BUFFER_SIZE - 4) {
-		ofono_error("ERROR RIL parcel bigger than buffer (%u), exiting",
-				plen);
-		exit(1);
+	/* Unsolicited flag, then event id or serial number and error */
+	if (len < 8 || (len < 12 && *((int32_t *) (void *) buf) == 0)) {
+		ofono_error("%s: RIL record too short (%u)", __func__, len);
+		return;
 	}
 
-	/*
-	 * If we don't have the whole fixed record in the ringbuffer
-	 * then return NULL & leave ringbuffer as is.
-	 */
+	dispatch(p, &message);
+}
 
-	message_len = *len - 4;
-	if (message_len < plen)
-		return NULL;
+/*
+ * Collects a record that does not fit into the ring buffer.  Returns
+ * FALSE once the ring buffer has been emptied and more data is needed.
+ */
+static gboolean read_spilled_record(struct ril_s *p, struct ring_buffer *rbuf)
+{
+	while (p->spill->len < p->spill_len) {
+		guint chunk = MIN((guint) ring_buffer_len_no_wrap(rbuf),
+					p->spill_len - p->spill->len);
 
-	message = g_malloc(sizeof(struct ril_msg));
+		if (chunk == 0)
+			return FALSE;
 
-	/* allocate ril_msg->buffer */
-	message->buf_len = plen;
-	message->buf = g_malloc(plen);
+		g_byte_array_append(p->spill,
+					ring_buffer_read_ptr(rbuf, 0), chunk);
+		ring_buffer_drain(rbuf, chunk);
+	}
+
+	dispatch_record(p, (gchar *) p->spill->data, p->spill->len);
 
-	/* Copy bytes into message buffer */
-	memmove(message->buf, (const void *) bytes, plen);
+	g_byte_array_free(p->spill, TRUE);
+	p->spill = NULL;
 
-	/* Indicate to caller size of record we extracted */
-	*len = plen + 4;
-	return message;
+	return TRUE;
 }
 
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
-	struct ril_msg *message;
 	struct ril_s *p = user_data;
-	unsigned int len = ring_buffer_len(rbuf);
-	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
-	guchar *buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
 
 	p->in_read_handler = TRUE;
 
-	while (p->suspended == FALSE && (p->read_so_far < len)) {
-		gsize rbytes = MIN(len - p->read_so_far, wrap - p->read_so_far);
+	while (p->suspended == FALSE) {
+		unsigned int len = ring_buffer_len(rbuf);
+		unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+		uint32_t plen;
+		gchar *copy = NULL;
 
-		if (rbytes < 4) {
-			DBG("Not enough bytes for header length: len: %d", len);
-			return;
-		}
+		if (p->spill) {
+			if (read_spilled_record(p, rbuf) == FALSE)
+				break;
 
-		/*
-		 * This function attempts to read the next full length
-		 * fixed message from the stream.  if not all bytes are
-		 * available, it returns NULL.  otherwise it allocates
-		 * and returns a ril_message with the copied bytes, and
-		 * drains those bytes from the ring_buffer
-		 */
-		message = read_fixed_record(p, buf, &rbytes);
+			continue;
+		}
 
-		/* wait for the rest of the record... */
-		if (message == NULL)
+		/* First four bytes are length in TCP byte order */
+		if (len < 4)
 			break;
 
-		buf += rbytes;
-		p->read_so_far += rbytes;
+		peek_bytes(rbuf, 0, &plen, 4);
+		plen = ntohl(plen);
 
-		/* TODO: need to better understand how wrap works! */
-		if (p->read_so_far == wrap) {
-			buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
-			wrap = len;
-		}
+		/* Wait for the rest of the record, making room for it */
+		if (len - 4 < plen) {
+			if (plen < G_MAXUINT - 4 &&
+					g_ril_io_reserve(p->io, plen + 4))
+				break;
 
-		dispatch(p, message);
+			/* Too big for any ring buffer, collect it aside */
+			p->spill = g_byte_array_new();
+			p->spill_len = plen;
+			ring_buffer_drain(rbuf, 4);
+			continue;
+		}
 
-		ring_buffer_drain(rbuf, p->read_so_far);
+		/* Common case: the record is contiguous, parse it in place */
+		if (plen + 4 <= wrap) {
+			dispatch_record(p,
+					(gchar *) ring_buffer_read_ptr(rbuf, 4),
+					plen);
+		} else {
+			copy = g_malloc(plen);
+			peek_bytes(rbuf, 4, copy, plen);
+			dispatch_record(p, copy, plen);
+			g_free(copy);
+		}
 
-		len -= p->read_so_far;
-		wrap -= p->read_so_far;
-		p->read_so_far = 0;
+		ring_buffer_drain(rbuf, plen + 4);
 	}
 
 	p->in_read_handler = FALSE;
@@ -648,69 +656,12 @@ static gboolean can_write_data(gpointer data)
 	struct ril_s *ril = data;
 	struct ril_request *req;
 	gsize bytes_written, towrite, len;
-	guint qlen, oqlen;
-	gint id;
-	gboolean written = TRUE;
-	guint i, j;
 
-	qlen = g_queue_get_length(ril->command_queue);
-	if (qlen < 1)
+	/* The head of the queue is the request being written */
+	req = g_queue_peek_head(ril->command_queue);
+	if (req == NULL)
 		return FALSE;
 
-	/* if the whole request was not written */
-	if (ril->req_bytes_written != 0) {
-
-		for (i = 0; i < qlen; i++) {
-			req = g_queue_peek_nth(ril->command_queue, i);
-			if (req) {
-				id = GPOINTER_TO_INT(g_queue_peek_head(
-							ril->out_queue));
-				if (req->id == id)
-					goto out;
-			} else {
-				return FALSE;
-			}
-		}
-	}
-	/* if no requests already sent */
-	oqlen = g_queue_get_length(ril->out_queue);
-	if (oqlen < 1) {
-		req = g_queue_peek_head(ril->command_queue);
-		if (req == NULL)
-			return FALSE;
-
-		g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
-
-		goto out;
-	}
-
-	for (i = 0; i < qlen; i++) {
-		req = g_queue_peek_nth(ril->command_queue, i);
-		if (req == NULL)
-			return FALSE;
-
-		for (j = 0; j < oqlen; j++) {
-			id = GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, j));
-			if (req->id == id) {
-				written = TRUE;
-				break;
-			} else {
-				written = FALSE;
-			}
-		}
-
-		if (written == FALSE)
-			break;
-	}
-
-	/* watcher fired though requests already written */
-	if (written == TRUE)
-		return FALSE;
-
-	g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
-
-out:
 	len = req->data_len;
 
 	towrite = len - ril->req_bytes_written;
@@ -730,8 +681,11 @@ out:
 	ril->req_bytes_written += bytes_written;
 	if (bytes_written < towrite)
 		return TRUE;
-	else
-		ril->req_bytes_written = 0;
+
+	/* Fully written, it now only waits for its response */
+	ril->req_bytes_written = 0;
+	g_queue_delete_link(ril->command_queue, req->link);
+	req->link = NULL;
 
 	return FALSE;
 }
@@ -882,11 +836,7 @@ static struct ril_s *create_ril(const char *sock_path, unsigned int uid,
 		goto error;
 	}
 
-	ril->out_queue = g_queue_new();
-	if (ril->out_queue == NULL) {
-		ofono_error("create_ril: Couldn't create out_queue.");
-		goto error;
-	}
+	ril->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	ril->notify_list = g_hash_table_new_full(g_int_hash, g_int_equal,
 							g_free,
@@ -923,42 +873,52 @@ static struct ril_notify *ril_notify_create(struct ril_s *ril,
 	return notify;
 }
 
-static void ril_cancel_group(struct ril_s *ril, guint group)
+struct cancel_data {
+	struct ril_s *ril;
+	guint group;
+	GSList *cancelled;
+};
+
+static gboolean ril_cancel_request(gpointer key, gpointer value,
+					gpointer user_data)
 {
-	int n = 0;
-	guint len, i;
-	struct ril_request *req;
-	gboolean sent;
+	struct cancel_data *data = user_data;
+	struct ril_s *ril = data->ril;
+	struct ril_request *req = value;
 
-	if (ril->command_queue == NULL)
-		return;
+	if (req->id == 0 || req->gid != data->group)
+		return FALSE;
 
-	while ((req = g_queue_peek_nth(ril->command_queue, n)) != NULL) {
-		if (req->id == 0 || req->gid != group) {
-			n += 1;
-			continue;
-		}
+	req->callback = NULL;
 
-		req->callback = NULL;
-		sent = FALSE;
+	/*
+	 * Requests which have been (partially) written stay around until
+	 * their response arrives
+	 */
+	if (req->link == NULL || (ril->req_bytes_written != 0 &&
+			req->link == g_queue_peek_head_link(
+						ril->command_queue)))
+		return FALSE;
 
-		len = g_queue_get_length(ril->out_queue);
-		for (i = 0; i < len; i++) {
-			if (GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, i))
-					== req->id) {
-				n += 1;
-				sent = TRUE;
-				break;
-			}
-		 }
+	g_queue_delete_link(ril->command_queue, req->link);
+	req->link = NULL;
 
-		if (sent)
-			continue;
+	/* Destroyed after the table walk, the notify may send requests */
+	data->cancelled = g_slist_prepend(data->cancelled, req);
 
-		g_queue_remove(ril->command_queue, req);
-		ril_request_destroy(req);
-	}
+	return TRUE;
+}
+
+static void ril_cancel_group(struct ril_s *ril, guint group)
+{
+	struct cancel_data data = { ril, group, NULL };
+
+	if (ril->command_queue == NULL)
+		return;
+
+	g_hash_table_foreach_steal(ril->pending, ril_cancel_request, &data);
+	g_slist_free_full(data.cancelled,
+				(GDestroyNotify) ril_request_destroy);
 }
 
 static guint ril_register(struct ril_s *ril, guint group,
@@ -1151,6 +1111,8 @@ gint g_ril_send(GRil *ril, const gint reqid, struct parcel *rilp,
 	p->next_cmd_id++;
 
 	g_queue_push_tail(p->command_queue, r);
+	r->link = g_queue_peek_tail_link(p->command_queue);
+	g_hash_table_insert(p->pending, GINT_TO_POINTER(r->id), r);
 
 	ril_wakeup_writer(p);
 
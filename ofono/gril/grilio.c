@@ -391,6 +391,43 @@ void g_ril_io_set_write_done(GRilIO *io, GRilDisconnectFunc func,
 	io->write_done_data = user_data;
 }
 
+/*
+ * Grows the read buffer so that a record of @size bytes fits.  Buffer
+ * pointers previously handed to the read handler are invalid afterwards.
+ */
+gboolean g_ril_io_reserve(GRilIO *io, guint size)
+{
+	struct ring_buffer *buf;
+	unsigned int len, wrap;
+
+	if (io == NULL || io->buf == NULL)
+		return FALSE;
+
+	if ((guint) ring_buffer_capacity(io->buf) >= size)
+		return TRUE;
+
+	/* Ring buffers have an upper size limit */
+	buf = ring_buffer_new(size);
+	if (buf == NULL)
+		return FALSE;
+
+	if ((guint) ring_buffer_capacity(buf) < size) {
+		ring_buffer_free(buf);
+		return FALSE;
+	}
+
+	len = ring_buffer_len(io->buf);
+	wrap = ring_buffer_len_no_wrap(io->buf);
+
+	ring_buffer_write(buf, ring_buffer_read_ptr(io->buf, 0), wrap);
+	ring_buffer_write(buf, ring_buffer_read_ptr(io->buf, wrap), len - wrap);
+
+	ring_buffer_free(io->buf);
+	io->buf = buf;
+
+	return TRUE;
+}
+
 void g_ril_io_drain_ring_buffer(GRilIO *io, guint len)
 {
 	ring_buffer_drain(io->buf, len);
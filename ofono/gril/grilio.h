@@ -55,6 +55,7 @@ gboolean g_ril_io_set_write_handler(GRilIO *io, GRilIOWriteFunc write_handler,
 void g_ril_io_set_write_done(GRilIO *io, GRilDisconnectFunc func,
 				gpointer user_data);
 
+gboolean g_ril_io_reserve(GRilIO *io, guint size);
 void g_ril_io_drain_ring_buffer(GRilIO *io, guint len);
 
 gsize g_ril_io_write(GRilIO *io, const gchar *data, gsize count);
@@ -62,6 +62,20 @@ void parcel_grow(struct parcel *p, size_t size)
 	p->capacity += size;
 }
 
+/* Makes room for len more bytes, doubling the capacity as needed */
+void parcel_reserve(struct parcel *p, size_t len)
+{
+	size_t capacity = p->capacity;
+
+	if (p->offset + len <= capacity)
+		return;
+
+	while (capacity < p->offset + len)
+		capacity = capacity ? capacity * 2 : 64;
+
+	parcel_grow(p, capacity - p->capacity);
+}
+
 void parcel_free(struct parcel *p)
 {
 	g_free(p->data);
@@ -90,85 +104,102 @@ int32_t parcel_r_int32(struct parcel *p)
 
 int parcel_w_int32(struct parcel *p, int32_t val)
 {
-	for (;;) {
-
-		if (p->offset + sizeof(int32_t) < p->capacity) {
-			/* There's enough space */
-			*((int32_t *) (void *) (p->data + p->offset)) = val;
-			p->offset += sizeof(int32_t);
-			p->size += sizeof(int32_t);
-			break;
-		} else {
-			/* Grow data and retry */
-			parcel_grow(p, sizeof(int32_t));
-		}
-	}
+	parcel_reserve(p, sizeof(int32_t));
+
+	*((int32_t *) (void *) (p->data + p->offset)) = val;
+	p->offset += sizeof(int32_t);
+	p->size += sizeof(int32_t);
+
 	return 0;
 }
 
+/* Number of UTF-16 code units needed for str, -1 if it is not UTF-8 */
+static long utf16_len(const char *str)
+{
+	long len = 0;
+
+	while (*str) {
+		gunichar c = g_utf8_get_char_validated(str, -1);
+
+		if (c == (gunichar) -1 || c == (gunichar) -2)
+			return -1;
+
+		len += c < 0x10000 ? 1 : 2;
+		str = g_utf8_next_char(str);
+	}
+
+	return len;
+}
+
 int parcel_w_string(struct parcel *p, const char *str)
 {
-	gunichar2 *gs16;
-	glong gs16_len;
-	size_t len;
-	size_t gs16_size;
+	const char *s;
+	char16_t *dst;
+	long len16;
+	size_t padded;
 
 	if (str == NULL) {
 		parcel_w_int32(p, -1);
 		return 0;
 	}
 
-	gs16 = g_utf8_to_utf16(str, -1, NULL, &gs16_len, NULL);
+	/* Plain ASCII maps one to one onto UTF-16 */
+	for (s = str; *s && !(*s & 0x80); s++)
+		;
 
-	if (parcel_w_int32(p, gs16_len) == -1)
+	if (*s == '\0')
+		len16 = s - str;
+	else
+		len16 = utf16_len(str);
+
+	if (len16 < 0) {
+		ofono_error("%s: wrong UTF8 coding", __func__);
+		parcel_w_int32(p, -1);
 		return -1;
+	}
 
-	gs16_size = gs16_len * sizeof(char16_t);
-	len = gs16_size + sizeof(char16_t);
-	for (;;) {
-		size_t padded = PAD_SIZE(len);
-
-		if (p->offset + len < p->capacity) {
-			/* There's enough space */
-			memcpy(p->data + p->offset, gs16, gs16_size);
-			*((char16_t *) (void *)
-				(p->data + p->offset + gs16_size)) = 0;
-			p->offset += padded;
-			p->size += padded;
-			if (padded != len) {
-
-#if BYTE_ORDER == BIG_ENDIAN
-				static const uint32_t mask[4] = {
-					0x00000000, 0xffffff00,
-					0xffff0000, 0xff000000
-				};
-#endif
-#if BYTE_ORDER == LITTLE_ENDIAN
-				static const uint32_t mask[4] = {
-					0x00000000, 0x00ffffff,
-					0x0000ffff, 0x000000ff
-				};
-#endif
+	parcel_w_int32(p, len16);
+
+	/* Encode straight into the parcel, terminator and padding zeroed */
+	padded = PAD_SIZE((len16 + 1) * sizeof(char16_t));
+	parcel_reserve(p, padded);
 
-				*((uint32_t *) (void *)
-					(p->data + p->offset - 4)) &=
-							mask[padded - len];
-			}
-			break;
+	dst = (char16_t *) (void *) (p->data + p->offset);
+	memset((char *) (dst + len16), 0, padded - len16 * sizeof(char16_t));
 
+	for (s = str; *s && !(*s & 0x80); s++)
+		*dst++ = *s;
+
+	while (*s) {
+		gunichar c = g_utf8_get_char(s);
+
+		if (c < 0x10000) {
+			*dst++ = c;
 		} else {
-			/* Grow data and retry */
-			parcel_grow(p, padded);
+			c -= 0x10000;
+			*dst++ = 0xd800 | (c >> 10);
+			*dst++ = 0xdc00 | (c & 0x3ff);
 		}
+
+		s = g_utf8_next_char(s);
 	}
 
-	g_free(gs16);
+	p->offset += padded;
+	p->size += padded;
+
 	return 0;
 }
 
-char *parcel_r_string(struct parcel *p)
+/*
+ * Validates the length and bounds of the next string and returns its
+ * UTF-16 data, or NULL for a null string or a malformed parcel.  The
+ * string is consumed before the callers convert it, so one which turns
+ * out not to be valid UTF-16 is skipped as well; the parcel is marked
+ * malformed in that case and nothing more can be read from it anyway.
+ */
+static const char16_t *parcel_r_string16(struct parcel *p, int *len)
 {
-	char *ret;
+	const char16_t *data;
 	int len16 = parcel_r_int32(p);
 	int strbytes;
 
@@ -186,19 +217,105 @@ char *parcel_r_string(struct parcel *p)
 		return NULL;
 	}
 
-	ret = g_utf16_to_utf8((gunichar2 *) (void *) (p->data + p->offset),
-				len16, NULL, NULL, NULL);
+	data = (const char16_t *) (void *) (p->data + p->offset);
+	p->offset += strbytes;
+	*len = len16;
+
+	return data;
+}
+
+static gboolean utf16_is_ascii(const char16_t *data, int len16)
+{
+	int i;
+
+	for (i = 0; i < len16; i++)
+		if (data[i] >= 0x80)
+			return FALSE;
+
+	return TRUE;
+}
+
+char *parcel_r_string(struct parcel *p)
+{
+	const char16_t *data;
+	char *ret;
+	int len16;
+	int i;
+
+	data = parcel_r_string16(p, &len16);
+	if (data == NULL)
+		return NULL;
+
+	if (utf16_is_ascii(data, len16)) {
+		ret = g_malloc(len16 + 1);
+
+		for (i = 0; i < len16; i++)
+			ret[i] = data[i];
+
+		ret[len16] = '\0';
+		return ret;
+	}
+
+	ret = g_utf16_to_utf8(data, len16, NULL, NULL, NULL);
 	if (ret == NULL) {
 		ofono_error("%s: wrong UTF16 coding", __func__);
 		p->malformed = 1;
 		return NULL;
 	}
 
-	p->offset += strbytes;
-
 	return ret;
 }
 
+/*
+ * Like parcel_r_string, but the string is read into a buffer supplied by
+ * the caller instead of an allocated one.  Meant for values which are
+ * compared or hashed and then dropped.  A string which doesn't fit is
+ * consumed and NULL is returned.
+ */
+const char *parcel_r_string_buf(struct parcel *p, char *buf, size_t size)
+{
+	const char16_t *data;
+	char *utf8;
+	size_t len;
+	int len16;
+	int i;
+
+	data = parcel_r_string16(p, &len16);
+	if (data == NULL)
+		return NULL;
+
+	if (!utf16_is_ascii(data, len16)) {
+		utf8 = g_utf16_to_utf8(data, len16, NULL, NULL, NULL);
+		if (utf8 == NULL) {
+			ofono_error("%s: wrong UTF16 coding", __func__);
+			p->malformed = 1;
+			return NULL;
+		}
+
+		len = strlen(utf8);
+
+		if (len >= size) {
+			g_free(utf8);
+			return NULL;
+		}
+
+		memcpy(buf, utf8, len + 1);
+		g_free(utf8);
+
+		return buf;
+	}
+
+	if ((size_t) len16 >= size)
+		return NULL;
+
+	for (i = 0; i < len16; i++)
+		buf[i] = data[i];
+
+	buf[len16] = '\0';
+
+	return buf;
+}
+
 void parcel_skip_string(struct parcel *p)
 {
 	int len16 = parcel_r_int32(p);
@@ -229,19 +346,12 @@ int parcel_w_raw(struct parcel *p, const void *data, size_t len)
 
 	parcel_w_int32(p, len);
 
-	for (;;) {
+	parcel_reserve(p, len);
+
+	memcpy(p->data + p->offset, data, len);
+	p->offset += len;
+	p->size += len;
 
-		if (p->offset + len < p->capacity) {
-			/* There's enough space */
-			memcpy(p->data + p->offset, data, len);
-			p->offset += len;
-			p->size += len;
-			break;
-		} else {
-			/* Grow data and retry */
-			parcel_grow(p, len);
-		}
-	}
 	return 0;
 }
 
@@ -35,11 +35,13 @@ struct parcel {
 
 void parcel_init(struct parcel *p);
 void parcel_grow(struct parcel *p, size_t size);
+void parcel_reserve(struct parcel *p, size_t len);
 void parcel_free(struct parcel *p);
 int32_t parcel_r_int32(struct parcel *p);
 int parcel_w_int32(struct parcel *p, int32_t val);
 int parcel_w_string(struct parcel *p, const char *str);
 char *parcel_r_string(struct parcel *p);
+const char *parcel_r_string_buf(struct parcel *p, char *buf, size_t size);
 void parcel_skip_string(struct parcel *p);
 int parcel_w_raw(struct parcel *p, const void *data, size_t len);
 void *parcel_r_raw(struct parcel *p,  int *len);
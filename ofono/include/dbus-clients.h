@@ -27,6 +27,11 @@ struct ofono_dbus_clients;
 typedef void (*ofono_dbus_clients_notify_func)(const char *name,
 							void *user_data);
 
+struct ofono_dbus_client_stats {
+	unsigned int signals;
+	unsigned long long bytes;
+};
+
 struct ofono_dbus_clients *ofono_dbus_clients_new(DBusConnection *conn,
 		ofono_dbus_clients_notify_func notify, void *user_data);
 void ofono_dbus_clients_free(struct ofono_dbus_clients *clients);
@@ -44,6 +49,30 @@ void ofono_dbus_clients_signal_property_changed(struct ofono_dbus_clients *dc,
 		const char *path, const char *interface, const char *name,
 		int type, const void *value);
 
+/* Since mer/1.29+git1 */
+
+/*
+ * A client added with ofono_dbus_clients_add_broadcast() has a match
+ * rule for the signals and may be served by a single signal without a
+ * destination, shared with other such clients. The bus delivers that
+ * signal to every peer with a matching rule, so it's only suitable for
+ * signals which carry nothing private. Other clients always get their
+ * own addressed copy.
+ */
+ofono_bool_t ofono_dbus_clients_add_broadcast(struct ofono_dbus_clients *dc,
+							const char *name);
+
+/*
+ * Per-client signal and byte counters. They only advance while stats
+ * are enabled, because counting bytes requires marshalling the signal.
+ * Enabling debug output for src/dbus-clients.c turns them on as well
+ * and logs each client's totals when it's removed or disconnects.
+ */
+void ofono_dbus_clients_set_stats(struct ofono_dbus_clients *dc,
+							ofono_bool_t enable);
+ofono_bool_t ofono_dbus_clients_get_stats(struct ofono_dbus_clients *dc,
+		const char *name, struct ofono_dbus_client_stats *stats);
+
 #endif /* OFONO_DBUS_CLIENTS_H */
 
 /*
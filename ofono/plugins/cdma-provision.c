@@ -72,6 +72,7 @@ static int cdma_provision_init(void)
 static void cdma_provision_exit(void)
 {
 	ofono_cdma_provision_driver_unregister(&provision_driver);
+	mbpi_cleanup();
 }
 
 OFONO_PLUGIN_DEFINE(cdma_provision, "CDMA provisioning Plugin", VERSION,
@@ -72,22 +72,60 @@ enum MBPI_ERROR {
 	MBPI_ERROR_DUPLICATE,
 };
 
-struct gsm_data {
-	const char *match_mcc;
-	const char *match_mnc;
-	char *provider_name;
-	gboolean provider_primary;
-	GSList *apns;
-	gboolean match_found;
-	gboolean allow_duplicates;
+/* An <apn> as parsed, copied out by lookups */
+struct mbpi_apn {
+	struct ofono_gprs_provision_data *ap;
+	unsigned int networks;		/* network-ids seen before it */
+	int line;
+	GError *error;
+};
+
+/* A <gsm> element */
+struct mbpi_gsm {
+	GPtrArray *apns;
+	unsigned int networks;
 };
 
-struct cdma_data {
-	const char *match_sid;
+/* Where a MCC/MNC pair first shows up in a <gsm> element */
+struct mbpi_match {
+	struct mbpi_gsm *gsm;
+	unsigned int network;
+};
+
+/*
+ * Everything lookups need from the database, built by a single parse
+ * and kept until the file or the protocol defaults change, or until
+ * no lookup has been made for MBPI_INDEX_IDLE_TIMEOUT seconds.
+ */
+struct mbpi_index {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	enum ofono_gprs_proto defaults[4];
+	gboolean complete;
+	GError *error;
+	GError *gsm_error;
+	GError *cdma_error;
+	GPtrArray *gsms;
+	GHashTable *networks;		/* "mcc,mnc" => GArray of mbpi_match */
+	GHashTable *sids;		/* sid => provider name */
+};
+
+struct mbpi_builder {
+	struct mbpi_index *index;
 	char *provider_name;
-	gboolean match_found;
+	gboolean provider_primary;
+	struct mbpi_gsm *gsm;
+	GSList *sids;
 };
 
+#define MBPI_INDEX_IDLE_TIMEOUT 60
+
+static struct mbpi_index *mbpi_index_cache;
+static guint mbpi_index_timeout;
+
 const char *mbpi_ap_type(enum ofono_gprs_context_type type)
 {
 	switch (type) {
@@ -301,40 +339,71 @@ static void apn_end(GMarkupParseContext *context, const gchar *element_name,
 		g_markup_parse_context_pop(context);
 }
 
-static void apn_error(GMarkupParseContext *context, GError *error,
-			gpointer userdata)
+static void mbpi_apn_free(gpointer data)
 {
-	/*
-	 * Note that even if the error happened in a subparser, this will
-	 * be called.  So we always perform cleanup of the allocated
-	 * provision data
-	 */
-	mbpi_ap_free(userdata);
+	struct mbpi_apn *apn = data;
+
+	mbpi_ap_free(apn->ap);
+
+	if (apn->error)
+		g_error_free(apn->error);
+
+	g_free(apn);
 }
 
-static const GMarkupParser apn_parser = {
-	apn_start,
-	apn_end,
-	NULL,
-	NULL,
-	apn_error,
-};
+static void mbpi_gsm_free(gpointer data)
+{
+	struct mbpi_gsm *gsm = data;
 
-static const GMarkupParser skip_parser = {
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-};
+	g_ptr_array_free(gsm->apns, TRUE);
+	g_free(gsm);
+}
+
+static void mbpi_index_free(struct mbpi_index *index)
+{
+	if (index == NULL)
+		return;
+
+	if (index->error)
+		g_error_free(index->error);
+
+	if (index->gsm_error)
+		g_error_free(index->gsm_error);
+
+	if (index->cdma_error)
+		g_error_free(index->cdma_error);
+
+	g_hash_table_destroy(index->networks);
+	g_hash_table_destroy(index->sids);
+	g_ptr_array_free(index->gsms, TRUE);
+	g_free(index->path);
+	g_free(index);
+}
+
+static void mbpi_index_defaults(enum ofono_gprs_proto *defaults)
+{
+	defaults[0] = mbpi_default_internet_proto;
+	defaults[1] = mbpi_default_mms_proto;
+	defaults[2] = mbpi_default_ims_proto;
+	defaults[3] = mbpi_default_proto;
+}
+
+static char *mbpi_network_key(const char *mcc, const char *mnc)
+{
+	return g_strconcat(mcc, ",", mnc, NULL);
+}
 
 static void network_id_handler(GMarkupParseContext *context,
-				struct gsm_data *gsm,
+				struct mbpi_builder *builder,
 				const gchar **attribute_names,
-				const gchar **attribute_values,
-				GError **error)
+				const gchar **attribute_values)
 {
+	struct mbpi_index *index = builder->index;
+	struct mbpi_gsm *gsm = builder->gsm;
 	const char *mcc = NULL, *mnc = NULL;
+	struct mbpi_match match;
+	GArray *matches;
+	char *key;
 	int i;
 
 	for (i = 0; attribute_names[i]; i++) {
@@ -344,75 +413,130 @@ static void network_id_handler(GMarkupParseContext *context,
 			mnc = attribute_values[i];
 	}
 
-	if (mcc == NULL) {
-		mbpi_g_set_error(context, error, G_MARKUP_ERROR,
+	if (mcc == NULL || mnc == NULL) {
+		/* This would fail every GSM lookup */
+		if (index->gsm_error == NULL)
+			mbpi_g_set_error(context, &index->gsm_error,
+					G_MARKUP_ERROR,
 					G_MARKUP_ERROR_MISSING_ATTRIBUTE,
-					"Missing attribute: mcc");
+					"Missing attribute: %s",
+					mcc ? "mnc" : "mcc");
 		return;
 	}
 
-	if (mnc == NULL) {
-		mbpi_g_set_error(context, error, G_MARKUP_ERROR,
-					G_MARKUP_ERROR_MISSING_ATTRIBUTE,
-					"Missing attribute: mnc");
-		return;
+	key = mbpi_network_key(mcc, mnc);
+	matches = g_hash_table_lookup(index->networks, key);
+
+	if (matches == NULL) {
+		matches = g_array_new(FALSE, FALSE, sizeof(match));
+		g_hash_table_insert(index->networks, key, matches);
+	} else {
+		g_free(key);
+	}
+
+	/* Only the first network-id of a <gsm> element counts */
+	if (matches->len == 0 || g_array_index(matches, struct mbpi_match,
+					matches->len - 1).gsm != gsm) {
+		match.gsm = gsm;
+		match.network = gsm->networks;
+		g_array_append_val(matches, match);
 	}
 
-	if (g_str_equal(mcc, gsm->match_mcc) &&
-			g_str_equal(mnc, gsm->match_mnc))
-		gsm->match_found = TRUE;
+	gsm->networks++;
+}
+
+static void index_apn_start(GMarkupParseContext *context,
+				const gchar *element_name,
+				const gchar **attribute_names,
+				const gchar **attribute_values,
+				gpointer userdata, GError **error)
+{
+	struct mbpi_apn *apn = userdata;
+	GError *apn_error = NULL;
+
+	/*
+	 * A broken <apn> only fails the lookups that get to it, so the
+	 * error is kept with it rather than stopping the parse.
+	 */
+	apn_start(context, element_name, attribute_names, attribute_values,
+			apn->ap, &apn_error);
+
+	if (apn_error && apn->error == NULL)
+		apn->error = apn_error;
+	else if (apn_error)
+		g_error_free(apn_error);
+}
+
+static void index_apn_end(GMarkupParseContext *context,
+				const gchar *element_name,
+				gpointer userdata, GError **error)
+{
+	struct mbpi_apn *apn = userdata;
+
+	apn_end(context, element_name, apn->ap, error);
 }
 
-static void apn_handler(GMarkupParseContext *context, struct gsm_data *gsm,
+static const GMarkupParser index_apn_parser = {
+	index_apn_start,
+	index_apn_end,
+	NULL,
+	NULL,
+	NULL,
+};
+
+static void apn_handler(GMarkupParseContext *context,
+			struct mbpi_builder *builder,
 			const gchar **attribute_names,
-			const gchar **attribute_values,
-			GError **error)
+			const gchar **attribute_values)
 {
+	struct mbpi_apn *apn;
 	struct ofono_gprs_provision_data *ap;
-	const char *apn;
+	const char *value;
 	int i;
 
-	if (gsm->match_found == FALSE) {
-		g_markup_parse_context_push(context, &skip_parser, NULL);
-		return;
-	}
-
-	for (i = 0, apn = NULL; attribute_names[i]; i++) {
+	for (i = 0, value = NULL; attribute_names[i]; i++) {
 		if (g_str_equal(attribute_names[i], "value") == FALSE)
 			continue;
 
-		apn = attribute_values[i];
+		value = attribute_values[i];
 		break;
 	}
 
-	if (apn == NULL) {
-		mbpi_g_set_error(context, error, G_MARKUP_ERROR,
-					G_MARKUP_ERROR_MISSING_ATTRIBUTE,
-					"APN attribute missing");
-		return;
-	}
-
 	ap = g_new0(struct ofono_gprs_provision_data, 1);
-	ap->provider_name = g_strdup(gsm->provider_name);
-	ap->provider_primary = gsm->provider_primary;
+	ap->provider_name = g_strdup(builder->provider_name);
+	ap->provider_primary = builder->provider_primary;
 
-	ap->apn = g_strdup(apn);
+	ap->apn = g_strdup(value);
 	ap->type = OFONO_GPRS_CONTEXT_TYPE_INTERNET;
 	ap->proto = mbpi_default_proto;
 	ap->auth_method = OFONO_GPRS_AUTH_METHOD_UNSPECIFIED;
 
-	g_markup_parse_context_push(context, &apn_parser, ap);
+	apn = g_new0(struct mbpi_apn, 1);
+	apn->ap = ap;
+	apn->networks = builder->gsm->networks;
+
+	if (value == NULL)
+		mbpi_g_set_error(context, &apn->error, G_MARKUP_ERROR,
+					G_MARKUP_ERROR_MISSING_ATTRIBUTE,
+					"APN attribute missing");
+
+	g_ptr_array_add(builder->gsm->apns, apn);
+	g_markup_parse_context_push(context, &index_apn_parser, apn);
 }
 
 static void sid_handler(GMarkupParseContext *context,
-				struct cdma_data *cdma,
+				struct mbpi_builder *builder,
 				const gchar **attribute_names,
-				const gchar **attribute_values,
-				GError **error)
+				const gchar **attribute_values)
 {
+	struct mbpi_index *index = builder->index;
 	const char *sid = NULL;
 	int i;
 
+	/* Lookups used to stop at the first bad sid */
+	if (index->cdma_error)
+		return;
+
 	for (i = 0; attribute_names[i]; i++) {
 		if (g_str_equal(attribute_names[i], "value") == FALSE)
 			continue;
@@ -422,14 +546,13 @@ static void sid_handler(GMarkupParseContext *context,
 	}
 
 	if (sid == NULL) {
-		mbpi_g_set_error(context, error, G_MARKUP_ERROR,
+		mbpi_g_set_error(context, &index->cdma_error, G_MARKUP_ERROR,
 					G_MARKUP_ERROR_MISSING_ATTRIBUTE,
 					"Missing attribute: sid");
 		return;
 	}
 
-	if (g_str_equal(sid, cdma->match_sid))
-		cdma->match_found = TRUE;
+	builder->sids = g_slist_prepend(builder->sids, g_strdup(sid));
 }
 
 static void gsm_start(GMarkupParseContext *context, const gchar *element_name,
@@ -437,68 +560,28 @@ static void gsm_start(GMarkupParseContext *context, const gchar *element_name,
 			const gchar **attribute_values,
 			gpointer userdata, GError **error)
 {
-	if (g_str_equal(element_name, "network-id")) {
-		struct gsm_data *gsm = userdata;
-
-		/*
-		 * For entries with multiple network-id elements, don't bother
-		 * searching if we already have a match
-		 */
-		if (gsm->match_found == TRUE)
-			return;
-
+	if (g_str_equal(element_name, "network-id"))
 		network_id_handler(context, userdata, attribute_names,
-					attribute_values, error);
-	} else if (g_str_equal(element_name, "apn"))
+					attribute_values);
+	else if (g_str_equal(element_name, "apn"))
 		apn_handler(context, userdata, attribute_names,
-				attribute_values, error);
+				attribute_values);
 }
 
 static void gsm_end(GMarkupParseContext *context, const gchar *element_name,
 			gpointer userdata, GError **error)
 {
-	struct gsm_data *gsm;
-	struct ofono_gprs_provision_data *ap;
+	struct mbpi_apn *apn;
+	int line_number, char_number;
 
 	if (!g_str_equal(element_name, "apn"))
 		return;
 
-	gsm = userdata;
-
-	ap = g_markup_parse_context_pop(context);
-	if (ap == NULL)
-		return;
-
-	/* Fix the authentication method if none was specified */
-	if (ap->auth_method == OFONO_GPRS_AUTH_METHOD_UNSPECIFIED) {
-		if ((!ap->username || !ap->username[0]) &&
-				(!ap->password || !ap->password[0])) {
-			/* No username or password => no authentication */
-			ap->auth_method = OFONO_GPRS_AUTH_METHOD_NONE;
-		} else {
-			ap->auth_method = mbpi_default_auth_method;
-		}
-	}
-
-	if (gsm->allow_duplicates == FALSE) {
-		GSList *l;
+	apn = g_markup_parse_context_pop(context);
 
-		for (l = gsm->apns; l; l = l->next) {
-			struct ofono_gprs_provision_data *pd = l->data;
-
-			if (pd->type != ap->type)
-				continue;
-
-			mbpi_g_set_error(context, error, mbpi_error_quark(),
-						MBPI_ERROR_DUPLICATE,
-						"Duplicate context detected");
-
-			mbpi_ap_free(ap);
-			return;
-		}
-	}
-
-	gsm->apns = g_slist_append(gsm->apns, ap);
+	g_markup_parse_context_get_position(context, &line_number,
+						&char_number);
+	apn->line = line_number;
 }
 
 static const GMarkupParser gsm_parser = {
@@ -514,18 +597,9 @@ static void cdma_start(GMarkupParseContext *context, const gchar *element_name,
 			const gchar **attribute_values,
 			gpointer userdata, GError **error)
 {
-	if (g_str_equal(element_name, "sid")) {
-		struct cdma_data *cdma = userdata;
-		/*
-		 * For entries with multiple sid elements, don't bother
-		 * searching if we already have a match
-		 */
-		if (cdma->match_found == TRUE)
-			return;
-
-		sid_handler(context, cdma, attribute_names, attribute_values,
-				error);
-	}
+	if (g_str_equal(element_name, "sid"))
+		sid_handler(context, userdata, attribute_names,
+				attribute_values);
 }
 
 static const GMarkupParser cdma_parser = {
@@ -542,17 +616,21 @@ static void provider_start(GMarkupParseContext *context,
 				const gchar **attribute_values,
 				gpointer userdata, GError **error)
 {
-	if (g_str_equal(element_name, "name")) {
-		struct cdma_data *cdma = userdata;
+	struct mbpi_builder *builder = userdata;
 
-		g_free(cdma->provider_name);
-		cdma->provider_name = NULL;
+	if (g_str_equal(element_name, "name")) {
+		g_free(builder->provider_name);
+		builder->provider_name = NULL;
 		g_markup_parse_context_push(context, &text_parser,
-						&cdma->provider_name);
-	} else if (g_str_equal(element_name, "gsm"))
-		g_markup_parse_context_push(context, &skip_parser, NULL);
-	else if (g_str_equal(element_name, "cdma"))
-		g_markup_parse_context_push(context, &cdma_parser, userdata);
+						&builder->provider_name);
+	} else if (g_str_equal(element_name, "gsm")) {
+		builder->gsm = g_new0(struct mbpi_gsm, 1);
+		builder->gsm->apns = g_ptr_array_new_with_free_func(
+								mbpi_apn_free);
+		g_ptr_array_add(builder->index->gsms, builder->gsm);
+		g_markup_parse_context_push(context, &gsm_parser, builder);
+	} else if (g_str_equal(element_name, "cdma"))
+		g_markup_parse_context_push(context, &cdma_parser, builder);
 }
 
 static void provider_end(GMarkupParseContext *context,
@@ -563,7 +641,6 @@ static void provider_end(GMarkupParseContext *context,
 				g_str_equal(element_name, "gsm") ||
 				g_str_equal(element_name, "cdma"))
 		g_markup_parse_context_pop(context);
-
 }
 
 static const GMarkupParser provider_parser = {
@@ -574,107 +651,61 @@ static const GMarkupParser provider_parser = {
 	NULL,
 };
 
-static void gsm_provider_start(GMarkupParseContext *context,
-					const gchar *element_name,
-					const gchar **attribute_names,
-					const gchar **attribute_values,
-					gpointer userdata, GError **error)
-{
-	struct gsm_data *gsm = userdata;
-
-	if (g_str_equal(element_name, "name")) {
-		g_free(gsm->provider_name);
-		gsm->provider_name = NULL;
-		g_markup_parse_context_push(context, &text_parser,
-						&gsm->provider_name);
-	} else if (g_str_equal(element_name, "gsm")) {
-		gsm->match_found = FALSE;
-		g_markup_parse_context_push(context, &gsm_parser, gsm);
-	} else if (g_str_equal(element_name, "cdma"))
-		g_markup_parse_context_push(context, &skip_parser, NULL);
-}
-
-static void gsm_provider_end(GMarkupParseContext *context,
-					const gchar *element_name,
-					gpointer userdata, GError **error)
-{
-	if (g_str_equal(element_name, "name") ||
-				g_str_equal(element_name, "gsm") ||
-				g_str_equal(element_name, "cdma"))
-		g_markup_parse_context_pop(context);
-}
-
-static const GMarkupParser gsm_provider_parser = {
-	gsm_provider_start,
-	gsm_provider_end,
-	NULL,
-	NULL,
-	NULL,
-};
-
-static void toplevel_gsm_start(GMarkupParseContext *context,
+static void toplevel_start(GMarkupParseContext *context,
 					const gchar *element_name,
 					const gchar **attribute_names,
 					const gchar **attribute_values,
 					gpointer userdata, GError **error)
 {
-	struct gsm_data *gsm = userdata;
+	struct mbpi_builder *builder = userdata;
 
 	if (g_str_equal(element_name, "provider")) {
 		g_markup_collect_attributes(element_name, attribute_names,
 				attribute_values, error,
 				G_MARKUP_COLLECT_BOOLEAN | G_MARKUP_COLLECT_OPTIONAL,
-				"primary", &gsm->provider_primary,
+				"primary", &builder->provider_primary,
 				G_MARKUP_COLLECT_INVALID);
 
-		g_markup_parse_context_push(context, &gsm_provider_parser, gsm);
+		g_markup_parse_context_push(context, &provider_parser,
+						builder);
 	}
 }
 
-static void toplevel_gsm_end(GMarkupParseContext *context,
+static void toplevel_end(GMarkupParseContext *context,
 					const gchar *element_name,
 					gpointer userdata, GError **error)
 {
-	if (g_str_equal(element_name, "provider"))
-		g_markup_parse_context_pop(context);
-}
+	struct mbpi_builder *builder = userdata;
+	GHashTable *sids = builder->index->sids;
+	GSList *l;
 
-static const GMarkupParser toplevel_gsm_parser = {
-	toplevel_gsm_start,
-	toplevel_gsm_end,
-	NULL,
-	NULL,
-	NULL,
-};
+	if (!g_str_equal(element_name, "provider"))
+		return;
 
-static void toplevel_cdma_start(GMarkupParseContext *context,
-					const gchar *element_name,
-					const gchar **attribute_names,
-					const gchar **attribute_values,
-					gpointer userdata, GError **error)
-{
-	struct cdma_data *cdma = userdata;
+	g_markup_parse_context_pop(context);
 
-	if (g_str_equal(element_name, "provider") == FALSE)
-		return;
+	/*
+	 * A sid belongs to the first provider listing it, under the name
+	 * that provider has once it's been parsed completely.
+	 */
+	builder->sids = g_slist_reverse(builder->sids);
 
-	if (cdma->match_found == TRUE)
-		g_markup_parse_context_push(context, &skip_parser, NULL);
-	else
-		g_markup_parse_context_push(context, &provider_parser, cdma);
-}
+	for (l = builder->sids; l; l = l->next) {
+		if (g_hash_table_contains(sids, l->data))
+			continue;
 
-static void toplevel_cdma_end(GMarkupParseContext *context,
-					const gchar *element_name,
-					gpointer userdata, GError **error)
-{
-	if (g_str_equal(element_name, "provider"))
-		g_markup_parse_context_pop(context);
+		g_hash_table_insert(sids, l->data,
+					g_strdup(builder->provider_name));
+		l->data = NULL;
+	}
+
+	g_slist_free_full(builder->sids, g_free);
+	builder->sids = NULL;
 }
 
-static const GMarkupParser toplevel_cdma_parser = {
-	toplevel_cdma_start,
-	toplevel_cdma_end,
+static const GMarkupParser toplevel_parser = {
+	toplevel_start,
+	toplevel_end,
 	NULL,
 	NULL,
 	NULL,
@@ -733,40 +764,242 @@ static gboolean mbpi_parse(const GMarkupParser *parser, gpointer userdata,
 	return ret;
 }
 
+static struct mbpi_index *mbpi_index_build(const struct stat *st)
+{
+	struct mbpi_index *index = g_new0(struct mbpi_index, 1);
+	struct mbpi_builder builder;
+
+	index->path = g_strdup(mbpi_database);
+	index->dev = st->st_dev;
+	index->ino = st->st_ino;
+	index->size = st->st_size;
+	index->mtime = st->st_mtim;
+	mbpi_index_defaults(index->defaults);
+
+	index->gsms = g_ptr_array_new_with_free_func(mbpi_gsm_free);
+	index->networks = g_hash_table_new_full(g_str_hash, g_str_equal,
+					g_free, (GDestroyNotify) g_array_unref);
+	index->sids = g_hash_table_new_full(g_str_hash, g_str_equal,
+					g_free, g_free);
+
+	memset(&builder, 0, sizeof(builder));
+	builder.index = index;
+
+	/*
+	 * Like the lookups this replaced, a failure to finish the parse
+	 * still leaves what was parsed usable.
+	 */
+	index->complete = mbpi_parse(&toplevel_parser, &builder,
+					&index->error);
+
+	g_free(builder.provider_name);
+	g_slist_free_full(builder.sids, g_free);
+
+	return index;
+}
+
+static gboolean mbpi_index_valid(const struct mbpi_index *index,
+					const struct stat *st)
+{
+	enum ofono_gprs_proto defaults[4];
+
+	mbpi_index_defaults(defaults);
+
+	return g_strcmp0(index->path, mbpi_database) == 0 &&
+		index->dev == st->st_dev && index->ino == st->st_ino &&
+		index->size == st->st_size &&
+		index->mtime.tv_sec == st->st_mtim.tv_sec &&
+		index->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		memcmp(index->defaults, defaults, sizeof(defaults)) == 0;
+}
+
+static gboolean mbpi_index_expire(gpointer user_data)
+{
+	mbpi_index_timeout = 0;
+
+	mbpi_index_free(mbpi_index_cache);
+	mbpi_index_cache = NULL;
+
+	return FALSE;
+}
+
+static struct mbpi_index *mbpi_index_get(GError **error)
+{
+	struct stat st;
+
+	if (stat(mbpi_database, &st) < 0) {
+		mbpi_index_free(mbpi_index_cache);
+		mbpi_index_cache = NULL;
+
+		g_set_error(error, G_FILE_ERROR,
+				g_file_error_from_errno(errno),
+				"open(%s) failed: %s", mbpi_database,
+				g_strerror(errno));
+		return NULL;
+	}
+
+	if (mbpi_index_timeout > 0)
+		g_source_remove(mbpi_index_timeout);
+
+	/* Provisioning happens in bursts, don't hold on to the index */
+	mbpi_index_timeout = g_timeout_add_seconds(MBPI_INDEX_IDLE_TIMEOUT,
+						mbpi_index_expire, NULL);
+
+	if (mbpi_index_cache && mbpi_index_valid(mbpi_index_cache, &st))
+		return mbpi_index_cache;
+
+	mbpi_index_free(mbpi_index_cache);
+	mbpi_index_cache = mbpi_index_build(&st);
+
+	return mbpi_index_cache;
+}
+
+void mbpi_cleanup(void)
+{
+	if (mbpi_index_timeout > 0) {
+		g_source_remove(mbpi_index_timeout);
+		mbpi_index_timeout = 0;
+	}
+
+	mbpi_index_free(mbpi_index_cache);
+	mbpi_index_cache = NULL;
+}
+
+static struct ofono_gprs_provision_data *mbpi_ap_copy(
+				const struct ofono_gprs_provision_data *src)
+{
+	struct ofono_gprs_provision_data *ap;
+
+	ap = g_new0(struct ofono_gprs_provision_data, 1);
+	*ap = *src;
+
+	ap->provider_name = g_strdup(src->provider_name);
+	ap->name = g_strdup(src->name);
+	ap->apn = g_strdup(src->apn);
+	ap->username = g_strdup(src->username);
+	ap->password = g_strdup(src->password);
+	ap->message_proxy = g_strdup(src->message_proxy);
+	ap->message_center = g_strdup(src->message_center);
+
+	/* Fix the authentication method if none was specified */
+	if (ap->auth_method == OFONO_GPRS_AUTH_METHOD_UNSPECIFIED) {
+		if ((!ap->username || !ap->username[0]) &&
+				(!ap->password || !ap->password[0])) {
+			/* No username or password => no authentication */
+			ap->auth_method = OFONO_GPRS_AUTH_METHOD_NONE;
+		} else {
+			ap->auth_method = mbpi_default_auth_method;
+		}
+	}
+
+	return ap;
+}
+
+static gboolean mbpi_collect_apns(struct mbpi_index *index,
+					GArray *matches,
+					gboolean allow_duplicates,
+					GSList **apns, GError **error)
+{
+	unsigned int i, j;
+
+	for (i = 0; matches && i < matches->len; i++) {
+		struct mbpi_match *match =
+			&g_array_index(matches, struct mbpi_match, i);
+		GPtrArray *list = match->gsm->apns;
+
+		for (j = 0; j < list->len; j++) {
+			struct mbpi_apn *apn = g_ptr_array_index(list, j);
+			GSList *l;
+
+			/* The APN comes before the matching network-id */
+			if (apn->networks <= match->network)
+				continue;
+
+			if (apn->error) {
+				g_propagate_error(error,
+						g_error_copy(apn->error));
+				return FALSE;
+			}
+
+			for (l = *apns; l && !allow_duplicates; l = l->next) {
+				struct ofono_gprs_provision_data *pd = l->data;
+
+				if (pd->type != apn->ap->type)
+					continue;
+
+				g_set_error(error, mbpi_error_quark(),
+						MBPI_ERROR_DUPLICATE,
+						"%s:%d Duplicate context "
+						"detected", index->path,
+						apn->line);
+				return FALSE;
+			}
+
+			*apns = g_slist_append(*apns, mbpi_ap_copy(apn->ap));
+		}
+	}
+
+	return TRUE;
+}
+
 GSList *mbpi_lookup_apn(const char *mcc, const char *mnc,
 			gboolean allow_duplicates, GError **error)
 {
-	struct gsm_data gsm;
-	GSList *l;
-
-	memset(&gsm, 0, sizeof(gsm));
-	gsm.match_mcc = mcc;
-	gsm.match_mnc = mnc;
-	gsm.allow_duplicates = allow_duplicates;
+	struct mbpi_index *index;
+	GSList *apns = NULL;
+	GArray *matches;
+	char *key;
+
+	index = mbpi_index_get(error);
+	if (index == NULL)
+		return NULL;
+
+	if (!index->complete || index->gsm_error) {
+		g_propagate_error(error, g_error_copy(index->complete ?
+					index->gsm_error : index->error));
+		return NULL;
+	}
 
-	if (mbpi_parse(&toplevel_gsm_parser, &gsm, error) == FALSE) {
-		for (l = gsm.apns; l; l = l->next)
-			mbpi_ap_free(l->data);
+	key = mbpi_network_key(mcc, mnc);
+	matches = g_hash_table_lookup(index->networks, key);
+	g_free(key);
 
-		g_slist_free(gsm.apns);
-		gsm.apns = NULL;
+	if (!mbpi_collect_apns(index, matches, allow_duplicates, &apns,
+								error)) {
+		g_slist_free_full(apns, (GDestroyNotify) mbpi_ap_free);
+		return NULL;
 	}
 
-	g_free(gsm.provider_name);
-	return gsm.apns;
+	if (index->error)
+		g_propagate_error(error, g_error_copy(index->error));
+
+	return apns;
 }
 
 char *mbpi_lookup_cdma_provider_name(const char *sid, GError **error)
 {
-	struct cdma_data cdma;
+	struct mbpi_index *index;
+	gpointer name;
 
-	memset(&cdma, 0, sizeof(cdma));
-	cdma.match_sid = sid;
+	index = mbpi_index_get(error);
+	if (index == NULL)
+		return NULL;
 
-	if (mbpi_parse(&toplevel_cdma_parser, &cdma, error) == FALSE) {
-		g_free(cdma.provider_name);
-		cdma.provider_name = NULL;
+	if (!index->complete) {
+		g_propagate_error(error, g_error_copy(index->error));
+		return NULL;
 	}
 
-	return cdma.provider_name;
+	if (g_hash_table_lookup_extended(index->sids, sid, NULL, &name))
+		return g_strdup(name);
+
+	if (index->cdma_error) {
+		g_propagate_error(error, g_error_copy(index->cdma_error));
+		return NULL;
+	}
+
+	if (index->error)
+		g_propagate_error(error, g_error_copy(index->error));
+
+	return NULL;
 }
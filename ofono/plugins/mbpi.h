@@ -35,3 +35,5 @@ GSList *mbpi_lookup_apn(const char *mcc, const char *mnc,
 			gboolean allow_duplicates, GError **error);
 
 char *mbpi_lookup_cdma_provider_name(const char *sid, GError **error);
+
+void mbpi_cleanup(void);
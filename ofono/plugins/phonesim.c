@@ -1087,6 +1087,18 @@ static struct ofono_modem *create_modem(GKeyFile *keyfile, const char *group)
 		g_free(value);
 	}
 
+	value = g_key_file_get_string(keyfile, group, "SmsSubmitWindow", NULL);
+	if (value) {
+		ofono_modem_set_integer(modem, "SmsSubmitWindow", atoi(value));
+		g_free(value);
+	}
+
+	value = g_key_file_get_string(keyfile, group, "SimFileOpsWindow", NULL);
+	if (value) {
+		ofono_modem_set_integer(modem, "SimFileOpsWindow", atoi(value));
+		g_free(value);
+	}
+
 	DBG("%p", modem);
 
 	return modem;
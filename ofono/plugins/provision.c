@@ -111,6 +111,7 @@ static int provision_init(void)
 static void provision_exit(void)
 {
 	ofono_gprs_provision_driver_unregister(&provision_driver);
+	mbpi_cleanup();
 }
 
 OFONO_PLUGIN_DEFINE(provision, "Provisioning Plugin", VERSION,
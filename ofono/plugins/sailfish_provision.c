@@ -254,6 +254,7 @@ static void provision_exit(void)
 {
 	DBG("");
 	ofono_gprs_provision_driver_unregister(&provision_driver);
+	mbpi_cleanup();
 }
 
 OFONO_PLUGIN_DEFINE(provision, "Provisioning Plugin", VERSION,
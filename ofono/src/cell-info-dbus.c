@@ -27,6 +27,7 @@
 
 typedef struct cell_entry {
 	guint cell_id;
+	guint seen;
 	char *path;
 	struct ofono_cell cell;
 } CellEntry;
@@ -38,13 +39,17 @@ typedef struct cell_info_dbus {
 	char *path;
 	gulong handler_id;
 	guint next_cell_id;
-	GSList *entries;
+	guint update_count;
+	GPtrArray *entries;
+	GHashTable *cells;	/* Location => CellEntry */
+	GHashTable *ids;	/* cell_id + 1 => CellEntry */
 	struct ofono_dbus_clients *clients;
 } CellInfoDBus;
 
 #define CELL_INFO_DBUS_INTERFACE            "org.nemomobile.ofono.CellInfo"
 #define CELL_INFO_DBUS_CELLS_ADDED_SIGNAL   "CellsAdded"
 #define CELL_INFO_DBUS_CELLS_REMOVED_SIGNAL "CellsRemoved"
+#define CELL_INFO_DBUS_CELLS_CHANGED_SIGNAL "CellsChanged"
 #define CELL_INFO_DBUS_UNSUBSCRIBED_SIGNAL  "Unsubscribed"
 
 #define CELL_DBUS_INTERFACE_VERSION         (1)
@@ -319,56 +324,58 @@ static const GDBusSignalTable cell_info_dbus_cell_signals[] = {
 	{ }
 };
 
-static CellEntry *cell_info_dbus_find_id(CellInfoDBus *dbus, guint id)
+/* Hashes the fields ofono_cell_compare_location() looks at */
+static guint cell_info_dbus_location_hash(gconstpointer key)
 {
-	GSList *l;
+	const struct ofono_cell *cell = key;
+	guint h = cell->type;
 
-	for (l = dbus->entries; l; l = l->next) {
-		CellEntry *entry = l->data;
-
-		if (entry->cell_id == id) {
-			return entry;
-		}
+	switch (cell->type) {
+	case OFONO_CELL_TYPE_GSM:
+		h = h * 31 + cell->info.gsm.mcc;
+		h = h * 31 + cell->info.gsm.mnc;
+		h = h * 31 + cell->info.gsm.lac;
+		h = h * 31 + cell->info.gsm.cid;
+		break;
+	case OFONO_CELL_TYPE_WCDMA:
+		h = h * 31 + cell->info.wcdma.mcc;
+		h = h * 31 + cell->info.wcdma.mnc;
+		h = h * 31 + cell->info.wcdma.lac;
+		h = h * 31 + cell->info.wcdma.cid;
+		break;
+	case OFONO_CELL_TYPE_LTE:
+		h = h * 31 + cell->info.lte.mcc;
+		h = h * 31 + cell->info.lte.mnc;
+		h = h * 31 + cell->info.lte.ci;
+		h = h * 31 + cell->info.lte.pci;
+		h = h * 31 + cell->info.lte.tac;
+		break;
+	case OFONO_CELL_TYPE_NR:
+		h = h * 31 + cell->info.nr.mcc;
+		h = h * 31 + cell->info.nr.mnc;
+		h = h * 31 + (guint) cell->info.nr.nci;
+		h = h * 31 + (guint) (cell->info.nr.nci >> 32);
+		h = h * 31 + cell->info.nr.pci;
+		h = h * 31 + cell->info.nr.tac;
+		break;
 	}
-	return NULL;
-}
 
-static guint cell_info_dbus_next_cell_id(CellInfoDBus *dbus)
-{
-	while (cell_info_dbus_find_id(dbus, dbus->next_cell_id)) {
-		dbus->next_cell_id++;
-	}
-	return dbus->next_cell_id++;
+	return h;
 }
 
-static const struct ofono_cell *cell_info_dbus_find_ofono_cell
-	(struct ofono_cell_info *info, const struct ofono_cell *cell)
+static gboolean cell_info_dbus_location_equal(gconstpointer a,
+	gconstpointer b)
 {
-	const ofono_cell_ptr *c;
-
-	for (c = info->cells; *c; c++) {
-		if (!ofono_cell_compare_location(*c, cell)) {
-			return *c;
-		}
-	}
-	return NULL;
+	return !ofono_cell_compare_location(a, b);
 }
 
-static CellEntry *cell_info_dbus_find_cell(CellInfoDBus *dbus,
-	const struct ofono_cell *cell)
+static guint cell_info_dbus_next_cell_id(CellInfoDBus *dbus)
 {
-	if (cell) {
-		GSList *l;
-
-		for (l = dbus->entries; l; l = l->next) {
-			CellEntry *e = l->data;
-
-			if (!ofono_cell_compare_location(&e->cell, cell)) {
-				return e;
-			}
-		}
+	while (g_hash_table_contains(dbus->ids,
+				GUINT_TO_POINTER(dbus->next_cell_id + 1))) {
+		dbus->next_cell_id++;
 	}
-	return NULL;
+	return dbus->next_cell_id++;
 }
 
 static void cell_info_dbus_emit_path_list(CellInfoDBus *dbus, const char *name,
@@ -431,6 +438,39 @@ static int cell_info_dbus_compare(const struct ofono_cell *c1,
 	}
 }
 
+static void cell_info_dbus_append_changes(DBusMessageIter *it,
+	const CellEntry *entry, int mask)
+{
+	int i, n;
+	DBusMessageIter e, dict;
+	const struct ofono_cell *cell = &entry->cell;
+	const struct cell_property *prop =
+		cell_info_dbus_cell_properties(cell->type, &n);
+
+	dbus_message_iter_open_container(it, DBUS_TYPE_DICT_ENTRY, NULL, &e);
+	dbus_message_iter_append_basic(&e, DBUS_TYPE_OBJECT_PATH,
+		&entry->path);
+	dbus_message_iter_open_container(&e, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+	if (mask & CELL_PROPERTY_REGISTERED) {
+		const dbus_bool_t registered = (cell->registered != FALSE);
+
+		ofono_dbus_dict_append(&dict, "registered",
+			DBUS_TYPE_BOOLEAN, &registered);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (mask & prop[i].flag) {
+			ofono_dbus_dict_append(&dict, prop[i].name,
+				prop[i].type,
+				G_STRUCT_MEMBER_P(&cell->info, prop[i].off));
+		}
+	}
+
+	dbus_message_iter_close_container(&e, &dict);
+	dbus_message_iter_close_container(it, &e);
+}
+
 static void cell_info_dbus_emit_signal(CellInfoDBus *dbus, const char *path,
 	const char *intf, const char *name, int type, ...)
 {
@@ -478,44 +518,68 @@ static void cell_info_dbus_property_changed(CellInfoDBus *dbus,
 
 static void cell_info_dbus_update_entries(CellInfoDBus *dbus, gboolean emit)
 {
-	GSList *l;
 	GPtrArray* added = NULL;
 	GPtrArray* removed = NULL;
+	DBusMessage *changed = NULL;
+	DBusMessageIter it, changes;
 	const ofono_cell_ptr *c;
+	const guint seen = ++dbus->update_count;
+	guint i, n, nchanged = 0;
+
+	/* Mark the cells which are still there */
+	for (c = dbus->info->cells; *c; c++) {
+		CellEntry *entry = g_hash_table_lookup(dbus->cells, *c);
+
+		if (entry) {
+			entry->seen = seen;
+		}
+	}
 
 	/* Remove non-existent cells */
-	l = dbus->entries;
-	while (l) {
-		GSList *next = l->next;
-		CellEntry *entry = l->data;
-
-		if (!cell_info_dbus_find_ofono_cell(dbus->info, &entry->cell)) {
-			DBG("%s removed", entry->path);
-			dbus->entries = g_slist_delete_link(dbus->entries, l);
-			cell_info_dbus_emit_signal(dbus, entry->path,
-				CELL_DBUS_INTERFACE,
-				CELL_DBUS_REMOVED_SIGNAL,
-				DBUS_TYPE_INVALID);
-			g_dbus_unregister_interface(dbus->conn, entry->path,
-				CELL_DBUS_INTERFACE);
-			if (emit) {
-				if (!removed) {
-					removed = g_ptr_array_new_with_free_func
-						(g_free);
-				}
-				/* Steal the path */
-				g_ptr_array_add(removed, entry->path);
-				entry->path = NULL;
+	for (i = 0, n = 0; i < dbus->entries->len; i++) {
+		CellEntry *entry = dbus->entries->pdata[i];
+
+		if (entry->seen == seen) {
+			dbus->entries->pdata[n++] = entry;
+			continue;
+		}
+
+		DBG("%s removed", entry->path);
+		g_hash_table_remove(dbus->cells, &entry->cell);
+		g_hash_table_remove(dbus->ids,
+			GUINT_TO_POINTER(entry->cell_id + 1));
+		cell_info_dbus_emit_signal(dbus, entry->path,
+			CELL_DBUS_INTERFACE,
+			CELL_DBUS_REMOVED_SIGNAL,
+			DBUS_TYPE_INVALID);
+		g_dbus_unregister_interface(dbus->conn, entry->path,
+			CELL_DBUS_INTERFACE);
+		if (emit) {
+			if (!removed) {
+				removed = g_ptr_array_new_with_free_func
+					(g_free);
 			}
-			cell_info_destroy_entry(entry);
+			/* Steal the path */
+			g_ptr_array_add(removed, entry->path);
+			entry->path = NULL;
 		}
-		l = next;
+		cell_info_destroy_entry(entry);
+	}
+	g_ptr_array_set_size(dbus->entries, n);
+
+	if (emit && ofono_dbus_clients_count(dbus->clients)) {
+		changed = dbus_message_new_signal(dbus->path,
+			CELL_INFO_DBUS_INTERFACE,
+			CELL_INFO_DBUS_CELLS_CHANGED_SIGNAL);
+		dbus_message_iter_init_append(changed, &it);
+		dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY,
+			"{oa{sv}}", &changes);
 	}
 
-	/* Add new cells */
+	/* Update the existing cells and add new ones */
 	for (c = dbus->info->cells; *c; c++) {
 		const struct ofono_cell *cell = *c;
-		CellEntry *entry = cell_info_dbus_find_cell(dbus, cell);
+		CellEntry *entry = g_hash_table_lookup(dbus->cells, cell);
 
 		if (entry) {
 			if (emit) {
@@ -525,16 +589,25 @@ static void cell_info_dbus_update_entries(CellInfoDBus *dbus, gboolean emit)
 				entry->cell = *cell;
 				cell_info_dbus_property_changed(dbus, entry,
 					diff);
+				if (changed && diff > 0) {
+					cell_info_dbus_append_changes(&changes,
+						entry, diff);
+					nchanged++;
+				}
 			} else {
 				entry->cell = *cell;
 			}
 		} else {
 			entry = g_new0(CellEntry, 1);
 			entry->cell = *cell;
+			entry->seen = seen;
 			entry->cell_id = cell_info_dbus_next_cell_id(dbus);
 			entry->path = g_strdup_printf("%s/cell_%u", dbus->path,
 				entry->cell_id);
-			dbus->entries = g_slist_append(dbus->entries, entry);
+			g_ptr_array_add(dbus->entries, entry);
+			g_hash_table_insert(dbus->cells, &entry->cell, entry);
+			g_hash_table_insert(dbus->ids,
+				GUINT_TO_POINTER(entry->cell_id + 1), entry);
 			DBG("%s added", entry->path);
 			g_dbus_register_interface(dbus->conn, entry->path,
 				CELL_DBUS_INTERFACE,
@@ -550,6 +623,14 @@ static void cell_info_dbus_update_entries(CellInfoDBus *dbus, gboolean emit)
 		}
 	}
 
+	if (changed) {
+		dbus_message_iter_close_container(&it, &changes);
+		if (nchanged) {
+			ofono_dbus_clients_signal(dbus->clients, changed);
+		}
+		dbus_message_unref(changed);
+	}
+
 	if (removed) {
 		cell_info_dbus_emit_path_list(dbus,
 			CELL_INFO_DBUS_CELLS_REMOVED_SIGNAL, removed);
@@ -577,22 +658,23 @@ static DBusMessage *cell_info_dbus_error_failed(DBusMessage *msg,
 								explanation);
 }
 
-static DBusMessage *cell_info_dbus_get_cells(DBusConnection *conn,
-	DBusMessage *msg, void *data)
+static DBusMessage *cell_info_dbus_subscribe(CellInfoDBus *dbus,
+	DBusMessage *msg, gboolean broadcast)
 {
-	CellInfoDBus *dbus = data;
 	const char *sender = dbus_message_get_sender(msg);
 
-	if (ofono_dbus_clients_add(dbus->clients, sender)) {
+	if (broadcast ?
+		ofono_dbus_clients_add_broadcast(dbus->clients, sender) :
+		ofono_dbus_clients_add(dbus->clients, sender)) {
 		DBusMessage *reply = dbus_message_new_method_return(msg);
 		DBusMessageIter it, a;
-		GSList *l;
+		guint i;
 
 		cell_info_dbus_set_updates_enabled(dbus, TRUE);
 		dbus_message_iter_init_append(reply, &it);
 		dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "o", &a);
-		for (l = dbus->entries; l; l = l->next) {
-			const CellEntry *entry = l->data;
+		for (i = 0; i < dbus->entries->len; i++) {
+			const CellEntry *entry = dbus->entries->pdata[i];
 
 			dbus_message_iter_append_basic(&a,
 					DBUS_TYPE_OBJECT_PATH, &entry->path);
@@ -603,6 +685,24 @@ static DBusMessage *cell_info_dbus_get_cells(DBusConnection *conn,
 	return cell_info_dbus_error_failed(msg, "Operation failed");
 }
 
+static DBusMessage *cell_info_dbus_get_cells(DBusConnection *conn,
+	DBusMessage *msg, void *data)
+{
+	return cell_info_dbus_subscribe((CellInfoDBus *) data, msg, FALSE);
+}
+
+/*
+ * Same as GetCells but the caller receives the updates as undirected
+ * signals, i.e. it must have a match rule for CellInfo and Cell signals
+ * under the modem path. With several such subscribers each update goes
+ * through the bus once instead of once per subscriber.
+ */
+static DBusMessage *cell_info_dbus_get_cells_broadcast(DBusConnection *conn,
+	DBusMessage *msg, void *data)
+{
+	return cell_info_dbus_subscribe((CellInfoDBus *) data, msg, TRUE);
+}
+
 static DBusMessage *cell_info_dbus_unsubscribe(DBusConnection *conn,
 	DBusMessage *msg, void *data)
 {
@@ -629,6 +729,9 @@ static const GDBusMethodTable cell_info_dbus_methods[] = {
 	{ GDBUS_METHOD("GetCells", NULL,
 			GDBUS_ARGS({ "paths", "ao" }),
 			cell_info_dbus_get_cells) },
+	{ GDBUS_METHOD("GetCellsBroadcast", NULL,
+			GDBUS_ARGS({ "paths", "ao" }),
+			cell_info_dbus_get_cells_broadcast) },
 	{ GDBUS_METHOD("Unsubscribe", NULL, NULL,
 			cell_info_dbus_unsubscribe) },
 	{ }
@@ -639,6 +742,8 @@ static const GDBusSignalTable cell_info_dbus_signals[] = {
 			GDBUS_ARGS({ "paths", "ao" })) },
 	{ GDBUS_SIGNAL(CELL_INFO_DBUS_CELLS_REMOVED_SIGNAL,
 			GDBUS_ARGS({ "paths", "ao" })) },
+	{ GDBUS_SIGNAL(CELL_INFO_DBUS_CELLS_CHANGED_SIGNAL,
+			GDBUS_ARGS({ "cells", "a{oa{sv}}" })) },
 	{ GDBUS_SIGNAL(CELL_INFO_DBUS_UNSUBSCRIBED_SIGNAL,
 			GDBUS_ARGS({})) },
 	{ }
@@ -665,6 +770,10 @@ CellInfoDBus *cell_info_dbus_new(struct ofono_modem *modem,
 		dbus->conn = dbus_connection_ref(ofono_dbus_get_connection());
 		dbus->info = ofono_cell_info_ref(info);
 		dbus->ctl = cell_info_control_ref(ctl);
+		dbus->entries = g_ptr_array_new();
+		dbus->cells = g_hash_table_new(cell_info_dbus_location_hash,
+			cell_info_dbus_location_equal);
+		dbus->ids = g_hash_table_new(g_direct_hash, g_direct_equal);
 		dbus->handler_id = ofono_cell_info_add_change_handler(info,
 			cell_info_dbus_cells_changed_cb, dbus);
 
@@ -691,7 +800,7 @@ CellInfoDBus *cell_info_dbus_new(struct ofono_modem *modem,
 void cell_info_dbus_free(CellInfoDBus *dbus)
 {
 	if (dbus) {
-		GSList *l;
+		guint i;
 
 		DBG("%s", dbus->path);
 		ofono_dbus_clients_free(dbus->clients);
@@ -699,15 +808,15 @@ void cell_info_dbus_free(CellInfoDBus *dbus)
 			CELL_INFO_DBUS_INTERFACE);
 
 		/* Unregister cells */
-		l = dbus->entries;
-		while (l) {
-			CellEntry *entry = l->data;
+		for (i = 0; i < dbus->entries->len; i++) {
+			CellEntry *entry = dbus->entries->pdata[i];
 			g_dbus_unregister_interface(dbus->conn, entry->path,
 				CELL_DBUS_INTERFACE);
 			cell_info_destroy_entry(entry);
-			l = l->next;
 		}
-		g_slist_free(dbus->entries);
+		g_ptr_array_free(dbus->entries, TRUE);
+		g_hash_table_destroy(dbus->cells);
+		g_hash_table_destroy(dbus->ids);
 
 		dbus_connection_unref(dbus->conn);
 
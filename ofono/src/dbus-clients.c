@@ -22,6 +22,8 @@ struct ofono_dbus_client {
 	struct ofono_dbus_clients *clients;
 	char *name;
 	unsigned int watch_id;
+	ofono_bool_t broadcast;
+	struct ofono_dbus_client_stats stats;
 };
 
 struct ofono_dbus_clients {
@@ -29,8 +31,39 @@ struct ofono_dbus_clients {
 	GHashTable* table;
 	ofono_dbus_clients_notify_func notify;
 	void *user_data;
+	unsigned int broadcast_count;
+	ofono_bool_t stats;
 };
 
+/*
+ * Per-client counters are also collected whenever debug output is
+ * enabled for this file (e.g. ofonod -d '*dbus-clients*'), and logged
+ * when the client goes away.
+ */
+static struct ofono_debug_desc ofono_dbus_clients_stats_debug
+							OFONO_DEBUG_ATTR = {
+	.file = __FILE__,
+	.flags = OFONO_DEBUG_FLAG_DEFAULT,
+};
+
+static ofono_bool_t ofono_dbus_clients_stats_enabled
+					(struct ofono_dbus_clients *self)
+{
+	return self->stats || (ofono_dbus_clients_stats_debug.flags &
+						OFONO_DEBUG_FLAG_PRINT);
+}
+
+static void ofono_dbus_client_log_stats(struct ofono_dbus_client *client,
+							const char *name)
+{
+	if (ofono_dbus_clients_stats_debug.flags & OFONO_DEBUG_FLAG_PRINT) {
+		ofono_dbg(&ofono_dbus_clients_stats_debug,
+			"%s: %u signal(s), %llu byte(s)%s", name,
+			client->stats.signals, client->stats.bytes,
+			client->broadcast ? " (broadcast)" : "");
+	}
+}
+
 /* Compatible with GDestroyNotify */
 static void ofono_dbus_client_free(struct ofono_dbus_client *client)
 {
@@ -40,6 +73,9 @@ static void ofono_dbus_client_free(struct ofono_dbus_client *client)
 	if (client->watch_id) {
 		g_dbus_remove_watch(clients->conn, client->watch_id);
 	}
+	if (client->broadcast) {
+		clients->broadcast_count--;
+	}
 	g_free(client->name);
 	g_slice_free(struct ofono_dbus_client, client);
 }
@@ -59,6 +95,7 @@ static void ofono_dbus_clients_disconnect_notify(DBusConnection *connection,
 	 */
 	client->name = NULL;
 	DBG("%s is gone", name);
+	ofono_dbus_client_log_stats(client, name);
 	g_hash_table_remove(self->table, name);
 	if (self->notify) {
 		self->notify(name, self->user_data);
@@ -97,8 +134,9 @@ unsigned int ofono_dbus_clients_count(struct ofono_dbus_clients *self)
 	return self ? g_hash_table_size(self->table) : 0;
 }
 
-ofono_bool_t ofono_dbus_clients_add(struct ofono_dbus_clients *self,
-							const char *name)
+static ofono_bool_t ofono_dbus_clients_add_client
+		(struct ofono_dbus_clients *self, const char *name,
+						ofono_bool_t broadcast)
 {
 	if (self && name) {
 		struct ofono_dbus_client *client =
@@ -111,7 +149,12 @@ ofono_bool_t ofono_dbus_clients_add(struct ofono_dbus_clients *self,
 			client, NULL);
 
 		if (client->watch_id) {
-			DBG("%s is registered", client->name);
+			DBG("%s is registered%s", client->name,
+					broadcast ? " (broadcast)" : "");
+			if (broadcast) {
+				client->broadcast = TRUE;
+				self->broadcast_count++;
+			}
 			g_hash_table_replace(self->table, (gpointer)
 				client->name, client);
 			return TRUE;
@@ -123,10 +166,61 @@ ofono_bool_t ofono_dbus_clients_add(struct ofono_dbus_clients *self,
 	return FALSE;
 }
 
+ofono_bool_t ofono_dbus_clients_add(struct ofono_dbus_clients *self,
+							const char *name)
+{
+	return ofono_dbus_clients_add_client(self, name, FALSE);
+}
+
+ofono_bool_t ofono_dbus_clients_add_broadcast(struct ofono_dbus_clients *self,
+							const char *name)
+{
+	return ofono_dbus_clients_add_client(self, name, TRUE);
+}
+
 ofono_bool_t ofono_dbus_clients_remove(struct ofono_dbus_clients *self,
 							const char *name)
 {
-	return self && name && g_hash_table_remove(self->table, name);
+	struct ofono_dbus_client *client = (self && name) ?
+		g_hash_table_lookup(self->table, name) : NULL;
+
+	if (client) {
+		ofono_dbus_client_log_stats(client, name);
+		return g_hash_table_remove(self->table, name);
+	}
+	return FALSE;
+}
+
+void ofono_dbus_clients_set_stats(struct ofono_dbus_clients *self,
+							ofono_bool_t enable)
+{
+	if (self) {
+		self->stats = enable;
+	}
+}
+
+ofono_bool_t ofono_dbus_clients_get_stats(struct ofono_dbus_clients *self,
+		const char *name, struct ofono_dbus_client_stats *stats)
+{
+	struct ofono_dbus_client *client = (self && name) ?
+		g_hash_table_lookup(self->table, name) : NULL;
+
+	if (client) {
+		if (stats) {
+			*stats = client->stats;
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void ofono_dbus_clients_send_copy(struct ofono_dbus_clients *self,
+				DBusMessage *signal, const char *name)
+{
+	DBusMessage *copy = dbus_message_copy(signal);
+
+	dbus_message_set_destination(copy, name);
+	g_dbus_send_message(self->conn, copy);
 }
 
 void ofono_dbus_clients_signal(struct ofono_dbus_clients *self,
@@ -134,18 +228,44 @@ void ofono_dbus_clients_signal(struct ofono_dbus_clients *self,
 {
 	if (self && signal && g_hash_table_size(self->table)) {
 		GHashTableIter it;
-		gpointer key;
+		gpointer value;
 		const char *last_name = NULL;
+		int size = 0;
+
+		/*
+		 * Broadcasting only pays off if it replaces at least
+		 * two unicast copies.
+		 */
+		const ofono_bool_t broadcast = self->broadcast_count > 1;
+		const ofono_bool_t stats =
+				ofono_dbus_clients_stats_enabled(self);
+
+		if (stats) {
+			char *data = NULL;
+
+			if (dbus_message_marshal(signal, &data, &size)) {
+				dbus_free(data);
+			}
+		}
 
 		g_hash_table_iter_init(&it, self->table);
-		g_hash_table_iter_next(&it, &key, NULL);
-		last_name = key;
+		while (g_hash_table_iter_next(&it, NULL, &value)) {
+			struct ofono_dbus_client *client = value;
 
-		while (g_hash_table_iter_next(&it, &key, NULL)) {
-			DBusMessage *copy = dbus_message_copy(signal);
+			if (stats) {
+				client->stats.signals++;
+				client->stats.bytes += size;
+			}
+			if (broadcast && client->broadcast) {
+				/* The bus will deliver the broadcast */
+				continue;
+			}
 
-			dbus_message_set_destination(copy, key);
-			g_dbus_send_message(self->conn, copy);
+			if (last_name) {
+				ofono_dbus_clients_send_copy(self, signal,
+								last_name);
+			}
+			last_name = client->name;
 		}
 
 		/*
@@ -154,6 +274,13 @@ void ofono_dbus_clients_signal(struct ofono_dbus_clients *self,
 		 * reference. The caller still owns the message when this
 		 * function returns.
 		 */
+		if (broadcast) {
+			if (last_name) {
+				ofono_dbus_clients_send_copy(self, signal,
+								last_name);
+			}
+			last_name = NULL;
+		}
 		dbus_message_ref(signal);
 		dbus_message_set_destination(signal, last_name);
 		g_dbus_send_message(self->conn, signal);
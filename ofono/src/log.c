@@ -30,6 +30,8 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <syslog.h>
 #ifdef __GLIBC__
 #include <execinfo.h>
@@ -44,6 +46,52 @@ static GString *ofono_debug_str;
 static const char *program_exec;
 static const char *program_path;
 
+/*
+ * Trace mode: instead of formatting and logging debug output, ofono_dbg()
+ * stores the arguments in binary form in a ring of fixed size entries.
+ * They are only formatted when the ring is dumped, which keeps the cost
+ * of leaving debug output enabled close to a memcpy.
+ *
+ * Writers claim an entry by bumping trace_head and mark it complete by
+ * storing its sequence number + 1 into it, so the dump can tell entries
+ * that were overwritten while it was reading them.
+ */
+#define TRACE_ARGS_SIZE 200
+#define TRACE_STRING_NULL 0xffff
+
+struct trace_entry {
+	gint seq;
+	guint16 len;
+	gboolean truncated;
+	const struct ofono_debug_desc *desc;
+	const char *format;
+	gint64 time;
+	unsigned char args[TRACE_ARGS_SIZE];
+};
+
+struct trace_spec {
+	const char *start;
+	const char *end;
+	int stars;
+	int precision;		/* -1 if none, -2 if taken from the last * */
+	int length;
+	char conv;
+};
+
+enum {
+	TRACE_LEN_NONE,
+	TRACE_LEN_L,
+	TRACE_LEN_LL,
+	TRACE_LEN_SIZE,
+	TRACE_LEN_MAX,
+	TRACE_LEN_PTRDIFF,
+	TRACE_LEN_LONG_DOUBLE,
+};
+
+static struct trace_entry *trace_ring;
+static guint trace_mask;
+static gint trace_head;
+
 /**
  * ofono_info:
  * @format: format string
@@ -143,6 +191,465 @@ void ofono_debug(const char *format, ...)
 	}
 }
 
+/*
+ * Parses the conversion starting at the '%' in fmt.  Returns FALSE on
+ * anything this code doesn't know how to store.
+ */
+static gboolean trace_parse_spec(const char *fmt, struct trace_spec *spec)
+{
+	const char *p = fmt + 1;
+
+	spec->start = fmt;
+	spec->stars = 0;
+	spec->precision = -1;
+	spec->length = TRACE_LEN_NONE;
+
+	while (*p && strchr("#0- +'", *p))
+		p++;
+
+	if (*p == '*') {
+		spec->stars++;
+		p++;
+	} else {
+		while (g_ascii_isdigit(*p))
+			p++;
+	}
+
+	if (*p == '.') {
+		p++;
+
+		if (*p == '*') {
+			spec->stars++;
+			spec->precision = -2;
+			p++;
+		} else {
+			spec->precision = 0;
+
+			for (; g_ascii_isdigit(*p); p++)
+				spec->precision = MIN(spec->precision * 10 +
+							(*p - '0'), 0xffff);
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		p += p[1] == 'h' ? 2 : 1;
+		break;
+	case 'l':
+		if (p[1] == 'l') {
+			spec->length = TRACE_LEN_LL;
+			p += 2;
+		} else {
+			spec->length = TRACE_LEN_L;
+			p++;
+		}
+		break;
+	case 'q':
+		spec->length = TRACE_LEN_LL;
+		p++;
+		break;
+	case 'z':
+		spec->length = TRACE_LEN_SIZE;
+		p++;
+		break;
+	case 'j':
+		spec->length = TRACE_LEN_MAX;
+		p++;
+		break;
+	case 't':
+		spec->length = TRACE_LEN_PTRDIFF;
+		p++;
+		break;
+	case 'L':
+		spec->length = TRACE_LEN_LONG_DOUBLE;
+		p++;
+		break;
+	}
+
+	if (*p == '\0' || !strchr("diouxXcsfFeEgGaAp%m", *p))
+		return FALSE;
+
+	spec->conv = *p;
+	spec->end = p + 1;
+
+	return TRUE;
+}
+
+static gboolean trace_put(struct trace_entry *e, const void *data, size_t len)
+{
+	if (e->len + len > TRACE_ARGS_SIZE)
+		return FALSE;
+
+	memcpy(e->args + e->len, data, len);
+	e->len += len;
+
+	return TRUE;
+}
+
+/*
+ * A precision bounds how much of the string may be read, it doesn't
+ * have to be NUL terminated then.  Negative precision means none.
+ */
+static gboolean trace_put_string(struct trace_entry *e, const char *str,
+					int precision)
+{
+	size_t room;
+	size_t n;
+	guint16 len;
+
+	if (str == NULL) {
+		len = TRACE_STRING_NULL;
+		return trace_put(e, &len, sizeof(len));
+	}
+
+	if (e->len + sizeof(len) > TRACE_ARGS_SIZE)
+		return FALSE;
+
+	room = TRACE_ARGS_SIZE - e->len - sizeof(len);
+
+	if (precision >= 0 && (size_t) precision <= room)
+		n = strnlen(str, precision);
+	else
+		n = strnlen(str, room + 1);
+
+	len = MIN(n, room);
+
+	if (!trace_put(e, &len, sizeof(len)) || !trace_put(e, str, len))
+		return FALSE;
+
+	return len == n;
+}
+
+/* Stores the arguments the conversion takes, FALSE if they didn't fit */
+static gboolean trace_store_arg(struct trace_entry *e,
+				const struct trace_spec *spec, va_list *ap)
+{
+	int precision = spec->precision;
+	guint64 u;
+	double d;
+	long double ld;
+	void *ptr;
+	int i;
+
+	for (i = 0; i < spec->stars; i++) {
+		int star = va_arg(*ap, int);
+
+		if (!trace_put(e, &star, sizeof(star)))
+			return FALSE;
+
+		if (precision == -2 && i == spec->stars - 1)
+			precision = star < 0 ? -1 : star;
+	}
+
+	switch (spec->conv) {
+	case '%':
+	case 'm':
+		return TRUE;
+	case 's':
+		return trace_put_string(e, va_arg(*ap, const char *),
+								precision);
+	case 'p':
+		ptr = va_arg(*ap, void *);
+		return trace_put(e, &ptr, sizeof(ptr));
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+		if (spec->length == TRACE_LEN_LONG_DOUBLE) {
+			ld = va_arg(*ap, long double);
+			return trace_put(e, &ld, sizeof(ld));
+		}
+
+		d = va_arg(*ap, double);
+		return trace_put(e, &d, sizeof(d));
+	}
+
+	switch (spec->length) {
+	case TRACE_LEN_L:
+		u = va_arg(*ap, unsigned long);
+		break;
+	case TRACE_LEN_LL:
+		u = va_arg(*ap, unsigned long long);
+		break;
+	case TRACE_LEN_SIZE:
+		u = va_arg(*ap, size_t);
+		break;
+	case TRACE_LEN_MAX:
+		u = va_arg(*ap, uintmax_t);
+		break;
+	case TRACE_LEN_PTRDIFF:
+		u = va_arg(*ap, ptrdiff_t);
+		break;
+	default:
+		u = va_arg(*ap, unsigned int);
+		break;
+	}
+
+	return trace_put(e, &u, sizeof(u));
+}
+
+static void trace_record(const struct ofono_debug_desc *desc,
+				const char *format, va_list ap)
+{
+	guint seq = g_atomic_int_add(&trace_head, 1);
+	struct trace_entry *e = trace_ring + (seq & trace_mask);
+	const char *p;
+	va_list args;
+
+	g_atomic_int_set(&e->seq, 0);
+
+	e->desc = desc;
+	e->format = format;
+	e->time = g_get_real_time();
+	e->len = 0;
+	e->truncated = FALSE;
+
+	va_copy(args, ap);
+
+	for (p = strchr(format, '%'); p; p = strchr(p, '%')) {
+		struct trace_spec spec;
+
+		if (!trace_parse_spec(p, &spec) ||
+				!trace_store_arg(e, &spec, &args)) {
+			e->truncated = TRUE;
+			break;
+		}
+
+		p = spec.end;
+	}
+
+	va_end(args);
+
+	g_atomic_int_set(&e->seq, seq + 1);
+}
+
+static gboolean trace_get(const unsigned char **pos, const unsigned char *end,
+				void *data, size_t len)
+{
+	if (*pos + len > end)
+		return FALSE;
+
+	memcpy(data, *pos, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+/* Formats a single conversion from the stored arguments */
+static gboolean trace_format_arg(GString *out, const struct trace_spec *spec,
+				const unsigned char **pos,
+				const unsigned char *end)
+{
+	char *fmt = g_strndup(spec->start, spec->end - spec->start);
+	int star[2] = { 0, 0 };
+	gboolean ok = TRUE;
+	guint64 u;
+	double d;
+	long double ld;
+	void *ptr;
+	guint16 len;
+	char *str;
+	int i;
+
+	for (i = 0; i < spec->stars && ok; i++)
+		ok = trace_get(pos, end, &star[i], sizeof(int));
+
+	if (!ok)
+		goto out;
+
+#define TRACE_APPEND(value) do { \
+	if (spec->stars == 2) \
+		g_string_append_printf(out, fmt, star[0], star[1], value); \
+	else if (spec->stars == 1) \
+		g_string_append_printf(out, fmt, star[0], value); \
+	else \
+		g_string_append_printf(out, fmt, value); \
+} while (0)
+
+	switch (spec->conv) {
+	case '%':
+		g_string_append_c(out, '%');
+		goto out;
+	case 'm':
+		/* errno is long gone */
+		g_string_append(out, "%m");
+		goto out;
+	case 's':
+		ok = trace_get(pos, end, &len, sizeof(len));
+		if (!ok)
+			goto out;
+
+		if (len == TRACE_STRING_NULL) {
+			TRACE_APPEND((char *) NULL);
+			goto out;
+		}
+
+		if (*pos + len > end) {
+			ok = FALSE;
+			goto out;
+		}
+
+		str = g_strndup((const char *) *pos, len);
+		*pos += len;
+		TRACE_APPEND(str);
+		g_free(str);
+		goto out;
+	case 'p':
+		ok = trace_get(pos, end, &ptr, sizeof(ptr));
+		if (ok)
+			TRACE_APPEND(ptr);
+		goto out;
+	case 'f': case 'F': case 'e': case 'E':
+	case 'g': case 'G': case 'a': case 'A':
+		if (spec->length == TRACE_LEN_LONG_DOUBLE) {
+			ok = trace_get(pos, end, &ld, sizeof(ld));
+			if (ok)
+				TRACE_APPEND(ld);
+		} else {
+			ok = trace_get(pos, end, &d, sizeof(d));
+			if (ok)
+				TRACE_APPEND(d);
+		}
+		goto out;
+	}
+
+	ok = trace_get(pos, end, &u, sizeof(u));
+	if (!ok)
+		goto out;
+
+	/* Hand the value back the way it was passed */
+	switch (spec->length) {
+	case TRACE_LEN_L:
+		TRACE_APPEND((unsigned long) u);
+		break;
+	case TRACE_LEN_LL:
+		TRACE_APPEND((unsigned long long) u);
+		break;
+	case TRACE_LEN_SIZE:
+		TRACE_APPEND((size_t) u);
+		break;
+	case TRACE_LEN_MAX:
+		TRACE_APPEND((uintmax_t) u);
+		break;
+	case TRACE_LEN_PTRDIFF:
+		TRACE_APPEND((ptrdiff_t) u);
+		break;
+	default:
+		TRACE_APPEND((unsigned int) u);
+		break;
+	}
+
+#undef TRACE_APPEND
+
+out:
+	g_free(fmt);
+	return ok;
+}
+
+static void trace_format(GString *out, const struct trace_entry *e)
+{
+	const unsigned char *pos = e->args;
+	const unsigned char *end = e->args + e->len;
+	const char *p = e->format;
+	const char *next;
+
+	while ((next = strchr(p, '%')) != NULL) {
+		struct trace_spec spec;
+
+		g_string_append_len(out, p, next - p);
+
+		if (!trace_parse_spec(next, &spec) ||
+				!trace_format_arg(out, &spec, &pos, end)) {
+			g_string_append(out, "...");
+			return;
+		}
+
+		p = spec.end;
+	}
+
+	g_string_append(out, p);
+
+	if (e->truncated)
+		g_string_append(out, "...");
+}
+
+void __ofono_log_trace_init(unsigned int entries)
+{
+	unsigned int size = 1;
+
+	g_free(trace_ring);
+	trace_ring = NULL;
+	trace_head = 0;
+
+	if (entries == 0)
+		return;
+
+	while (size < entries)
+		size <<= 1;
+
+	trace_ring = g_new0(struct trace_entry, size);
+	trace_mask = size - 1;
+}
+
+/*
+ * Formats whatever the ring holds, oldest first, and hands it to func.
+ * Entries being written or overwritten while they are read are skipped.
+ */
+void __ofono_log_trace_foreach(ofono_log_trace_func func, void *user_data)
+{
+	GString *msg;
+	guint head;
+	guint seq;
+
+	if (trace_ring == NULL)
+		return;
+
+	msg = g_string_sized_new(127);
+	head = g_atomic_int_get(&trace_head);
+	seq = head > trace_mask ? head - trace_mask - 1 : 0;
+
+	for (; seq != head; seq++) {
+		const struct trace_entry *slot = trace_ring +
+							(seq & trace_mask);
+		struct trace_entry e;
+
+		if ((guint) g_atomic_int_get(&slot->seq) != seq + 1)
+			continue;
+
+		memcpy(&e, slot, sizeof(e));
+
+		if ((guint) g_atomic_int_get(&slot->seq) != seq + 1)
+			continue;
+
+		g_string_truncate(msg, 0);
+		trace_format(msg, &e);
+		func(e.desc, e.time, msg->str, user_data);
+	}
+
+	g_string_free(msg, TRUE);
+}
+
+static void trace_dump_entry(const struct ofono_debug_desc *desc,
+				gint64 time, const char *msg, void *user_data)
+{
+	syslog(LOG_INFO, "%" G_GINT64_FORMAT ".%06d %s:%s",
+				time / G_USEC_PER_SEC,
+				(int) (time % G_USEC_PER_SEC),
+				desc->file, msg);
+}
+
+void __ofono_log_trace_dump(void)
+{
+	guint head;
+
+	if (trace_ring == NULL)
+		return;
+
+	head = g_atomic_int_get(&trace_head);
+	syslog(LOG_INFO, "Trace: %u entries",
+			head > trace_mask ? trace_mask + 1 : head);
+
+	__ofono_log_trace_foreach(trace_dump_entry, NULL);
+}
+
 void ofono_dbg(const struct ofono_debug_desc *desc, const char *format, ...)
 {
 	va_list ap;
@@ -152,7 +659,9 @@ void ofono_dbg(const struct ofono_debug_desc *desc, const char *format, ...)
 
 	va_start(ap, format);
 
-	if (ofono_debug_str) {
+	if (trace_ring) {
+		trace_record(desc, format, ap);
+	} else if (ofono_debug_str) {
 		g_string_vprintf(ofono_debug_str, format, ap);
 		syslog(LOG_DEBUG, "%s:%s", desc->file, ofono_debug_str->str);
 	} else {
@@ -398,4 +907,6 @@ void __ofono_log_cleanup(ofono_bool_t backtrace)
 	g_strfreev(enabled);
 	g_string_free(ofono_debug_str, TRUE);
 	ofono_debug_str = NULL;
+
+	__ofono_log_trace_init(0);
 }
@@ -39,6 +39,7 @@
 #endif
 
 #include "ofono.h"
+#include "storage.h"
 
 #define SHUTDOWN_GRACE_SECONDS 10
 
@@ -85,6 +86,9 @@ static gboolean signal_handler(GIOChannel *channel, GIOCondition cond,
 
 		__terminated = 1;
 		break;
+	case SIGUSR1:
+		__ofono_log_trace_dump();
+		break;
 	}
 
 	return TRUE;
@@ -100,6 +104,7 @@ static guint setup_signalfd(void)
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
 
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
 		perror("Failed to set signal mask");
@@ -140,6 +145,8 @@ static gchar *option_noplugin = NULL;
 static gboolean option_detach = TRUE;
 static gboolean option_version = FALSE;
 static gboolean option_backtrace = TRUE;
+static gint option_storage_delay = STORAGE_SYNC_DELAY_DEFAULT;
+static gint option_trace = 0;
 
 static gboolean parse_debug(const char *key, const char *value,
 					gpointer user_data, GError **error)
@@ -177,9 +184,27 @@ static GOptionEntry options[] = {
 	{ "nobacktrace", 0, G_OPTION_FLAG_REVERSE,
 				G_OPTION_ARG_NONE, &option_backtrace,
 				"Don't print out backtrace information" },
+	{ "storage-delay", 0, 0, G_OPTION_ARG_INT, &option_storage_delay,
+				"Delay settings writes by up to MSEC "
+				"(0 writes immediately)", "MSEC" },
+	{ "trace", 0, 0, G_OPTION_ARG_INT, &option_trace,
+				"Keep the last N debug messages in memory "
+				"instead of logging them, SIGUSR1 dumps them",
+				"N" },
 	{ NULL },
 };
 
+static void log_storage_stats(void)
+{
+	struct storage_stats stats;
+
+	storage_get_stats(&stats);
+
+	DBG("storage: %u syncs, %u writes, %u failed, %" G_GUINT64_FORMAT
+		" us total, %" G_GUINT64_FORMAT " us max", stats.syncs,
+		stats.writes, stats.failures, stats.total_usec, stats.max_usec);
+}
+
 #ifdef HAVE_ELL
 struct ell_event_source {
 	GSource source;
@@ -269,6 +294,9 @@ int main(int argc, char **argv)
 	__ofono_log_init(argv[0], option_debug, option_detach,
 							option_backtrace);
 
+	if (option_trace > 0)
+		__ofono_log_trace_init(option_trace);
+
 	dbus_error_init(&error);
 
 	conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, NULL, &error);
@@ -289,6 +317,8 @@ int main(int argc, char **argv)
 
 	__ofono_dbus_init(conn);
 
+	__ofono_storage_init(MAX(option_storage_delay, 0));
+
 	__ofono_modemwatch_init();
 
 	__ofono_manager_init();
@@ -315,6 +345,9 @@ int main(int argc, char **argv)
 
 	__ofono_modemwatch_cleanup();
 
+	__ofono_storage_cleanup();
+	log_storage_stats();
+
 	__ofono_dbus_cleanup();
 	dbus_connection_unref(conn);
 
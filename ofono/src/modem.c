@@ -65,6 +65,7 @@ struct ofono_modem {
 	char			*path;
 	enum modem_state	modem_state;
 	GSList			*atoms;
+	GSList			*atoms_by_type[OFONO_ATOM_TYPE_COUNT];
 	struct ofono_watchlist	*atom_watches;
 	GSList			*interface_list;
 	GSList			*feature_list;
@@ -234,6 +235,8 @@ struct ofono_atom *__ofono_modem_add_atom(struct ofono_modem *modem,
 	atom->modem = modem;
 
 	modem->atoms = g_slist_prepend(modem->atoms, atom);
+	modem->atoms_by_type[type] =
+		g_slist_prepend(modem->atoms_by_type[type], atom);
 
 	return atom;
 }
@@ -337,10 +340,10 @@ unsigned int __ofono_modem_add_atom_watch(struct ofono_modem *modem,
 	id = __ofono_watchlist_add_item(modem->atom_watches,
 					(struct ofono_watchlist_item *)watch);
 
-	for (l = modem->atoms; l; l = l->next) {
+	for (l = modem->atoms_by_type[type]; l; l = l->next) {
 		atom = l->data;
 
-		if (atom->type != type || atom->unregister == NULL)
+		if (atom->unregister == NULL)
 			continue;
 
 		notify(atom, OFONO_ATOM_WATCH_CONDITION_REGISTERED, data);
@@ -364,10 +367,10 @@ struct ofono_atom *__ofono_modem_find_atom(struct ofono_modem *modem,
 	if (modem == NULL)
 		return NULL;
 
-	for (l = modem->atoms; l; l = l->next) {
+	for (l = modem->atoms_by_type[type]; l; l = l->next) {
 		atom = l->data;
 
-		if (atom->type == type && atom->unregister != NULL)
+		if (atom->unregister != NULL)
 			return atom;
 	}
 
@@ -384,12 +387,8 @@ void __ofono_modem_foreach_atom(struct ofono_modem *modem,
 	if (modem == NULL)
 		return;
 
-	for (l = modem->atoms; l; l = l->next) {
+	for (l = modem->atoms_by_type[type]; l; l = l->next) {
 		atom = l->data;
-
-		if (atom->type != type)
-			continue;
-
 		callback(atom, data);
 	}
 }
@@ -405,12 +404,9 @@ void __ofono_modem_foreach_registered_atom(struct ofono_modem *modem,
 	if (modem == NULL)
 		return;
 
-	for (l = modem->atoms; l; l = l->next) {
+	for (l = modem->atoms_by_type[type]; l; l = l->next) {
 		atom = l->data;
 
-		if (atom->type != type)
-			continue;
-
 		if (atom->unregister == NULL)
 			continue;
 
@@ -423,6 +419,8 @@ void __ofono_atom_free(struct ofono_atom *atom)
 	struct ofono_modem *modem = atom->modem;
 
 	modem->atoms = g_slist_remove(modem->atoms, atom);
+	modem->atoms_by_type[atom->type] =
+		g_slist_remove(modem->atoms_by_type[atom->type], atom);
 
 	__ofono_atom_unregister(atom);
 
@@ -455,6 +453,8 @@ static void flush_atoms(struct ofono_modem *modem, enum modem_state new_state)
 		}
 
 		__ofono_atom_unregister(atom);
+		modem->atoms_by_type[atom->type] =
+			g_slist_remove(modem->atoms_by_type[atom->type], atom);
 
 		if (atom->destruct)
 			atom->destruct(atom);
@@ -616,17 +616,7 @@ void __ofono_modem_remove_powered_watch(struct ofono_modem *modem,
 
 static gboolean modem_has_sim(struct ofono_modem *modem)
 {
-	GSList *l;
-	struct ofono_atom *atom;
-
-	for (l = modem->atoms; l; l = l->next) {
-		atom = l->data;
-
-		if (atom->type == OFONO_ATOM_TYPE_SIM)
-			return TRUE;
-	}
-
-	return FALSE;
+	return modem->atoms_by_type[OFONO_ATOM_TYPE_SIM] != NULL;
 }
 
 static gboolean modem_is_always_online(struct ofono_modem *modem)
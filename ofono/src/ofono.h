@@ -37,6 +37,9 @@ void __ofono_handsfree_audio_manager_cleanup(void);
 
 void __ofono_modem_shutdown(void);
 
+void __ofono_storage_init(unsigned int delay_ms);
+void __ofono_storage_cleanup(void);
+
 #include <ofono/log.h>
 
 int __ofono_log_init(const char *program, const char *debug,
@@ -45,6 +48,14 @@ int __ofono_log_init(const char *program, const char *debug,
 void __ofono_log_cleanup(ofono_bool_t backtrace);
 void __ofono_log_enable(struct ofono_debug_desc *start,
 					struct ofono_debug_desc *stop);
+void __ofono_log_trace_init(unsigned int entries);
+void __ofono_log_trace_dump(void);
+
+typedef void (*ofono_log_trace_func)(const struct ofono_debug_desc *desc,
+					gint64 time, const char *message,
+					void *user_data);
+
+void __ofono_log_trace_foreach(ofono_log_trace_func func, void *user_data);
 
 #include <ofono/dbus.h>
 
@@ -162,6 +173,7 @@ enum ofono_atom_type {
 	OFONO_ATOM_TYPE_NETMON,
 	OFONO_ATOM_TYPE_LTE,
 	OFONO_ATOM_TYPE_IMS,
+	OFONO_ATOM_TYPE_COUNT	/* Not a type, must be the last one */
 };
 
 enum ofono_atom_watch_condition {
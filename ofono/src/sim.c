@@ -59,6 +59,22 @@ enum session_state {
 	SESSION_STATE_OPEN
 };
 
+/* Milestones of the SIM initialization, timed for the debug log */
+enum sim_init_stage {
+	SIM_INIT_STARTED = 0,
+	SIM_INIT_ICCID,
+	SIM_INIT_LANGUAGES,
+	SIM_INIT_PIN,
+	SIM_INIT_SERVICES,
+	SIM_INIT_IMSI,
+	SIM_INIT_READY,
+	SIM_INIT_STAGES,
+};
+
+static const char *const sim_init_stage_names[] = {
+	"started", "iccid", "languages", "pin", "services", "imsi", "ready",
+};
+
 struct ofono_sim_aid_session {
 	struct sim_app_record *record;
 	int session_id;
@@ -139,6 +155,7 @@ struct ofono_sim {
 	GSList *aid_sessions;
 	GSList *aid_list;
 	char *impi;
+	gint64 init_time[SIM_INIT_STAGES];
 	bool reading_spn : 1;
 	bool language_prefs_update : 1;
 	bool fixed_dialing : 1;
@@ -1756,6 +1773,44 @@ static void sim_ready(enum ofono_sim_state new_state, void *user)
 					sim_efimg_changed, sim, NULL);
 }
 
+static void sim_init_mark(struct ofono_sim *sim, enum sim_init_stage stage)
+{
+	if (sim->init_time[stage] == 0)
+		sim->init_time[stage] = g_get_monotonic_time();
+}
+
+static void sim_init_report(struct ofono_sim *sim)
+{
+	gint64 start = sim->init_time[SIM_INIT_STARTED];
+	gint64 last = start;
+	GString *report;
+	int i;
+
+	if (start == 0)
+		return;
+
+	report = g_string_new(NULL);
+
+	/* Time spent in each stage, stages which were skipped are left out */
+	for (i = SIM_INIT_STARTED + 1; i < SIM_INIT_STAGES; i++) {
+		gint64 t = sim->init_time[i];
+
+		if (t == 0)
+			continue;
+
+		g_string_append_printf(report, " %s +%" G_GINT64_FORMAT "ms",
+					sim_init_stage_names[i],
+					(t - last) / 1000);
+		last = t;
+	}
+
+	DBG("%s initialized in %" G_GINT64_FORMAT "ms:%s",
+			__ofono_atom_get_path(sim->atom),
+			(last - start) / 1000, report->str);
+
+	g_string_free(report, TRUE);
+}
+
 static void sim_set_ready(struct ofono_sim *sim)
 {
 	if (sim == NULL)
@@ -1767,6 +1822,9 @@ static void sim_set_ready(struct ofono_sim *sim)
 
 	sim->state = OFONO_SIM_STATE_READY;
 
+	sim_init_mark(sim, SIM_INIT_READY);
+	sim_init_report(sim);
+
 	sim_fs_check_version(sim->simfs);
 
 	call_state_watches(sim);
@@ -1791,6 +1849,15 @@ static void impi_read_cb(int ok, int total_length, int record,
 	sim->impi = g_strndup((const char *)data + 2, data[1]);
 }
 
+/* Number of SIM file operations the driver is given at the same time */
+static unsigned int sim_file_ops_window(struct ofono_sim *sim)
+{
+	struct ofono_modem *modem = __ofono_atom_get_modem(sim->atom);
+	int window = ofono_modem_get_integer(modem, "SimFileOpsWindow");
+
+	return window > 0 ? window : 1;
+}
+
 static void discover_apps_cb(const struct ofono_error *error,
 		const unsigned char *dataobj,
 		int len, void *data)
@@ -1823,6 +1890,8 @@ static void discover_apps_cb(const struct ofono_error *error,
 			 * the FS structure so the ISIM EF's can be accessed.
 			 */
 			sim->simfs_isim = sim_fs_new(sim, sim->driver);
+			sim_fs_set_max_ops(sim->simfs_isim,
+					sim_file_ops_window(sim));
 			sim->isim_context = ofono_sim_context_create_isim(
 					sim);
 			/* attempt to get the NAI from EFimpi */
@@ -1840,6 +1909,8 @@ static void sim_imsi_obtained(struct ofono_sim *sim, const char *imsi)
 	DBusConnection *conn = ofono_dbus_get_connection();
 	const char *path = __ofono_atom_get_path(sim->atom);
 
+	sim_init_mark(sim, SIM_INIT_IMSI);
+
 	sim->imsi = g_strdup(imsi);
 
 	ofono_dbus_signal_property_changed(conn, path,
@@ -1950,6 +2021,8 @@ static void sim_imsi_cb(const struct ofono_error *error, const char *imsi,
 
 static void sim_retrieve_imsi(struct ofono_sim *sim)
 {
+	sim_init_mark(sim, SIM_INIT_SERVICES);
+
 	if (sim->driver->read_imsi) {
 		sim->driver->read_imsi(sim, sim_imsi_cb, sim);
 		return;
@@ -2260,6 +2333,8 @@ static void sim_efphase_read_cb(int ok, int length, int record,
 
 static void sim_initialize_after_pin(struct ofono_sim *sim)
 {
+	sim_init_mark(sim, SIM_INIT_PIN);
+
 	sim->context = ofono_sim_context_create(sim);
 
 	/*
@@ -2467,8 +2542,10 @@ skip_efpl:
 						&sim->language_prefs);
 
 	/* Proceed with sim initialization if we're not merely updating */
-	if (!sim->language_prefs_update)
+	if (!sim->language_prefs_update) {
+		sim_init_mark(sim, SIM_INIT_LANGUAGES);
 		__ofono_sim_recheck_pin(sim);
+	}
 
 	sim->language_prefs_update = false;
 }
@@ -2485,6 +2562,8 @@ static void sim_iccid_read_cb(int ok, int length, int record,
 	if (!ok || length < 10)
 		return;
 
+	sim_init_mark(sim, SIM_INIT_ICCID);
+
 	extract_bcd_number(data, length, iccid);
 	iccid[20] = '\0';
 	sim->iccid = g_strdup(iccid);
@@ -2565,6 +2644,9 @@ static void sim_initialize(struct ofono_sim *sim)
 	 * in the EFust
 	 */
 
+	memset(sim->init_time, 0, sizeof(sim->init_time));
+	sim_init_mark(sim, SIM_INIT_STARTED);
+
 	if (sim->early_context == NULL)
 		sim->early_context = ofono_sim_context_create(sim);
 
@@ -2877,6 +2959,8 @@ static void aid_session_free(gpointer data)
 static void sim_free_main_state(struct ofono_sim *sim)
 {
 	if (sim->imsi) {
+		/* Settings of the departing SIM go to disk now */
+		storage_flush();
 		g_free(sim->imsi);
 		sim->imsi = NULL;
 	}
@@ -3684,6 +3768,7 @@ void ofono_sim_register(struct ofono_sim *sim)
 	sim->state_watches = __ofono_watchlist_new(g_free);
 	sim->spn_watches = __ofono_watchlist_new(g_free);
 	sim->simfs = sim_fs_new(sim, sim->driver);
+	sim_fs_set_max_ops(sim->simfs, sim_file_ops_window(sim));
 
 	ofono_sim_add_state_watch(sim, sim_ready, sim, NULL);
 
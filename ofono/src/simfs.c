@@ -34,6 +34,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "ofono.h"
 
@@ -45,18 +47,26 @@
 #define SIM_CACHE_BASEPATH STORAGEDIR "/%s-%i"
 #define SIM_CACHE_VERSION SIM_CACHE_BASEPATH "/version"
 #define SIM_CACHE_PATH SIM_CACHE_BASEPATH "/%04x"
-#define SIM_CACHE_HEADER_SIZE 39
+#define SIM_CACHE_FILE SIM_CACHE_BASEPATH "/simfs"
+#define SIM_CACHE_MAGIC "OSC1"
+#define SIM_CACHE_ENTRIES 128
+#define SIM_CACHE_DIR_SIZE (sizeof(struct sim_cache_header) + \
+			SIM_CACHE_ENTRIES * sizeof(struct sim_cache_entry))
+#define SIM_CACHE_SLOT_FILLED 1
 #define SIM_FILE_INFO_SIZE 7
 #define SIM_IMAGE_CACHE_BASEPATH STORAGEDIR "/%s-%i/images"
 #define SIM_IMAGE_CACHE_PATH SIM_IMAGE_CACHE_BASEPATH "/%d.xpm"
 
-#define SIM_FS_VERSION 2
+#define SIM_FS_VERSION 3
 
-static gboolean sim_fs_op_next(gpointer user_data);
+#define SIM_FS_MAX_OPS 8
+
+static gboolean sim_fs_op_start(gpointer user_data);
 static gboolean sim_fs_op_read_record(gpointer user);
 static gboolean sim_fs_op_read_block(gpointer user_data);
 
 struct sim_fs_op {
+	struct sim_fs *fs;
 	int id;
 	unsigned char *buffer;
 	enum ofono_sim_file_structure structure;
@@ -70,8 +80,18 @@ struct sim_fs_op {
 	unsigned char path_len;
 	gconstpointer cb;
 	gboolean is_read;
+	gboolean is_record;		/* Single record of a linear EF */
 	void *userdata;
 	struct ofono_sim_context *context;
+	guint source;
+	unsigned int cache_area;	/* Cache area of the EF */
+	unsigned int cache_area_size;
+	unsigned char file_status;
+	int received;			/* Records read from the SIM */
+	int delivered;			/* Records passed to the callback */
+	gboolean done;
+	gboolean ok;
+	unsigned int serial;		/* Order of queueing */
 };
 
 struct ofono_sim_context {
@@ -79,11 +99,41 @@ struct ofono_sim_context {
 	struct ofono_watchlist *file_watches;
 };
 
+/*
+ * All cached EFs of a SIM live in a single file. The file starts with
+ * a header and a fixed size directory of entries, each pointing to an
+ * area holding the EF file info followed by one slot per record (or
+ * per 256 byte block of a transparent EF). Each slot begins with a
+ * byte telling whether the rest of it has been filled. A freed entry
+ * keeps its area so that it can be reused for another EF.
+ */
+struct sim_cache_header {
+	char magic[4];
+	guint32 entries;
+};
+
+struct sim_cache_entry {
+	guint32 id;			/* Zero if the entry is free */
+	guint32 offset;
+	guint32 size;			/* Zero if the entry is unused */
+};
+
+/* The cache file is read through the map and written through the fd */
+struct sim_fs_cache {
+	int fd;
+	const unsigned char *map;
+	size_t size;
+	char *imsi;
+	enum ofono_sim_phase phase;
+};
+
 struct sim_fs {
-	GQueue *op_q;
+	GQueue *op_q;			/* Not started yet */
+	GQueue *op_active;		/* Started, in the order of queueing */
 	gint op_source;
-	unsigned char bitmap[32];
-	int fd;
+	unsigned int op_serial;
+	unsigned int max_ops;
+	struct sim_fs_cache cache;
 	struct ofono_sim *sim;
 	const struct ofono_sim_driver *driver;
 	GSList *contexts;
@@ -92,14 +142,359 @@ struct sim_fs {
 	unsigned int watch_id;
 };
 
+/* All sim_fs instances, several of them may share one cache file */
+static GSList *sim_fs_list;
+
 static void sim_fs_op_free(gpointer pointer)
 {
 	struct sim_fs_op *node = pointer;
 
+	if (node->source)
+		g_source_remove(node->source);
+
 	g_free(node->buffer);
 	g_free(node);
 }
 
+/* Stops caching into the given area, or any area if it's zero */
+static void sim_fs_cache_forget_area(struct sim_fs *fs, unsigned int area)
+{
+	GList *l;
+
+	if (fs->op_active == NULL)
+		return;
+
+	for (l = fs->op_active->head; l; l = l->next) {
+		struct sim_fs_op *op = l->data;
+
+		if (area == 0 || op->cache_area == area) {
+			op->cache_area = 0;
+			op->cache_area_size = 0;
+		}
+	}
+}
+
+/*
+ * Releases the area in every sim_fs using the same cache file, their
+ * operations must not write into it once it gets reused.
+ */
+static void sim_fs_cache_release_area(struct sim_fs *fs, unsigned int area)
+{
+	GSList *l;
+
+	for (l = sim_fs_list; l; l = l->next) {
+		struct sim_fs *other = l->data;
+
+		if (other->cache.fd == -1 ||
+				other->cache.phase != fs->cache.phase ||
+				g_strcmp0(other->cache.imsi, fs->cache.imsi))
+			continue;
+
+		sim_fs_cache_forget_area(other, area);
+	}
+}
+
+static void sim_fs_cache_close(struct sim_fs *fs)
+{
+	struct sim_fs_cache *cache = &fs->cache;
+
+	sim_fs_cache_forget_area(fs, 0);
+
+	if (cache->map) {
+		munmap((void *) cache->map, cache->size);
+		cache->map = NULL;
+		cache->size = 0;
+	}
+
+	if (cache->fd != -1) {
+		TFR(close(cache->fd));
+		cache->fd = -1;
+	}
+
+	g_free(cache->imsi);
+	cache->imsi = NULL;
+}
+
+/* Makes sure that the whole file is mapped */
+static gboolean sim_fs_cache_map(struct sim_fs *fs)
+{
+	struct sim_fs_cache *cache = &fs->cache;
+	struct stat st;
+	void *map;
+
+	/* The file may have been flushed through another sim_fs */
+	if (fstat(cache->fd, &st) < 0 || st.st_nlink == 0)
+		return FALSE;
+
+	if ((size_t) st.st_size < SIM_CACHE_DIR_SIZE)
+		return FALSE;
+
+	if ((size_t) st.st_size == cache->size)
+		return TRUE;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	if (cache->map)
+		munmap((void *) cache->map, cache->size);
+
+	cache->map = map;
+	cache->size = st.st_size;
+
+	return TRUE;
+}
+
+static gboolean sim_fs_cache_reset(struct sim_fs *fs)
+{
+	guint32 dir[SIM_CACHE_DIR_SIZE / sizeof(guint32)];
+	struct sim_cache_header *header = (void *) dir;
+
+	memset(dir, 0, sizeof(dir));
+	memcpy(header->magic, SIM_CACHE_MAGIC, sizeof(header->magic));
+	header->entries = SIM_CACHE_ENTRIES;
+
+	if (ftruncate(fs->cache.fd, 0) < 0)
+		return FALSE;
+
+	if (TFR(pwrite(fs->cache.fd, dir, sizeof(dir), 0)) != sizeof(dir))
+		return FALSE;
+
+	return sim_fs_cache_map(fs);
+}
+
+static gboolean sim_fs_cache_open(struct sim_fs *fs, gboolean create)
+{
+	struct sim_fs_cache *cache = &fs->cache;
+	const char *imsi = ofono_sim_get_imsi(fs->sim);
+	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+	const struct sim_cache_header *header;
+	char *path;
+	int fd;
+
+	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+		return FALSE;
+
+	if (cache->fd != -1) {
+		if (!g_strcmp0(cache->imsi, imsi) && cache->phase == phase &&
+				sim_fs_cache_map(fs))
+			return TRUE;
+
+		sim_fs_cache_close(fs);
+	}
+
+	path = g_strdup_printf(SIM_CACHE_FILE, imsi, phase);
+
+	if (create && create_dirs(path, SIM_CACHE_MODE | S_IXUSR) != 0) {
+		g_free(path);
+		return FALSE;
+	}
+
+	fd = TFR(open(path, create ? (O_RDWR | O_CREAT) : O_RDWR,
+							SIM_CACHE_MODE));
+	g_free(path);
+
+	if (fd == -1) {
+		if (errno != ENOENT)
+			DBG("Error %i opening cache file for IMSI %s",
+								errno, imsi);
+
+		return FALSE;
+	}
+
+	cache->fd = fd;
+	cache->imsi = g_strdup(imsi);
+	cache->phase = phase;
+
+	if (sim_fs_cache_map(fs)) {
+		header = (const void *) cache->map;
+
+		if (!memcmp(header->magic, SIM_CACHE_MAGIC,
+					sizeof(header->magic)) &&
+				header->entries == SIM_CACHE_ENTRIES)
+			return TRUE;
+	}
+
+	/* Empty or unknown format, start from scratch */
+	if (create && sim_fs_cache_reset(fs))
+		return TRUE;
+
+	sim_fs_cache_close(fs);
+	return FALSE;
+}
+
+static const struct sim_cache_entry *sim_fs_cache_entries(struct sim_fs *fs)
+{
+	return (const void *) (fs->cache.map +
+					sizeof(struct sim_cache_header));
+}
+
+static const struct sim_cache_entry *sim_fs_cache_lookup(struct sim_fs *fs,
+								int id)
+{
+	const struct sim_cache_entry *entries = sim_fs_cache_entries(fs);
+	int i;
+
+	for (i = 0; i < SIM_CACHE_ENTRIES; i++) {
+		const struct sim_cache_entry *entry = entries + i;
+
+		if (entry->id != (guint32) id || entry->id == 0)
+			continue;
+
+		if (entry->offset < SIM_CACHE_DIR_SIZE ||
+				entry->size < SIM_FILE_INFO_SIZE ||
+				(guint64) entry->offset + entry->size >
+							fs->cache.size)
+			return NULL;
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+static gboolean sim_fs_cache_set_entry(struct sim_fs *fs, int index,
+					guint32 id, guint32 offset,
+					guint32 size)
+{
+	struct sim_cache_entry entry;
+	off_t pos = sizeof(struct sim_cache_header) + index * sizeof(entry);
+
+	entry.id = id;
+	entry.offset = offset;
+	entry.size = size;
+
+	return TFR(pwrite(fs->cache.fd, &entry, sizeof(entry), pos)) ==
+								sizeof(entry);
+}
+
+static unsigned int sim_fs_cache_area_size(
+				enum ofono_sim_file_structure structure,
+				int length, int record_length)
+{
+	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
+		return SIM_FILE_INFO_SIZE + (length + 255) / 256 * 257;
+
+	if (record_length <= 0)
+		return SIM_FILE_INFO_SIZE;
+
+	return SIM_FILE_INFO_SIZE +
+			length / record_length * (record_length + 1);
+}
+
+/*
+ * Picks the best fitting free area or appends a new one, writes the
+ * file info followed by empty slots and makes it the area of the op.
+ */
+static gboolean sim_fs_cache_alloc(struct sim_fs_op *op,
+					const unsigned char *fileinfo,
+					unsigned int size)
+{
+	struct sim_fs *fs = op->fs;
+	guint32 id = op->id;
+	const struct sim_cache_entry *entries = sim_fs_cache_entries(fs);
+	guint32 end = SIM_CACHE_DIR_SIZE;
+	guint32 offset;
+	int unused = -1;
+	int found = -1;
+	struct iovec iov[2];
+	unsigned char *slots;
+	ssize_t written;
+	int i;
+
+	for (i = 0; i < SIM_CACHE_ENTRIES; i++) {
+		const struct sim_cache_entry *entry = entries + i;
+		gboolean is_free = entry->id == 0;
+
+		if (entry->size == 0) {
+			if (unused < 0)
+				unused = i;
+
+			continue;
+		}
+
+		end = MAX(end, entry->offset + entry->size);
+
+		/* Drop the stale copy of the same EF */
+		if (entry->id == id) {
+			sim_fs_cache_release_area(fs, entry->offset);
+
+			if (!sim_fs_cache_set_entry(fs, i, 0, entry->offset,
+							entry->size))
+				return FALSE;
+
+			is_free = TRUE;
+		}
+
+		if (is_free && entry->size >= size &&
+				(found < 0 || entry->size < entries[found].size))
+			found = i;
+	}
+
+	if (found >= 0) {
+		offset = entries[found].offset;
+		size = entries[found].size;
+	} else if (unused >= 0) {
+		found = unused;
+		offset = end;
+	} else {
+		return FALSE;
+	}
+
+	slots = g_try_malloc0(size - SIM_FILE_INFO_SIZE + 1);
+	if (slots == NULL)
+		return FALSE;
+
+	iov[0].iov_base = (void *) fileinfo;
+	iov[0].iov_len = SIM_FILE_INFO_SIZE;
+	iov[1].iov_base = slots;
+	iov[1].iov_len = size - SIM_FILE_INFO_SIZE;
+
+	written = TFR(pwritev(fs->cache.fd, iov, 2, offset));
+	g_free(slots);
+
+	if (written != (ssize_t) size)
+		return FALSE;
+
+	if (!sim_fs_cache_set_entry(fs, found, id, offset, size) ||
+			!sim_fs_cache_map(fs))
+		return FALSE;
+
+	op->cache_area = offset;
+	op->cache_area_size = size;
+
+	return TRUE;
+}
+
+/* Returns the file offset of the slot or zero if it's out of range */
+static unsigned int sim_fs_cache_slot(struct sim_fs_op *op, int block,
+								int block_len)
+{
+	unsigned int offset;
+
+	if (op->cache_area == 0 || block < 0)
+		return 0;
+
+	offset = SIM_FILE_INFO_SIZE + block * (block_len + 1);
+
+	if (offset + block_len + 1 > op->cache_area_size)
+		return 0;
+
+	return op->cache_area + offset;
+}
+
+static const unsigned char *sim_fs_cache_get_block(struct sim_fs_op *op,
+						int block, int block_len)
+{
+	const unsigned char *map = op->fs->cache.map;
+	unsigned int offset = sim_fs_cache_slot(op, block, block_len);
+
+	if (offset == 0 || map[offset] != SIM_CACHE_SLOT_FILLED)
+		return NULL;
+
+	return map + offset + 1;
+}
+
 void sim_fs_free(struct sim_fs *fs)
 {
 	if (fs == NULL)
@@ -119,12 +514,19 @@ void sim_fs_free(struct sim_fs *fs)
 		fs->op_q = NULL;
 	}
 
+	if (fs->op_active) {
+		g_queue_free_full(fs->op_active, sim_fs_op_free);
+		fs->op_active = NULL;
+	}
+
 	while (fs->contexts)
 		sim_fs_context_free(fs->contexts->data);
 
 	if (fs->watch_id)
 		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
 
+	sim_fs_cache_close(fs);
+	sim_fs_list = g_slist_remove(sim_fs_list, fs);
 	g_free(fs);
 }
 
@@ -144,11 +546,18 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 
 	fs->sim = sim;
 	fs->driver = driver;
-	fs->fd = -1;
+	fs->max_ops = 1;
+	fs->cache.fd = -1;
+	sim_fs_list = g_slist_prepend(sim_fs_list, fs);
 
 	return fs;
 }
 
+void sim_fs_set_max_ops(struct sim_fs *fs, unsigned int max_ops)
+{
+	fs->max_ops = CLAMP(max_ops, 1U, SIM_FS_MAX_OPS);
+}
+
 struct ofono_sim_context *sim_fs_context_new(struct sim_fs *fs)
 {
 	struct ofono_sim_context *context =
@@ -183,26 +592,35 @@ struct ofono_sim_context *sim_fs_context_new_with_aid(struct sim_fs *fs,
 void sim_fs_context_free(struct ofono_sim_context *context)
 {
 	struct sim_fs *fs = context->fs;
-	int n = 0;
 	struct sim_fs_op *op;
+	GList *l;
 
-	if (fs->op_q) {
-		while ((op = g_queue_peek_nth(fs->op_q, n)) != NULL) {
-			if (op->context != context) {
-				n += 1;
+	/*
+	 * Operations in progress are completed without a callback. The
+	 * queued ones are finished as soon as they are started, without
+	 * reaching the driver, so that the ones after them get delivered.
+	 */
+	if (fs->op_active) {
+		for (l = fs->op_active->head; l; l = l->next) {
+			op = l->data;
+
+			if (op->context != context)
 				continue;
-			}
 
-			if (n == 0) {
-				op->cb = NULL;
-				op->context = NULL;
+			op->cb = NULL;
+			op->context = NULL;
+		}
+	}
+
+	if (fs->op_q) {
+		for (l = fs->op_q->head; l; l = l->next) {
+			op = l->data;
 
-				n += 1;
+			if (op->context != context)
 				continue;
-			}
 
-			sim_fs_op_free(op);
-			g_queue_remove(fs->op_q, op);
+			op->cb = NULL;
+			op->context = NULL;
 		}
 	}
 
@@ -265,133 +683,197 @@ void sim_fs_notify_file_watches(struct sim_fs *fs, int id)
 
 }
 
-static void sim_fs_end_current(struct sim_fs *fs)
+static void sim_fs_kick(struct sim_fs *fs)
 {
-	struct sim_fs_op *op = g_queue_pop_head(fs->op_q);
-
-	if (g_queue_get_length(fs->op_q) > 0)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
-	else if (fs->watch_id) /* release the session if no pending reads */
-		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
+	if (fs->op_source == 0 && !g_queue_is_empty(fs->op_q))
+		fs->op_source = g_idle_add(sim_fs_op_start, fs);
+}
 
-	if (fs->fd != -1) {
-		TFR(close(fs->fd));
-		fs->fd = -1;
-	}
+/* Whether everything queued before the op has been delivered */
+static gboolean sim_fs_op_is_head(struct sim_fs_op *op)
+{
+	struct sim_fs *fs = op->fs;
+	struct sim_fs_op *first = g_queue_peek_head(fs->op_q);
 
-	memset(fs->bitmap, 0, sizeof(fs->bitmap));
+	if (g_queue_peek_head(fs->op_active) != op)
+		return FALSE;
 
-	sim_fs_op_free(op);
+	return first == NULL || first->serial > op->serial;
 }
 
-static void sim_fs_op_error(struct sim_fs *fs)
+static void sim_fs_op_complete(struct sim_fs_op *op)
 {
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	ofono_sim_file_read_cb_t cb = op->cb;
+
+	if (op->cb == NULL)
+		return;
+
+	if (op->ok == FALSE) {
+		if (op->info_only == TRUE)
+			((ofono_sim_read_info_cb_t) op->cb)
+				(0, 0, 0, 0, op->userdata);
+		else if (op->is_record == TRUE)
+			cb(0, -1, op->current, NULL, 0, op->userdata);
+		else if (op->is_read == TRUE)
+			cb(0, 0, 0, 0, 0, op->userdata);
+		else
+			((ofono_sim_file_write_cb_t) op->cb)
+				(0, op->userdata);
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
 		return;
 	}
 
 	if (op->info_only == TRUE)
 		((ofono_sim_read_info_cb_t) op->cb)
-			(0, 0, 0, 0, op->userdata);
-	else if (op->is_read == TRUE)
-		((ofono_sim_file_read_cb_t) op->cb)
-			(0, 0, 0, 0, 0, op->userdata);
-	else
-		((ofono_sim_file_write_cb_t) op->cb)
-			(0, op->userdata);
-
-	sim_fs_end_current(fs);
+			(1, op->file_status, op->length,
+				op->record_length, op->userdata);
+	else if (op->is_read == FALSE)
+		((ofono_sim_file_write_cb_t) op->cb)(1, op->userdata);
+	else if (op->is_record == TRUE)
+		cb(1, -1, op->current, op->buffer, op->num_bytes,
+			op->userdata);
+	else if (op->fs->session)
+		cb(1, op->num_bytes, 0, op->buffer, op->num_bytes,
+			op->userdata);
+	else if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
+		cb(1, op->num_bytes, 0, op->buffer, op->record_length,
+			op->userdata);
+
+	/* Records of linear fixed and cyclic EFs have been handed out */
 }
 
-static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
-				const unsigned char *data, int num_bytes)
+/* Passes on the records which arrived before the op became the head */
+static void sim_fs_op_flush_records(struct sim_fs_op *op)
 {
-	int offset;
-	int bit;
-	ssize_t r;
-	unsigned char b;
-
-	if (fs->fd == -1)
-		return FALSE;
+	while (op->cb != NULL && op->delivered < op->received) {
+		ofono_sim_file_read_cb_t cb = op->cb;
+		int record = ++op->delivered;
 
-	if (lseek(fs->fd, block * block_len +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-		return FALSE;
+		cb(1, op->length, record,
+			op->buffer + (record - 1) * op->record_length,
+			op->record_length, op->userdata);
+	}
+}
 
-	r = TFR(write(fs->fd, data, num_bytes));
+/*
+ * Callbacks are invoked in the order in which the operations were
+ * queued, no matter in which order the driver completes them. Users
+ * of sim_fs depend on that, e.g. EFpl is parsed together with EFli.
+ */
+static void sim_fs_deliver(struct sim_fs *fs)
+{
+	struct sim_fs_op *op;
 
-	if (r != num_bytes)
-		return FALSE;
+	while ((op = g_queue_peek_head(fs->op_active)) != NULL &&
+						sim_fs_op_is_head(op)) {
+		sim_fs_op_flush_records(op);
 
-	/* update present bit for this block */
-	offset = block / 8;
-	bit = block % 8;
+		if (op->done == FALSE)
+			break;
 
-	/* lseek to correct byte (skip file info) */
-	lseek(fs->fd, offset + SIM_FILE_INFO_SIZE, SEEK_SET);
+		g_queue_pop_head(fs->op_active);
+		sim_fs_op_complete(op);
+		sim_fs_op_free(op);
+	}
 
-	b = fs->bitmap[offset];
-	b |= 1 << bit;
+	if (!g_queue_is_empty(fs->op_q))
+		sim_fs_kick(fs);
+	else if (g_queue_is_empty(fs->op_active) && fs->watch_id)
+		/* release the session if no pending reads */
+		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
+}
 
-	r = TFR(write(fs->fd, &b, sizeof(b)));
+static void sim_fs_op_finish(struct sim_fs_op *op, gboolean ok)
+{
+	if (op->source) {
+		g_source_remove(op->source);
+		op->source = 0;
+	}
 
-	if (r != sizeof(b))
-		return FALSE;
+	op->done = TRUE;
+	op->ok = ok;
+	op->cache_area = 0;
+	op->cache_area_size = 0;
 
-	fs->bitmap[offset] = b;
+	sim_fs_deliver(op->fs);
+}
 
-	return TRUE;
+static void sim_fs_op_error(struct sim_fs_op *op)
+{
+	sim_fs_op_finish(op, FALSE);
 }
 
-static void sim_fs_op_write_cb(const struct ofono_error *error, void *data)
+static void sim_fs_op_record(struct sim_fs_op *op, const unsigned char *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	ofono_sim_file_write_cb_t cb = op->cb;
+	ofono_sim_file_read_cb_t cb = op->cb;
 
-	if (cb == NULL) {
-		sim_fs_end_current(fs);
+	if (cb == NULL)
+		return;
+
+	if (sim_fs_op_is_head(op)) {
+		op->received = op->current;
+		op->delivered = op->current;
+
+		cb(1, op->length, op->current,
+				data, op->record_length, op->userdata);
 		return;
 	}
 
-	if (error->type == OFONO_ERROR_TYPE_NO_ERROR)
-		cb(1, op->userdata);
-	else
-		cb(0, op->userdata);
+	/* Keep it until the operations queued before this one are done */
+	memcpy(op->buffer + (op->current - 1) * op->record_length, data,
+			op->record_length);
+	op->received = op->current;
+}
+
+static gboolean cache_block(struct sim_fs_op *op, int block, int block_len,
+				const unsigned char *data, int num_bytes)
+{
+	static const unsigned char filled = SIM_CACHE_SLOT_FILLED;
+	unsigned int offset = sim_fs_cache_slot(op, block, block_len);
+	struct iovec iov[2];
+
+	if (offset == 0 || num_bytes > block_len)
+		return FALSE;
+
+	/* The present flag and the data are written together */
+	iov[0].iov_base = (void *) &filled;
+	iov[0].iov_len = sizeof(filled);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = num_bytes;
 
-	sim_fs_end_current(fs);
+	return TFR(pwritev(op->fs->cache.fd, iov, 2, offset)) ==
+						(ssize_t) (num_bytes + 1);
+}
+
+static void sim_fs_op_write_cb(const struct ofono_error *error, void *data)
+{
+	struct sim_fs_op *op = data;
+
+	sim_fs_op_finish(op, error->type == OFONO_ERROR_TYPE_NO_ERROR);
 }
 
 static void sim_fs_op_read_record_cb(const struct ofono_error *error,
 					const unsigned char *sdata, int length,
 					void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	ofono_sim_file_read_cb_t cb = op->cb;
+	struct sim_fs_op *op = data;
 
-	if (cb == NULL) {
-		sim_fs_end_current(fs);
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
+		sim_fs_op_error(op);
 		return;
 	}
 
-	if (error->type == OFONO_ERROR_TYPE_NO_ERROR)
-		cb(1, -1, op->current, sdata, length, op->userdata);
-	else
-		cb(0, -1, op->current, NULL, 0, op->userdata);
+	op->buffer = g_memdup(sdata, length);
+	op->num_bytes = length;
 
-	sim_fs_end_current(fs);
+	sim_fs_op_finish(op, TRUE);
 }
 
 static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 					const unsigned char *data, int len,
 					void *user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
 	int start_block;
 	int end_block;
 	int bufoff;
@@ -399,7 +881,7 @@ static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 	int tocopy;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
@@ -422,39 +904,33 @@ static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 				bufoff, dataoff, tocopy);
 
 	memcpy(op->buffer + bufoff, data + dataoff, tocopy);
-	cache_block(fs, op->current, 256, data, len);
+	cache_block(op, op->current, 256, data, len);
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_finish(op, FALSE);
 		return;
 	}
 
 	op->current++;
 
-	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
-
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
-	} else {
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
-	}
+	if (op->current > end_block)
+		sim_fs_op_finish(op, TRUE);
+	else
+		op->source = g_idle_add(sim_fs_op_read_block, op);
 }
 
 static gboolean sim_fs_op_read_block(gpointer user_data)
 {
-	struct sim_fs *fs = user_data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user_data;
+	struct sim_fs *fs = op->fs;
 	int start_block;
 	int end_block;
 	unsigned short read_bytes;
 
-	fs->op_source = 0;
+	op->source = 0;
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_finish(op, FALSE);
 		return FALSE;
 	}
 
@@ -465,58 +941,46 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 		op->buffer = g_try_new0(unsigned char, op->num_bytes);
 
 		if (op->buffer == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 	}
 
-	while (fs->fd != -1 && op->current <= end_block) {
-		int offset = op->current / 8;
-		int bit = 1 << op->current % 8;
+	while (op->current <= end_block) {
+		const unsigned char *block =
+			sim_fs_cache_get_block(op, op->current, 256);
 		int bufoff;
-		int seekoff;
+		int dataoff;
 		int toread;
 
-		if ((fs->bitmap[offset] & bit) == 0)
+		if (block == NULL)
 			break;
 
 		if (op->current == start_block) {
 			bufoff = 0;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256 +
-				op->offset % 256;
+			dataoff = op->offset % 256;
 			toread = MIN(256 - op->offset % 256, op->num_bytes);
 		} else {
 			bufoff = (op->current - start_block) * 256 -
 					op->offset % 256;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256;
+			dataoff = 0;
 			toread = MIN(256, op->num_bytes - bufoff);
 		}
 
-		DBG("bufoff: %d, seekoff: %d, toread: %d",
-				bufoff, seekoff, toread);
-
-		if (lseek(fs->fd, seekoff, SEEK_SET) == (off_t) -1)
-			break;
-
-		if (TFR(read(fs->fd, op->buffer + bufoff, toread)) != toread)
-			break;
+		DBG("bufoff: %d, dataoff: %d, toread: %d",
+				bufoff, dataoff, toread);
 
+		memcpy(op->buffer + bufoff, block + dataoff, toread);
 		op->current += 1;
 	}
 
 	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
-
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
-
+		sim_fs_op_finish(op, TRUE);
 		return FALSE;
 	}
 
 	if (fs->driver->read_file_transparent == NULL) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return FALSE;
 	}
 
@@ -526,7 +990,7 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 						read_bytes,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_read_block_cb, fs);
+						sim_fs_op_read_block_cb, op);
 
 	return FALSE;
 }
@@ -535,81 +999,80 @@ static void sim_fs_op_retrieve_cb(const struct ofono_error *error,
 					const unsigned char *data, int len,
 					void *user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
 	int total = op->length / op->record_length;
-	ofono_sim_file_read_cb_t cb = op->cb;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	cache_block(fs, op->current - 1, op->record_length,
+	cache_block(op, op->current - 1, op->record_length,
 			data, op->record_length);
 
-	if (cb == NULL) {
-		sim_fs_end_current(fs);
+	if (op->cb == NULL) {
+		sim_fs_op_finish(op, FALSE);
 		return;
 	}
 
-	cb(1, op->length, op->current, data, op->record_length, op->userdata);
+	sim_fs_op_record(op, data);
 
 	if (op->current < total) {
 		op->current += 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+		op->source = g_idle_add(sim_fs_op_read_record, op);
 	} else {
-		sim_fs_end_current(fs);
+		sim_fs_op_finish(op, TRUE);
 	}
 }
 
 static gboolean sim_fs_op_read_record(gpointer user)
 {
-	struct sim_fs *fs = user;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = user;
+	struct sim_fs *fs = op->fs;
 	const struct ofono_sim_driver *driver = fs->driver;
 	int total = op->length / op->record_length;
 	unsigned char buf[256];
 
-	fs->op_source = 0;
+	op->source = 0;
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_finish(op, FALSE);
 		return FALSE;
 	}
 
-	while (fs->fd != -1 && op->current <= total) {
-		int offset = (op->current - 1) / 8;
-		int bit = 1 << ((op->current - 1) % 8);
-		ofono_sim_file_read_cb_t cb = op->cb;
+	if (op->buffer == NULL && !sim_fs_op_is_head(op)) {
+		op->buffer = g_try_new0(unsigned char, op->length);
 
-		if ((fs->bitmap[offset] & bit) == 0)
-			break;
+		if (op->buffer == NULL) {
+			sim_fs_op_error(op);
+			return FALSE;
+		}
+	}
 
-		if (lseek(fs->fd, (op->current - 1) * op->record_length +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-			break;
+	while (op->current <= total &&
+			op->record_length <= (int) sizeof(buf)) {
+		const unsigned char *record = sim_fs_cache_get_block(op,
+					op->current - 1, op->record_length);
 
-		if (TFR(read(fs->fd, buf, op->record_length)) !=
-				op->record_length)
+		if (record == NULL)
 			break;
 
-		cb(1, op->length, op->current,
-				buf, op->record_length, op->userdata);
+		/* The callback may flush the cache, give it a copy */
+		memcpy(buf, record, op->record_length);
+		sim_fs_op_record(op, buf);
 
 		op->current += 1;
 	}
 
 	if (op->current > total) {
-		sim_fs_end_current(fs);
-
+		sim_fs_op_finish(op, TRUE);
 		return FALSE;
 	}
 
 	switch (op->structure) {
 	case OFONO_SIM_FILE_STRUCTURE_FIXED:
 		if (driver->read_file_linear == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 
@@ -617,11 +1080,11 @@ static gboolean sim_fs_op_read_record(gpointer user)
 						op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_retrieve_cb, fs);
+						sim_fs_op_retrieve_cb, op);
 		break;
 	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
 		if (driver->read_file_cyclic == NULL) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return FALSE;
 		}
 
@@ -629,7 +1092,7 @@ static gboolean sim_fs_op_read_record(gpointer user)
 						op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_retrieve_cb, fs);
+						sim_fs_op_retrieve_cb, op);
 		break;
 	default:
 		ofono_error("Unrecognized file structure, this can't happen");
@@ -638,7 +1101,7 @@ static gboolean sim_fs_op_read_record(gpointer user)
 	return FALSE;
 }
 
-static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
+static void sim_fs_op_cache_fileinfo(struct sim_fs_op *op,
 					const struct ofono_error *error,
 					int length,
 					enum ofono_sim_file_structure structure,
@@ -646,15 +1109,11 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 					const unsigned char access[3],
 					unsigned char file_status)
 {
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
 	enum sim_file_access update;
 	enum sim_file_access invalidate;
 	enum sim_file_access rehabilitate;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	unsigned char fileinfo[SIM_FILE_INFO_SIZE];
 	gboolean cache;
-	char *path;
 
 	/* TS 11.11, Section 9.3 */
 	update = file_access_condition_decode(access[0] & 0xf);
@@ -669,11 +1128,9 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 			(rehabilitate == SIM_FILE_ACCESS_ADM ||
 				rehabilitate == SIM_FILE_ACCESS_NEVER);
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN || cache == FALSE)
+	if (cache == FALSE || !sim_fs_cache_open(op->fs, TRUE))
 		return;
 
-	memset(fileinfo, 0, SIM_CACHE_HEADER_SIZE);
-
 	fileinfo[0] = error->type;
 	fileinfo[1] = length >> 8;
 	fileinfo[2] = length & 0xff;
@@ -682,19 +1139,9 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	fileinfo[5] = record_length & 0xff;
 	fileinfo[6] = file_status;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-	fs->fd = TFR(open(path, O_WRONLY | O_CREAT | O_TRUNC, SIM_CACHE_MODE));
-	g_free(path);
-
-	if (fs->fd == -1)
-		return;
-
-	if (TFR(write(fs->fd, fileinfo, SIM_CACHE_HEADER_SIZE)) ==
-			SIM_CACHE_HEADER_SIZE)
-		return;
-
-	TFR(close(fs->fd));
-	fs->fd = -1;
+	sim_fs_cache_alloc(op, fileinfo,
+			sim_fs_cache_area_size(structure, length,
+							record_length));
 }
 
 static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
@@ -704,26 +1151,25 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 				unsigned char file_status,
 				void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = data;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	sim_fs_op_cache_fileinfo(fs, error, length, structure, record_length,
+	sim_fs_op_cache_fileinfo(op, error, length, structure, record_length,
 					access, file_status);
 
 	if (structure != op->structure) {
 		ofono_error("Requested file structure differs from SIM: %x",
 				op->id);
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_finish(op, FALSE);
 		return;
 	}
 
@@ -738,13 +1184,13 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 		op->current = op->offset / 256;
 
 		if (op->info_only == FALSE)
-			fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+			op->source = g_idle_add(sim_fs_op_read_block, op);
 	} else {
 		op->record_length = record_length;
 		op->current = 1;
 
 		if (op->info_only == FALSE)
-			fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+			op->source = g_idle_add(sim_fs_op_read_record, op);
 	}
 
 	if (op->info_only == TRUE) {
@@ -752,55 +1198,30 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 		 * It's an info-only request, so there is no need to request
 		 * actual contents of the EF. Just return the EF-info.
 		 */
-		ofono_sim_read_info_cb_t cb = op->cb;
-
-		cb(1, file_status, op->length,
-			op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
+		op->file_status = file_status;
+		sim_fs_op_finish(op, TRUE);
 	}
 }
 
-static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
+static gboolean sim_fs_op_check_cached(struct sim_fs_op *op)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	char *path;
-	int fd;
-	ssize_t len;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	struct sim_fs *fs = op->fs;
+	const struct sim_cache_entry *entry;
+	const unsigned char *fileinfo;
 	int error_type;
 	int file_length;
 	enum ofono_sim_file_structure structure;
 	int record_length;
 	unsigned char file_status;
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
-		return FALSE;
-
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-
-	if (path == NULL)
+	if (!sim_fs_cache_open(fs, FALSE))
 		return FALSE;
 
-	fd = TFR(open(path, O_RDWR));
-	g_free(path);
-
-	if (fd == -1) {
-		if (errno != ENOENT)
-			DBG("Error %i opening cache file for "
-					"fileid %04x, IMSI %s",
-					errno, op->id, imsi);
-
+	entry = sim_fs_cache_lookup(fs, op->id);
+	if (entry == NULL)
 		return FALSE;
-	}
-
-	len = TFR(read(fd, fileinfo, SIM_CACHE_HEADER_SIZE));
-
-	if (len != SIM_CACHE_HEADER_SIZE)
-		goto error;
 
+	fileinfo = fs->cache.map + entry->offset;
 	error_type = fileinfo[0];
 	file_length = (fileinfo[1] << 8) | fileinfo[2];
 	structure = fileinfo[3];
@@ -811,17 +1232,20 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 		record_length = file_length;
 
 	if (record_length == 0 || file_length < record_length)
-		goto error;
+		return FALSE;
+
+	if (sim_fs_cache_area_size(structure, file_length, record_length) >
+								entry->size)
+		return FALSE;
 
 	op->length = file_length;
 	op->record_length = record_length;
-	memcpy(fs->bitmap, fileinfo + SIM_FILE_INFO_SIZE,
-			SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE);
-	fs->fd = fd;
+	op->cache_area = entry->offset;
+	op->cache_area_size = entry->size;
 
 	if (error_type != OFONO_ERROR_TYPE_NO_ERROR ||
 			structure != op->structure) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return TRUE;
 	}
 
@@ -830,46 +1254,36 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 		 * It's an info-only request, so there is no need to request
 		 * actual contents of the EF. Just return the EF-info.
 		 */
-		ofono_sim_read_info_cb_t cb = op->cb;
-
-		cb(1, file_status, op->length,
-			op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
+		op->file_status = file_status;
+		sim_fs_op_finish(op, TRUE);
 	} else if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
 		if (op->num_bytes == 0)
 			op->num_bytes = op->length;
 
 		op->current = op->offset / 256;
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+		op->source = g_idle_add(sim_fs_op_read_block, op);
 	} else {
 		op->current = 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+		op->source = g_idle_add(sim_fs_op_read_record, op);
 	}
 
 	return TRUE;
-
-error:
-	TFR(close(fd));
-	return FALSE;
 }
 
 static void sim_fs_read_session_cb(const struct ofono_error *error,
 		const unsigned char *sdata, int length, void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	ofono_sim_file_read_cb_t cb;
+	struct sim_fs_op *op = data;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	cb = op->cb;
-	cb(TRUE, length, 0, sdata, length, op->userdata);
+	op->buffer = g_memdup(sdata, length);
+	op->num_bytes = length;
 
-	sim_fs_end_current(fs);
+	sim_fs_op_finish(op, TRUE);
 }
 
 static void session_read_info_cb(const struct ofono_error *error,
@@ -880,44 +1294,43 @@ static void session_read_info_cb(const struct ofono_error *error,
 					unsigned char file_status,
 					void *data)
 {
-	struct sim_fs *fs = data;
-	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_op *op = data;
+	struct sim_fs *fs = op->fs;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	sim_fs_op_cache_fileinfo(fs, error, filelength, structure, recordlength,
+	sim_fs_op_cache_fileinfo(op, error, filelength, structure, recordlength,
 			access, file_status);
 
 	if (op->info_only) {
-		sim_fs_read_info_cb_t cb = op->cb;
-
-		cb(1, file_status, filelength, recordlength, op->userdata);
-
-		sim_fs_end_current(fs);
+		op->length = filelength;
+		op->record_length = recordlength;
+		op->file_status = file_status;
+		sim_fs_op_finish(op, TRUE);
 		return;
 	}
 
 	if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
 		if (!fs->driver->session_read_binary) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return;
 		}
 
 		fs->driver->session_read_binary(fs->sim, fs->session_id,
 				op->id, op->offset, filelength, op->path,
-				op->path_len, sim_fs_read_session_cb, fs);
+				op->path_len, sim_fs_read_session_cb, op);
 	} else {
 		if (!fs->driver->session_read_record) {
-			sim_fs_op_error(fs);
+			sim_fs_op_error(op);
 			return;
 		}
 
 		fs->driver->session_read_record(fs->sim, fs->session_id,
 				op->id, op->offset, recordlength, op->path,
-				op->path_len, sim_fs_read_session_cb, fs);
+				op->path_len, sim_fs_read_session_cb, op);
 	}
 }
 
@@ -932,54 +1345,48 @@ static void get_session_cb(ofono_bool_t active, int session_id,
 		void *data)
 {
 	struct sim_fs *fs = data;
-	struct sim_fs_op *op;
+	/* Session based reads are never run concurrently */
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_active);
+
+	if (op == NULL)
+		return;
 
 	if (!active) {
-		sim_fs_op_error(fs);
+		sim_fs_op_error(op);
 		return;
 	}
 
-	op = g_queue_peek_head(fs->op_q);
-
 	fs->session_id = session_id;
 
 	fs->driver->session_read_info(fs->sim, session_id, op->id, op->path,
-			op->path_len, session_read_info_cb, fs);
+			op->path_len, session_read_info_cb, op);
 }
 
-static gboolean sim_fs_op_next(gpointer user_data)
+static void sim_fs_op_run(struct sim_fs_op *op)
 {
-	struct sim_fs *fs = user_data;
+	struct sim_fs *fs = op->fs;
 	const struct ofono_sim_driver *driver = fs->driver;
-	struct sim_fs_op *op;
-
-	fs->op_source = 0;
-
-	if (fs->op_q == NULL)
-		return FALSE;
-
-	op = g_queue_peek_head(fs->op_q);
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
-		return FALSE;
+		sim_fs_op_finish(op, FALSE);
+		return;
 	}
 
-	if (op->is_read == TRUE && op->current > 0) {
+	if (op->is_record == TRUE) {
 		switch (op->structure) {
 		case OFONO_SIM_FILE_STRUCTURE_FIXED:
 			driver->read_file_linear(fs->sim, op->id,
 						op->current, op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_read_record_cb, fs);
+						sim_fs_op_read_record_cb, op);
 			break;
 		case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
 			driver->read_file_cyclic(fs->sim, op->id,
 						op->current, op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_read_record_cb, fs);
+						sim_fs_op_read_record_cb, op);
 			break;
 		case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
 		default:
@@ -987,20 +1394,20 @@ static gboolean sim_fs_op_next(gpointer user_data)
 			break;
 		}
 	} else if (op->is_read == TRUE) {
-		if (sim_fs_op_check_cached(fs))
-			return FALSE;
+		if (sim_fs_op_check_cached(op))
+			return;
 
 		if (!fs->session) {
 			driver->read_file_info(fs->sim, op->id,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_info_cb, fs);
+						sim_fs_op_info_cb, op);
 		} else {
 			if (fs->watch_id)
 				fs->driver->session_read_info(fs->sim,
 						fs->session_id, op->id,
 						op->path, op->path_len,
-						session_read_info_cb, fs);
+						session_read_info_cb, op);
 			else
 				fs->watch_id = __ofono_sim_add_session_watch(
 						fs->session, get_session_cb,
@@ -1011,17 +1418,17 @@ static gboolean sim_fs_op_next(gpointer user_data)
 		case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
 			driver->write_file_transparent(fs->sim, op->id, 0,
 					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
+					NULL, 0, sim_fs_op_write_cb, op);
 			break;
 		case OFONO_SIM_FILE_STRUCTURE_FIXED:
 			driver->write_file_linear(fs->sim, op->id, op->current,
 					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
+					NULL, 0, sim_fs_op_write_cb, op);
 			break;
 		case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
 			driver->write_file_cyclic(fs->sim, op->id,
 					op->length, op->buffer,
-					NULL, 0, sim_fs_op_write_cb, fs);
+					NULL, 0, sim_fs_op_write_cb, op);
 			break;
 		default:
 			ofono_error("Unrecognized file structure, "
@@ -1031,10 +1438,93 @@ static gboolean sim_fs_op_next(gpointer user_data)
 		g_free(op->buffer);
 		op->buffer = NULL;
 	}
+}
+
+/* Whether the op has to wait for the ones started or queued before it */
+static gboolean sim_fs_op_blocked(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	GList *l;
+
+	/* Writes are exclusive */
+	if (op->is_read == FALSE && !g_queue_is_empty(fs->op_active))
+		return TRUE;
+
+	for (l = fs->op_active->head; l; l = l->next) {
+		struct sim_fs_op *other = l->data;
+
+		if (other->is_read == FALSE || other->id == op->id)
+			return TRUE;
+	}
+
+	for (l = fs->op_q->head; l && l->data != op; l = l->next) {
+		struct sim_fs_op *other = l->data;
+
+		if (other->is_read == FALSE || other->id == op->id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static struct sim_fs_op *sim_fs_op_pick(struct sim_fs *fs)
+{
+	unsigned int max_ops = fs->session ? 1 : fs->max_ops;
+	GList *l;
+
+	if (g_queue_get_length(fs->op_active) >= max_ops)
+		return NULL;
+
+	for (l = fs->op_q->head; l; l = l->next) {
+		struct sim_fs_op *op = l->data;
+
+		if (!sim_fs_op_blocked(fs, op))
+			return op;
+	}
+
+	return NULL;
+}
+
+static gint sim_fs_op_compare(gconstpointer a, gconstpointer b,
+							gpointer user_data)
+{
+	const struct sim_fs_op *op_a = a;
+	const struct sim_fs_op *op_b = b;
+
+	return op_a->serial < op_b->serial ? -1 :
+					op_a->serial > op_b->serial;
+}
+
+static gboolean sim_fs_op_start(gpointer user_data)
+{
+	struct sim_fs *fs = user_data;
+	struct sim_fs_op *op;
+
+	fs->op_source = 0;
+
+	while (fs->op_q && (op = sim_fs_op_pick(fs)) != NULL) {
+		g_queue_remove(fs->op_q, op);
+		g_queue_insert_sorted(fs->op_active, op,
+					sim_fs_op_compare, NULL);
+		sim_fs_op_run(op);
+	}
 
 	return FALSE;
 }
 
+static void sim_fs_op_queue(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	if (fs->op_q == NULL)
+		fs->op_q = g_queue_new();
+
+	if (fs->op_active == NULL)
+		fs->op_active = g_queue_new();
+
+	op->fs = fs;
+	op->serial = fs->op_serial++;
+	g_queue_push_tail(fs->op_q, op);
+	sim_fs_kick(fs);
+}
+
 int sim_fs_read_info(struct ofono_sim_context *context, int id,
 			enum ofono_sim_file_structure expected_type,
 			const unsigned char *path, unsigned int pth_len,
@@ -1052,9 +1542,6 @@ int sim_fs_read_info(struct ofono_sim_context *context, int id,
 	if (fs->driver->read_file_info == NULL)
 		return -ENOSYS;
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
 	op = g_try_new0(struct sim_fs_op, 1);
 	if (op == NULL)
 		return -ENOMEM;
@@ -1069,10 +1556,7 @@ int sim_fs_read_info(struct ofono_sim_context *context, int id,
 	memcpy(op->path, path, pth_len);
 	op->path_len = pth_len;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1105,9 +1589,6 @@ int sim_fs_read(struct ofono_sim_context *context, int id,
 		}
 	}
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
 	op = g_try_new0(struct sim_fs_op, 1);
 	if (op == NULL)
 		return -ENOMEM;
@@ -1124,10 +1605,7 @@ int sim_fs_read(struct ofono_sim_context *context, int id,
 	memcpy(op->path, path, path_len);
 	op->path_len = path_len;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1158,9 +1636,6 @@ int sim_fs_read_record(struct ofono_sim_context *context, int id,
 		return -ENOSYS;
 	}
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
 	op = g_try_new0(struct sim_fs_op, 1);
 	if (op == NULL)
 		return -ENOMEM;
@@ -1174,13 +1649,11 @@ int sim_fs_read_record(struct ofono_sim_context *context, int id,
 	op->context = context;
 	op->record_length = record_length;
 	op->current = record;
+	op->is_record = TRUE;
 	memcpy(op->path, path, path_len);
 	op->path_len = path_len;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1217,9 +1690,6 @@ int sim_fs_write(struct ofono_sim_context *context, int id,
 	if (fn == NULL)
 		return -ENOSYS;
 
-	if (fs->op_q == NULL)
-		fs->op_q = g_queue_new();
-
 	op = g_try_new0(struct sim_fs_op, 1);
 	if (op == NULL)
 		return -ENOMEM;
@@ -1234,10 +1704,7 @@ int sim_fs_write(struct ofono_sim_context *context, int id,
 	op->current = record;
 	op->context = context;
 
-	g_queue_push_tail(fs->op_q, op);
-
-	if (g_queue_get_length(fs->op_q) == 1)
-		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	sim_fs_op_queue(fs, op);
 
 	return 0;
 }
@@ -1370,14 +1837,20 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 {
 	const char *imsi = ofono_sim_get_imsi(fs->sim);
 	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
+	char *path = g_strdup_printf(SIM_CACHE_FILE, imsi, phase);
 	struct dirent **entries;
-	int len = scandir(path, &entries, NULL, alphasort);
+	int len;
+
+	sim_fs_cache_close(fs);
+	remove(path);
+	g_free(path);
 
+	path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
+	len = scandir(path, &entries, NULL, alphasort);
 	g_free(path);
 
 	if (len > 0) {
-		/* Remove all file ids */
+		/* Remove all file ids left by older versions */
 		while (len--) {
 			remove_cachefile(imsi, phase, entries[len]);
 			g_free(entries[len]);
@@ -1391,12 +1864,20 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 
 void sim_fs_cache_flush_file(struct sim_fs *fs, int id)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, id);
+	const struct sim_cache_entry *entry;
 
-	remove(path);
-	g_free(path);
+	if (!sim_fs_cache_open(fs, FALSE))
+		return;
+
+	entry = sim_fs_cache_lookup(fs, id);
+	if (entry == NULL)
+		return;
+
+	/* Stop caching the EF if it's being read right now */
+	sim_fs_cache_release_area(fs, entry->offset);
+
+	sim_fs_cache_set_entry(fs, entry - sim_fs_cache_entries(fs), 0,
+						entry->offset, entry->size);
 }
 
 void sim_fs_image_cache_flush(struct sim_fs *fs)
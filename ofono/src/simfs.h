@@ -31,6 +31,9 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 				const struct ofono_sim_driver *driver);
 struct ofono_sim_context *sim_fs_context_new(struct sim_fs *fs);
 
+/* Number of file operations which may be outstanding at the same time */
+void sim_fs_set_max_ops(struct sim_fs *fs, unsigned int max_ops);
+
 struct ofono_sim_context *sim_fs_context_new_with_aid(struct sim_fs *fs,
 		const struct sim_aid *aid);
 
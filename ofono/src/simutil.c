@@ -39,6 +39,9 @@ struct sim_eons {
 	GSList *opl_list;
 	gboolean pnn_valid;
 	int pnn_max;
+	/* Built by sim_eons_optimize, NULL while OPL records are added */
+	GHashTable *opl_plmns;
+	GSList *opl_wildcards;
 };
 
 struct spdi_operator {
@@ -52,6 +55,22 @@ struct opl_operator {
 	guint16 lac_tac_low;
 	guint16 lac_tac_high;
 	guint8 id;
+	int pos;
+};
+
+/* A LAC/TAC range all of which resolves to the same OPL record */
+struct opl_segment {
+	guint16 low;
+	guint16 high;
+	const struct opl_operator *opl;
+};
+
+/* The OPL records of one MCC/MNC without wildcard digits */
+struct opl_plmn {
+	const struct opl_operator *any_lac;
+	struct opl_segment *segments;
+	int num_segments;
+	GSList *ranges;		/* Only used while building the index */
 };
 
 #define MF	1
@@ -1064,6 +1083,255 @@ static struct opl_operator *opl_operator_alloc(const guint8 *record)
 	return oper;
 }
 
+static gboolean opl_operator_all_lacs(const struct opl_operator *opl)
+{
+	return opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe;
+}
+
+static gboolean opl_operator_match(const struct opl_operator *opl,
+					const char *mcc, const char *mnc,
+					gboolean have_lac, guint16 lac)
+{
+	int i;
+
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
+		if (mcc[i] != opl->mcc[i] &&
+				!(opl->mcc[i] == 'b' && mcc[i]))
+			return FALSE;
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
+		if (mnc[i] != opl->mnc[i] &&
+				!(opl->mnc[i] == 'b' && mnc[i]))
+			return FALSE;
+
+	if (opl_operator_all_lacs(opl))
+		return TRUE;
+
+	if (have_lac == FALSE)
+		return FALSE;
+
+	return lac >= opl->lac_tac_low && lac <= opl->lac_tac_high;
+}
+
+/*
+ * Records with wildcard digits, or with digits following an early
+ * terminator, can't be looked up by their MCC/MNC string
+ */
+static gboolean opl_digits_are_exact(const char *digits, int len)
+{
+	gboolean terminated = FALSE;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (digits[i] == 'b')
+			return FALSE;
+
+		if (digits[i] == '\0')
+			terminated = TRUE;
+		else if (terminated)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void opl_plmn_key(char *key, const char *mcc, const char *mnc)
+{
+	g_snprintf(key, OFONO_MAX_MCC_LENGTH + OFONO_MAX_MNC_LENGTH + 2,
+			"%.3s/%.3s", mcc, mnc);
+}
+
+static void opl_plmn_free(gpointer data)
+{
+	struct opl_plmn *plmn = data;
+
+	g_free(plmn->segments);
+	g_free(plmn);
+}
+
+static int guint32_compare(const void *a, const void *b)
+{
+	guint32 x = *(const guint32 *) a;
+	guint32 y = *(const guint32 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Splits the LAC/TAC space at every range boundary and assigns each
+ * piece the first record covering it, so that a lookup is a single
+ * binary search no matter how the ranges on the SIM overlap.
+ */
+static void opl_plmn_build_segments(struct opl_plmn *plmn, GSList *ranges)
+{
+	int num_ranges = g_slist_length(ranges);
+	guint32 *bounds = g_new(guint32, num_ranges * 2);
+	const struct opl_operator **owner;
+	int num_bounds = 0;
+	int n = 0;
+	GSList *l;
+	int i;
+
+	for (l = ranges; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
+
+		bounds[num_bounds++] = opl->lac_tac_low;
+		bounds[num_bounds++] = opl->lac_tac_high + 1;
+	}
+
+	qsort(bounds, num_bounds, sizeof(guint32), guint32_compare);
+
+	for (i = 0; i < num_bounds; i++)
+		if (n == 0 || bounds[n - 1] != bounds[i])
+			bounds[n++] = bounds[i];
+
+	num_bounds = n;
+	owner = g_new0(const struct opl_operator *, num_bounds);
+
+	/* Ranges are in record order, earlier records take precedence */
+	for (l = ranges; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
+		guint32 low = opl->lac_tac_low;
+		guint32 *first = bsearch(&low, bounds, num_bounds,
+						sizeof(guint32),
+						guint32_compare);
+
+		for (i = first - bounds; bounds[i] <= opl->lac_tac_high; i++)
+			if (owner[i] == NULL)
+				owner[i] = opl;
+	}
+
+	plmn->segments = g_new(struct opl_segment, num_bounds);
+	n = 0;
+
+	for (i = 0; i < num_bounds - 1; i++) {
+		if (owner[i] == NULL)
+			continue;
+
+		if (n > 0 && plmn->segments[n - 1].opl == owner[i] &&
+				plmn->segments[n - 1].high + 1 == bounds[i]) {
+			plmn->segments[n - 1].high = bounds[i + 1] - 1;
+			continue;
+		}
+
+		plmn->segments[n].low = bounds[i];
+		plmn->segments[n].high = bounds[i + 1] - 1;
+		plmn->segments[n].opl = owner[i];
+		n++;
+	}
+
+	plmn->num_segments = n;
+
+	g_free(owner);
+	g_free(bounds);
+}
+
+static const struct opl_operator *opl_plmn_lookup(
+						const struct opl_plmn *plmn,
+						gboolean have_lac, guint16 lac)
+{
+	int lo = 0;
+	int hi = plmn->num_segments - 1;
+
+	if (have_lac == FALSE)
+		return plmn->any_lac;
+
+	/* Only ranges preceding the all-LACs record have been kept */
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		const struct opl_segment *seg = &plmn->segments[mid];
+
+		if (lac < seg->low)
+			hi = mid - 1;
+		else if (lac > seg->high)
+			lo = mid + 1;
+		else
+			return seg->opl;
+	}
+
+	return plmn->any_lac;
+}
+
+static void sim_eons_drop_index(struct sim_eons *eons)
+{
+	if (eons->opl_plmns) {
+		g_hash_table_destroy(eons->opl_plmns);
+		eons->opl_plmns = NULL;
+	}
+
+	g_slist_free(eons->opl_wildcards);
+	eons->opl_wildcards = NULL;
+}
+
+static void sim_eons_build_index(struct sim_eons *eons)
+{
+	char key[OFONO_MAX_MCC_LENGTH + OFONO_MAX_MNC_LENGTH + 2];
+	GHashTableIter iter;
+	gpointer value;
+	GSList *l;
+	int pos = 0;
+
+	eons->opl_plmns = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, opl_plmn_free);
+
+	for (l = eons->opl_list; l; l = l->next) {
+		struct opl_operator *opl = l->data;
+		struct opl_plmn *plmn;
+
+		opl->pos = pos++;
+
+		if (!opl_digits_are_exact(opl->mcc, OFONO_MAX_MCC_LENGTH) ||
+				!opl_digits_are_exact(opl->mnc,
+							OFONO_MAX_MNC_LENGTH)) {
+			eons->opl_wildcards = g_slist_prepend(
+						eons->opl_wildcards, opl);
+			continue;
+		}
+
+		opl_plmn_key(key, opl->mcc, opl->mnc);
+
+		plmn = g_hash_table_lookup(eons->opl_plmns, key);
+		if (plmn == NULL) {
+			plmn = g_new0(struct opl_plmn, 1);
+			g_hash_table_insert(eons->opl_plmns, g_strdup(key),
+						plmn);
+		}
+
+		if (opl_operator_all_lacs(opl)) {
+			if (plmn->any_lac == NULL)
+				plmn->any_lac = opl;
+
+			continue;
+		}
+
+		if (opl->lac_tac_low > opl->lac_tac_high)
+			continue;
+
+		/* Nothing after an all-LACs record can be chosen */
+		if (plmn->any_lac != NULL)
+			continue;
+
+		plmn->ranges = g_slist_prepend(plmn->ranges, opl);
+	}
+
+	eons->opl_wildcards = g_slist_reverse(eons->opl_wildcards);
+
+	g_hash_table_iter_init(&iter, eons->opl_plmns);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct opl_plmn *plmn = value;
+
+		if (plmn->ranges == NULL)
+			continue;
+
+		plmn->ranges = g_slist_reverse(plmn->ranges);
+		opl_plmn_build_segments(plmn, plmn->ranges);
+
+		g_slist_free(plmn->ranges);
+		plmn->ranges = NULL;
+	}
+}
+
 void sim_eons_add_opl_record(struct sim_eons *eons,
 				const guint8 *contents, int length)
 {
@@ -1076,12 +1344,17 @@ void sim_eons_add_opl_record(struct sim_eons *eons,
 		return;
 	}
 
+	sim_eons_drop_index(eons);
+
 	eons->opl_list = g_slist_prepend(eons->opl_list, oper);
 }
 
 void sim_eons_optimize(struct sim_eons *eons)
 {
 	eons->opl_list = g_slist_reverse(eons->opl_list);
+
+	sim_eons_drop_index(eons);
+	sim_eons_build_index(eons);
 }
 
 void sim_eons_free(struct sim_eons *eons)
@@ -1096,51 +1369,62 @@ void sim_eons_free(struct sim_eons *eons)
 
 	g_free(eons->pnn_list);
 
+	sim_eons_drop_index(eons);
 	g_slist_free_full(eons->opl_list, g_free);
 
 	g_free(eons);
 }
 
-static const struct sim_eons_operator_info *
-	sim_eons_lookup_common(struct sim_eons *eons,
-				const char *mcc, const char *mnc,
-				gboolean have_lac, guint16 lac)
+static const struct opl_operator *sim_eons_find_opl(struct sim_eons *eons,
+						const char *mcc,
+						const char *mnc,
+						gboolean have_lac,
+						guint16 lac)
 {
+	char key[OFONO_MAX_MCC_LENGTH + OFONO_MAX_MNC_LENGTH + 2];
+	const struct opl_operator *found = NULL;
+	const struct opl_plmn *plmn;
 	GSList *l;
-	const struct opl_operator *opl;
-	int i;
 
-	for (l = eons->opl_list; l; l = l->next) {
-		opl = l->data;
+	if (eons->opl_plmns == NULL) {
+		for (l = eons->opl_list; l; l = l->next)
+			if (opl_operator_match(l->data, mcc, mnc,
+							have_lac, lac))
+				return l->data;
 
-		for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
-			if (mcc[i] != opl->mcc[i] &&
-					!(opl->mcc[i] == 'b' && mcc[i]))
-				break;
-		if (i < OFONO_MAX_MCC_LENGTH)
-			continue;
+		return NULL;
+	}
 
-		for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
-			if (mnc[i] != opl->mnc[i] &&
-					!(opl->mnc[i] == 'b' && mnc[i]))
-				break;
-		if (i < OFONO_MAX_MNC_LENGTH)
-			continue;
+	opl_plmn_key(key, mcc, mnc);
 
-		if (opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe)
-			break;
+	plmn = g_hash_table_lookup(eons->opl_plmns, key);
+	if (plmn)
+		found = opl_plmn_lookup(plmn, have_lac, lac);
 
-		if (have_lac == FALSE)
-			continue;
+	/* The first matching record wins, wildcard or not */
+	for (l = eons->opl_wildcards; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
 
-		if ((lac >= opl->lac_tac_low) && (lac <= opl->lac_tac_high))
+		if (found && opl->pos > found->pos)
 			break;
+
+		if (opl_operator_match(opl, mcc, mnc, have_lac, lac))
+			return opl;
 	}
 
-	if (l == NULL)
-		return NULL;
+	return found;
+}
 
-	opl = l->data;
+static const struct sim_eons_operator_info *
+	sim_eons_lookup_common(struct sim_eons *eons,
+				const char *mcc, const char *mnc,
+				gboolean have_lac, guint16 lac)
+{
+	const struct opl_operator *opl;
+
+	opl = sim_eons_find_opl(eons, mcc, mnc, have_lac, lac);
+	if (opl == NULL)
+		return NULL;
 
 	/* 0 is not a valid record id */
 	if (opl->id == 0)
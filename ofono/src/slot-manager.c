@@ -983,7 +983,7 @@ static void ofono_slot_manager_object_finalize(GObject* obj)
 	if (mgr->errors) {
 		g_hash_table_destroy(mgr->errors);
 	}
-	g_key_file_free(mgr->storage);
+	storage_close(NULL, SM_STORE, mgr->storage, FALSE);
 	g_free(mgr->default_voice_imsi);
 	g_free(mgr->default_data_imsi);
 	g_free(mgr->mms_imsi);
@@ -49,6 +49,7 @@
 #define SETTINGS_GROUP "Settings"
 
 #define TXQ_MAX_RETRIES 4
+#define TXQ_MAX_WINDOW 16
 #define NETWORK_TIMEOUT 332
 
 static gboolean tx_next(gpointer user_data);
@@ -72,6 +73,7 @@ struct ofono_sms {
 	GQueue *txq;
 	unsigned long tx_counter;
 	guint tx_source;
+	struct sms_tx_window *tx_window;
 	struct ofono_message_waiting *mw;
 	unsigned int mw_watch;
 	ofono_bool_t registered;
@@ -101,7 +103,6 @@ struct pending_pdu {
 struct tx_queue_entry {
 	struct pending_pdu *pdus;
 	unsigned char num_pdus;
-	unsigned char cur_pdu;
 	struct sms_address receiver;
 	struct ofono_uuid uuid;
 	unsigned int retry;
@@ -675,6 +676,7 @@ static void sms_tx_queue_remove_entry(struct ofono_sms *sms, GList *entry_list,
 	struct ofono_modem *modem = __ofono_atom_get_modem(sms->atom);
 
 	g_queue_delete_link(sms->txq, entry_list);
+	sms_tx_window_remove(sms->tx_window, entry);
 
 	DBG("%p", entry);
 
@@ -724,18 +726,37 @@ done:
 	tx_queue_entry_destroy(entry);
 }
 
+static void tx_schedule(struct ofono_sms *sms)
+{
+	if (sms->tx_source == 0)
+		sms->tx_source = g_timeout_add(0, tx_next, sms);
+}
+
 static void tx_finished(const struct ofono_error *error, int mr, void *data)
 {
-	struct ofono_sms *sms = data;
-	struct tx_queue_entry *entry = g_queue_peek_head(sms->txq);
+	struct sms_tx_submit *submit = data;
+	struct ofono_sms *sms = submit->window->user_data;
+	struct tx_queue_entry *entry;
+	unsigned char cur;
 	gboolean ok = error->type == OFONO_ERROR_TYPE_NO_ERROR;
+	enum sms_tx_window_result result;
 	enum message_state tx_state;
 
-	DBG("tx_finished %p", entry);
+	result = sms_tx_window_done(submit, ok, (void **) &entry, &cur);
+
+	DBG("tx_finished %p pdu %u", entry, cur);
+
+	if (sms->tx_window->pending == NULL)
+		sms->flags &= ~MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+
+	if (result == SMS_TX_WINDOW_IGNORED) {
+		if (sms->registered && g_queue_peek_head(sms->txq))
+			tx_schedule(sms);
 
-	sms->flags &= ~MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+		return;
+	}
 
-	if (ok == FALSE) {
+	if (result == SMS_TX_WINDOW_FAILED) {
 		/* Retry again when back in online mode */
 		/* Note this does not increment retry count */
 		if (sms->registered == FALSE)
@@ -756,6 +777,12 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 		if (entry->retry < TXQ_MAX_RETRIES) {
 			DBG("Sending failed, retry in %d secs",
 					entry->retry * 5);
+
+			/* Nothing gets submitted until the retry */
+			if (sms->tx_source)
+				g_source_remove(sms->tx_source);
+
+			sms->tx_window->hold = TRUE;
 			sms->tx_source = g_timeout_add_seconds(entry->retry * 5,
 								tx_next, sms);
 			return;
@@ -768,9 +795,8 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS)
 		sms_tx_backup_remove(sms->imsi, entry->id, entry->flags,
 						ofono_uuid_to_str(&entry->uuid),
-						entry->cur_pdu);
+						cur);
 
-	entry->cur_pdu += 1;
 	entry->retry = 0;
 
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR)
@@ -780,15 +806,15 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 							mr, time(NULL),
 							entry->num_pdus);
 
-	if (entry->cur_pdu < entry->num_pdus) {
-		sms->tx_source = g_timeout_add(0, tx_next, sms);
+	if (result == SMS_TX_WINDOW_SENT) {
+		tx_schedule(sms);
 		return;
 	}
 
 	tx_state = MESSAGE_STATE_SENT;
 
 next_q:
-	sms_tx_queue_remove_entry(sms, g_queue_peek_head_link(sms->txq),
+	sms_tx_queue_remove_entry(sms, g_queue_find(sms->txq, entry),
 					tx_state);
 
 	if (sms->registered == FALSE)
@@ -796,32 +822,39 @@ next_q:
 
 	if (g_queue_peek_head(sms->txq)) {
 		DBG("Scheduling next");
-		sms->tx_source = g_timeout_add(0, tx_next, sms);
+		tx_schedule(sms);
 	}
 }
 
 static gboolean tx_next(gpointer user_data)
 {
 	struct ofono_sms *sms = user_data;
-	int send_mms = 0;
-	struct tx_queue_entry *entry = g_queue_peek_head(sms->txq);
-	struct pending_pdu *pdu = &entry->pdus[entry->cur_pdu];
-
-	DBG("tx_next: %p", entry);
+	struct sms_tx_submit *submit;
+	struct tx_queue_entry *entry;
+	unsigned char cur;
+	gboolean more;
 
 	sms->tx_source = 0;
+	sms->tx_window->hold = FALSE;
 
-	if (sms->registered == FALSE)
-		return FALSE;
+	/*
+	 * Keep as many PDUs in flight as the window allows. The driver
+	 * may complete the submission synchronously, in which case
+	 * tx_finished() may schedule a retry - and then we stop here.
+	 */
+	while (sms->registered && sms->tx_source == 0 &&
+			(submit = sms_tx_window_next(sms->tx_window,
+							(void **) &entry,
+							&cur, &more))) {
+		struct pending_pdu *pdu = &entry->pdus[cur];
 
-	if (g_queue_get_length(sms->txq) > 1
-			|| (entry->num_pdus - entry->cur_pdu) > 1)
-		send_mms = 1;
+		DBG("tx_next: %p pdu %u", entry, cur);
 
-	sms->flags |= MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+		sms->flags |= MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
 
-	sms->driver->submit(sms, pdu->pdu, pdu->pdu_len, pdu->tpdu_len,
-				send_mms, tx_finished, sms);
+		sms->driver->submit(sms, pdu->pdu, pdu->pdu_len, pdu->tpdu_len,
+					more, tx_finished, submit);
+	}
 
 	return FALSE;
 }
@@ -1277,28 +1310,23 @@ int __ofono_sms_txq_cancel(struct ofono_sms *sms, const struct ofono_uuid *uuid)
 
 	entry = l->data;
 
-	if (entry == g_queue_peek_head(sms->txq)) {
-		/*
-		 * Fail if any pdu was already transmitted or if we are
-		 * waiting the answer from driver.
-		 */
-		if (entry->cur_pdu > 0)
-			return -EPERM;
+	/*
+	 * Fail if any pdu was already transmitted or if we are
+	 * waiting the answer from driver.
+	 */
+	if (sms_tx_window_started(sms->tx_window, entry))
+		return -EPERM;
 
-		if (sms->flags & MESSAGE_MANAGER_FLAG_TXQ_ACTIVE)
-			return -EPERM;
-		/*
-		 * Make sure we don't call tx_next() if there are no entries
-		 * and that next entry doesn't have to wait a 'retry time'
-		 * from this one.
-		 */
-		if (sms->tx_source) {
-			g_source_remove(sms->tx_source);
-			sms->tx_source = 0;
+	/*
+	 * Make sure that next entry doesn't have to wait a 'retry time'
+	 * from this one.
+	 */
+	if (entry->retry && sms->tx_source) {
+		g_source_remove(sms->tx_source);
+		sms->tx_source = 0;
 
-			if (g_queue_get_length(sms->txq) > 1)
-				sms->tx_source = g_timeout_add(0, tx_next, sms);
-		}
+		if (g_queue_get_length(sms->txq) > 1)
+			sms->tx_source = g_timeout_add(0, tx_next, sms);
 	}
 
 	sms_tx_queue_remove_entry(sms, l, MESSAGE_STATE_CANCELLED);
@@ -1956,6 +1984,9 @@ static void sms_remove(struct ofono_atom *atom)
 		sms->tx_source = 0;
 	}
 
+	sms_tx_window_free(sms->tx_window);
+	sms->tx_window = NULL;
+
 	if (sms->assembly) {
 		sms_assembly_free(sms->assembly);
 		sms->assembly = NULL;
@@ -1980,6 +2011,7 @@ static void sms_remove(struct ofono_atom *atom)
 
 		storage_close(sms->imsi, SETTINGS_STORE, sms->settings, TRUE);
 
+		sms_tx_backup_close(sms->imsi);
 		g_free(sms->imsi);
 		sms->imsi = NULL;
 		sms->settings = NULL;
@@ -2011,6 +2043,7 @@ struct ofono_sms *ofono_sms_create(struct ofono_modem *modem,
 {
 	struct ofono_sms *sms;
 	GSList *l;
+	int window;
 
 	if (driver == NULL)
 		return NULL;
@@ -2025,6 +2058,11 @@ struct ofono_sms *ofono_sms_create(struct ofono_modem *modem,
 	sms->txq = g_queue_new();
 	sms->messages = g_hash_table_new(uuid_hash, uuid_equal);
 
+	/* Number of PDUs which may be submitted without waiting for result */
+	window = ofono_modem_get_integer(modem, "SmsSubmitWindow");
+	sms->tx_window = sms_tx_window_new(CLAMP(window, 1, TXQ_MAX_WINDOW),
+									sms);
+
 	sms->atom = __ofono_modem_add_atom(modem, OFONO_ATOM_TYPE_SMS,
 						sms_remove, sms);
 
@@ -2166,6 +2204,8 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 
 		txq_entry->id = sms->tx_counter++;
 		g_queue_push_tail(sms->txq, txq_entry);
+		sms_tx_window_add(sms->tx_window, txq_entry,
+						txq_entry->num_pdus);
 
 loop_out:
 		g_slist_free_full(backup_entry->msg_list, g_free);
@@ -2301,9 +2341,12 @@ int __ofono_sms_txq_submit(struct ofono_sms *sms, GSList *list,
 	entry->id = sms->tx_counter++;
 
 	g_queue_push_tail(sms->txq, entry);
+	sms_tx_window_add(sms->tx_window, entry, entry->num_pdus);
 
 	if (sms->registered && g_queue_get_length(sms->txq) == 1)
 		sms->tx_source = g_timeout_add(100, tx_next, sms);
+	else if (sms->registered && sms->tx_window->size > 1)
+		tx_schedule(sms);
 
 	if (uuid)
 		memcpy(uuid, &entry->uuid, sizeof(*uuid));
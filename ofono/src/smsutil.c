@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -45,15 +46,15 @@
 
 #define SMS_BACKUP_MODE 0600
 #define SMS_BACKUP_PATH STORAGEDIR "/%s/sms_assembly"
-#define SMS_BACKUP_PATH_DIR SMS_BACKUP_PATH "/%s-%i-%i"
-#define SMS_BACKUP_PATH_FILE SMS_BACKUP_PATH_DIR "/%03i"
+#define SMS_BACKUP_JOURNAL SMS_BACKUP_PATH ".journal"
+#define SMS_BACKUP_KEY "%s-%i-%i"
 
 #define SMS_SR_BACKUP_PATH STORAGEDIR "/%s/sms_sr"
 #define SMS_SR_BACKUP_PATH_FILE SMS_SR_BACKUP_PATH "/%s-%s"
 
 #define SMS_TX_BACKUP_PATH STORAGEDIR "/%s/tx_queue"
-#define SMS_TX_BACKUP_PATH_DIR SMS_TX_BACKUP_PATH "/%lu-%lu-%s"
-#define SMS_TX_BACKUP_PATH_FILE SMS_TX_BACKUP_PATH_DIR "/%03i"
+#define SMS_TX_BACKUP_JOURNAL SMS_TX_BACKUP_PATH ".journal"
+#define SMS_TX_BACKUP_KEY "%lu-%lu-%s"
 
 #define SMS_ADDR_FMT "%24[0-9A-F]"
 #define SMS_MSGID_FMT "%40[0-9A-F]"
@@ -2424,162 +2425,834 @@ gboolean sms_address_to_hex_string(const struct sms_address *in, char *straddr)
 	return TRUE;
 }
 
+/*
+ * Backups are kept in per-IMSI append-only journals. A journal holds
+ * records grouped under a string key (one key per message), each
+ * record being identified within its key by a sequence number. Every
+ * change appends a CRC protected record to the file, and the contents
+ * are replayed into memory when the journal is opened. Once most of
+ * the records in the file have been superseded, the file is rewritten
+ * with only the live records.
+ */
+#define SMS_JOURNAL_MAGIC "OSJ1"
+#define SMS_JOURNAL_MAGIC_LEN 4
+#define SMS_JOURNAL_HEADER_LEN 5	/* op, seq, key len, data len (LE) */
+#define SMS_JOURNAL_CRC_LEN 4
+#define SMS_JOURNAL_MAX_KEY 255
+#define SMS_JOURNAL_MAX_DATA 1024
+#define SMS_JOURNAL_COMPACT_MIN 64
+
+enum sms_journal_op {
+	SMS_JOURNAL_PUT = 1,
+	SMS_JOURNAL_REMOVE,
+	SMS_JOURNAL_DROP,
+	SMS_JOURNAL_RENAME,	/* The data is the new key */
+};
+
+struct sms_journal_value {
+	guint8 seq;
+	guint16 len;
+	unsigned char data[];
+};
+
+struct sms_journal_key {
+	char *key;
+	GSList *values;			/* Sorted by seq */
+	GList *link;
+};
+
+struct sms_journal {
+	char *path;
+	int fd;
+	off_t size;
+	GHashTable *keys;
+	GQueue order;			/* Keys in order of creation */
+	unsigned int records;		/* Records in the file */
+	unsigned int live;		/* Records still in use */
+};
+
+typedef void (*sms_journal_foreach_cb)(const char *key, guint8 seq,
+				const unsigned char *data, guint16 len,
+				void *user_data);
+
+static guint32 sms_journal_crc(const unsigned char *buf, size_t len)
+{
+	static guint32 table[256];
+	guint32 crc = 0xffffffff;
+	size_t i;
+
+	if (G_UNLIKELY(table[1] == 0)) {
+		guint32 n, k, c;
+
+		for (n = 0; n < 256; n++) {
+			for (c = n, k = 0; k < 8; k++)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+
+			table[n] = c;
+		}
+	}
+
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+static void sms_journal_key_free(gpointer data)
+{
+	struct sms_journal_key *k = data;
+
+	g_slist_free_full(k->values, g_free);
+	g_free(k->key);
+	g_free(k);
+}
+
+static void sms_journal_key_remove(struct sms_journal *j,
+					struct sms_journal_key *k)
+{
+	j->live -= g_slist_length(k->values);
+	g_queue_delete_link(&j->order, k->link);
+	g_hash_table_remove(j->keys, k->key);
+}
+
+/* Returns whether applying the record would change anything */
+static gboolean sms_journal_check(struct sms_journal *j, enum sms_journal_op op,
+					const char *key, guint8 seq,
+					const unsigned char *data, guint16 len)
+{
+	struct sms_journal_key *k = g_hash_table_lookup(j->keys, key);
+	GSList *l;
+	char *newkey;
+	gboolean ok;
+
+	switch (op) {
+	case SMS_JOURNAL_PUT:
+		return TRUE;
+
+	case SMS_JOURNAL_REMOVE:
+		if (k == NULL)
+			return FALSE;
+
+		for (l = k->values; l; l = l->next) {
+			struct sms_journal_value *v = l->data;
+
+			if (v->seq == seq)
+				return TRUE;
+		}
+
+		return FALSE;
+
+	case SMS_JOURNAL_DROP:
+		return k != NULL;
+
+	case SMS_JOURNAL_RENAME:
+		if (k == NULL || len == 0)
+			return FALSE;
+
+		newkey = g_strndup((const char *) data, len);
+		ok = !g_hash_table_contains(j->keys, newkey);
+		g_free(newkey);
+		return ok;
+	}
+
+	return FALSE;
+}
+
+/* Updates the in-memory state, returns FALSE if nothing has changed */
+static gboolean sms_journal_apply(struct sms_journal *j, enum sms_journal_op op,
+					const char *key, guint8 seq,
+					const unsigned char *data, guint16 len)
+{
+	struct sms_journal_key *k = g_hash_table_lookup(j->keys, key);
+	struct sms_journal_value *v;
+	GSList *l, *prev;
+	char *newkey;
+
+	switch (op) {
+	case SMS_JOURNAL_PUT:
+		if (k == NULL) {
+			k = g_new0(struct sms_journal_key, 1);
+			k->key = g_strdup(key);
+			g_queue_push_tail(&j->order, k);
+			k->link = j->order.tail;
+			g_hash_table_insert(j->keys, k->key, k);
+		}
+
+		v = g_malloc(sizeof(*v) + len);
+		v->seq = seq;
+		v->len = len;
+		memcpy(v->data, data, len);
+
+		for (prev = NULL, l = k->values; l; prev = l, l = l->next) {
+			struct sms_journal_value *old = l->data;
+
+			if (old->seq < seq)
+				continue;
+
+			if (old->seq == seq) {
+				l->data = v;
+				g_free(old);
+				return TRUE;
+			}
+
+			break;
+		}
+
+		if (prev)
+			prev->next = g_slist_prepend(l, v);
+		else
+			k->values = g_slist_prepend(l, v);
+
+		j->live++;
+		return TRUE;
+
+	case SMS_JOURNAL_REMOVE:
+		if (k == NULL)
+			return FALSE;
+
+		for (l = k->values; l; l = l->next) {
+			v = l->data;
+
+			if (v->seq == seq)
+				break;
+		}
+
+		if (l == NULL)
+			return FALSE;
+
+		k->values = g_slist_delete_link(k->values, l);
+		g_free(v);
+		j->live--;
+
+		if (k->values == NULL)
+			sms_journal_key_remove(j, k);
+
+		return TRUE;
+
+	case SMS_JOURNAL_DROP:
+		if (k == NULL)
+			return FALSE;
+
+		sms_journal_key_remove(j, k);
+		return TRUE;
+
+	case SMS_JOURNAL_RENAME:
+		if (k == NULL || len == 0)
+			return FALSE;
+
+		newkey = g_strndup((const char *) data, len);
+
+		if (g_hash_table_contains(j->keys, newkey)) {
+			g_free(newkey);
+			return FALSE;
+		}
+
+		g_hash_table_steal(j->keys, k->key);
+		g_free(k->key);
+		k->key = newkey;
+		g_hash_table_insert(j->keys, k->key, k);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gsize sms_journal_encode(unsigned char *buf, enum sms_journal_op op,
+					const char *key, guint8 seq,
+					const unsigned char *data, guint16 len)
+{
+	gsize keylen = strlen(key);
+	gsize n = SMS_JOURNAL_HEADER_LEN;
+	guint32 crc;
+
+	buf[0] = op;
+	buf[1] = seq;
+	buf[2] = keylen;
+	buf[3] = len & 0xff;
+	buf[4] = len >> 8;
+	memcpy(buf + n, key, keylen);
+	n += keylen;
+
+	if (len) {
+		memcpy(buf + n, data, len);
+		n += len;
+	}
+
+	crc = GUINT32_TO_LE(sms_journal_crc(buf, n));
+	memcpy(buf + n, &crc, SMS_JOURNAL_CRC_LEN);
+
+	return n + SMS_JOURNAL_CRC_LEN;
+}
+
+/* Rewrites the file with nothing but the live records */
+static gboolean sms_journal_compact(struct sms_journal *j)
+{
+	unsigned char buf[SMS_JOURNAL_HEADER_LEN + SMS_JOURNAL_MAX_KEY +
+				SMS_JOURNAL_MAX_DATA + SMS_JOURNAL_CRC_LEN];
+	GByteArray *out = g_byte_array_new();
+	char *tmp_path = g_strconcat(j->path, ".tmp", NULL);
+	gboolean ok = FALSE;
+	GList *kl;
+	int fd;
+
+	g_byte_array_append(out, (const guint8 *) SMS_JOURNAL_MAGIC,
+						SMS_JOURNAL_MAGIC_LEN);
+
+	for (kl = j->order.head; kl; kl = kl->next) {
+		struct sms_journal_key *k = kl->data;
+		GSList *l;
+
+		for (l = k->values; l; l = l->next) {
+			struct sms_journal_value *v = l->data;
+
+			g_byte_array_append(out, buf,
+				sms_journal_encode(buf, SMS_JOURNAL_PUT,
+						k->key, v->seq, v->data,
+						v->len));
+		}
+	}
+
+	fd = TFR(open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+							SMS_BACKUP_MODE));
+	if (fd == -1)
+		goto out;
+
+	if (TFR(write(fd, out->data, out->len)) != (ssize_t) out->len ||
+					rename(tmp_path, j->path) == -1) {
+		TFR(close(fd));
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (j->fd != -1)
+		TFR(close(j->fd));
+
+	j->fd = fd;
+	j->size = out->len;
+	j->records = j->live;
+	ok = TRUE;
+
+out:
+	g_free(tmp_path);
+	g_byte_array_free(out, TRUE);
+	return ok;
+}
+
+static gboolean sms_journal_write(struct sms_journal *j, enum sms_journal_op op,
+					const char *key, guint8 seq,
+					const unsigned char *data, guint16 len)
+{
+	unsigned char buf[SMS_JOURNAL_HEADER_LEN + SMS_JOURNAL_MAX_KEY +
+				SMS_JOURNAL_MAX_DATA + SMS_JOURNAL_CRC_LEN];
+	gsize n;
+
+	if (strlen(key) > SMS_JOURNAL_MAX_KEY || len > SMS_JOURNAL_MAX_DATA)
+		return FALSE;
+
+	if (!sms_journal_check(j, op, key, seq, data, len))
+		return FALSE;
+
+	n = sms_journal_encode(buf, op, key, seq, data, len);
+
+	if (j->fd == -1 || TFR(write(j->fd, buf, n)) != (ssize_t) n) {
+		/* Don't leave a partial record behind */
+		if (j->fd != -1 && ftruncate(j->fd, j->size) < 0)
+			sms_journal_compact(j);
+
+		return FALSE;
+	}
+
+	/* Memory only changes once the record is in the file */
+	sms_journal_apply(j, op, key, seq, data, len);
+	j->size += n;
+	j->records++;
+
+	if (j->records >= SMS_JOURNAL_COMPACT_MIN && j->records >= 2 * j->live)
+		sms_journal_compact(j);
+
+	return TRUE;
+}
+
+static gboolean sms_journal_put(struct sms_journal *j, const char *key,
+		guint8 seq, const unsigned char *data, guint16 len)
+{
+	return sms_journal_write(j, SMS_JOURNAL_PUT, key, seq, data, len);
+}
+
+static gboolean sms_journal_remove(struct sms_journal *j, const char *key,
+								guint8 seq)
+{
+	return sms_journal_write(j, SMS_JOURNAL_REMOVE, key, seq, NULL, 0);
+}
+
+static gboolean sms_journal_drop(struct sms_journal *j, const char *key)
+{
+	return sms_journal_write(j, SMS_JOURNAL_DROP, key, 0, NULL, 0);
+}
+
+static gboolean sms_journal_rename(struct sms_journal *j, const char *key,
+							const char *newkey)
+{
+	return sms_journal_write(j, SMS_JOURNAL_RENAME, key, 0,
+				(const unsigned char *) newkey, strlen(newkey));
+}
+
+/* The callback must not modify the journal */
+static void sms_journal_foreach(struct sms_journal *j,
+				sms_journal_foreach_cb cb, void *user_data)
+{
+	GList *kl;
+
+	for (kl = j->order.head; kl; kl = kl->next) {
+		struct sms_journal_key *k = kl->data;
+		GSList *l;
+
+		for (l = k->values; l; l = l->next) {
+			struct sms_journal_value *v = l->data;
+
+			cb(k->key, v->seq, v->data, v->len, user_data);
+		}
+	}
+}
+
+/* Replays the file, returns the length of its valid part */
+static gsize sms_journal_replay(struct sms_journal *j,
+				const unsigned char *buf, gsize len)
+{
+	char key[SMS_JOURNAL_MAX_KEY + 1];
+	gsize pos = SMS_JOURNAL_MAGIC_LEN;
+
+	if (len < SMS_JOURNAL_MAGIC_LEN ||
+			memcmp(buf, SMS_JOURNAL_MAGIC, SMS_JOURNAL_MAGIC_LEN))
+		return 0;
+
+	while (len - pos >= SMS_JOURNAL_HEADER_LEN + SMS_JOURNAL_CRC_LEN) {
+		const unsigned char *rec = buf + pos;
+		guint8 keylen = rec[2];
+		guint16 datalen = rec[3] | (rec[4] << 8);
+		gsize n = SMS_JOURNAL_HEADER_LEN + keylen + datalen;
+		guint32 crc;
+
+		if (len - pos < n + SMS_JOURNAL_CRC_LEN)
+			break;
+
+		memcpy(&crc, rec + n, SMS_JOURNAL_CRC_LEN);
+		if (GUINT32_FROM_LE(crc) != sms_journal_crc(rec, n))
+			break;
+
+		memcpy(key, rec + SMS_JOURNAL_HEADER_LEN, keylen);
+		key[keylen] = 0;
+
+		sms_journal_apply(j, rec[0], key, rec[1],
+				rec + SMS_JOURNAL_HEADER_LEN + keylen, datalen);
+		j->records++;
+		pos += n + SMS_JOURNAL_CRC_LEN;
+	}
+
+	return pos;
+}
+
+static struct sms_journal *sms_journal_open(const char *path)
+{
+	struct sms_journal *j;
+	gchar *contents = NULL;
+	gsize len = 0, valid = 0;
+
+	if (create_dirs(path, SMS_BACKUP_MODE | S_IXUSR) != 0)
+		return NULL;
+
+	j = g_new0(struct sms_journal, 1);
+	j->path = g_strdup(path);
+	j->fd = -1;
+	j->keys = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+							sms_journal_key_free);
+	g_queue_init(&j->order);
+
+	if (g_file_get_contents(path, &contents, &len, NULL)) {
+		valid = sms_journal_replay(j, (unsigned char *) contents, len);
+		g_free(contents);
+	}
+
+	/*
+	 * Anything after a torn or corrupted record is dropped, and
+	 * a new or mostly obsolete file is rewritten.
+	 */
+	if (valid == 0 || valid != len || (j->records >=
+			SMS_JOURNAL_COMPACT_MIN && j->records >= 2 * j->live)) {
+		if (sms_journal_compact(j))
+			return j;
+	} else {
+		j->fd = TFR(open(path, O_WRONLY | O_APPEND));
+		j->size = len;
+
+		if (j->fd != -1)
+			return j;
+	}
+
+	g_queue_clear(&j->order);
+	g_hash_table_destroy(j->keys);
+	g_free(j->path);
+	g_free(j);
+	return NULL;
+}
+
+static void sms_journal_close(struct sms_journal *j)
+{
+	if (j == NULL)
+		return;
+
+	if (j->fd != -1)
+		TFR(close(j->fd));
+
+	g_queue_clear(&j->order);
+	g_hash_table_destroy(j->keys);
+	g_free(j->path);
+	g_free(j);
+}
+
+/*
+ * Moves the fragments stored by older versions, one file per fragment
+ * in a directory per message, into the journal.
+ */
+static void sms_assembly_migrate(struct sms_assembly *assembly)
+{
+	char *path = g_strdup_printf(SMS_BACKUP_PATH, assembly->imsi);
+	DIR *dir = opendir(path);
+	struct dirent *msg;
+	gboolean failed = FALSE;
+
+	if (dir == NULL)
+		goto out;
+
+	while ((msg = readdir(dir)) != NULL) {
+		struct dirent *entry;
+		DIR *segments;
+		char *msgpath;
+		gboolean msg_failed = FALSE;
+
+		if (msg->d_type != DT_DIR || !strcmp(msg->d_name, ".") ||
+						!strcmp(msg->d_name, ".."))
+			continue;
+
+		msgpath = g_strdup_printf("%s/%s", path, msg->d_name);
+		segments = opendir(msgpath);
+		g_free(msgpath);
+
+		if (segments == NULL) {
+			failed = TRUE;
+			continue;
+		}
+
+		while ((entry = readdir(segments)) != NULL) {
+			unsigned char buf[8 + 177];
+			struct stat segment_stat;
+			gint64 ts;
+			char *endp;
+			int seq, fd, r;
+
+			if (entry->d_type != DT_REG)
+				continue;
+
+			seq = strtol(entry->d_name, &endp, 10);
+			if (*endp != '\0' || seq < 0 || seq > 255)
+				continue;
+
+			fd = TFR(openat(dirfd(segments), entry->d_name,
+								O_RDONLY));
+			if (fd == -1) {
+				msg_failed = TRUE;
+				continue;
+			}
+
+			if (fstat(fd, &segment_stat) == 0)
+				r = TFR(read(fd, buf + 8, sizeof(buf) - 8));
+			else
+				r = -1;
+
+			TFR(close(fd));
+
+			if (r > 0) {
+				ts = GINT64_TO_LE(segment_stat.st_mtime);
+				memcpy(buf, &ts, 8);
+
+				if (!sms_journal_put(assembly->journal,
+						msg->d_name, seq, buf, r + 8))
+					r = -1;
+			}
+
+			/* Only what made it into the journal is deleted */
+			if (r < 0) {
+				msg_failed = TRUE;
+				continue;
+			}
+
+			unlinkat(dirfd(segments), entry->d_name, 0);
+		}
+
+		closedir(segments);
+
+		/* Only the directories with leftovers are kept */
+		if (msg_failed)
+			failed = TRUE;
+		else
+			unlinkat(dirfd(dir), msg->d_name, AT_REMOVEDIR);
+	}
+
+	closedir(dir);
+
+	if (!failed)
+		rmdir(path);
+
+out:
+	g_free(path);
+}
+
+struct sms_assembly_record {
+	char *key;
+	guint8 seq;
+	guint16 len;
+	unsigned char *data;
+};
+
+static void sms_assembly_collect(const char *key, guint8 seq,
+				const unsigned char *data, guint16 len,
+				void *user_data)
+{
+	GSList **list = user_data;
+	struct sms_assembly_record *rec = g_new(struct sms_assembly_record, 1);
+
+	rec->key = g_strdup(key);
+	rec->seq = seq;
+	rec->len = len;
+	rec->data = g_memdup(data, len);
+	*list = g_slist_prepend(*list, rec);
+}
+
 static void sms_assembly_load(struct sms_assembly *assembly,
-				const struct dirent *dir)
+				const struct sms_assembly_record *rec)
 {
 	struct sms_address addr;
 	DECLARE_SMS_ADDR_STR(straddr);
 	guint16 ref;
 	guint8 max;
-	guint8 seq;
-	char *path;
-	int len;
-	struct stat segment_stat;
-	struct dirent **segments;
-	char *endp;
-	int r;
-	int i;
-	unsigned char buf[177];
+	gint64 ts;
 	struct sms segment;
-
-	if (dir->d_type != DT_DIR)
-		return;
+	GSList *completed;
 
 	/* Max of SMS address size is 12 bytes, hex encoded */
-	if (sscanf(dir->d_name, SMS_ADDR_FMT "-%hi-%hhi",
+	if (sscanf(rec->key, SMS_ADDR_FMT "-%hi-%hhi",
 				straddr, &ref, &max) < 3)
 		return;
 
 	if (sms_assembly_extract_address(straddr, &addr) == FALSE)
 		return;
 
-	path = g_strdup_printf(SMS_BACKUP_PATH "/%s",
-			assembly->imsi, dir->d_name);
-	len = scandir(path, &segments, NULL, versionsort);
-	g_free(path);
-
-	if (len < 0)
+	if (rec->len <= 8)
 		return;
 
-	for (i = 0; i < len; i++) {
-		if (segments[i]->d_type != DT_REG)
-			continue;
-
-		seq = strtol(segments[i]->d_name, &endp, 10);
-		if (*endp != '\0')
-			continue;
-
-		r = read_file(buf, sizeof(buf), SMS_BACKUP_PATH "/%s/%s",
-				assembly->imsi,
-				dir->d_name, segments[i]->d_name);
-		if (r < 0)
-			continue;
-
-		if (!sms_deserialize(buf, &segment, r))
-			continue;
-
-		path = g_strdup_printf(SMS_BACKUP_PATH "/%s/%s",
-				assembly->imsi,
-				dir->d_name, segments[i]->d_name);
-		r = stat(path, &segment_stat);
-		g_free(path);
+	memcpy(&ts, rec->data, 8);
 
-		if (r != 0)
-			continue;
+	if (!sms_deserialize(rec->data + 8, &segment, rec->len - 8))
+		return;
 
-		/* Errors cannot occur here */
-		sms_assembly_add_fragment_backup(assembly, &segment,
-						segment_stat.st_mtime,
-						&addr, ref, max, seq, FALSE);
-	}
+	/* Errors cannot occur here */
+	completed = sms_assembly_add_fragment_backup(assembly, &segment,
+					GINT64_FROM_LE(ts), &addr, ref, max,
+					rec->seq, FALSE);
+	g_slist_free_full(completed, g_free);
+}
 
-	for (i = 0; i < len; i++)
-		free(segments[i]);
+static void sms_assembly_record_free(gpointer data)
+{
+	struct sms_assembly_record *rec = data;
 
-	free(segments);
+	g_free(rec->key);
+	g_free(rec->data);
+	g_free(rec);
 }
 
 static gboolean sms_assembly_store(struct sms_assembly *assembly,
 				struct sms_assembly_node *node,
 				const struct sms *sms, guint8 seq)
 {
-	unsigned char buf[177];
-	int len;
+	unsigned char buf[8 + 177];
+	char key[SMS_JOURNAL_MAX_KEY + 1];
 	DECLARE_SMS_ADDR_STR(straddr);
+	gint64 ts;
+	int len;
 
-	if (assembly->imsi == NULL)
+	if (assembly->journal == NULL)
 		return FALSE;
 
 	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
 		return FALSE;
 
-	len = sms_serialize(buf, sms);
+	/* The whole message carries the time of its first fragment */
+	ts = GINT64_TO_LE(node->ts);
+	memcpy(buf, &ts, 8);
+	len = sms_serialize(buf + 8, sms);
 
-	if (write_file(buf, len, SMS_BACKUP_MODE,
-				SMS_BACKUP_PATH_FILE, assembly->imsi, straddr,
-				node->ref, node->max_fragments, seq) != len)
-		return FALSE;
+	snprintf(key, sizeof(key), SMS_BACKUP_KEY, straddr,
+					node->ref, node->max_fragments);
 
-	return TRUE;
+	return sms_journal_put(assembly->journal, key, seq, buf, len + 8);
 }
 
 static void sms_assembly_backup_free(struct sms_assembly *assembly,
 					struct sms_assembly_node *node)
 {
-	char *path;
-	int seq;
+	char key[SMS_JOURNAL_MAX_KEY + 1];
 	DECLARE_SMS_ADDR_STR(straddr);
 
-	if (assembly->imsi == NULL)
+	if (assembly->journal == NULL)
 		return;
 
 	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
 		return;
 
-	for (seq = 0; seq < node->max_fragments; seq++) {
-		int offset = seq / 32;
-		int bit = 1 << (seq % 32);
+	snprintf(key, sizeof(key), SMS_BACKUP_KEY, straddr,
+					node->ref, node->max_fragments);
+	sms_journal_drop(assembly->journal, key);
+}
 
-		if (node->bitmap[offset] & bit) {
-			path = g_strdup_printf(SMS_BACKUP_PATH_FILE,
-					assembly->imsi, straddr,
-					node->ref, node->max_fragments, seq);
-			unlink(path);
-			g_free(path);
-		}
+static guint sms_assembly_node_hash(gconstpointer v)
+{
+	const struct sms_assembly_node *node = v;
+	guint h = g_str_hash(node->addr.address);
+
+	h = h * 31 + node->addr.number_type;
+	h = h * 31 + node->addr.numbering_plan;
+	h = h * 31 + node->ref;
+
+	return h;
+}
+
+static gboolean sms_assembly_node_equal(gconstpointer v1, gconstpointer v2)
+{
+	const struct sms_assembly_node *a = v1;
+	const struct sms_assembly_node *b = v2;
+
+	if (a->ref != b->ref)
+		return FALSE;
+
+	if (a->addr.number_type != b->addr.number_type)
+		return FALSE;
+
+	if (a->addr.numbering_plan != b->addr.numbering_plan)
+		return FALSE;
+
+	return strcmp(a->addr.address, b->addr.address) == 0;
+}
+
+static size_t sms_assembly_node_size(const struct sms_assembly_node *node)
+{
+	return sizeof(*node) + node->num_fragments * sizeof(struct sms);
+}
+
+/* Unlinks the node from the assembly; the caller owns the fragments */
+static void sms_assembly_unlink(struct sms_assembly *assembly,
+				struct sms_assembly_node *node)
+{
+	g_hash_table_remove(assembly->assembly_table, node);
+	g_queue_delete_link(&assembly->assembly_queue, node->link);
+	assembly->bytes -= sms_assembly_node_size(node);
+}
+
+static void sms_assembly_drop(struct sms_assembly *assembly,
+				struct sms_assembly_node *node)
+{
+	sms_assembly_backup_free(assembly, node);
+	sms_assembly_unlink(assembly, node);
+
+	g_slist_free_full(node->fragment_list, g_free);
+	g_free(node);
+}
+
+/*
+ * Drops the oldest partial messages until the assembly fits its limits
+ * again.  The node given in keep is never dropped.
+ */
+static void sms_assembly_evict(struct sms_assembly *assembly,
+				struct sms_assembly_node *keep)
+{
+	GQueue *queue = &assembly->assembly_queue;
+
+	while (queue->length > assembly->max_nodes ||
+			assembly->bytes > assembly->max_bytes) {
+		struct sms_assembly_node *oldest = g_queue_peek_head(queue);
+
+		if (oldest == keep)
+			break;
+
+		sms_assembly_drop(assembly, oldest);
 	}
+}
 
-	path = g_strdup_printf(SMS_BACKUP_PATH_DIR, assembly->imsi, straddr,
-				node->ref, node->max_fragments);
-	rmdir(path);
-	g_free(path);
+static gint sms_assembly_node_compare_ts(gconstpointer a, gconstpointer b,
+							gpointer user_data)
+{
+	const struct sms_assembly_node *n1 = a;
+	const struct sms_assembly_node *n2 = b;
+
+	if (n1->ts != n2->ts)
+		return n1->ts < n2->ts ? -1 : 1;
+
+	return 0;
 }
 
 struct sms_assembly *sms_assembly_new(const char *imsi)
 {
 	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
+	GSList *records = NULL;
+	GSList *l;
+	GList *q;
 	char *path;
-	struct dirent **entries;
-	int len;
+
+	ret->assembly_table = g_hash_table_new(sms_assembly_node_hash,
+						sms_assembly_node_equal);
+	g_queue_init(&ret->assembly_queue);
+	ret->max_nodes = SMS_ASSEMBLY_DEFAULT_MAX_NODES;
+	ret->max_bytes = SMS_ASSEMBLY_DEFAULT_MAX_BYTES;
 
 	if (imsi) {
 		ret->imsi = imsi;
 
-		/* Restore state from backup */
+		/* Restore state from backup */
+
+		path = g_strdup_printf(SMS_BACKUP_JOURNAL, imsi);
+		ret->journal = sms_journal_open(path);
+		g_free(path);
+
+		if (ret->journal == NULL)
+			return ret;
+
+		sms_assembly_migrate(ret);
+
+		/* Loading may drop records, collect them first */
+		sms_journal_foreach(ret->journal, sms_assembly_collect,
+								&records);
+		records = g_slist_reverse(records);
+
+		for (l = records; l; l = l->next)
+			sms_assembly_load(ret, l->data);
+
+		g_slist_free_full(records, sms_assembly_record_free);
 
-		path = g_strdup_printf(SMS_BACKUP_PATH, imsi);
-		len = scandir(path, &entries, NULL, alphasort);
-		g_free(path);
+		/*
+		 * Nothing is evicted while loading, the records don't come
+		 * in the order of arrival.  Put the oldest messages first
+		 * and only then apply the limits.
+		 */
+		g_queue_sort(&ret->assembly_queue,
+				sms_assembly_node_compare_ts, NULL);
 
-		if (len < 0)
-			return ret;
+		for (q = ret->assembly_queue.head; q; q = q->next) {
+			struct sms_assembly_node *node = q->data;
 
-		while (len--) {
-			sms_assembly_load(ret, entries[len]);
-			free(entries[len]);
+			node->link = q;
 		}
 
-		free(entries);
+		sms_assembly_evict(ret, NULL);
 	}
 
 	return ret;
@@ -2587,19 +3260,35 @@ struct sms_assembly *sms_assembly_new(const char *imsi)
 
 void sms_assembly_free(struct sms_assembly *assembly)
 {
-	GSList *l;
+	GList *l;
 
-	for (l = assembly->assembly_list; l; l = l->next) {
+	for (l = assembly->assembly_queue.head; l; l = l->next) {
 		struct sms_assembly_node *node = l->data;
 
 		g_slist_free_full(node->fragment_list, g_free);
 		g_free(node);
 	}
 
-	g_slist_free(assembly->assembly_list);
+	g_queue_clear(&assembly->assembly_queue);
+	g_hash_table_destroy(assembly->assembly_table);
+	sms_journal_close(assembly->journal);
 	g_free(assembly);
 }
 
+/*!
+ * Limits the number of partial messages kept, and the memory they use.
+ * When either limit is exceeded the oldest partial messages are dropped,
+ * along with their backup.
+ */
+void sms_assembly_set_limits(struct sms_assembly *assembly,
+				unsigned int max_nodes, size_t max_bytes)
+{
+	assembly->max_nodes = max_nodes;
+	assembly->max_bytes = max_bytes;
+
+	sms_assembly_evict(assembly, NULL);
+}
+
 GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
 					const struct sms *sms, time_t ts,
 					const struct sms_address *addr,
@@ -2617,32 +3306,19 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 {
 	unsigned int offset = seq / 32;
 	unsigned int bit = 1 << (seq % 32);
-	GSList *l;
-	GSList *prev;
 	struct sms *newsms;
+	struct sms_assembly_node lookup;
 	struct sms_assembly_node *node;
 	GSList *completed;
 	unsigned int position;
 	unsigned int i;
-	unsigned int j;
-
-	prev = NULL;
-
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		node = l->data;
 
-		if (node->addr.number_type != addr->number_type)
-			continue;
-
-		if (node->addr.numbering_plan != addr->numbering_plan)
-			continue;
-
-		if (strcmp(node->addr.address, addr->address))
-			continue;
+	memcpy(&lookup.addr, addr, sizeof(struct sms_address));
+	lookup.ref = ref;
 
-		if (ref != node->ref)
-			continue;
+	node = g_hash_table_lookup(assembly->assembly_table, &lookup);
 
+	if (node) {
 		/*
 		 * Message Reference and address the same, but max is not
 		 * ignore the SMS completely
@@ -2655,39 +3331,31 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 			return NULL;
 
 		/*
-		 * Iterate over the bitmap to find in which position
-		 * should the fragment be inserted -- basically we
-		 * walk each bit in the bitmap until the bit we care
-		 * about (offset:bit) and count which are stored --
-		 * that gives us in which position we have to insert.
+		 * The fragment goes after every stored fragment with a
+		 * lower sequence number, so count the bits set in the
+		 * bitmap below offset:bit.
 		 */
 		position = 0;
 		for (i = 0; i < offset; i++)
-			for (j = 0; j < 32; j++)
-				if (node->bitmap[i] & (1 << j))
-					position += 1;
-
-		for (j = 1; j < bit; j = j << 1)
-			if (node->bitmap[offset] & j)
-				position += 1;
+			position += __builtin_popcount(node->bitmap[i]);
 
-		goto out;
-	}
-
-	node = g_new0(struct sms_assembly_node, 1);
-	memcpy(&node->addr, addr, sizeof(struct sms_address));
-	node->ts = ts;
-	node->ref = ref;
-	node->max_fragments = max;
+		position += __builtin_popcount(node->bitmap[offset] &
+						(bit - 1));
+	} else {
+		node = g_new0(struct sms_assembly_node, 1);
+		memcpy(&node->addr, addr, sizeof(struct sms_address));
+		node->ts = ts;
+		node->ref = ref;
+		node->max_fragments = max;
 
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
+		g_hash_table_add(assembly->assembly_table, node);
+		g_queue_push_tail(&assembly->assembly_queue, node);
+		node->link = assembly->assembly_queue.tail;
+		assembly->bytes += sms_assembly_node_size(node);
 
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
+		position = 0;
+	}
 
-out:
 	newsms = g_new(struct sms, 1);
 
 	memcpy(newsms, sms, sizeof(struct sms));
@@ -2695,10 +3363,14 @@ out:
 						newsms, position);
 	node->bitmap[offset] |= bit;
 	node->num_fragments += 1;
+	assembly->bytes += sizeof(struct sms);
 
 	if (node->num_fragments < node->max_fragments) {
-		if (backup)
+		/* Backups being loaded are evicted once they're all in */
+		if (backup) {
 			sms_assembly_store(assembly, node, sms, seq);
+			sms_assembly_evict(assembly, node);
+		}
 
 		return NULL;
 	}
@@ -2706,14 +3378,9 @@ out:
 	completed = node->fragment_list;
 
 	sms_assembly_backup_free(assembly, node);
-
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
+	sms_assembly_unlink(assembly, node);
 
 	g_free(node);
-	g_slist_free_1(l);
 	return completed;
 }
 
@@ -2724,35 +3391,17 @@ out:
  */
 void sms_assembly_expire(struct sms_assembly *assembly, time_t before)
 {
-	GSList *cur;
-	GSList *prev;
-	GSList *tmp;
+	GList *l = assembly->assembly_queue.head;
 
-	prev = NULL;
-	cur = assembly->assembly_list;
+	while (l) {
+		struct sms_assembly_node *node = l->data;
 
-	while (cur) {
-		struct sms_assembly_node *node = cur->data;
+		l = l->next;
 
-		if (node->ts > before) {
-			prev = cur;
-			cur = cur->next;
+		if (node->ts > before)
 			continue;
-		}
-
-		sms_assembly_backup_free(assembly, node);
-
-		g_slist_free_full(node->fragment_list, g_free);
-		g_free(node);
-
-		if (prev)
-			prev->next = cur->next;
-		else
-			assembly->assembly_list = cur->next;
 
-		tmp = cur;
-		cur = cur->next;
-		g_slist_free_1(tmp);
+		sms_assembly_drop(assembly, node);
 	}
 }
 
@@ -3214,73 +3863,402 @@ void status_report_assembly_expire(struct status_report_assembly *assembly,
 	}
 }
 
-static int sms_tx_load_filter(const struct dirent *dent)
+static GHashTable *sms_tx_journals;	/* IMSI => struct sms_journal */
+
+/*
+ * Moves the queue stored by older versions, a directory per message
+ * named after its key and a file per pdu, into the journal.
+ */
+static void sms_tx_backup_migrate(struct sms_journal *journal,
+							const char *imsi)
 {
-	char *endp;
-	guint8 seq __attribute__ ((unused));
+	char *path = g_strdup_printf(SMS_TX_BACKUP_PATH, imsi);
+	DIR *dir = opendir(path);
+	struct dirent *msg;
+	gboolean failed = FALSE;
 
-	if (dent->d_type != DT_REG)
-		return 0;
+	if (dir == NULL)
+		goto out;
 
-	seq = strtol(dent->d_name, &endp, 10);
-	if (*endp != '\0')
-		return 0;
+	while ((msg = readdir(dir)) != NULL) {
+		struct dirent *entry;
+		DIR *pdus;
+		char *msgpath;
+		gboolean msg_failed = FALSE;
 
-	return 1;
+		if (msg->d_type != DT_DIR || !strcmp(msg->d_name, ".") ||
+						!strcmp(msg->d_name, ".."))
+			continue;
+
+		msgpath = g_strdup_printf("%s/%s", path, msg->d_name);
+		pdus = opendir(msgpath);
+		g_free(msgpath);
+
+		if (pdus == NULL) {
+			failed = TRUE;
+			continue;
+		}
+
+		while ((entry = readdir(pdus)) != NULL) {
+			unsigned char buf[177];
+			char *endp;
+			int seq, fd, r;
+
+			if (entry->d_type != DT_REG)
+				continue;
+
+			seq = strtol(entry->d_name, &endp, 10);
+			if (*endp != '\0' || seq < 0 || seq > 255)
+				continue;
+
+			fd = TFR(openat(dirfd(pdus), entry->d_name, O_RDONLY));
+			if (fd == -1) {
+				msg_failed = TRUE;
+				continue;
+			}
+
+			r = TFR(read(fd, buf, sizeof(buf)));
+			TFR(close(fd));
+
+			if (r > 0 && !sms_journal_put(journal, msg->d_name,
+								seq, buf, r))
+				r = -1;
+
+			/* Only what made it into the journal is deleted */
+			if (r < 0) {
+				msg_failed = TRUE;
+				continue;
+			}
+
+			unlinkat(dirfd(pdus), entry->d_name, 0);
+		}
+
+		closedir(pdus);
+
+		/* Only the directories with leftovers are kept */
+		if (msg_failed)
+			failed = TRUE;
+		else
+			unlinkat(dirfd(dir), msg->d_name, AT_REMOVEDIR);
+	}
+
+	closedir(dir);
+
+	if (!failed)
+		rmdir(path);
+
+out:
+	g_free(path);
 }
 
-/*
- * Each directory contains a file per pdu.
- */
-static GSList *sms_tx_load(const char *imsi, const struct dirent *dir)
+static void sms_tx_journal_free(gpointer data)
 {
-	GSList *list = NULL;
-	struct dirent **pdus;
+	sms_journal_close(data);
+}
+
+static struct sms_journal *sms_tx_journal(const char *imsi)
+{
+	struct sms_journal *journal;
 	char *path;
-	int len, r;
-	unsigned char buf[177];
-	struct sms s;
 
-	if (dir->d_type != DT_DIR)
+	if (imsi == NULL)
 		return NULL;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH "/%s", imsi, dir->d_name);
-	len = scandir(path, &pdus, sms_tx_load_filter, versionsort);
+	if (sms_tx_journals == NULL)
+		sms_tx_journals = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, sms_tx_journal_free);
+
+	journal = g_hash_table_lookup(sms_tx_journals, imsi);
+	if (journal)
+		return journal;
+
+	path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, imsi);
+	journal = sms_journal_open(path);
 	g_free(path);
 
-	if (len < 0)
+	if (journal == NULL)
 		return NULL;
 
-	while (len--) {
-		r = read_file(buf, sizeof(buf), SMS_TX_BACKUP_PATH "/%s/%s",
-					imsi, dir->d_name, pdus[len]->d_name);
+	sms_tx_backup_migrate(journal, imsi);
+	g_hash_table_insert(sms_tx_journals, g_strdup(imsi), journal);
 
-		if (r < 0)
-			goto free_pdu;
+	return journal;
+}
 
-		if (sms_deserialize_outgoing(buf, &s, r) == FALSE)
-			goto free_pdu;
+/*
+ * Releases the TX queue backup of this IMSI, the next call to any
+ * of sms_tx_* functions loads it again.
+ */
+void sms_tx_backup_close(const char *imsi)
+{
+	if (sms_tx_journals == NULL || imsi == NULL)
+		return;
 
-		list = g_slist_prepend(list, g_memdup(&s, sizeof(s)));
+	g_hash_table_remove(sms_tx_journals, imsi);
 
-free_pdu:
-		g_free(pdus[len]);
+	if (g_hash_table_size(sms_tx_journals) == 0) {
+		g_hash_table_destroy(sms_tx_journals);
+		sms_tx_journals = NULL;
 	}
+}
+
+enum sms_tx_pdu_state {
+	SMS_TX_PDU_QUEUED = 0,
+	SMS_TX_PDU_SUBMITTING,
+	SMS_TX_PDU_SENT,
+};
+
+struct sms_tx_window_msg {
+	void *data;
+	guint8 num_pdus;
+	guint8 sent;
+	guint8 submitting;
+	guint8 state[];			/* enum sms_tx_pdu_state */
+};
+
+struct sms_tx_window *sms_tx_window_new(unsigned int size, void *user_data)
+{
+	struct sms_tx_window *window = g_new0(struct sms_tx_window, 1);
 
-	g_free(pdus);
+	window->size = size ? size : 1;
+	window->user_data = user_data;
+	g_queue_init(&window->msgs);
 
-	return list;
+	return window;
 }
 
-static int sms_tx_queue_filter(const struct dirent *dirent)
+void sms_tx_window_free(struct sms_tx_window *window)
 {
-	if (dirent->d_type != DT_DIR)
-		return 0;
+	struct sms_tx_window_msg *msg;
 
-	if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
-		return 0;
+	if (window == NULL)
+		return;
 
-	return 1;
+	g_slist_free_full(window->pending, g_free);
+
+	while ((msg = g_queue_pop_head(&window->msgs)))
+		g_free(msg);
+
+	g_free(window);
+}
+
+static GList *sms_tx_window_find(struct sms_tx_window *window, void *data)
+{
+	GList *l;
+
+	for (l = window->msgs.head; l; l = l->next) {
+		struct sms_tx_window_msg *msg = l->data;
+
+		if (msg->data == data)
+			return l;
+	}
+
+	return NULL;
+}
+
+void sms_tx_window_add(struct sms_tx_window *window, void *data,
+							guint8 num_pdus)
+{
+	struct sms_tx_window_msg *msg;
+
+	msg = g_malloc0(sizeof(*msg) + num_pdus);
+	msg->data = data;
+	msg->num_pdus = num_pdus;
+
+	g_queue_push_tail(&window->msgs, msg);
+}
+
+/*
+ * Completions for the PDUs of a removed message still come back, they
+ * are reported as SMS_TX_WINDOW_IGNORED.
+ */
+void sms_tx_window_remove(struct sms_tx_window *window, void *data)
+{
+	GList *l = sms_tx_window_find(window, data);
+	struct sms_tx_window_msg *msg;
+	GSList *sl;
+
+	if (l == NULL)
+		return;
+
+	msg = l->data;
+
+	for (sl = window->pending; sl; sl = sl->next) {
+		struct sms_tx_submit *submit = sl->data;
+
+		if (submit->msg == msg)
+			submit->msg = NULL;
+	}
+
+	g_queue_delete_link(&window->msgs, l);
+	g_free(msg);
+}
+
+/* Whether any PDU of the message has been sent or is in flight */
+gboolean sms_tx_window_started(struct sms_tx_window *window, void *data)
+{
+	GList *l = sms_tx_window_find(window, data);
+	struct sms_tx_window_msg *msg;
+
+	if (l == NULL)
+		return FALSE;
+
+	msg = l->data;
+
+	return msg->sent > 0 || msg->submitting > 0;
+}
+
+/*
+ * Hands out the first PDU in the queue which hasn't been submitted yet,
+ * NULL if the window is full, held or there's nothing to submit.  more
+ * tells whether anything else is waiting behind it.
+ */
+struct sms_tx_submit *sms_tx_window_next(struct sms_tx_window *window,
+						void **data, guint8 *pdu,
+						gboolean *more)
+{
+	struct sms_tx_submit *submit;
+	GList *l;
+
+	if (window->hold || g_slist_length(window->pending) >= window->size)
+		return NULL;
+
+	for (l = window->msgs.head; l; l = l->next) {
+		struct sms_tx_window_msg *msg = l->data;
+		unsigned int i;
+
+		if (msg->sent + msg->submitting >= msg->num_pdus)
+			continue;
+
+		for (i = 0; i < msg->num_pdus; i++)
+			if (msg->state[i] == SMS_TX_PDU_QUEUED)
+				break;
+
+		if (i == msg->num_pdus)
+			continue;
+
+		if (more)
+			*more = l->next != NULL || msg->num_pdus - msg->sent -
+							msg->submitting > 1;
+
+		msg->state[i] = SMS_TX_PDU_SUBMITTING;
+		msg->submitting += 1;
+
+		submit = g_new0(struct sms_tx_submit, 1);
+		submit->window = window;
+		submit->msg = msg;
+		submit->pdu = i;
+		window->pending = g_slist_prepend(window->pending, submit);
+
+		if (data)
+			*data = msg->data;
+
+		if (pdu)
+			*pdu = i;
+
+		return submit;
+	}
+
+	return NULL;
+}
+
+/* Records the result of a submission and frees submit */
+enum sms_tx_window_result sms_tx_window_done(struct sms_tx_submit *submit,
+						gboolean ok, void **data,
+						guint8 *pdu)
+{
+	struct sms_tx_window *window = submit->window;
+	struct sms_tx_window_msg *msg = submit->msg;
+	guint8 i = submit->pdu;
+
+	window->pending = g_slist_remove(window->pending, submit);
+	g_free(submit);
+
+	if (data)
+		*data = msg ? msg->data : NULL;
+
+	if (pdu)
+		*pdu = i;
+
+	if (msg == NULL)
+		return SMS_TX_WINDOW_IGNORED;
+
+	msg->submitting -= 1;
+
+	if (!ok) {
+		msg->state[i] = SMS_TX_PDU_QUEUED;
+		return SMS_TX_WINDOW_FAILED;
+	}
+
+	msg->state[i] = SMS_TX_PDU_SENT;
+	msg->sent += 1;
+
+	return msg->sent < msg->num_pdus ? SMS_TX_WINDOW_SENT :
+						SMS_TX_WINDOW_DONE;
+}
+
+struct sms_tx_load_entry {
+	char *key;
+	unsigned long id;
+	unsigned long flags;
+	char uuid[SMS_MSGID_LEN * 2 + 1];
+	GSList *msg_list;
+};
+
+static void sms_tx_load_entry_free(gpointer data)
+{
+	struct sms_tx_load_entry *entry = data;
+
+	g_slist_free_full(entry->msg_list, g_free);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+/* Builds the list of messages, pdus come sorted by seq within a key */
+static void sms_tx_load(const char *key, guint8 seq,
+				const unsigned char *data, guint16 len,
+				void *user_data)
+{
+	GSList **entries = user_data;
+	struct sms_tx_load_entry *entry = *entries ? (*entries)->data : NULL;
+	struct sms s;
+
+	if (entry == NULL || strcmp(entry->key, key)) {
+		char endc;
+
+		entry = g_new0(struct sms_tx_load_entry, 1);
+		entry->key = g_strdup(key);
+		*entries = g_slist_prepend(*entries, entry);
+
+		/* Entries with malformed keys stay empty and get dropped */
+		if (sscanf(key, "%lu-%lu-" SMS_MSGID_FMT "%c", &entry->id,
+				&entry->flags, entry->uuid, &endc) != 3 ||
+				strlen(entry->uuid) != 2 * SMS_MSGID_LEN)
+			entry->uuid[0] = 0;
+	}
+
+	if (entry->uuid[0] == 0)
+		return;
+
+	if (sms_deserialize_outgoing(data, &s, len) == FALSE)
+		return;
+
+	entry->msg_list = g_slist_append(entry->msg_list,
+						g_memdup(&s, sizeof(s)));
+}
+
+static gint sms_tx_load_compare(gconstpointer a, gconstpointer b)
+{
+	const struct sms_tx_load_entry *e1 = a;
+	const struct sms_tx_load_entry *e2 = b;
+
+	if (e1->id != e2->id)
+		return e1->id < e2->id ? -1 : 1;
+
+	if (e1->flags != e2->flags)
+		return e1->flags < e2->flags ? -1 : 1;
+
+	return strcmp(e1->uuid, e2->uuid);
 }
 
 /*
@@ -3289,76 +4267,53 @@ static int sms_tx_queue_filter(const struct dirent *dirent)
  */
 GQueue *sms_tx_queue_load(const char *imsi)
 {
-	GQueue *retq = 0;
-	char *path;
-	struct dirent **entries;
-	int len;
-	int i;
+	struct sms_journal *journal = sms_tx_journal(imsi);
+	GSList *entries = NULL;
+	GQueue *retq;
+	GSList *l;
 	unsigned long id;
 
-	if (imsi == NULL)
+	if (journal == NULL)
 		return NULL;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH, imsi);
-
-	len = scandir(path, &entries, sms_tx_queue_filter, versionsort);
-	if (len < 0)
-		goto nodir_exit;
+	sms_journal_foreach(journal, sms_tx_load, &entries);
+	entries = g_slist_sort(entries, sms_tx_load_compare);
 
 	retq = g_queue_new();
 
-	for (i = 0, id = 0; i < len; i++) {
-		char uuid[SMS_MSGID_LEN * 2 + 1];
-		GSList *msg_list;
-		unsigned long oldid;
-		unsigned long flags;
-		char *oldpath, *newpath;
-		struct txq_backup_entry *entry;
-		struct dirent *dir = entries[i];
-		char endc;
-
-		if (sscanf(dir->d_name, "%lu-%lu-" SMS_MSGID_FMT "%c",
-					&oldid, &flags, uuid, &endc) != 3)
-			continue;
-
-		if (strlen(uuid) !=  2 * SMS_MSGID_LEN)
-			continue;
+	for (l = entries, id = 0; l; l = l->next) {
+		struct sms_tx_load_entry *entry = l->data;
+		struct txq_backup_entry *backup;
+		char *newkey;
 
-		msg_list = sms_tx_load(imsi, dir);
-		if (msg_list == NULL)
+		if (entry->msg_list == NULL) {
+			sms_journal_drop(journal, entry->key);
 			continue;
+		}
 
-		entry = g_new0(struct txq_backup_entry, 1);
-		entry->msg_list = msg_list;
-		entry->flags = flags;
-		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
+		backup = g_new0(struct txq_backup_entry, 1);
+		backup->msg_list = entry->msg_list;
+		backup->flags = entry->flags;
+		decode_hex_own_buf(entry->uuid, -1, NULL, 0, backup->uuid);
+		entry->msg_list = NULL;
 
-		g_queue_push_tail(retq, entry);
+		g_queue_push_tail(retq, backup);
 
 		/* Don't bother re-shuffling the ids if they are the same */
-		if (oldid == id) {
+		if (entry->id == id) {
 			id++;
 			continue;
 		}
 
-		oldpath = g_strdup_printf("%s/%s", path, dir->d_name);
-		newpath = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-						imsi, id++, flags, uuid);
-
-		/* rename directory to reflect new position in queue */
-		rename(oldpath, newpath);
-
-		g_free(newpath);
-		g_free(oldpath);
+		/* Rename the entry to reflect new position in queue */
+		newkey = g_strdup_printf(SMS_TX_BACKUP_KEY, id++,
+						entry->flags, entry->uuid);
+		sms_journal_rename(journal, entry->key, newkey);
+		g_free(newkey);
 	}
 
-	for (i = 0; i < len; i++)
-		g_free(entries[i]);
-
-	g_free(entries);
+	g_slist_free_full(entries, sms_tx_load_entry_free);
 
-nodir_exit:
-	g_free(path);
 	return retq;
 }
 
@@ -3367,73 +4322,49 @@ gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
 				guint8 seq, const unsigned char *pdu,
 				int pdu_len, int tpdu_len)
 {
+	struct sms_journal *journal = sms_tx_journal(imsi);
 	unsigned char buf[177];
-	int len;
+	char key[SMS_JOURNAL_MAX_KEY + 1];
 
-	if (!imsi)
+	if (journal == NULL)
 		return FALSE;
 
 	memcpy(buf + 1, pdu, pdu_len);
 	buf[0] = tpdu_len;
-	len = pdu_len + 1;
 
 	/*
-	 * file name is: imsi/tx_queue/order-flags-uuid/pdu
+	 * key is: order-flags-uuid
 	 */
-	if (write_file(buf, len, SMS_BACKUP_MODE, SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq) != len)
-		return FALSE;
+	snprintf(key, sizeof(key), SMS_TX_BACKUP_KEY, id, flags, uuid);
 
-	return TRUE;
+	return sms_journal_put(journal, key, seq, buf, pdu_len + 1);
 }
 
 void sms_tx_backup_free(const char *imsi, unsigned long id,
 				unsigned long flags, const char *uuid)
 {
-	char *path;
-	struct dirent **entries;
-	int len;
-
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-					imsi, id, flags, uuid);
-
-	len = scandir(path, &entries, NULL, versionsort);
-
-	if (len < 0)
-		goto nodir_exit;
-
-	/* skip '..' and '.' entries */
-	while (len-- > 2) {
-		struct dirent *dir = entries[len];
-		char *file = g_strdup_printf("%s/%s", path, dir->d_name);
-
-		unlink(file);
-		g_free(file);
-
-		g_free(entries[len]);
-	}
-
-	g_free(entries[1]);
-	g_free(entries[0]);
-	g_free(entries);
+	struct sms_journal *journal = sms_tx_journal(imsi);
+	char key[SMS_JOURNAL_MAX_KEY + 1];
 
-	rmdir(path);
+	if (journal == NULL)
+		return;
 
-nodir_exit:
-	g_free(path);
+	snprintf(key, sizeof(key), SMS_TX_BACKUP_KEY, id, flags, uuid);
+	sms_journal_drop(journal, key);
 }
 
 void sms_tx_backup_remove(const char *imsi, unsigned long id,
 				unsigned long flags, const char *uuid,
 				guint8 seq)
 {
-	char *path;
+	struct sms_journal *journal = sms_tx_journal(imsi);
+	char key[SMS_JOURNAL_MAX_KEY + 1];
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq);
-	unlink(path);
+	if (journal == NULL)
+		return;
 
-	g_free(path);
+	snprintf(key, sizeof(key), SMS_TX_BACKUP_KEY, id, flags, uuid);
+	sms_journal_remove(journal, key, seq);
 }
 
 static inline GSList *sms_list_append(GSList *l, const struct sms *in)
@@ -385,15 +385,26 @@ struct sms_assembly_node {
 	struct sms_address addr;
 	time_t ts;
 	GSList *fragment_list;
+	GList *link;
 	guint16 ref;
 	guint8 max_fragments;
 	guint8 num_fragments;
 	unsigned int bitmap[8];
 };
 
+#define SMS_ASSEMBLY_DEFAULT_MAX_NODES 4096
+#define SMS_ASSEMBLY_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+struct sms_journal;
+
 struct sms_assembly {
 	const char *imsi;
-	GSList *assembly_list;
+	struct sms_journal *journal;	/* Backup of the fragments */
+	GHashTable *assembly_table;	/* Keyed by address and reference */
+	GQueue assembly_queue;		/* Oldest first, for eviction */
+	unsigned int max_nodes;
+	size_t max_bytes;
+	size_t bytes;
 };
 
 struct id_table_node {
@@ -409,6 +420,35 @@ struct status_report_assembly {
 	GHashTable *assembly_table;
 };
 
+enum sms_tx_window_result {
+	SMS_TX_WINDOW_IGNORED,		/* The message has been removed */
+	SMS_TX_WINDOW_FAILED,		/* The PDU is queued again */
+	SMS_TX_WINDOW_SENT,		/* More PDUs of the message remain */
+	SMS_TX_WINDOW_DONE,		/* The whole message is sent */
+};
+
+struct sms_tx_window_msg;
+
+/* One for each PDU handed over for submission */
+struct sms_tx_submit {
+	struct sms_tx_window *window;
+	struct sms_tx_window_msg *msg;	/* NULL once removed */
+	guint8 pdu;
+};
+
+/*
+ * Keeps track of the PDUs of queued messages, handing them out for
+ * submission in order with up to size of them in flight at a time.
+ * Nothing is handed out while hold is set.
+ */
+struct sms_tx_window {
+	unsigned int size;
+	gboolean hold;
+	GQueue msgs;			/* struct sms_tx_window_msg */
+	GSList *pending;		/* struct sms_tx_submit */
+	void *user_data;
+};
+
 struct cbs {
 	enum cbs_geo_scope gs;			/* 2 bits */
 	guint16 message_code;			/* 10 bits */
@@ -533,6 +573,8 @@ char *sms_decode_text(GSList *sms_list);
 
 struct sms_assembly *sms_assembly_new(const char *imsi);
 void sms_assembly_free(struct sms_assembly *assembly);
+void sms_assembly_set_limits(struct sms_assembly *assembly,
+				unsigned int max_nodes, size_t max_bytes);
 GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
 					const struct sms *sms, time_t ts,
 					const struct sms_address *addr,
@@ -564,6 +606,20 @@ void sms_tx_backup_remove(const char *imsi, unsigned long id,
 void sms_tx_backup_free(const char *imsi, unsigned long id,
 				unsigned long flags, const char *uuid);
 GQueue *sms_tx_queue_load(const char *imsi);
+void sms_tx_backup_close(const char *imsi);
+
+struct sms_tx_window *sms_tx_window_new(unsigned int size, void *user_data);
+void sms_tx_window_free(struct sms_tx_window *window);
+void sms_tx_window_add(struct sms_tx_window *window, void *data,
+							guint8 num_pdus);
+void sms_tx_window_remove(struct sms_tx_window *window, void *data);
+gboolean sms_tx_window_started(struct sms_tx_window *window, void *data);
+struct sms_tx_submit *sms_tx_window_next(struct sms_tx_window *window,
+						void **data, guint8 *pdu,
+						gboolean *more);
+enum sms_tx_window_result sms_tx_window_done(struct sms_tx_submit *submit,
+						gboolean ok, void **data,
+						guint8 *pdu);
 
 GSList *sms_text_prepare(const char *to, const char *utf8, guint16 ref,
 				gboolean use_16bit,
@@ -180,18 +180,135 @@ error_create_dirs:
 	return r;
 }
 
+/*
+ * storage_sync() doesn't write the file right away.  The keyfile is
+ * remembered per path and written out once the sync delay has passed
+ * since the first unsaved change, so that a burst of property changes
+ * costs one rewrite of the file.  Opening a store, saving it on
+ * close, SIM removal and shutdown write out whatever is pending.  The
+ * pending entry holds a reference to the keyfile, it stays valid after
+ * the store has been closed.
+ */
+struct storage_pending {
+	char *path;
+	GKeyFile *keyfile;
+};
+
+static GHashTable *pending_table;
+static guint pending_flush_id;
+static unsigned int sync_delay = STORAGE_SYNC_DELAY_DEFAULT;
+static struct storage_stats stats;
+
+static char *storage_path(const char *imsi, const char *store)
+{
+	if (imsi)
+		return g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
+	else
+		return g_strdup_printf(STORAGEDIR "/%s", store);
+}
+
+static void storage_write(const char *path, GKeyFile *keyfile)
+{
+	gint64 start = g_get_monotonic_time();
+	gint64 elapsed;
+	char *data;
+	gsize length = 0;
+
+	if (create_dirs(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
+		stats.failures++;
+		return;
+	}
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+
+	if (!g_file_set_contents(path, data, length, NULL))
+		stats.failures++;
+
+	g_free(data);
+
+	elapsed = g_get_monotonic_time() - start;
+
+	stats.writes++;
+	stats.total_usec += elapsed;
+
+	if ((guint64) elapsed > stats.max_usec)
+		stats.max_usec = elapsed;
+}
+
+static void storage_pending_free(gpointer data)
+{
+	struct storage_pending *pending = data;
+
+	g_key_file_unref(pending->keyfile);
+	g_free(pending->path);
+	g_free(pending);
+}
+
+static struct storage_pending *storage_pending_lookup(const char *path)
+{
+	if (pending_table == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(pending_table, path);
+}
+
+static void storage_pending_write(struct storage_pending *pending)
+{
+	storage_write(pending->path, pending->keyfile);
+	g_hash_table_remove(pending_table, pending->path);
+}
+
+static gboolean storage_flush_cb(gpointer user_data)
+{
+	pending_flush_id = 0;
+	storage_flush();
+
+	return FALSE;
+}
+
+void storage_flush(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (pending_flush_id) {
+		g_source_remove(pending_flush_id);
+		pending_flush_id = 0;
+	}
+
+	if (pending_table == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, pending_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct storage_pending *pending = value;
+
+		storage_write(pending->path, pending->keyfile);
+		g_hash_table_iter_remove(&iter);
+	}
+}
+
+void storage_get_stats(struct storage_stats *out)
+{
+	*out = stats;
+}
+
 GKeyFile *storage_open(const char *imsi, const char *store)
 {
+	struct storage_pending *pending;
 	GKeyFile *keyfile;
 	char *path;
 
 	if (store == NULL)
 		return NULL;
 
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
+	path = storage_path(imsi, store);
+
+	/* The file on disk has to be current before it's read back */
+	pending = storage_pending_lookup(path);
+	if (pending)
+		storage_pending_write(pending);
 
 	keyfile = g_key_file_new();
 
@@ -205,36 +322,85 @@ GKeyFile *storage_open(const char *imsi, const char *store)
 
 void storage_sync(const char *imsi, const char *store, GKeyFile *keyfile)
 {
+	struct storage_pending *pending;
 	char *path;
-	char *data;
-	gsize length = 0;
-
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
 
+	path = storage_path(imsi, store);
 	if (path == NULL)
 		return;
 
-	if (create_dirs(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
+	stats.syncs++;
+
+	if (sync_delay == 0) {
+		storage_write(path, keyfile);
 		g_free(path);
 		return;
 	}
 
-	data = g_key_file_to_data(keyfile, &length, NULL);
+	if (pending_table == NULL)
+		pending_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, storage_pending_free);
 
-	g_file_set_contents(path, data, length, NULL);
+	pending = g_hash_table_lookup(pending_table, path);
 
-	g_free(data);
-	g_free(path);
+	if (pending) {
+		/*
+		 * Another keyfile may have been synced to the same path
+		 * earlier, the last one synced is what ends up on disk.
+		 */
+		if (pending->keyfile != keyfile) {
+			g_key_file_unref(pending->keyfile);
+			pending->keyfile = g_key_file_ref(keyfile);
+		}
+
+		g_free(path);
+	} else {
+		pending = g_new0(struct storage_pending, 1);
+		pending->path = path;
+		pending->keyfile = g_key_file_ref(keyfile);
+		g_hash_table_insert(pending_table, pending->path, pending);
+	}
+
+	if (pending_flush_id == 0)
+		pending_flush_id = g_timeout_add(sync_delay,
+						storage_flush_cb, NULL);
 }
 
 void storage_close(const char *imsi, const char *store, GKeyFile *keyfile,
 			gboolean save)
 {
-	if (save == TRUE)
-		storage_sync(imsi, store, keyfile);
+	struct storage_pending *pending;
+	char *path = storage_path(imsi, store);
+
+	pending = storage_pending_lookup(path);
+
+	if (save == TRUE) {
+		/* Whatever is pending for this path is superseded */
+		if (pending)
+			g_hash_table_remove(pending_table, path);
+
+		storage_write(path, keyfile);
+	}
+
+	/*
+	 * Not freed, only unreferenced: a pending sync still holds the
+	 * keyfile and writes it out later.
+	 */
+	g_free(path);
+	g_key_file_unref(keyfile);
+}
+
+void __ofono_storage_init(unsigned int delay_ms)
+{
+	sync_delay = delay_ms;
+}
 
-	g_key_file_free(keyfile);
+void __ofono_storage_cleanup(void)
+{
+	storage_flush();
+
+	if (pending_table) {
+		g_hash_table_destroy(pending_table);
+		pending_table = NULL;
+	}
 }
@@ -43,7 +43,20 @@ ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
 			const char *path_fmt, ...)
 	__attribute__((format(printf, 4, 5)));
 
+/* Milliseconds storage_sync() waits for more changes before writing */
+#define STORAGE_SYNC_DELAY_DEFAULT 1000
+
+struct storage_stats {
+	unsigned int syncs;		/* storage_sync() calls */
+	unsigned int writes;		/* Files actually written */
+	unsigned int failures;		/* Writes that didn't make it */
+	guint64 total_usec;		/* Time spent writing */
+	guint64 max_usec;		/* Longest single write */
+};
+
 GKeyFile *storage_open(const char *imsi, const char *store);
 void storage_sync(const char *imsi, const char *store, GKeyFile *keyfile);
 void storage_close(const char *imsi, const char *store, GKeyFile *keyfile,
 			gboolean save);
+void storage_flush(void);
+void storage_get_stats(struct storage_stats *stats);
@@ -27,7 +27,6 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 
 #include <glib.h>
@@ -2664,12 +2663,6 @@ static unsigned short codepoint_lookup(struct codepoint *key,
 	return result ? result->to : GUND;
 }
 
-static unsigned short gsm_locking_shift_lookup(struct conversion_table *t,
-						unsigned char k)
-{
-	return t->locking_g[k];
-}
-
 static unsigned short gsm_single_shift_lookup(struct conversion_table *t,
 						unsigned char k)
 {
@@ -2677,20 +2670,6 @@ static unsigned short gsm_single_shift_lookup(struct conversion_table *t,
 	return codepoint_lookup(&key, t->single_g, t->single_len_g);
 }
 
-static unsigned short unicode_locking_shift_lookup(struct conversion_table *t,
-							unsigned short k)
-{
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->locking_u, t->locking_len_u);
-}
-
-static unsigned short unicode_single_shift_lookup(struct conversion_table *t,
-							unsigned short k)
-{
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->single_u, t->single_len_u);
-}
-
 static bool populate_locking_shift(struct conversion_table *t,
 					enum gsm_dialect lang)
 {
@@ -2894,6 +2873,97 @@ static bool conversion_table_init(struct conversion_table *t,
 			populate_single_shift(t, single);
 }
 
+#define GSM_DIALECTS (GSM_DIALECT_URDU + 1)
+
+/*
+ * Direct-indexed form of a conversion_table.  Unicode to GSM goes through
+ * pages of 256 code points, with single shift codes stored as 0x1bXX.
+ * The ascii arrays flag the characters that map to themselves, which are
+ * copied over in runs.
+ */
+struct gsm_codec {
+	unsigned short locking_g[128];
+	unsigned short single_g[128];
+	unsigned short *pages[256];
+	unsigned char gsm_is_ascii[128];
+	unsigned char ascii_is_gsm[128];
+};
+
+static unsigned short gsm_codec_to_gsm(const struct gsm_codec *codec,
+					gunichar c)
+{
+	const unsigned short *page;
+
+	if (c > 0xffff)
+		return GUND;
+
+	page = codec->pages[c >> 8];
+	if (page == NULL)
+		return GUND;
+
+	return page[c & 0xff];
+}
+
+static void gsm_codec_add(struct gsm_codec *codec,
+				const struct codepoint *table, unsigned int len)
+{
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < len; i++) {
+		unsigned short **page = &codec->pages[table[i].from >> 8];
+
+		if (*page == NULL) {
+			*page = g_new(unsigned short, 256);
+
+			for (j = 0; j < 256; j++)
+				(*page)[j] = GUND;
+		}
+
+		(*page)[table[i].from & 0xff] = table[i].to;
+	}
+}
+
+/* Tables are built on first use of a dialect pair and kept from then on */
+static const struct gsm_codec *gsm_codec_get(enum gsm_dialect locking,
+						enum gsm_dialect single)
+{
+	static struct gsm_codec *codecs[GSM_DIALECTS][GSM_DIALECTS];
+	struct conversion_table t;
+	struct gsm_codec *codec;
+	unsigned int c;
+
+	if ((unsigned int) locking >= GSM_DIALECTS ||
+			(unsigned int) single >= GSM_DIALECTS)
+		return NULL;
+
+	if (codecs[locking][single])
+		return codecs[locking][single];
+
+	if (!conversion_table_init(&t, locking, single))
+		return NULL;
+
+	codec = g_new0(struct gsm_codec, 1);
+
+	for (c = 0; c < 128; c++) {
+		codec->locking_g[c] = t.locking_g[c];
+		codec->single_g[c] = gsm_single_shift_lookup(&t, c);
+	}
+
+	/* Locking shift goes last, it takes precedence over single shift */
+	gsm_codec_add(codec, t.single_u, t.single_len_u);
+	gsm_codec_add(codec, t.locking_u, t.locking_len_u);
+
+	for (c = 0; c < 128; c++) {
+		codec->gsm_is_ascii[c] = c != 0x1b && codec->locking_g[c] == c;
+		codec->ascii_is_gsm[c] = gsm_codec_to_gsm(codec, c) == c;
+	}
+
+	codecs[locking][single] = codec;
+
+	return codec;
+}
+
 /*!
  * Converts text coded using GSM codec into UTF8 encoded text, using
  * the given language identifiers for single shift and locking shift
@@ -2918,9 +2988,10 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 	long i = 0;
 	long res_length;
 
-	struct conversion_table t;
+	const struct gsm_codec *t;
 
-	if (!conversion_table_init(&t, locking_lang, single_lang))
+	t = gsm_codec_get(locking_lang, single_lang);
+	if (t == NULL)
 		return NULL;
 
 	if (len < 0 && !terminator)
@@ -2943,10 +3014,10 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 
 		if (text[i] == 0x1b) {
 			++i;
-			if (i >= len)
+			if (i >= len || text[i] > 0x7f)
 				goto error;
 
-			c = gsm_single_shift_lookup(&t, text[i]);
+			c = t->single_g[text[i]];
 
 			/*
 			 * According to the comment in the table from
@@ -2961,9 +3032,9 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 			 * in subclause 6.2.1.2.3 is used."
 			 */
 			if (c == GUND)
-				c = gsm_locking_shift_lookup(&t, text[i]);
+				c = t->locking_g[text[i]];
 		} else
-			c = gsm_locking_shift_lookup(&t, text[i]);
+			c = t->locking_g[text[i]];
 
 		res_length += UTF8_LENGTH(c);
 	}
@@ -2975,16 +3046,28 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 	out = res;
 
 	i = 0;
-	while (out < res + res_length) {
+	while (i < len) {
 		unsigned short c;
+		long run = i;
+
+		/* Characters that are plain ASCII either way are copied */
+		while (run < len && t->gsm_is_ascii[text[run]])
+			run++;
+
+		if (run > i) {
+			memcpy(out, text + i, run - i);
+			out += run - i;
+			i = run;
+			continue;
+		}
 
 		if (text[i] == 0x1b) {
-			c = gsm_single_shift_lookup(&t, text[++i]);
+			c = t->single_g[text[++i]];
 
 			if (c == GUND)
-				c = gsm_locking_shift_lookup(&t, text[i]);
+				c = t->locking_g[text[i]];
 		} else
-			c = gsm_locking_shift_lookup(&t, text[i]);
+			c = t->locking_g[text[i]];
 
 		out += g_unichar_to_utf8(c, out);
 
@@ -3030,7 +3113,7 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 					enum gsm_dialect locking_lang,
 					enum gsm_dialect single_lang)
 {
-	struct conversion_table t;
+	const struct gsm_codec *t;
 	long nchars = 0;
 	const char *in;
 	unsigned char *out;
@@ -3038,7 +3121,8 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 	long res_len;
 	long i;
 
-	if (!conversion_table_init(&t, locking_lang, single_lang))
+	t = gsm_codec_get(locking_lang, single_lang);
+	if (t == NULL)
 		return NULL;
 
 	in = text;
@@ -3046,19 +3130,18 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 
 	while ((len < 0 || text + len - in > 0) && *in) {
 		long max = len < 0 ? 6 : text + len - in;
-		gunichar c = g_utf8_get_char_validated(in, max);
 		unsigned short converted = GUND;
+		gunichar c;
 
-		if (c & 0x80000000)
-			goto err_out;
+		if (*in & 0x80) {
+			c = g_utf8_get_char_validated(in, max);
 
-		if (c > 0xffff)
-			goto err_out;
-
-		converted = unicode_locking_shift_lookup(&t, c);
+			if (c & 0x80000000)
+				goto err_out;
+		} else
+			c = *in;
 
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
+		converted = gsm_codec_to_gsm(t, c);
 
 		if (converted == GUND)
 			goto err_out;
@@ -3080,13 +3163,24 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 	out = res;
 	for (i = 0; i < nchars; i++) {
 		unsigned short converted;
+		gunichar c;
+		long run = 0;
+
+		/* Characters that are plain ASCII either way are copied */
+		while (i + run < nchars && !(in[run] & 0x80) &&
+				t->ascii_is_gsm[(unsigned char) in[run]])
+			run++;
+
+		if (run > 0) {
+			memcpy(out, in, run);
+			out += run;
+			in += run;
+			i += run - 1;
+			continue;
+		}
 
-		gunichar c = g_utf8_get_char(in);
-
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
+		c = g_utf8_get_char(in);
+		converted = gsm_codec_to_gsm(t, c);
 
 		if (converted & 0x1b00) {
 			*out = 0x1b;
@@ -3188,6 +3282,76 @@ out:
 	return encoded;
 }
 
+#define ONES64 0x0101010101010101ULL
+#define HIGH64 0x8080808080808080ULL
+
+/* High bit of each byte set where that byte is >= n, bytes must be < 0x80 */
+#define BYTES_GE(x, n) ((((x) | HIGH64) - (n) * ONES64) & HIGH64)
+
+static const unsigned char *hex_value_table(void)
+{
+	static unsigned char table[256];
+	int c;
+
+	if (table[0] == 0) {
+		memset(table, 0xff, sizeof(table));
+
+		for (c = 0; c < 10; c++)
+			table['0' + c] = c;
+
+		for (c = 0; c < 6; c++) {
+			table['A' + c] = 10 + c;
+			table['a' + c] = 10 + c;
+		}
+	}
+
+	return table;
+}
+
+/*
+ * Decodes 16 hex digits into 8 bytes, working on 8 digits per word.
+ * Returns false if any of them is not a hex digit.
+ */
+static bool decode_hex_16(const char *in, unsigned char *out)
+{
+	int half;
+
+	for (half = 0; half < 2; half++) {
+		guint64 x;
+		guint64 lower;
+		guint64 digit;
+		guint64 alpha;
+		guint32 bytes;
+
+		memcpy(&x, in + half * 8, 8);
+		x = GUINT64_FROM_LE(x);
+
+		if (x & HIGH64)
+			return false;
+
+		lower = x | (0x20 * ONES64);
+		digit = BYTES_GE(x, '0') & ~BYTES_GE(x, '9' + 1);
+		alpha = BYTES_GE(lower, 'a') & ~BYTES_GE(lower, 'f' + 1);
+
+		if ((digit | alpha) != HIGH64)
+			return false;
+
+		/* Nibble values, one per byte */
+		x = (x & (0x0f * ONES64)) + (alpha >> 7) * 9;
+
+		/* Pair them up, first digit is the high nibble */
+		x = ((x & 0x000f000f000f000fULL) << 4) |
+					((x >> 8) & 0x000f000f000f000fULL);
+		x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+		x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+
+		bytes = GUINT32_TO_LE((guint32) x);
+		memcpy(out + half * 4, &bytes, 4);
+	}
+
+	return true;
+}
+
 /*!
  * Decodes the hex encoded data and converts to a byte array.  If terminator
  * is not 0, the terminator character is appended to the end of the result.
@@ -3202,37 +3366,28 @@ unsigned char *decode_hex_own_buf(const char *in, long len, long *items_written,
 					unsigned char terminator,
 					unsigned char *buf)
 {
+	const unsigned char *table = hex_value_table();
 	long i, j;
-	char c;
-	unsigned char b;
+	unsigned char hi;
+	unsigned char lo;
 
 	if (len < 0)
 		len = strlen(in);
 
 	len &= ~0x1;
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = toupper(in[i]);
-
-		if (c >= '0' && c <= '9')
-			b = c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = 10 + c - 'A';
-		else
+	for (i = 0, j = 0; len - i >= 16; i += 16, j += 8)
+		if (!decode_hex_16(in + i, buf + j))
 			return NULL;
 
-		i += 1;
-
-		c = toupper(in[i]);
+	for (; i < len; i += 2, j++) {
+		hi = table[(unsigned char) in[i]];
+		lo = table[(unsigned char) in[i + 1]];
 
-		if (c >= '0' && c <= '9')
-			b = b * 16 + c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = b * 16 + 10 + c - 'A';
-		else
+		if ((hi | lo) & 0xf0)
 			return NULL;
 
-		buf[j] = b;
+		buf[j] = (hi << 4) | lo;
 	}
 
 	if (terminator)
@@ -3247,8 +3402,6 @@ unsigned char *decode_hex_own_buf(const char *in, long len, long *items_written,
 unsigned char *decode_hex(const char *in, long len, long *items_written,
 				unsigned char terminator)
 {
-	long i;
-	char c;
 	unsigned char *buf;
 
 	if (len < 0)
@@ -3256,18 +3409,37 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 
 	len &= ~0x1;
 
-	for (i = 0; i < len; i++) {
-		c = toupper(in[i]);
+	buf = g_new(unsigned char, (len >> 1) + (terminator ? 1 : 0));
 
-		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))
-			continue;
+	if (decode_hex_own_buf(in, len, items_written, terminator, buf))
+		return buf;
 
-		return NULL;
-	}
+	g_free(buf);
+	return NULL;
+}
 
-	buf = g_new(unsigned char, (len >> 1) + (terminator ? 1 : 0));
+/* Encodes 4 bytes into 8 upper case hex digits */
+static void encode_hex_4(const unsigned char *in, char *out)
+{
+	guint32 bytes;
+	guint64 x;
+	guint64 letter;
 
-	return decode_hex_own_buf(in, len, items_written, terminator, buf);
+	memcpy(&bytes, in, 4);
+	x = GUINT32_FROM_LE(bytes);
+
+	/* Spread the bytes to 16 bit lanes, high nibble first */
+	x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+	x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+	x = ((x >> 4) & 0x000f000f000f000fULL) |
+				((x & 0x000f000f000f000fULL) << 8);
+
+	/* '0' + n, skipping ahead to 'A' where n > 9 */
+	letter = ((x + 0x06 * ONES64) >> 4) & ONES64;
+	x += '0' * ONES64 + letter * 7;
+
+	x = GUINT64_TO_LE(x);
+	memcpy(out, &x, 8);
 }
 
 /*!
@@ -3279,8 +3451,8 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 char *encode_hex_own_buf(const unsigned char *in, long len,
 				unsigned char terminator, char *buf)
 {
+	static const char digits[] = "0123456789ABCDEF";
 	long i, j;
-	char c;
 
 	if (len < 0) {
 		i = 0;
@@ -3291,22 +3463,12 @@ char *encode_hex_own_buf(const unsigned char *in, long len,
 		len = i;
 	}
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = (in[i] >> 4) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
+	for (i = 0, j = 0; len - i >= 4; i += 4, j += 8)
+		encode_hex_4(in + i, buf + j);
 
-		j += 1;
-
-		c = (in[i]) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
+	for (; i < len; i++) {
+		buf[j++] = digits[in[i] >> 4];
+		buf[j++] = digits[in[i] & 0xf];
 	}
 
 	buf[j] = '\0';
@@ -3333,6 +3495,46 @@ char *encode_hex(const unsigned char *in, long len, unsigned char terminator)
 	return encode_hex_own_buf(in, len, terminator, buf);
 }
 
+/* Unpacks the 8 septets held in 7 octets */
+static void unpack_septets(const unsigned char *in, unsigned char *out)
+{
+	guint64 x = 0;
+	guint64 septets;
+
+	memcpy(&x, in, 7);
+	x = GUINT64_FROM_LE(x);
+
+	septets = (x & 0x7f) |
+		((x >> 7) & 0x7f) << 8 |
+		((x >> 14) & 0x7f) << 16 |
+		((x >> 21) & 0x7f) << 24 |
+		((x >> 28) & 0x7f) << 32 |
+		((x >> 35) & 0x7f) << 40 |
+		((x >> 42) & 0x7f) << 48 |
+		((x >> 49) & 0x7f) << 56;
+
+	septets = GUINT64_TO_LE(septets);
+	memcpy(out, &septets, 8);
+}
+
+/* Packs 8 septets into 7 octets */
+static void pack_septets(const unsigned char *in, unsigned char *out)
+{
+	guint64 x;
+
+	x = (guint64) in[0] |
+		(guint64) in[1] << 7 |
+		(guint64) in[2] << 14 |
+		(guint64) in[3] << 21 |
+		(guint64) in[4] << 28 |
+		(guint64) in[5] << 35 |
+		(guint64) in[6] << 42 |
+		(guint64) (in[7] & 0x7f) << 49;
+
+	x = GUINT64_TO_LE(x);
+	memcpy(out, &x, 7);
+}
+
 unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 					int byte_offset, bool ussd,
 					long max_to_unpack, long *items_written,
@@ -3352,6 +3554,20 @@ unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 		max_to_unpack = len * 8 / 7;
 
 	for (i = 0; (i < len) && ((out-buf) < max_to_unpack); i++) {
+		/*
+		 * On a septet boundary, 7 octets hold 8 characters.  Take
+		 * as many of those groups in one go as fit.
+		 */
+		while (bits == 7 && len - i >= 7 &&
+				max_to_unpack - (out - buf) >= 8) {
+			unpack_septets(in + i, out);
+			i += 7;
+			out += 8;
+		}
+
+		if (i == len || (out - buf) == max_to_unpack)
+			break;
+
 		/* Grab what we have in the current octet */
 		*out = (in[i] & ((1 << bits) - 1)) << (7 - bits);
 
@@ -3454,6 +3670,16 @@ unsigned char *pack_7bit_own_buf(const unsigned char *in, long len,
 	}
 
 	for (i = 0; i < len; i++) {
+		/* On an octet boundary, pack whole groups of 8 characters */
+		while (bits == 7 && len - i >= 8) {
+			pack_septets(in + i, out);
+			i += 8;
+			out += 7;
+		}
+
+		if (i == len)
+			break;
+
 		if (bits != 7) {
 			*out |= (in[i] & ((1 << (7 - bits)) - 1)) <<
 					(bits + 1);
@@ -3533,7 +3759,7 @@ unsigned char *pack_7bit(const unsigned char *in, long len, int byte_offset,
 
 char *sim_string_to_utf8(const unsigned char *buffer, int length)
 {
-	struct conversion_table t;
+	const struct gsm_codec *t;
 	int i;
 	int j;
 	int num_chars;
@@ -3543,8 +3769,8 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 	char *utf8 = NULL;
 	char *out;
 
-	if (!conversion_table_init(&t, GSM_DIALECT_DEFAULT,
-					GSM_DIALECT_DEFAULT))
+	t = gsm_codec_get(GSM_DIALECT_DEFAULT, GSM_DIALECT_DEFAULT);
+	if (t == NULL)
 		return NULL;
 
 	if (length < 1)
@@ -3629,14 +3855,15 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 			if (i >= length)
 				return NULL;
 
-			c = gsm_single_shift_lookup(&t, buffer[i++]);
+			c = buffer[i] & 0x80 ? GUND : t->single_g[buffer[i]];
+			i++;
 
 			if (c == 0)
 				return NULL;
 
 			j += 2;
 		} else {
-			c = gsm_locking_shift_lookup(&t, buffer[i++]);
+			c = t->locking_g[buffer[i++]];
 			j += 1;
 		}
 
@@ -3665,9 +3892,10 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 			c = (buffer[i++] & 0x7f) + ucs2_offset;
 		else if (buffer[i] == 0x1b) {
 			++i;
-			c = gsm_single_shift_lookup(&t, buffer[i++]);
+			c = buffer[i] & 0x80 ? GUND : t->single_g[buffer[i]];
+			i++;
 		} else
-			c = gsm_locking_shift_lookup(&t, buffer[i++]);
+			c = t->locking_g[buffer[i++]];
 
 		out += g_unichar_to_utf8(c, out);
 	}
@@ -3739,7 +3967,7 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 					enum gsm_dialect locking_lang,
 					enum gsm_dialect single_lang)
 {
-	struct conversion_table t;
+	const struct gsm_codec *t;
 	long nchars = 0;
 	const unsigned char *in;
 	unsigned char *out;
@@ -3747,7 +3975,8 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 	long res_len;
 	long i;
 
-	if (!conversion_table_init(&t, locking_lang, single_lang))
+	t = gsm_codec_get(locking_lang, single_lang);
+	if (t == NULL)
 		return NULL;
 
 	if (len < 1 || len % 2)
@@ -3760,13 +3989,7 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 		gunichar c = (in[i] << 8) | in[i + 1];
 		unsigned short converted = GUND;
 
-		if (c > 0xffff)
-			goto err_out;
-
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
+		converted = gsm_codec_to_gsm(t, c);
 
 		if (converted == GUND)
 			goto err_out;
@@ -3790,10 +4013,7 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 		gunichar c = (in[i] << 8) | in[i + 1];
 		unsigned short converted = GUND;
 
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
+		converted = gsm_codec_to_gsm(t, c);
 
 		if (converted & 0x1b00) {
 			*out = 0x1b;
@@ -110,6 +110,7 @@ int main(int argc, char **argv)
 	}
 
 	lookup_apn(argv[1], argv[2], option_duplicates);
+	mbpi_cleanup();
 
 	return 0;
 }
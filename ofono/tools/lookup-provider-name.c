@@ -95,6 +95,7 @@ int main(int argc, char **argv)
 	}
 
 	lookup_cdma_provider_name(argv[1]);
+	mbpi_cleanup();
 
 	return 0;
 }
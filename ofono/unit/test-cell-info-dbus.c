@@ -33,6 +33,7 @@
 #define CELL_INFO_DBUS_INTERFACE            "org.nemomobile.ofono.CellInfo"
 #define CELL_INFO_DBUS_CELLS_ADDED_SIGNAL   "CellsAdded"
 #define CELL_INFO_DBUS_CELLS_REMOVED_SIGNAL "CellsRemoved"
+#define CELL_INFO_DBUS_CELLS_CHANGED_SIGNAL "CellsChanged"
 #define CELL_INFO_DBUS_UNSUBSCRIBED_SIGNAL  "Unsubscribed"
 
 #define CELL_DBUS_INTERFACE_VERSION         (1)
@@ -476,6 +477,86 @@ static void test_get_cells(void)
 	}
 }
 
+/* ==== GetCellsBroadcast ==== */
+
+static void test_get_cells_broadcast_reply2(DBusPendingCall *call, void *data)
+{
+	struct test_get_cells_data *test = data;
+	DBusMessageIter it;
+	DBusMessage *signal = test_dbus_take_signal(&test->context,
+				test->modem.path, CELL_INFO_DBUS_INTERFACE,
+				CELL_INFO_DBUS_CELLS_ADDED_SIGNAL);
+
+	DBG("");
+	test_check_get_cells_reply(call, "/test/cell_0", "/test/cell_1", NULL);
+	dbus_pending_call_unref(call);
+
+	/* Subscribed clients still receive the signal */
+	g_assert(signal);
+	dbus_message_iter_init(signal, &it);
+	test_check_object_path_array(&it, "/test/cell_1", NULL);
+	dbus_message_unref(signal);
+
+	test_loop_quit_later(test->context.loop);
+}
+
+static void test_get_cells_broadcast_reply1(DBusPendingCall *call, void *data)
+{
+	struct test_get_cells_data *test = data;
+	struct ofono_cell_info *info = test->ctl->info;
+	struct ofono_cell cell;
+
+	DBG("");
+	test_check_get_cells_reply(call, "/test/cell_0", NULL);
+	dbus_pending_call_unref(call);
+
+	/* Add "/test/cell_1" */
+	fake_cell_info_add_cell(info, test_cell_init_gsm2(&cell));
+	fake_cell_info_cells_changed(info);
+	test_submit_cell_info_call(test->context.client_connection,
+		"GetCellsBroadcast", test_get_cells_broadcast_reply2, test);
+}
+
+static void test_get_cells_broadcast_start(struct test_dbus_context *context)
+{
+	struct ofono_cell cell;
+	struct ofono_cell_info *info = fake_cell_info_new();
+	struct test_get_cells_data *test =
+		G_CAST(context, struct test_get_cells_data, context);
+
+	DBG("");
+	fake_cell_info_add_cell(info, test_cell_init_gsm1(&cell));
+	test->ctl = cell_info_control_get(test->modem.path);
+	cell_info_control_set_cell_info(test->ctl, info);
+
+	test->dbus = cell_info_dbus_new(&test->modem, test->ctl);
+	g_assert(test->dbus);
+	ofono_cell_info_unref(info);
+
+	test_submit_cell_info_call(context->client_connection,
+		"GetCellsBroadcast", test_get_cells_broadcast_reply1, test);
+}
+
+static void test_get_cells_broadcast(void)
+{
+	struct test_get_cells_data test;
+	guint timeout = test_setup_timeout();
+
+	memset(&test, 0, sizeof(test));
+	test.modem.path = TEST_MODEM_PATH;
+	test.context.start = test_get_cells_broadcast_start;
+	test_dbus_setup(&test.context);
+
+	g_main_loop_run(test.context.loop);
+
+	cell_info_control_unref(test.ctl);
+	cell_info_dbus_free(test.dbus);
+	test_dbus_shutdown(&test.context);
+	if (timeout) {
+		g_source_remove(timeout);
+	}
+}
+
 /* ==== GetAll ==== */
 
 struct test_get_all_data {
@@ -1014,6 +1095,40 @@ static void test_property_changed_start(struct test_dbus_context *context)
 					test_property_changed_reply1, test);
 }
 
+static void test_check_cells_changed(DBusMessage *msg, const char *path,
+	const char *name, int value)
+{
+	DBusMessageIter it, a, e, d, p, v;
+	const char *str;
+
+	g_assert(msg);
+	g_assert(dbus_message_iter_init(msg, &it));
+	g_assert_cmpint(dbus_message_iter_get_arg_type(&it), ==,
+		DBUS_TYPE_ARRAY);
+	dbus_message_iter_recurse(&it, &a);
+
+	/* Exactly one cell with exactly one changed property */
+	g_assert_cmpint(dbus_message_iter_get_arg_type(&a), ==,
+		DBUS_TYPE_DICT_ENTRY);
+	dbus_message_iter_recurse(&a, &e);
+	g_assert_cmpstr(test_dbus_get_object_path(&e), ==, path);
+	g_assert_cmpint(dbus_message_iter_get_arg_type(&e), ==,
+		DBUS_TYPE_ARRAY);
+	dbus_message_iter_recurse(&e, &d);
+	g_assert_cmpint(dbus_message_iter_get_arg_type(&d), ==,
+		DBUS_TYPE_DICT_ENTRY);
+	dbus_message_iter_recurse(&d, &p);
+	g_assert_cmpint(dbus_message_iter_get_arg_type(&p), ==,
+		DBUS_TYPE_STRING);
+	dbus_message_iter_get_basic(&p, &str);
+	g_assert_cmpstr(str, ==, name);
+	g_assert(dbus_message_iter_next(&p));
+	dbus_message_iter_recurse(&p, &v);
+	g_assert_cmpint(test_dbus_get_int32(&v), ==, value);
+	g_assert(!dbus_message_iter_next(&d));
+	g_assert(!dbus_message_iter_next(&a));
+}
+
 static void test_property_changed(void)
 {
 	struct test_property_changed_data test;
@@ -1033,6 +1148,12 @@ static void test_property_changed(void)
 	g_assert(test_dbus_find_signal(&test.context, test.cell_path,
 		CELL_DBUS_INTERFACE, CELL_DBUS_PROPERTY_CHANGED_SIGNAL));
 
+	/* And the same change batched into "CellsChanged" */
+	test_check_cells_changed(test_dbus_find_signal(&test.context,
+		test.modem.path, CELL_INFO_DBUS_INTERFACE,
+		CELL_INFO_DBUS_CELLS_CHANGED_SIGNAL), test.cell_path,
+		"signalStrength", test.cell.info.gsm.signalStrength);
+
 	cell_info_control_unref(test.ctl);
 	cell_info_dbus_free(test.dbus);
 	test_dbus_shutdown(&test.context);
@@ -1170,6 +1291,7 @@ int main(int argc, char *argv[])
 
 	g_test_add_func(TEST_("Misc"), test_misc);
 	g_test_add_func(TEST_("GetCells"), test_get_cells);
+	g_test_add_func(TEST_("GetCellsBroadcast"), test_get_cells_broadcast);
 	g_test_add_func(TEST_("GetAll1"), test_get_all1);
 	g_test_add_func(TEST_("GetAll2"), test_get_all2);
 	g_test_add_func(TEST_("GetAll3"), test_get_all3);
@@ -28,6 +28,7 @@
 #define TEST_TIMEOUT                    (10)   /* seconds */
 #define TEST_SENDER                     ":1.0"
 #define TEST_SENDER_1                   ":1.1"
+#define TEST_SENDER_2                   ":1.2"
 
 #define TEST_DBUS_PATH                  "/test"
 #define TEST_DBUS_INTERFACE             "test.interface"
@@ -39,6 +40,7 @@ struct test_data {
 	struct test_dbus_context dbus;
 	struct ofono_dbus_clients *clients;
 	int count;
+	int unicast_count;
 };
 
 static gboolean test_debug;
@@ -111,7 +113,10 @@ static void test_null(void)
 	g_assert(!ofono_dbus_clients_new(NULL, NULL, NULL));
 	g_assert(!ofono_dbus_clients_count(NULL));
 	g_assert(!ofono_dbus_clients_add(NULL, NULL));
+	g_assert(!ofono_dbus_clients_add_broadcast(NULL, NULL));
 	g_assert(!ofono_dbus_clients_remove(NULL, NULL));
+	g_assert(!ofono_dbus_clients_get_stats(NULL, NULL, NULL));
+	ofono_dbus_clients_set_stats(NULL, TRUE);
 }
 
 /* ==== basic ==== */
@@ -241,6 +246,105 @@ static void test_signal(void)
 	}
 }
 
+/* ==== broadcast ==== */
+
+static void test_broadcast_handle(struct test_dbus_context *dbus,
+							DBusMessage *msg)
+{
+	struct test_data *test = G_CAST(dbus, struct test_data, dbus);
+	const char *dest = dbus_message_get_destination(msg);
+
+	g_assert_cmpstr(dbus_message_get_member(msg), == ,
+						TEST_PROPERTY_CHANGED_SIGNAL);
+	if (dest) {
+		/* Only the plain client gets an addressed copy */
+		g_assert_cmpstr(dest, == ,TEST_SENDER_2);
+		test->unicast_count++;
+	}
+	test->count++;
+	if (test->count == 4) {
+		test_loop_quit_later(dbus->loop);
+	}
+}
+
+static void test_broadcast_start(struct test_dbus_context *dbus)
+{
+	struct test_data *test = G_CAST(dbus, struct test_data, dbus);
+	struct ofono_dbus_client_stats stats;
+	const char *value = TEST_PROPERTY_VALUE;
+	const unsigned int counted = g_test_verbose() ? 1 : 0;
+
+	test_register_dummy_interface();
+	test->clients = ofono_dbus_clients_new(ofono_dbus_get_connection(),
+								NULL, NULL);
+
+	g_assert(ofono_dbus_clients_add_broadcast(test->clients, TEST_SENDER));
+	g_assert(ofono_dbus_clients_add_broadcast(test->clients,
+							TEST_SENDER_1));
+	g_assert(ofono_dbus_clients_add(test->clients, TEST_SENDER_2));
+	g_assert_cmpuint(ofono_dbus_clients_count(test->clients), == ,3);
+
+	ofono_dbus_clients_signal_property_changed(test->clients,
+				TEST_DBUS_PATH, TEST_DBUS_INTERFACE,
+				TEST_PROPERTY_NAME, DBUS_TYPE_STRING, &value);
+
+	/*
+	 * Nothing is counted until stats are enabled, unless debug
+	 * output is on (which is the case in verbose mode)
+	 */
+	g_assert(ofono_dbus_clients_get_stats(test->clients, TEST_SENDER,
+								&stats));
+	g_assert_cmpuint(stats.signals, == ,counted);
+	if (!counted) {
+		g_assert_cmpuint(stats.bytes, == ,0);
+	}
+
+	ofono_dbus_clients_set_stats(test->clients, TRUE);
+	ofono_dbus_clients_signal_property_changed(test->clients,
+				TEST_DBUS_PATH, TEST_DBUS_INTERFACE,
+				TEST_PROPERTY_NAME, DBUS_TYPE_STRING, &value);
+
+	/* Every client is accounted for, however it was delivered */
+	g_assert(!ofono_dbus_clients_get_stats(test->clients, NULL, &stats));
+	g_assert(!ofono_dbus_clients_get_stats(test->clients, ":1.3", &stats));
+	g_assert(ofono_dbus_clients_get_stats(test->clients, TEST_SENDER,
+								NULL));
+	g_assert(ofono_dbus_clients_get_stats(test->clients, TEST_SENDER,
+								&stats));
+	g_assert_cmpuint(stats.signals, == ,counted + 1);
+	g_assert(stats.bytes > 0);
+	g_assert(ofono_dbus_clients_get_stats(test->clients, TEST_SENDER_2,
+								&stats));
+	g_assert_cmpuint(stats.signals, == ,counted + 1);
+	g_assert(stats.bytes > 0);
+
+	/* Each signal makes one broadcast and one addressed copy */
+}
+
+static void test_broadcast(void)
+{
+	struct test_data test;
+	guint timeout = test_setup_timeout();
+
+	memset(&test, 0, sizeof(test));
+	test_dbus_setup(&test.dbus);
+	test.dbus.start = test_broadcast_start;
+	test.dbus.handle_signal = test_broadcast_handle;
+
+	g_main_loop_run(test.dbus.loop);
+
+	g_assert_cmpint(test.count, == ,4);
+	g_assert_cmpint(test.unicast_count, == ,2);
+	test_dbus_watch_disconnect_all();
+	g_assert_cmpuint(ofono_dbus_clients_count(test.clients), == ,0);
+	ofono_dbus_clients_free(test.clients);
+
+	test_dbus_shutdown(&test.dbus);
+	if (timeout) {
+		g_source_remove(timeout);
+	}
+}
+
 #define TEST_(name) "/dbus-clients/" name
 
 int main(int argc, char *argv[])
@@ -267,6 +371,7 @@ int main(int argc, char *argv[])
 	g_test_add_func(TEST_("null"), test_null);
 	g_test_add_func(TEST_("basic"), test_basic);
 	g_test_add_func(TEST_("signal"), test_signal);
+	g_test_add_func(TEST_("broadcast"), test_broadcast);
 
 	return g_test_run();
 }
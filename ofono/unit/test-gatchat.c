@@ -0,0 +1,515 @@
+/*
+ *
+ *  AT chat library with GLib integration
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "gatchat.h"
+#include "gatio.h"
+#include "ringbuffer.h"
+
+#define STORM_REPEAT	20000
+
+struct urc_test {
+	GMainLoop *mainloop;
+	GAtChat *chat;
+	GIOChannel *modem;
+	const char *data;
+	gsize data_len;
+	gsize written;
+	guint repeat;
+	guint expected;
+	guint received;
+	guint pdus;
+	GSList *lines;
+	const char *reply;
+};
+
+/* A recorded burst of network/indicator URCs as seen from an LTE modem */
+static const char urc_storm[] =
+	"\r\n+CREG: 1,\"1A2B\",\"01C3D4E5\",7\r\n"
+	"\r\n+CGREG: 1,\"1A2B\",\"01C3D4E5\",7,\"01\"\r\n"
+	"\r\n+CEREG: 1,\"1A2B\",\"01C3D4E5\",7\r\n"
+	"\r\n+CIEV: 2,4\r\n"
+	"\r\n+CSQ: 23,99\r\n"
+	"\r\n+CIEV: 7,1\r\n"
+	"\r\n+CUSATEND\r\n"
+	"\r\n+CRING: VOICE\r\n"
+	"\r\n+CLIP: \"+15551234567\",145,,,,0\r\n"
+	"\r\n^MODE: 5,4\r\n";
+
+#define STORM_LINES	10
+
+static const char *vendor_urcs[] = {
+	"^RSSI:", "^HRSSILVL:", "^HDRRSSI:", "^BOOT:", "^SIMST:", "^SRVST:",
+	"^NDISSTAT:", "^DSFLOWRPT:", "^ORIG:", "^CONF:", "^CONN:", "^CEND:",
+	"^CSNR:", "^SYSINFO:", "^STIN:", "^SMMEMFULL:", "^CUSD:", "^ICCID:",
+	"*EMRDY:", "*ESTKSMENU:", "*EPEV", "*EPSB:", "*EIAAUR:", "*ERINFO:",
+	"+PBREADY", "+XCIEV:", "+XREG:", "+XCSQ:", "+XSIM:", "+XLOCK:",
+	"+XNITZINFO:", "+XCALLSTAT:", "+XPROGRESS:", "+XEMC:", "+XCGEDPAGE:",
+	"#QSS:", "#PSNT:", "#RFSTS:", "#CPIN:", "#MONI:", "#SMSATRUN:",
+	"+QIND:", "+QUSIM:", "+QSTK:", "+QIURC:", "+QNTP:", "+QCFG:",
+	"$QCSIMSTAT:", "$QCRMCALL:", "+KSUP:", "+KCNX_IND:", "+KTCP_IND:",
+	"+STKPCI:", "+WIND:", "+CSIM:", "+CPSB:", "+CNSMOD:", "+CTZV:",
+	"+ZUSIMR:", "+ZPASR:", "+ZDONR:", "+ZSTR:", NULL
+};
+
+static void urc_notify(GAtResult *result, gpointer user_data)
+{
+	struct urc_test *test = user_data;
+
+	test->received += 1;
+
+	if (test->received == test->expected)
+		g_main_loop_quit(test->mainloop);
+}
+
+static void urc_notify_check(GAtResult *result, gpointer user_data)
+{
+	struct urc_test *test = user_data;
+	char *expected = test->lines->data;
+
+	g_assert_cmpstr(result->lines->data, ==, expected);
+
+	test->lines = g_slist_delete_link(test->lines, test->lines);
+	g_free(expected);
+
+	urc_notify(result, user_data);
+}
+
+static void urc_notify_pdu(GAtResult *result, gpointer user_data)
+{
+	struct urc_test *test = user_data;
+
+	g_assert(g_at_result_pdu(result) != NULL);
+	test->pdus += 1;
+
+	urc_notify(result, user_data);
+}
+
+static gboolean modem_write(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct urc_test *test = user_data;
+	int fd = g_io_channel_unix_get_fd(channel);
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
+		return FALSE;
+
+	while (test->repeat > 0) {
+		len = write(fd, test->data + test->written,
+				test->data_len - test->written);
+
+		if (len < 0) {
+			g_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			return TRUE;
+		}
+
+		test->written += len;
+
+		if (test->written == test->data_len) {
+			test->written = 0;
+			test->repeat -= 1;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean modem_read(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct urc_test *test = user_data;
+	int fd = g_io_channel_unix_get_fd(channel);
+	char buf[256];
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
+		return FALSE;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len <= 0 || memchr(buf, '\r', len) == NULL || test->reply == NULL)
+		return TRUE;
+
+	g_assert(write(fd, test->reply, strlen(test->reply)) ==
+			(ssize_t) strlen(test->reply));
+	test->reply = NULL;
+
+	return TRUE;
+}
+
+static void urc_test_init_syntax(struct urc_test *test, GAtSyntax *syntax)
+{
+	int sv[2];
+
+	memset(test, 0, sizeof(*test));
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	test->mainloop = g_main_loop_new(NULL, FALSE);
+	test->modem = g_io_channel_unix_new(sv[1]);
+	g_io_channel_set_close_on_unref(test->modem, TRUE);
+	g_io_channel_set_encoding(test->modem, NULL, NULL);
+	g_io_channel_set_buffered(test->modem, FALSE);
+	g_io_channel_set_flags(test->modem, G_IO_FLAG_NONBLOCK, NULL);
+
+	{
+		GIOChannel *io = g_io_channel_unix_new(sv[0]);
+
+		g_io_channel_set_close_on_unref(io, TRUE);
+
+		test->chat = g_at_chat_new(io, syntax);
+		g_at_syntax_unref(syntax);
+		g_io_channel_unref(io);
+	}
+
+	g_assert(test->chat != NULL);
+}
+
+static void urc_test_init(struct urc_test *test)
+{
+	urc_test_init_syntax(test, g_at_syntax_new_gsm_permissive());
+}
+
+static void urc_test_run(struct urc_test *test, const char *data,
+					guint repeat, guint expected)
+{
+	test->data = data;
+	test->data_len = strlen(data);
+	test->written = 0;
+	test->repeat = repeat;
+	test->expected = expected;
+	test->received = 0;
+
+	g_io_add_watch(test->modem, G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				modem_write, test);
+	g_main_loop_run(test->mainloop);
+}
+
+static void urc_test_cleanup(struct urc_test *test)
+{
+	g_at_chat_unref(test->chat);
+	g_io_channel_unref(test->modem);
+	g_main_loop_unref(test->mainloop);
+}
+
+static void test_prefix_match(void)
+{
+	struct urc_test test;
+	guint creg;
+
+	urc_test_init(&test);
+
+	/* There is no catch-all prefix */
+	g_assert(g_at_chat_register(test.chat, "", urc_notify,
+					FALSE, &test, NULL) == 0);
+	g_assert(g_at_chat_register(test.chat, NULL, urc_notify,
+					FALSE, &test, NULL) == 0);
+
+	/* Both the short and the long prefix match +CREG lines */
+	creg = g_at_chat_register(test.chat, "+CREG:", urc_notify,
+					FALSE, &test, NULL);
+	g_assert(creg > 0);
+	g_assert(g_at_chat_register(test.chat, "+CRE", urc_notify,
+					FALSE, &test, NULL) > 0);
+	g_assert(g_at_chat_register(test.chat, "+CGREG:", urc_notify,
+					FALSE, &test, NULL) > 0);
+
+	/* A prefix longer than the line must not match */
+	g_assert(g_at_chat_register(test.chat, "+CSQ: 23,99,1", urc_notify,
+					FALSE, &test, NULL) > 0);
+
+	urc_test_run(&test, "\r\n+CREG: 1\r\n\r\n+CSQ: 23,99\r\n"
+				"\r\n+CGREG: 1\r\n\r\n+CEREG: 1\r\n", 1, 3);
+	g_assert(test.received == 3);
+
+	/* Removing the long prefix keeps the short one on its path */
+	g_assert(g_at_chat_unregister(test.chat, creg));
+	urc_test_run(&test, "\r\n+CREG: 1\r\n\r\n+CGREG: 1\r\n", 1, 2);
+	g_assert(test.received == 2);
+
+	/* Same prefix registered twice, both callbacks are invoked */
+	g_assert(g_at_chat_register(test.chat, "+CGREG:", urc_notify,
+					FALSE, &test, NULL) > 0);
+	urc_test_run(&test, "\r\n+CGREG: 1\r\n", 1, 2);
+	g_assert(test.received == 2);
+
+	g_assert(g_at_chat_unregister_all(test.chat));
+	g_assert(g_at_chat_register(test.chat, "+CREG:", urc_notify,
+					FALSE, &test, NULL) > 0);
+	urc_test_run(&test, "\r\n+CRE\r\n\r\n+CGREG: 1\r\n\r\n+CREG: 2\r\n",
+				1, 1);
+	g_assert(test.received == 1);
+
+	urc_test_cleanup(&test);
+}
+
+static void test_prefix_pdu(void)
+{
+	struct urc_test test;
+
+	urc_test_init(&test);
+
+	g_assert(g_at_chat_register(test.chat, "+CMT:", urc_notify_pdu,
+					TRUE, &test, NULL) > 0);
+	g_assert(g_at_chat_register(test.chat, "+CDS:", urc_notify_pdu,
+					TRUE, &test, NULL) > 0);
+
+	/* A prefix can't be registered for both PDU and non-PDU lines */
+	g_assert(g_at_chat_register(test.chat, "+CMT:", urc_notify,
+					FALSE, &test, NULL) == 0);
+
+	g_assert(g_at_chat_register(test.chat, "+CMTI:", urc_notify,
+					FALSE, &test, NULL) > 0);
+
+	urc_test_run(&test, "\r\n+CMT: ,23\r\n0791447758100650040C9144\r\n"
+				"\r\n+CMTI: \"SM\",1\r\n"
+				"\r\n+CDS: 25\r\n0791447758100650060C9144\r\n",
+				1, 3);
+	g_assert(test.received == 3);
+	g_assert(test.pdus == 2);
+
+	urc_test_cleanup(&test);
+}
+
+static void test_line_wrap(gconstpointer data)
+{
+	GAtSyntax *(*syntax_new)(void) = data;
+	struct urc_test test;
+	GString *stream = g_string_new(NULL);
+	GSList *lines = NULL;
+	char *line;
+	guint n = 2000;
+	guint i;
+
+	urc_test_init_syntax(&test, syntax_new());
+
+	g_assert(g_at_chat_register(test.chat, "+CREG:", urc_notify_check,
+					FALSE, &test, NULL) > 0);
+
+	/* Varying line lengths, so that lines wrap around the read buffer */
+	for (i = 0; i < n; i++) {
+		line = g_strdup_printf("+CREG: %u,\"%.*s\",\"%X\"", i % 5,
+					i % 37, "0123456789ABCDEF0123456789"
+					"ABCDEF0123456789ABCDEF", i * 7919);
+
+		g_string_append_printf(stream, "\r\n%s\r\n", line);
+		lines = g_slist_prepend(lines, line);
+	}
+
+	test.lines = g_slist_reverse(lines);
+
+	urc_test_run(&test, stream->str, 1, n);
+	g_assert(test.received == n);
+	g_assert(test.lines == NULL);
+
+	/* CR inside a quoted string is part of a 27.007 line */
+	if (syntax_new == g_at_syntax_new_gsmv1) {
+		test.lines = g_slist_append(NULL, g_strdup("+CREG: \"a\rb\""));
+		urc_test_run(&test, "\r\n+CREG: \"a\rb\"\r\n", 1, 1);
+		g_assert(test.lines == NULL);
+	}
+
+	g_string_free(stream, TRUE);
+	urc_test_cleanup(&test);
+}
+
+static void response_cb(gboolean ok, GAtResult *result, gpointer user_data)
+{
+	struct urc_test *test = user_data;
+
+	g_assert(ok);
+	g_assert_cmpstr(result->final_or_pdu, ==, "OK");
+	g_assert(g_slist_length(result->lines) == 2);
+	g_assert_cmpstr(result->lines->data, ==, "+CGMI: \"Vendor\"");
+	g_assert_cmpstr(result->lines->next->data, ==, "+CGMI: \"Other\"");
+
+	g_main_loop_quit(test->mainloop);
+}
+
+static void test_response_lines(void)
+{
+	static const char *cgmi_prefix[] = { "+CGMI:", NULL };
+	struct urc_test test;
+
+	urc_test_init(&test);
+
+	g_assert(g_at_chat_register(test.chat, "+CREG:", urc_notify,
+					FALSE, &test, NULL) > 0);
+
+	/* Response lines must outlive the URC interleaved with them */
+	test.reply = "\r\n+CGMI: \"Vendor\"\r\n\r\n+CREG: 1\r\n"
+			"\r\n+CGMI: \"Other\"\r\n\r\nOK\r\n";
+	g_io_add_watch(test.modem, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				modem_read, &test);
+
+	g_assert(g_at_chat_send(test.chat, "AT+CGMI", cgmi_prefix,
+					response_cb, &test, NULL) > 0);
+	g_main_loop_run(test.mainloop);
+	g_assert(test.received == 1);
+
+	urc_test_cleanup(&test);
+}
+
+static void test_urc_storm(void)
+{
+	struct urc_test test;
+	guint expected;
+	gdouble elapsed;
+	int i;
+
+	urc_test_init(&test);
+
+	for (i = 0; vendor_urcs[i]; i++)
+		g_assert(g_at_chat_register(test.chat, vendor_urcs[i],
+					urc_notify, FALSE, &test, NULL) > 0);
+
+	g_at_chat_register(test.chat, "+CREG:", urc_notify, FALSE, &test, NULL);
+	g_at_chat_register(test.chat, "+CGREG:", urc_notify, FALSE, &test,
+				NULL);
+	g_at_chat_register(test.chat, "+CEREG:", urc_notify, FALSE, &test,
+				NULL);
+	g_at_chat_register(test.chat, "+CIEV:", urc_notify, FALSE, &test, NULL);
+	g_at_chat_register(test.chat, "+CSQ:", urc_notify, FALSE, &test, NULL);
+	g_at_chat_register(test.chat, "+CUSATEND", urc_notify, FALSE, &test,
+				NULL);
+	g_at_chat_register(test.chat, "+CRING:", urc_notify, FALSE, &test,
+				NULL);
+	g_at_chat_register(test.chat, "+CLIP:", urc_notify, FALSE, &test, NULL);
+	g_at_chat_register(test.chat, "^MODE:", urc_notify, FALSE, &test, NULL);
+
+	expected = STORM_LINES * (g_test_perf() ? STORM_REPEAT : 100);
+
+	g_test_timer_start();
+	urc_test_run(&test, urc_storm, expected / STORM_LINES, expected);
+	elapsed = g_test_timer_elapsed();
+
+	g_assert(test.received == expected);
+
+	if (g_test_perf())
+		g_test_maximized_result(expected / elapsed,
+					"%u URC lines in %.3f s, %.0f lines/s",
+					expected, elapsed, expected / elapsed);
+
+	urc_test_cleanup(&test);
+}
+
+struct io_test {
+	GMainLoop *mainloop;
+	gsize hold;
+	gsize drained;
+};
+
+static void io_test_read(struct ring_buffer *rbuf, gpointer user_data)
+{
+	struct io_test *test = user_data;
+	unsigned int len = ring_buffer_len(rbuf);
+
+	/* Let the data pile up to simulate a slow reader */
+	if (len < test->hold)
+		return;
+
+	ring_buffer_drain(rbuf, len);
+	test->drained += len;
+
+	g_main_loop_quit(test->mainloop);
+}
+
+static void test_io_adaptive(void)
+{
+	struct io_test test;
+	const GAtIOStats *stats;
+	char data[20000];
+	GIOChannel *channel;
+	GAtIO *io;
+	int sk[2];
+	int i;
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sk) == 0);
+
+	channel = g_io_channel_unix_new(sk[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+
+	io = g_at_io_new(channel);
+	g_assert(io != NULL);
+	g_io_channel_unref(channel);
+
+	test.mainloop = g_main_loop_new(NULL, FALSE);
+	test.hold = sizeof(data);
+	test.drained = 0;
+
+	g_at_io_set_read_handler(io, io_test_read, &test);
+
+	stats = g_at_io_get_stats(io);
+	g_assert(stats->buffer_size == 8192);
+
+	/* More than the initial buffer can hold before the reader drains */
+	memset(data, 'A', sizeof(data));
+	g_assert(write(sk[1], data, sizeof(data)) == sizeof(data));
+	g_main_loop_run(test.mainloop);
+
+	g_assert(test.drained == sizeof(data));
+	g_assert(stats->bytes_read == sizeof(data));
+	g_assert(stats->max_fill == sizeof(data));
+	g_assert(stats->buffer_size > 8192);
+	g_assert(stats->stalls == 0);
+
+	/* A quiet channel gives the memory back */
+	test.hold = 1;
+
+	for (i = 0; i < 64; i++) {
+		g_assert(write(sk[1], data, 16) == 16);
+		g_main_loop_run(test.mainloop);
+	}
+
+	g_assert(test.drained == sizeof(data) + 64 * 16);
+	g_assert(stats->buffer_size == 8192);
+
+	g_at_io_unref(io);
+	g_main_loop_unref(test.mainloop);
+	close(sk[1]);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testgatchat/prefix_match", test_prefix_match);
+	g_test_add_func("/testgatchat/prefix_pdu", test_prefix_pdu);
+	g_test_add_data_func("/testgatchat/line_wrap_permissive",
+				g_at_syntax_new_gsm_permissive, test_line_wrap);
+	g_test_add_data_func("/testgatchat/line_wrap_gsmv1",
+				g_at_syntax_new_gsmv1, test_line_wrap);
+	g_test_add_func("/testgatchat/response_lines", test_response_lines);
+	g_test_add_func("/testgatchat/urc_storm", test_urc_storm);
+	g_test_add_func("/testgatchat/io_adaptive", test_io_adaptive);
+
+	return g_test_run();
+}
@@ -0,0 +1,572 @@
+/*
+ *
+ *  AT chat library with GLib integration
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "crc-ccitt.h"
+#include "gathdlc.h"
+
+#define HDLC_FLAG	0x7e
+#define HDLC_ESCAPE	0x7d
+#define HDLC_TRANS	0x20
+#define HDLC_INITFCS	0xffff
+#define HDLC_GOODFCS	0xf0b8
+
+#define FRAME_MAX	1500
+#define FRAMES		400
+#define PERF_FRAMES	40000
+
+struct hdlc_test {
+	GMainLoop *mainloop;
+	GAtHDLC *hdlc;
+	GIOChannel *peer;
+	GRand *rand;
+	GPtrArray *frames;
+	GByteArray *stream;
+	gsize written;
+	guint sent;
+	guint received;
+	gboolean held;
+	guint write_done;
+	/* Reference decoder state */
+	GByteArray *decode;
+	guint16 decode_fcs;
+	gboolean decode_escape;
+	guint32 accm;
+};
+
+/* Frames of random bytes mixed with runs of plain payload */
+static GByteArray *make_frame(GRand *rand)
+{
+	guint len = g_rand_int_range(rand, 1, FRAME_MAX + 1);
+	GByteArray *frame = g_byte_array_sized_new(len);
+	gboolean binary = g_rand_boolean(rand);
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		guint8 c;
+
+		if (binary)
+			c = g_rand_int_range(rand, 0, 256);
+		else
+			c = g_rand_int_range(rand, 0x20, 0x7b);
+
+		g_byte_array_append(frame, &c, 1);
+	}
+
+	return frame;
+}
+
+static void make_frames(struct hdlc_test *test, guint count)
+{
+	guint i;
+
+	for (i = 0; i < count; i++)
+		g_ptr_array_add(test->frames, make_frame(test->rand));
+}
+
+/* Byte at a time RFC 1662 encoder, the way gathdlc used to do it */
+static void ref_append(GByteArray *out, guint8 c, guint32 accm)
+{
+	if (c == HDLC_FLAG || c == HDLC_ESCAPE ||
+			(c < 0x20 && (accm & (1 << c)))) {
+		guint8 esc[2] = { HDLC_ESCAPE, c ^ HDLC_TRANS };
+
+		g_byte_array_append(out, esc, 2);
+	} else
+		g_byte_array_append(out, &c, 1);
+}
+
+static void ref_encode(GByteArray *out, const guint8 *data, gsize len,
+							guint32 accm)
+{
+	guint8 flag = HDLC_FLAG;
+	guint16 fcs = HDLC_INITFCS;
+	gsize i;
+
+	g_byte_array_append(out, &flag, 1);
+
+	for (i = 0; i < len; i++) {
+		fcs = crc_ccitt_byte(fcs, data[i]);
+		ref_append(out, data[i], accm);
+	}
+
+	fcs ^= HDLC_INITFCS;
+	ref_append(out, fcs & 0xff, accm);
+	ref_append(out, fcs >> 8, accm);
+
+	g_byte_array_append(out, &flag, 1);
+}
+
+static void check_frame(struct hdlc_test *test, const unsigned char *data,
+								gsize size)
+{
+	GByteArray *frame;
+
+	g_assert(test->received < test->frames->len);
+
+	frame = g_ptr_array_index(test->frames, test->received);
+	g_assert(size == frame->len);
+	g_assert(memcmp(data, frame->data, size) == 0);
+
+	test->received += 1;
+}
+
+static guint ref_decode(struct hdlc_test *test, const guint8 *buf, gsize len)
+{
+	guint frames = 0;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		guint8 c = buf[i];
+
+		if (test->decode_escape) {
+			c ^= HDLC_TRANS;
+			test->decode_escape = FALSE;
+		} else if (c == HDLC_ESCAPE) {
+			test->decode_escape = TRUE;
+			continue;
+		} else if (c == HDLC_FLAG) {
+			if (test->decode->len > 2 &&
+					test->decode_fcs == HDLC_GOODFCS) {
+				if (test->frames)
+					check_frame(test, test->decode->data,
+							test->decode->len - 2);
+				frames += 1;
+			}
+
+			g_byte_array_set_size(test->decode, 0);
+			test->decode_fcs = HDLC_INITFCS;
+			continue;
+		} else if (c < 0x20 && (test->accm & (1 << c)))
+			continue;
+
+		g_byte_array_append(test->decode, &c, 1);
+		test->decode_fcs = crc_ccitt_byte(test->decode_fcs, c);
+	}
+
+	return frames;
+}
+
+static void hdlc_test_init(struct hdlc_test *test, guint32 accm)
+{
+	GIOChannel *channel;
+	int sk[2];
+
+	memset(test, 0, sizeof(*test));
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sk) == 0);
+
+	channel = g_io_channel_unix_new(sk[0]);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	test->hdlc = g_at_hdlc_new(channel);
+	g_assert(test->hdlc != NULL);
+	g_io_channel_unref(channel);
+
+	g_at_hdlc_set_xmit_accm(test->hdlc, accm);
+	g_at_hdlc_set_recv_accm(test->hdlc, accm);
+
+	test->peer = g_io_channel_unix_new(sk[1]);
+	g_io_channel_set_close_on_unref(test->peer, TRUE);
+	g_io_channel_set_encoding(test->peer, NULL, NULL);
+	g_io_channel_set_buffered(test->peer, FALSE);
+	g_io_channel_set_flags(test->peer, G_IO_FLAG_NONBLOCK, NULL);
+
+	test->mainloop = g_main_loop_new(NULL, FALSE);
+	test->rand = g_rand_new_with_seed(0x7e7d);
+	test->frames = g_ptr_array_new_with_free_func(
+					(GDestroyNotify) g_byte_array_unref);
+	test->decode = g_byte_array_new();
+	test->decode_fcs = HDLC_INITFCS;
+	test->accm = accm;
+}
+
+static void hdlc_test_cleanup(struct hdlc_test *test)
+{
+	g_at_hdlc_unref(test->hdlc);
+	g_io_channel_unref(test->peer);
+	g_main_loop_unref(test->mainloop);
+	g_rand_free(test->rand);
+	g_byte_array_unref(test->decode);
+
+	if (test->frames)
+		g_ptr_array_unref(test->frames);
+
+	if (test->stream)
+		g_byte_array_unref(test->stream);
+}
+
+static void test_crc(void)
+{
+	guint8 buf[128];
+	guint i, offset, len;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 37 + 11;
+
+	for (offset = 0; offset < 8; offset++) {
+		for (len = 0; len + offset <= sizeof(buf); len++) {
+			guint16 fcs = HDLC_INITFCS;
+
+			for (i = 0; i < len; i++)
+				fcs = crc_ccitt_byte(fcs, buf[offset + i]);
+
+			g_assert(crc_ccitt(HDLC_INITFCS, buf + offset, len) ==
+									fcs);
+		}
+	}
+}
+
+static gboolean peer_write(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+	gsize chunk;
+	gsize bytes_written;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
+
+	/* Odd sized chunks so frames straddle reads and the ring wrap */
+	chunk = MIN((gsize) g_rand_int_range(test->rand, 1, 3000),
+				test->stream->len - test->written);
+
+	g_io_channel_write_chars(channel,
+				(gchar *) test->stream->data + test->written,
+				chunk, &bytes_written, NULL);
+	test->written += bytes_written;
+
+	return test->written < test->stream->len;
+}
+
+static void receive_check(const unsigned char *data, gsize size,
+							gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+
+	check_frame(test, data, size);
+
+	if (test->received == test->frames->len)
+		g_main_loop_quit(test->mainloop);
+}
+
+static void test_receive(gconstpointer data)
+{
+	guint32 accm = GPOINTER_TO_UINT(data);
+	guint count = g_test_perf() ? PERF_FRAMES : FRAMES;
+	struct hdlc_test test;
+	gdouble elapsed;
+	guint i;
+
+	hdlc_test_init(&test, accm);
+	make_frames(&test, count);
+
+	test.stream = g_byte_array_new();
+
+	for (i = 0; i < count; i++) {
+		GByteArray *frame = g_ptr_array_index(test.frames, i);
+
+		ref_encode(test.stream, frame->data, frame->len, accm);
+	}
+
+	g_at_hdlc_set_receive(test.hdlc, receive_check, &test);
+	g_io_add_watch(test.peer, G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							peer_write, &test);
+
+	g_test_timer_start();
+	g_main_loop_run(test.mainloop);
+	elapsed = g_test_timer_elapsed();
+
+	g_assert(test.received == count);
+
+	if (g_test_perf())
+		g_test_maximized_result(test.stream->len / elapsed / 1e6,
+					"decoded %u bytes in %.3f s, %.1f MB/s",
+					test.stream->len, elapsed,
+					test.stream->len / elapsed / 1e6);
+
+	hdlc_test_cleanup(&test);
+}
+
+static gboolean send_next(struct hdlc_test *test)
+{
+	GByteArray *frame;
+
+	if (test->sent == test->frames->len)
+		return FALSE;
+
+	frame = g_ptr_array_index(test->frames, test->sent);
+
+	if (g_at_hdlc_send(test->hdlc, frame->data, frame->len) == FALSE)
+		return FALSE;
+
+	test->sent += 1;
+
+	return TRUE;
+}
+
+static gboolean peer_read(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+	guint8 buf[4096];
+	gsize bytes_read;
+	guint frames;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
+
+	g_io_channel_read_chars(channel, (gchar *) buf, sizeof(buf),
+							&bytes_read, NULL);
+
+	frames = ref_decode(test, buf, bytes_read);
+
+	while (frames-- && send_next(test))
+		;
+
+	if (test->received == test->frames->len) {
+		g_main_loop_quit(test->mainloop);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void test_send(gconstpointer data)
+{
+	guint32 accm = GPOINTER_TO_UINT(data);
+	guint count = g_test_perf() ? PERF_FRAMES : FRAMES;
+	struct hdlc_test test;
+	gsize total = 0;
+	gdouble elapsed;
+	guint i;
+
+	hdlc_test_init(&test, accm);
+	make_frames(&test, count);
+
+	for (i = 0; i < count; i++)
+		total += ((GByteArray *) g_ptr_array_index(test.frames, i))->len;
+
+	g_io_add_watch(test.peer, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							peer_read, &test);
+
+	g_test_timer_start();
+
+	/* Keep a window of frames in flight */
+	for (i = 0; i < 32; i++)
+		send_next(&test);
+
+	g_main_loop_run(test.mainloop);
+	elapsed = g_test_timer_elapsed();
+
+	g_assert(test.sent == count);
+	g_assert(test.received == count);
+
+	if (g_test_perf())
+		g_test_maximized_result(total / elapsed / 1e6,
+					"encoded %zu bytes in %.3f s, %.1f MB/s",
+					total, elapsed, total / elapsed / 1e6);
+
+	hdlc_test_cleanup(&test);
+}
+
+static gboolean peer_drain(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+	guint8 buf[4096];
+	gsize bytes_read;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
+
+	g_io_channel_read_chars(channel, (gchar *) buf, sizeof(buf),
+							&bytes_read, NULL);
+	ref_decode(test, buf, bytes_read);
+
+	if (test->received == test->frames->len) {
+		g_main_loop_quit(test->mainloop);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Sends frames until the queue is full, the way ppp_net reads from tun */
+static void send_until_full(struct hdlc_test *test)
+{
+	while (send_next(test))
+		;
+
+	test->held = test->sent < test->frames->len;
+}
+
+static void write_done_resume(gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+
+	test->write_done += 1;
+
+	/* There is room again, the frame refused last goes out first */
+	if (test->held) {
+		g_assert(send_next(test));
+		test->held = FALSE;
+	}
+
+	send_until_full(test);
+}
+
+/* A frame refused with a full queue is accepted from write done */
+static void test_write_done(void)
+{
+	struct hdlc_test test;
+
+	hdlc_test_init(&test, ~0U);
+	make_frames(&test, FRAMES);
+
+	g_at_hdlc_set_write_done(test.hdlc, write_done_resume, &test);
+	g_io_add_watch(test.peer, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							peer_drain, &test);
+
+	send_until_full(&test);
+	g_assert(test.held);
+
+	g_main_loop_run(test.mainloop);
+
+	g_assert(test.write_done > 0);
+	g_assert(!test.held);
+	g_assert(test.sent == FRAMES);
+	g_assert(test.received == FRAMES);
+
+	hdlc_test_cleanup(&test);
+}
+
+static void write_done_unref(gpointer user_data)
+{
+	struct hdlc_test *test = user_data;
+
+	g_at_hdlc_unref(test->hdlc);
+	test->hdlc = NULL;
+
+	g_main_loop_quit(test->mainloop);
+}
+
+/* Dropping the last reference from the write done callback is allowed */
+static void test_write_done_unref(void)
+{
+	struct hdlc_test test;
+
+	hdlc_test_init(&test, ~0U);
+	make_frames(&test, FRAMES);
+
+	while (send_next(&test))
+		;
+
+	g_assert(test.sent < FRAMES);
+
+	g_at_hdlc_set_write_done(test.hdlc, write_done_unref, &test);
+	g_main_loop_run(test.mainloop);
+
+	g_assert(test.hdlc == NULL);
+
+	hdlc_test_cleanup(&test);
+}
+
+/* Compare the byte at a time and the GAtHDLC decoders on the same data */
+static void test_throughput(void)
+{
+	struct hdlc_test test;
+	GByteArray *stream;
+	gdouble ref_elapsed, crc_elapsed, slice_elapsed;
+	guint16 fcs;
+	guint frames = 0;
+	guint i;
+
+	if (!g_test_perf())
+		return;
+
+	hdlc_test_init(&test, ~0U);
+	g_ptr_array_unref(test.frames);
+	test.frames = NULL;
+
+	stream = g_byte_array_new();
+
+	for (i = 0; i < PERF_FRAMES / 10; i++) {
+		GByteArray *frame = make_frame(test.rand);
+
+		ref_encode(stream, frame->data, frame->len, ~0U);
+		g_byte_array_unref(frame);
+	}
+
+	g_test_timer_start();
+	for (i = 0; i < 10; i++)
+		frames += ref_decode(&test, stream->data, stream->len);
+	ref_elapsed = g_test_timer_elapsed();
+
+	g_assert(frames == PERF_FRAMES);
+
+	g_test_timer_start();
+	for (i = 0, fcs = HDLC_INITFCS; i < stream->len * 10; i++)
+		fcs = crc_ccitt_byte(fcs, stream->data[i % stream->len]);
+	crc_elapsed = g_test_timer_elapsed();
+
+	g_test_timer_start();
+	for (i = 0; i < 10; i++)
+		fcs = crc_ccitt(fcs, stream->data, stream->len);
+	slice_elapsed = g_test_timer_elapsed();
+
+	g_test_message("byte at a time decoder: %.1f MB/s",
+				stream->len * 10 / ref_elapsed / 1e6);
+	g_test_message("crc_ccitt_byte: %.1f MB/s, crc_ccitt: %.1f MB/s (%x)",
+				stream->len * 10 / crc_elapsed / 1e6,
+				stream->len * 10 / slice_elapsed / 1e6, fcs);
+
+	g_byte_array_unref(stream);
+	hdlc_test_cleanup(&test);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testhdlc/crc", test_crc);
+	g_test_add_data_func("/testhdlc/receive", GUINT_TO_POINTER(~0U),
+							test_receive);
+	g_test_add_data_func("/testhdlc/receive_no_accm", GUINT_TO_POINTER(0),
+							test_receive);
+	g_test_add_data_func("/testhdlc/send", GUINT_TO_POINTER(~0U),
+							test_send);
+	g_test_add_data_func("/testhdlc/send_no_accm", GUINT_TO_POINTER(0),
+							test_send);
+	g_test_add_func("/testhdlc/write_done", test_write_done);
+	g_test_add_func("/testhdlc/write_done_unref", test_write_done_unref);
+	g_test_add_func("/testhdlc/throughput", test_throughput);
+
+	return g_test_run();
+}
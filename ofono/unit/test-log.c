@@ -0,0 +1,212 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include <ofono/log.h>
+#include "ofono.h"
+
+#define TEST_(name) "/log/" name
+
+static struct ofono_debug_desc test_desc OFONO_DEBUG_ATTR = {
+	.file = "test-log",
+	.flags = OFONO_DEBUG_FLAG_PRINT,
+};
+
+static void test_collect(const struct ofono_debug_desc *desc, gint64 time,
+					const char *message, void *user_data)
+{
+	GPtrArray *lines = user_data;
+
+	g_assert(desc == &test_desc);
+	g_ptr_array_add(lines, g_strdup(message));
+}
+
+static GPtrArray *test_lines(void)
+{
+	GPtrArray *lines = g_ptr_array_new_with_free_func(g_free);
+
+	__ofono_log_trace_foreach(test_collect, lines);
+	return lines;
+}
+
+static void test_check(char *expected)
+{
+	GPtrArray *lines = test_lines();
+
+	g_assert_cmpuint(lines->len, ==, 1);
+	g_assert_cmpstr(lines->pdata[0], ==, expected);
+
+	g_ptr_array_free(lines, TRUE);
+	g_free(expected);
+}
+
+/*
+ * Records the arguments into a fresh single entry ring and checks that
+ * formatting them later gives what printf gives right away.
+ */
+#define test_trace(fmt, args...) do { \
+	__ofono_log_trace_init(1); \
+	ofono_dbg(&test_desc, fmt, ## args); \
+	test_check(g_strdup_printf(fmt, ## args)); \
+} while (0)
+
+static void test_integers(void)
+{
+	short h = -12;
+	signed char hh = -3;
+
+	test_trace("no conversions");
+	test_trace("%d %i %u %o %x %X %c", -1, 42, 4000000000u, 8, 0xbeef,
+							0xbeef, 'z');
+	test_trace("%hd %hhd %hu", h, hh, (unsigned short) 65535);
+	test_trace("%ld %lu %lx", -1234567890L, 1234567890UL, 0xdeadUL);
+	test_trace("%lld %llu %llx", -(1LL << 40), 1ULL << 63,
+							0xfeedfacecafeULL);
+	test_trace("%zu %zd", (size_t) -1, (ssize_t) -5);
+	test_trace("%jd %ju", (intmax_t) INT64_MIN, (uintmax_t) UINT64_MAX);
+	test_trace("%td", (ptrdiff_t) -77);
+	test_trace("%p %p", (void *) &h, (void *) NULL);
+	test_trace("100%% %d%%", 5);
+
+	__ofono_log_trace_init(0);
+}
+
+static void test_widths(void)
+{
+	test_trace("[%5d] [%-5d] [%05d] [%+d] [% d] [%#x] [%#o]",
+						42, 42, 42, 42, 42, 255, 8);
+	test_trace("[%*d] [%-*d] [%.*d] [%*.*d]", 6, 1, 6, 2, 4, 3,
+							8, 5, 4);
+	test_trace("[%*d]", -6, 7);
+	test_trace("[%8.3f] [%-10s] [%10s]", 3.14159, "left", "right");
+	test_trace("[%*s] [%-*s]", 7, "a", 7, "b");
+
+	__ofono_log_trace_init(0);
+}
+
+static void test_strings(void)
+{
+	static const char unterminated[4] = { 'a', 'b', 'c', 'd' };
+	const char *null_str = NULL;
+
+	test_trace("%s", "");
+	test_trace("%s and %s", "this", "that");
+	test_trace("%s", null_str);
+	test_trace("[%.3s]", "abcdef");
+	test_trace("[%.0s]", "abcdef");
+	test_trace("[%10.2s]", "abcdef");
+	test_trace("[%.*s]", 2, "abcdef");
+	test_trace("[%.*s]", -1, "abcdef");
+	test_trace("[%*.*s]", 5, 1, "abcdef");
+	test_trace("[%.20s]", "short");
+
+	/* Precision means the string needn't be terminated */
+	test_trace("[%.4s]", unterminated);
+	test_trace("[%.*s] %d", 4, unterminated, 9);
+
+	__ofono_log_trace_init(0);
+}
+
+static void test_doubles(void)
+{
+	test_trace("%f %e %g %a", 1.5, -2.5e-10, 1e100, 0.5);
+	test_trace("%F %E %G %A", 1.0 / 3, 6.02e23, 1e-5, 2.0);
+	test_trace("%.2f %10.4e %-8g|", 2.71828, 2.71828, 2.71828);
+	test_trace("%Lf %Lg", (long double) 1.25, (long double) 1e300);
+	test_trace("%d %f %s %lld", 1, 2.0, "three", 4LL);
+
+	__ofono_log_trace_init(0);
+}
+
+static void test_truncated(void)
+{
+	char *big = g_strnfill(500, 'x');
+	GPtrArray *lines;
+	const char *line;
+
+	__ofono_log_trace_init(1);
+	ofono_dbg(&test_desc, "%s %d", big, 1);
+
+	lines = test_lines();
+	g_assert_cmpuint(lines->len, ==, 1);
+	line = lines->pdata[0];
+	g_assert(g_str_has_suffix(line, " ..."));
+	g_assert(strlen(line) < 500);
+	g_assert(strspn(line, "x") == strlen(line) - 4);
+	g_ptr_array_free(lines, TRUE);
+
+	__ofono_log_trace_init(0);
+	g_free(big);
+}
+
+static void test_wrap(void)
+{
+	GPtrArray *lines;
+	int i;
+
+	__ofono_log_trace_init(3);
+
+	/* Rounded up to 4 entries, only the newest ones are kept */
+	for (i = 0; i < 10; i++)
+		ofono_dbg(&test_desc, "line %d", i);
+
+	lines = test_lines();
+	g_assert_cmpuint(lines->len, ==, 4);
+
+	for (i = 0; i < 4; i++) {
+		char *expected = g_strdup_printf("line %d", i + 6);
+
+		g_assert_cmpstr(lines->pdata[i], ==, expected);
+		g_free(expected);
+	}
+
+	g_ptr_array_free(lines, TRUE);
+	__ofono_log_trace_init(0);
+
+	lines = test_lines();
+	g_assert_cmpuint(lines->len, ==, 0);
+	g_ptr_array_free(lines, TRUE);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func(TEST_("integers"), test_integers);
+	g_test_add_func(TEST_("widths"), test_widths);
+	g_test_add_func(TEST_("strings"), test_strings);
+	g_test_add_func(TEST_("doubles"), test_doubles);
+	g_test_add_func(TEST_("truncated"), test_truncated);
+	g_test_add_func(TEST_("wrap"), test_wrap);
+
+	return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 8
+ * indent-tabs-mode: t
+ * End:
+ */
@@ -23,9 +23,11 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -556,6 +558,378 @@ static void test_extract_advanced(void)
 	g_assert(total == sizeof(advanced_input2) - 1);
 }
 
+#define BULK_BYTES (4 * 1024 * 1024)
+#define BULK_PERF_BYTES (64 * 1024 * 1024)
+#define BULK_CHUNK 16384
+#define CONTROL_MESSAGES 200
+#define CONTROL_LEN 12
+
+/*
+ * Most bulk payload allowed between two control frames: the bulk DLC
+ * queues at most one budget per round and may be served at the end of
+ * one round and the start of the next.
+ */
+#define MAX_BULK_GAP (2 * 1024)
+
+struct interleave_data {
+	GMainLoop *loop;
+	GAtMux *mux;
+	GIOChannel *peer;
+	GIOChannel *bulk;
+	GIOChannel *control;
+	GByteArray *rx;
+	gsize bulk_total;
+	gsize bulk_sent;
+	gsize bulk_received;
+	gsize bulk_gap;
+	gsize bulk_max_gap;
+	guint control_sent;
+	guint control_received;
+	guint8 chunk[BULK_CHUNK];
+};
+
+static gboolean bulk_write(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct interleave_data *id = data;
+	gsize len = MIN(id->bulk_total - id->bulk_sent, BULK_CHUNK);
+	gsize written;
+	gsize i;
+
+	for (i = 0; i < len; i++)
+		id->chunk[i] = id->bulk_sent + i;
+
+	g_io_channel_write_chars(io, (gchar *) id->chunk, len, &written, NULL);
+	g_assert(written > 0);
+
+	id->bulk_sent += written;
+
+	return id->bulk_sent < id->bulk_total;
+}
+
+static gboolean control_write(GIOChannel *io, GIOCondition cond,
+							gpointer data)
+{
+	struct interleave_data *id = data;
+	char msg[CONTROL_LEN + 1];
+	gsize written;
+
+	snprintf(msg, sizeof(msg), "AT+CSQ%05u", id->control_sent);
+
+	g_io_channel_write_chars(io, msg, CONTROL_LEN, &written, NULL);
+	g_assert(written == CONTROL_LEN);
+
+	id->control_sent += 1;
+
+	return id->control_sent < CONTROL_MESSAGES;
+}
+
+static void interleave_frame(struct interleave_data *id, guint8 dlc,
+					const guint8 *frame, int len)
+{
+	char msg[CONTROL_LEN + 1];
+	int i;
+
+	if (dlc == 1) {
+		for (i = 0; i < len; i++)
+			g_assert(frame[i] == (guint8) (id->bulk_received + i));
+
+		id->bulk_received += len;
+		id->bulk_gap += len;
+		return;
+	}
+
+	g_assert(dlc == 2);
+	g_assert(len == CONTROL_LEN);
+
+	snprintf(msg, sizeof(msg), "AT+CSQ%05u", id->control_received);
+	g_assert(memcmp(frame, msg, CONTROL_LEN) == 0);
+
+	id->control_received += 1;
+	id->bulk_max_gap = MAX(id->bulk_max_gap, id->bulk_gap);
+	id->bulk_gap = 0;
+}
+
+static gboolean interleave_read(GIOChannel *io, GIOCondition cond,
+							gpointer data)
+{
+	struct interleave_data *id = data;
+	guint8 buf[8192];
+	guint8 *frame;
+	int frame_len;
+	guint8 dlc;
+	guint8 ctrl;
+	gsize rbytes;
+	int total = 0;
+	int nread;
+
+	g_io_channel_read_chars(io, (gchar *) buf, sizeof(buf), &rbytes, NULL);
+	g_byte_array_append(id->rx, buf, rbytes);
+
+	do {
+		frame = NULL;
+		nread = gsm0710_basic_extract_frame(id->rx->data + total,
+						id->rx->len - total,
+						&dlc, &ctrl,
+						&frame, &frame_len);
+		total += nread;
+
+		if (frame == NULL)
+			break;
+
+		if (ctrl == GSM0710_DATA)
+			interleave_frame(id, dlc, frame, frame_len);
+	} while (nread > 0);
+
+	g_byte_array_remove_range(id->rx, 0, total);
+
+	if (id->bulk_received == id->bulk_total &&
+			id->control_received == CONTROL_MESSAGES)
+		g_main_loop_quit(id->loop);
+
+	return TRUE;
+}
+
+static GIOChannel *interleave_dlc(GAtMux *mux)
+{
+	GIOChannel *io = g_at_mux_create_channel(mux);
+
+	g_assert(io);
+
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+
+	return io;
+}
+
+/*
+ * Saturates one DLC while a second one sends short commands, and checks
+ * that both streams arrive intact with the commands interleaved at a
+ * bounded distance.
+ */
+static void test_interleave(void)
+{
+	struct interleave_data id;
+	GIOChannel *io;
+	int sv[2];
+	double elapsed;
+
+	memset(&id, 0, sizeof(id));
+	id.bulk_total = g_test_perf() ? BULK_PERF_BYTES : BULK_BYTES;
+	id.rx = g_byte_array_new();
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	g_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+
+	id.mux = g_at_mux_new_gsm0710_basic(io, 64);
+	g_io_channel_unref(io);
+	g_assert(id.mux);
+	g_assert(g_at_mux_start(id.mux));
+
+	id.peer = g_io_channel_unix_new(sv[1]);
+	g_io_channel_set_encoding(id.peer, NULL, NULL);
+	g_io_channel_set_buffered(id.peer, FALSE);
+	g_io_channel_set_close_on_unref(id.peer, TRUE);
+	g_io_add_watch(id.peer, G_IO_IN, interleave_read, &id);
+
+	id.bulk = interleave_dlc(id.mux);
+	id.control = interleave_dlc(id.mux);
+
+	g_io_add_watch(id.bulk, G_IO_OUT, bulk_write, &id);
+	g_io_add_watch(id.control, G_IO_OUT, control_write, &id);
+
+	id.loop = g_main_loop_new(NULL, FALSE);
+
+	g_test_timer_start();
+	g_main_loop_run(id.loop);
+	elapsed = g_test_timer_elapsed();
+
+	if (g_test_perf())
+		g_test_maximized_result(id.bulk_total / elapsed / 1e6,
+					"%.1f MB/s with %u commands",
+					id.bulk_total / elapsed / 1e6,
+					CONTROL_MESSAGES);
+
+	g_assert(id.bulk_received == id.bulk_total);
+	g_assert(id.control_received == CONTROL_MESSAGES);
+	g_assert(id.bulk_max_gap <= MAX_BULK_GAP);
+
+	g_main_loop_unref(id.loop);
+	g_io_channel_unref(id.bulk);
+	g_io_channel_unref(id.control);
+	g_at_mux_unref(id.mux);
+	g_io_channel_unref(id.peer);
+	g_byte_array_free(id.rx, TRUE);
+}
+
+struct flow_data {
+	GAtMux *mux;
+	GIOChannel *dlc;
+	int peer;
+	GByteArray *rx;
+	int status;
+	int statuses;
+};
+
+static void peer_send(struct flow_data *fd, guint8 dlc,
+				const guint8 *data, int len)
+{
+	guint8 frame[256];
+	int frame_len;
+
+	frame_len = gsm0710_basic_fill_frame(frame, dlc, GSM0710_DATA,
+						data, len);
+	g_assert(write(fd->peer, frame, frame_len) == frame_len);
+}
+
+/* Collects the modem status commands the mux sends for DLC 1 */
+static void peer_receive(struct flow_data *fd)
+{
+	guint8 buf[1024];
+	guint8 *frame;
+	int frame_len;
+	guint8 dlc;
+	guint8 ctrl;
+	ssize_t rbytes;
+	int total = 0;
+	int nread;
+
+	rbytes = read(fd->peer, buf, sizeof(buf));
+	if (rbytes <= 0)
+		return;
+
+	g_byte_array_append(fd->rx, buf, rbytes);
+
+	do {
+		frame = NULL;
+		nread = gsm0710_basic_extract_frame(fd->rx->data + total,
+						fd->rx->len - total,
+						&dlc, &ctrl,
+						&frame, &frame_len);
+		total += nread;
+
+		if (frame == NULL)
+			break;
+
+		if (dlc == 0 && ctrl == GSM0710_DATA && frame_len == 4 &&
+				frame[0] == GSM0710_STATUS_SET &&
+				frame[2] >> 2 == 1) {
+			fd->status = frame[3];
+			fd->statuses += 1;
+		}
+	} while (nread > 0);
+
+	g_byte_array_remove_range(fd->rx, 0, total);
+}
+
+static void flow_wait_status(struct flow_data *fd, int statuses)
+{
+	while (fd->statuses < statuses) {
+		g_main_context_iteration(NULL, FALSE);
+		peer_receive(fd);
+	}
+}
+
+static void flow_iterate(void)
+{
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+}
+
+/*
+ * A DLC nobody reads from must make the mux ask the peer to stop, and
+ * resume it once drained.  Line noise filling the whole input buffer
+ * must be dropped rather than take the mux down.
+ */
+static void test_flow_control(void)
+{
+	struct flow_data fd;
+	GIOChannel *io;
+	guint8 payload[64];
+	guint8 garbage[12000];
+	char buf[256];
+	gsize rbytes;
+	int sv[2];
+	int i;
+
+	memset(&fd, 0, sizeof(fd));
+	fd.rx = g_byte_array_new();
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	g_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+	g_assert(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+	fd.peer = sv[1];
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+
+	fd.mux = g_at_mux_new_gsm0710_basic(io, 64);
+	g_io_channel_unref(io);
+	g_assert(fd.mux);
+	g_assert(g_at_mux_start(fd.mux));
+
+	fd.dlc = g_at_mux_create_channel_full(fd.mux, 256);
+	g_assert(fd.dlc);
+	g_io_channel_set_encoding(fd.dlc, NULL, NULL);
+	g_io_channel_set_buffered(fd.dlc, FALSE);
+
+	for (i = 0; i < 2; i++) {
+		memset(payload, i, sizeof(payload));
+		peer_send(&fd, 1, payload, sizeof(payload));
+	}
+
+	flow_iterate();
+	peer_receive(&fd);
+	g_assert(fd.statuses == 0);
+
+	/* Three quarters full, the peer is asked to stop */
+	peer_send(&fd, 1, payload, sizeof(payload));
+	flow_wait_status(&fd, 1);
+	g_assert(fd.status & G_AT_MUX_DLC_STATUS_FC);
+	g_assert(fd.status & G_AT_MUX_DLC_STATUS_RTR);
+
+	g_io_channel_read_chars(fd.dlc, buf, sizeof(buf), &rbytes, NULL);
+	g_assert(rbytes == 3 * sizeof(payload));
+
+	flow_wait_status(&fd, 2);
+	g_assert(!(fd.status & G_AT_MUX_DLC_STATUS_FC));
+
+	/* A frame header claiming more than the buffer holds, then noise */
+	memset(garbage, 0, sizeof(garbage));
+	garbage[0] = 0xF9;
+	garbage[1] = 0x07;
+	garbage[2] = GSM0710_DATA;
+	garbage[3] = 0xFE;
+	garbage[4] = 0xFF;
+
+	for (i = 0; i < (int) sizeof(garbage); ) {
+		ssize_t written = write(fd.peer, garbage + i,
+						sizeof(garbage) - i);
+
+		if (written > 0)
+			i += written;
+
+		flow_iterate();
+	}
+
+	memset(payload, 0x5a, sizeof(payload));
+	peer_send(&fd, 1, payload, sizeof(payload));
+	flow_iterate();
+
+	g_io_channel_read_chars(fd.dlc, buf, sizeof(buf), &rbytes, NULL);
+	g_assert(rbytes == sizeof(payload));
+	g_assert(memcmp(buf, payload, rbytes) == 0);
+
+	g_io_channel_unref(fd.dlc);
+	g_at_mux_unref(fd.mux);
+	close(fd.peer);
+	g_byte_array_free(fd.rx, TRUE);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -565,6 +939,8 @@ int main(int argc, char **argv)
 	g_test_add_func("/testmux/extract_basic", test_extract_basic);
 	g_test_add_func("/testmux/extract_advanced", test_extract_advanced);
 	g_test_add_func("/testmux/basic", test_basic);
+	g_test_add_func("/testmux/interleave", test_interleave);
+	g_test_add_func("/testmux/flow_control", test_flow_control);
 
 	return g_test_run();
 }
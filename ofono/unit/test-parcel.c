@@ -0,0 +1,316 @@
+/*
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include "ofono.h"
+#include "parcel.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PAD_SIZE(s) (((s)+3)&~3)
+
+/* Size of a string on the wire, length and terminator included */
+#define STRING_SIZE(len16) (4 + PAD_SIZE(((len16) + 1) * 2))
+
+static const char *test_strings[] = {
+	"",
+	"a",
+	"ab",
+	"abc",
+	"Hello, world!",
+	"\xc3\xa5\xc3\xa4\xc3\xb6",		/* åäö */
+	"mixed \xe2\x82\xac 10",		/* mixed € 10 */
+	"\xf0\x9f\x98\x80",			/* U+1F600 */
+	"a\xf0\x9d\x84\x9e" "b\xf0\x9f\x98\x80"	/* aU+1D11EbU+1F600 */
+};
+
+static const int test_strings_len16[] = { 0, 1, 2, 3, 13, 3, 10, 2, 6 };
+
+/* Rewinds a parcel that has been written for reading */
+static void test_rewind(struct parcel *p)
+{
+	p->offset = 0;
+}
+
+static void test_string(void)
+{
+	struct parcel p;
+	size_t size = 0;
+	guint i;
+
+	parcel_init(&p);
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++) {
+		g_assert(parcel_w_string(&p, test_strings[i]) == 0);
+		size += STRING_SIZE(test_strings_len16[i]);
+		g_assert(p.size == size);
+	}
+
+	test_rewind(&p);
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++) {
+		char *str = parcel_r_string(&p);
+
+		g_assert(!g_strcmp0(str, test_strings[i]));
+		g_free(str);
+	}
+
+	g_assert(!p.malformed);
+	g_assert(parcel_data_avail(&p) == 0);
+
+	/* Reading past the end marks the parcel malformed */
+	g_assert(!parcel_r_string(&p));
+	g_assert(p.malformed);
+
+	parcel_free(&p);
+}
+
+static void test_string_buf(void)
+{
+	struct parcel p;
+	char buf[16];
+	guint i;
+
+	parcel_init(&p);
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++)
+		parcel_w_string(&p, test_strings[i]);
+
+	test_rewind(&p);
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++)
+		g_assert(!g_strcmp0(parcel_r_string_buf(&p, buf, sizeof(buf)),
+							test_strings[i]));
+
+	g_assert(!p.malformed);
+	g_assert(parcel_data_avail(&p) == 0);
+	parcel_free(&p);
+}
+
+static void test_string_null(void)
+{
+	struct parcel p;
+	char buf[4];
+
+	parcel_init(&p);
+	g_assert(parcel_w_string(&p, NULL) == 0);
+	g_assert(parcel_w_string(&p, NULL) == 0);
+	g_assert(parcel_w_string(&p, NULL) == 0);
+	parcel_w_int32(&p, 42);
+	g_assert(p.size == 4 * 4);
+
+	test_rewind(&p);
+	g_assert(!parcel_r_string(&p));
+	g_assert(!parcel_r_string_buf(&p, buf, sizeof(buf)));
+	parcel_skip_string(&p);
+	g_assert(!p.malformed);
+	g_assert(parcel_r_int32(&p) == 42);
+	g_assert(parcel_data_avail(&p) == 0);
+	parcel_free(&p);
+}
+
+static void test_string_invalid(void)
+{
+	struct parcel p;
+
+	/* Invalid UTF-8 is written as a null string */
+	parcel_init(&p);
+	g_assert(parcel_w_string(&p, "bad \xc3") < 0);
+	g_assert(p.size == 4);
+
+	test_rewind(&p);
+	g_assert(!parcel_r_string(&p));
+	g_assert(!p.malformed);
+	parcel_free(&p);
+}
+
+static void test_string_truncated(void)
+{
+	struct parcel p;
+	char buf[4];
+	char *str;
+
+	parcel_init(&p);
+	parcel_w_string(&p, "abc");
+	parcel_w_string(&p, "abcd");
+	parcel_w_string(&p, "\xc3\xa5\xc3\xa4");	/* åä, 4 UTF-8 bytes */
+	parcel_w_string(&p, "\xc3\xa5");		/* å */
+	parcel_w_string(&p, "end");
+
+	/* A string that doesn't fit is consumed, the rest still reads */
+	test_rewind(&p);
+	g_assert(!g_strcmp0(parcel_r_string_buf(&p, buf, sizeof(buf)),
+								"abc"));
+	g_assert(p.offset == STRING_SIZE(3));
+
+	g_assert(!parcel_r_string_buf(&p, buf, sizeof(buf)));
+	g_assert(p.offset == STRING_SIZE(3) + STRING_SIZE(4));
+
+	g_assert(!parcel_r_string_buf(&p, buf, sizeof(buf)));
+	g_assert(p.offset == STRING_SIZE(3) + STRING_SIZE(4) +
+							STRING_SIZE(2));
+
+	g_assert(!g_strcmp0(parcel_r_string_buf(&p, buf, sizeof(buf)),
+								"\xc3\xa5"));
+
+	str = parcel_r_string(&p);
+	g_assert(!g_strcmp0(str, "end"));
+	g_free(str);
+
+	g_assert(!p.malformed);
+	g_assert(parcel_data_avail(&p) == 0);
+	parcel_free(&p);
+}
+
+static void test_string_bad_utf16(void)
+{
+	union { guint16 u16[2]; gint32 i32; } bad = { { 0xd800, 0 } };
+	struct parcel p;
+	char buf[16];
+
+	/* A lone high surrogate followed by the terminator */
+	parcel_init(&p);
+	parcel_w_int32(&p, 1);
+	parcel_w_int32(&p, bad.i32);
+	parcel_w_string(&p, "next");
+
+	/* The string is consumed and the parcel marked malformed */
+	test_rewind(&p);
+	g_assert(!parcel_r_string(&p));
+	g_assert(p.malformed);
+	g_assert(p.offset == STRING_SIZE(1));
+	g_assert(!parcel_r_string(&p));
+	g_assert(p.offset == STRING_SIZE(1));
+
+	p.malformed = 0;
+	test_rewind(&p);
+	g_assert(!parcel_r_string_buf(&p, buf, sizeof(buf)));
+	g_assert(p.malformed);
+	g_assert(p.offset == STRING_SIZE(1));
+	parcel_free(&p);
+}
+
+static void test_string_short(void)
+{
+	struct parcel p;
+
+	/* The length claims more data than the parcel has */
+	parcel_init(&p);
+	parcel_w_int32(&p, 8);
+	parcel_w_int32(&p, 0);
+
+	test_rewind(&p);
+	g_assert(!parcel_r_string(&p));
+	g_assert(p.malformed);
+	g_assert(p.offset == 4);
+	parcel_free(&p);
+}
+
+static void test_grow(void)
+{
+	struct parcel p;
+	char name[32];
+	char *str;
+	int i;
+
+	parcel_init(&p);
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "string %d \xe2\x82\xac", i);
+		parcel_w_int32(&p, i);
+		parcel_w_string(&p, name);
+		parcel_w_raw(&p, name, (i % 4) * 4);
+		g_assert(p.size <= p.capacity);
+	}
+
+	test_rewind(&p);
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "string %d \xe2\x82\xac", i);
+		g_assert(parcel_r_int32(&p) == i);
+
+		str = parcel_r_string(&p);
+		g_assert(!g_strcmp0(str, name));
+		g_free(str);
+
+		if (i % 4) {
+			int len;
+			void *raw = parcel_r_raw(&p, &len);
+
+			g_assert(len == (i % 4) * 4);
+			g_assert(!memcmp(raw, name, len));
+			g_free(raw);
+		} else {
+			g_assert(parcel_r_int32(&p) == 0);
+		}
+	}
+
+	g_assert(!p.malformed);
+	g_assert(parcel_data_avail(&p) == 0);
+	parcel_free(&p);
+}
+
+static void test_strv(void)
+{
+	struct parcel p;
+	char **strv;
+	guint i;
+
+	parcel_init(&p);
+	parcel_w_int32(&p, G_N_ELEMENTS(test_strings));
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++)
+		parcel_w_string(&p, test_strings[i]);
+
+	test_rewind(&p);
+	strv = parcel_r_strv(&p);
+	g_assert(strv);
+	g_assert(g_strv_length(strv) == G_N_ELEMENTS(test_strings));
+
+	for (i = 0; i < G_N_ELEMENTS(test_strings); i++)
+		g_assert(!g_strcmp0(strv[i], test_strings[i]));
+
+	g_strfreev(strv);
+	parcel_free(&p);
+}
+
+#define TEST_(name) "/parcel/" name
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	__ofono_log_init("test-parcel",
+		g_test_verbose() ? "*" : NULL,
+		FALSE, FALSE);
+
+	g_test_add_func(TEST_("string"), test_string);
+	g_test_add_func(TEST_("string_buf"), test_string_buf);
+	g_test_add_func(TEST_("string_null"), test_string_null);
+	g_test_add_func(TEST_("string_invalid"), test_string_invalid);
+	g_test_add_func(TEST_("string_truncated"), test_string_truncated);
+	g_test_add_func(TEST_("string_bad_utf16"), test_string_bad_utf16);
+	g_test_add_func(TEST_("string_short"), test_string_short);
+	g_test_add_func(TEST_("grow"), test_grow);
+	g_test_add_func(TEST_("strv"), test_strv);
+
+	return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 8
+ * indent-tabs-mode: t
+ * End:
+ */
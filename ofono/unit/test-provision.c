@@ -26,6 +26,8 @@
 #include "plugins/provision.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #define TEST_SUITE "/provision/"
 
@@ -1370,6 +1372,108 @@ static const struct provision_test_case test_cases[] = {
 	}
 };
 
+/*
+ * Looks up every network of a generated database, the first lookup
+ * parsing the XML and the rest served from the index.  With -m perf,
+ * the database is the size of the real one and both are timed.
+ */
+static void test_index()
+{
+	int providers = g_test_perf() ? 2000 : 50;
+	GString *xml = g_string_new("<serviceproviders format=\"2.0\">\n"
+					"<country code=\"xx\">\n");
+	double cold, warm;
+	GFile *file;
+	char *path;
+	char mcc[4];
+	char mnc[4];
+	GSList *apns;
+	int i;
+
+	for (i = 0; i < providers; i++)
+		g_string_append_printf(xml,
+"  <provider>\n\
+    <name>Provider %d</name>\n\
+    <gsm>\n\
+      <network-id mcc=\"%03d\" mnc=\"%02d\"/>\n\
+      <apn value=\"internet%d\">\n\
+        <usage type=\"internet\"/>\n\
+        <name>Internet</name>\n\
+      </apn>\n\
+      <apn value=\"mms%d\">\n\
+        <usage type=\"mms\"/>\n\
+        <mmsc>http://mms/</mmsc>\n\
+      </apn>\n\
+    </gsm>\n\
+    <cdma>\n\
+      <sid value=\"%d\"/>\n\
+    </cdma>\n\
+  </provider>\n", i, 200 + i / 100, i % 100, i, i, i);
+
+	g_string_append(xml, "</country>\n</serviceproviders>\n");
+
+	file = test_write_tmp_file(xml->str, ".xml");
+	path = g_file_get_path(file);
+	mbpi_database = path;
+
+	g_test_timer_start();
+	apns = mbpi_lookup_apn("200", "00", FALSE, NULL);
+	cold = g_test_timer_elapsed();
+
+	g_assert(g_slist_length(apns) == 2);
+	g_slist_free_full(apns, (GDestroyNotify) mbpi_ap_free);
+
+	g_test_timer_start();
+
+	for (i = 0; i < providers; i++) {
+		struct ofono_gprs_provision_data *ap;
+		char *name;
+		char sid[16];
+
+		snprintf(mcc, sizeof(mcc), "%03d", 200 + i / 100);
+		snprintf(mnc, sizeof(mnc), "%02d", i % 100);
+
+		apns = mbpi_lookup_apn(mcc, mnc, FALSE, NULL);
+		g_assert(g_slist_length(apns) == 2);
+
+		ap = apns->data;
+		g_assert(ap->type == OFONO_GPRS_CONTEXT_TYPE_INTERNET);
+		g_assert(ap->auth_method == OFONO_GPRS_AUTH_METHOD_NONE);
+		g_assert(g_str_has_prefix(ap->apn, "internet"));
+		g_assert(atoi(ap->apn + 8) == i);
+
+		ap = apns->next->data;
+		g_assert(ap->type == OFONO_GPRS_CONTEXT_TYPE_MMS);
+		g_assert_cmpstr(ap->message_center, ==, "http://mms/");
+
+		g_slist_free_full(apns, (GDestroyNotify) mbpi_ap_free);
+
+		snprintf(sid, sizeof(sid), "%d", i);
+		name = mbpi_lookup_cdma_provider_name(sid, NULL);
+		g_assert(name);
+		g_assert(atoi(name + 9) == i);
+		g_free(name);
+	}
+
+	warm = g_test_timer_elapsed() / providers;
+
+	g_assert(!mbpi_lookup_apn("999", "99", FALSE, NULL));
+	g_assert(!mbpi_lookup_cdma_provider_name("-1", NULL));
+
+	if (g_test_perf()) {
+		g_test_message("XML parse %.3f ms, index lookup %.3f us",
+						cold * 1e3, warm * 1e6);
+		g_test_minimized_result(warm * 1e6, "%.3f us per lookup",
+						warm * 1e6);
+	}
+
+	mbpi_cleanup();
+	g_file_delete(file, NULL, NULL);
+	g_object_unref(file);
+	g_string_free(xml, TRUE);
+	g_free(path);
+}
+
 int main(int argc, char **argv)
 {
 	guint i;
@@ -1378,6 +1482,7 @@ int main(int argc, char **argv)
 	g_test_add_func(TEST_SUITE "no_driver", test_no_driver);
 	g_test_add_func(TEST_SUITE "bad_driver", test_bad_driver);
 	g_test_add_func(TEST_SUITE "no_mcc_mnc", test_no_mcc_mnc);
+	g_test_add_func(TEST_SUITE "index", test_index);
 	for (i = 0; i < G_N_ELEMENTS(test_cases); i++) {
 		const struct provision_test_case *test = test_cases + i;
 		g_test_add_data_func(test->name, test, test_provision);
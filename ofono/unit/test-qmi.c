@@ -0,0 +1,395 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "drivers/qmimodem/qmi.h"
+
+#define QMI_CTL_GET_VERSION_INFO	33
+#define QMI_CTL_GET_CLIENT_ID		34
+#define TEST_MESSAGE			0x0020
+#define TEST_CLIENT			0x05
+#define PIPELINE_REQUESTS		500
+#define PIPELINE_PERF_REQUESTS		20000
+
+struct test_data {
+	struct qmi_device *device;
+	int peer;
+	uint8_t tid;
+	gboolean discovered;
+	struct qmi_service *service;
+	guint responses;
+};
+
+static void flush_events(void)
+{
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+}
+
+static void put_tlv(GByteArray *msg, uint8_t type, const void *value,
+							uint16_t len)
+{
+	uint8_t hdr[3] = { type, len & 0xff, len >> 8 };
+
+	g_byte_array_append(msg, hdr, sizeof(hdr));
+	g_byte_array_append(msg, value, len);
+}
+
+/* Wraps a control service message into a QMUX frame */
+static void put_control_frame(GByteArray *out, uint8_t type, uint8_t tid,
+				uint16_t message, const GByteArray *tlvs)
+{
+	uint16_t len = 5 + 2 + 4 + tlvs->len;
+	uint8_t hdr[] = {
+		0x01, len & 0xff, len >> 8, 0x80, 0x00, 0x00,
+		type, tid,
+		message & 0xff, message >> 8, tlvs->len & 0xff, tlvs->len >> 8,
+	};
+
+	g_byte_array_append(out, hdr, sizeof(hdr));
+	g_byte_array_append(out, tlvs->data, tlvs->len);
+}
+
+/* Version info response, padded with an unknown TLV to make it large */
+static void put_version_info(GByteArray *out, uint8_t tid, guint pad)
+{
+	static const uint8_t result[] = { 0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t services[] = {
+		0x02,
+		QMI_SERVICE_CONTROL, 0x01, 0x00, 0x05, 0x00,
+		QMI_SERVICE_NAS, 0x01, 0x00, 0x19, 0x00,
+	};
+	static const uint8_t version[] = { 0x04, 'T', 'E', 'S', 'T' };
+	GByteArray *tlvs = g_byte_array_new();
+	uint8_t *filler = g_malloc0(pad);
+
+	put_tlv(tlvs, 0x02, result, sizeof(result));
+	put_tlv(tlvs, 0x01, services, sizeof(services));
+	put_tlv(tlvs, 0x10, version, sizeof(version));
+	put_tlv(tlvs, 0x20, filler, pad);
+
+	put_control_frame(out, 0x01, tid, QMI_CTL_GET_VERSION_INFO, tlvs);
+
+	g_free(filler);
+	g_byte_array_unref(tlvs);
+}
+
+static void put_indication(GByteArray *out)
+{
+	static const uint8_t value[] = { 0x01, 0x02 };
+	GByteArray *tlvs = g_byte_array_new();
+
+	put_tlv(tlvs, 0x01, value, sizeof(value));
+	put_control_frame(out, 0x02, 0x00, 0x0024, tlvs);
+
+	g_byte_array_unref(tlvs);
+}
+
+/* Response to a service request, with a successful result code */
+static void put_service_response(GByteArray *out, uint16_t tid)
+{
+	uint16_t len = 5 + 3 + 4 + 7;
+	uint8_t frame[] = {
+		0x01, len & 0xff, len >> 8, 0x80, QMI_SERVICE_NAS, TEST_CLIENT,
+		0x02, tid & 0xff, tid >> 8,
+		TEST_MESSAGE & 0xff, TEST_MESSAGE >> 8, 0x07, 0x00,
+		0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+
+	g_byte_array_append(out, frame, sizeof(frame));
+}
+
+static void discover_cb(void *user_data)
+{
+	struct test_data *data = user_data;
+
+	data->discovered = TRUE;
+}
+
+/* Returns the first frame the device writes */
+static ssize_t peer_recv(struct test_data *data, uint8_t *buf, size_t size)
+{
+	ssize_t len = -1;
+
+	while (len <= 0) {
+		flush_events();
+		len = recv(data->peer, buf, size, MSG_DONTWAIT);
+	}
+
+	return len;
+}
+
+static void test_setup(struct test_data *data)
+{
+	uint8_t buf[256];
+	ssize_t len;
+	int sk[2];
+
+	memset(data, 0, sizeof(*data));
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sk) == 0);
+
+	data->device = qmi_device_new(sk[0]);
+	g_assert(data->device);
+	qmi_device_set_close_on_unref(data->device, true);
+
+	data->peer = sk[1];
+
+	g_assert(qmi_device_discover(data->device, discover_cb, data, NULL));
+
+	/* Pick up the version info request to learn its transaction id */
+	len = peer_recv(data, buf, sizeof(buf));
+
+	g_assert(len >= 8);
+	g_assert(buf[0] == 0x01 && buf[4] == QMI_SERVICE_CONTROL);
+
+	data->tid = buf[7];
+}
+
+static void test_teardown(struct test_data *data)
+{
+	qmi_service_unref(data->service);
+	qmi_device_unref(data->device);
+	close(data->peer);
+	flush_events();
+}
+
+static void check_discovered(struct test_data *data)
+{
+	uint16_t major, minor;
+
+	g_assert(data->discovered);
+	g_assert(qmi_device_has_service(data->device, QMI_SERVICE_NAS));
+	g_assert(qmi_device_get_service_version(data->device, QMI_SERVICE_NAS,
+							&major, &minor));
+	g_assert(major == 1 && minor == 25);
+}
+
+static void test_bytewise(void)
+{
+	struct test_data data;
+	GByteArray *frame = g_byte_array_new();
+	guint i;
+
+	test_setup(&data);
+
+	put_version_info(frame, data.tid, 3000);
+
+	for (i = 0; i < frame->len; i++) {
+		g_assert(!data.discovered);
+		g_assert(write(data.peer, frame->data + i, 1) == 1);
+		flush_events();
+	}
+
+	check_discovered(&data);
+
+	g_byte_array_unref(frame);
+	test_teardown(&data);
+}
+
+static void test_burst(void)
+{
+	static const uint8_t noise[] = { 'A', 'T', '\r', '\n' };
+	struct test_data data;
+	GByteArray *stream = g_byte_array_new();
+	gsize split;
+
+	test_setup(&data);
+
+	/* Junk, an indication, a large response and half an indication */
+	g_byte_array_append(stream, noise, sizeof(noise));
+	put_indication(stream);
+	put_version_info(stream, data.tid, 10000);
+	split = stream->len + 5;
+	put_indication(stream);
+
+	g_assert(write(data.peer, stream->data, split) == (ssize_t) split);
+
+	while (!data.discovered)
+		g_main_context_iteration(NULL, TRUE);
+
+	check_discovered(&data);
+
+	g_assert(write(data.peer, stream->data + split,
+			stream->len - split) == (ssize_t) (stream->len - split));
+	flush_events();
+
+	g_byte_array_unref(stream);
+	test_teardown(&data);
+}
+
+static void create_cb(struct qmi_service *service, void *user_data)
+{
+	struct test_data *data = user_data;
+
+	data->service = qmi_service_ref(service);
+}
+
+static void send_cb(struct qmi_result *result, void *user_data)
+{
+	struct test_data *data = user_data;
+
+	g_assert(qmi_result_set_error(result, NULL) == false);
+
+	data->responses += 1;
+}
+
+static void setup_service(struct test_data *data)
+{
+	static const uint8_t result[] = { 0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t client[] = { QMI_SERVICE_NAS, TEST_CLIENT };
+	GByteArray *stream = g_byte_array_new();
+	GByteArray *tlvs = g_byte_array_new();
+	uint8_t buf[256];
+
+	put_version_info(stream, data->tid, 0);
+	g_assert(write(data->peer, stream->data, stream->len) ==
+						(ssize_t) stream->len);
+
+	while (!data->discovered)
+		g_main_context_iteration(NULL, TRUE);
+
+	g_assert(qmi_service_create(data->device, QMI_SERVICE_NAS,
+						create_cb, data, NULL));
+
+	g_assert(peer_recv(data, buf, sizeof(buf)) >= 8);
+
+	put_tlv(tlvs, 0x02, result, sizeof(result));
+	put_tlv(tlvs, 0x01, client, sizeof(client));
+
+	g_byte_array_set_size(stream, 0);
+	put_control_frame(stream, 0x01, buf[7], QMI_CTL_GET_CLIENT_ID, tlvs);
+	g_assert(write(data->peer, stream->data, stream->len) ==
+						(ssize_t) stream->len);
+
+	while (!data->service)
+		g_main_context_iteration(NULL, TRUE);
+
+	g_byte_array_unref(tlvs);
+	g_byte_array_unref(stream);
+}
+
+/*
+ * Keep a few hundred service requests outstanding and answer them in
+ * reverse order, so every response has to be matched against a full
+ * table of pending transactions.
+ */
+static void test_pipeline(void)
+{
+	guint count = g_test_perf() ? PIPELINE_PERF_REQUESTS :
+							PIPELINE_REQUESTS;
+	struct test_data data;
+	GByteArray *requests = g_byte_array_new();
+	GByteArray *stream = g_byte_array_new();
+	uint16_t *tids = g_new0(uint16_t, count);
+	guint window = MIN(count, PIPELINE_REQUESTS);
+	guint sent = 0;
+	gsize offset;
+	gdouble elapsed;
+	guint i;
+
+	test_setup(&data);
+	setup_service(&data);
+
+	g_test_timer_start();
+
+	while (sent < count) {
+		guint batch = MIN(window, count - sent);
+		uint8_t buf[4096];
+		guint seen = 0;
+
+		for (i = 0; i < batch; i++) {
+			tids[sent + i] = qmi_service_send(data.service,
+						TEST_MESSAGE, NULL,
+						send_cb, &data, NULL);
+			g_assert(tids[sent + i] != 0);
+		}
+
+		/* Collect the whole batch of requests on the wire */
+		g_byte_array_set_size(requests, 0);
+
+		while (seen < batch) {
+			ssize_t len = peer_recv(&data, buf, sizeof(buf));
+
+			g_byte_array_append(requests, buf, len);
+
+			for (offset = 0, seen = 0; offset + 9 <= requests->len;
+								seen++) {
+				const uint8_t *frame = requests->data + offset;
+				gsize flen = (frame[1] | (frame[2] << 8)) + 1;
+
+				if (offset + flen > requests->len)
+					break;
+
+				g_assert((frame[7] | (frame[8] << 8)) ==
+							tids[sent + seen]);
+				offset += flen;
+			}
+		}
+
+		g_byte_array_set_size(stream, 0);
+
+		for (i = batch; i > 0; i--)
+			put_service_response(stream, tids[sent + i - 1]);
+
+		g_assert(write(data.peer, stream->data, stream->len) ==
+						(ssize_t) stream->len);
+
+		sent += batch;
+
+		while (data.responses < sent)
+			g_main_context_iteration(NULL, TRUE);
+	}
+
+	elapsed = g_test_timer_elapsed();
+
+	g_assert(data.responses == count);
+
+	if (g_test_perf())
+		g_test_minimized_result(elapsed / count * 1e6,
+				"%u requests in %.3f s, %.2f us per request",
+				count, elapsed, elapsed / count * 1e6);
+
+	g_free(tids);
+	g_byte_array_unref(stream);
+	g_byte_array_unref(requests);
+	test_teardown(&data);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testqmi/bytewise", test_bytewise);
+	g_test_add_func("/testqmi/burst", test_burst);
+	g_test_add_func("/testqmi/pipeline", test_pipeline);
+
+	return g_test_run();
+}
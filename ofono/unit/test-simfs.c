@@ -0,0 +1,607 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "ofono.h"
+#include "simfs.h"
+
+#define TEST_(name) "/simfs/" name
+
+#define TEST_EF_A 0x6f07
+#define TEST_EF_B 0x6fad
+#define TEST_EF_C 0x6f46
+
+enum test_req_type {
+	TEST_REQ_INFO,
+	TEST_REQ_READ,
+	TEST_REQ_RECORD,
+	TEST_REQ_WRITE,
+};
+
+/* A request the fake driver has been given and not completed yet */
+struct test_req {
+	enum test_req_type type;
+	int id;
+	int arg;			/* Offset or record number */
+	int length;
+	gconstpointer cb;
+	void *data;
+};
+
+/* Fake ofono_sim, nothing gets cached unless it has an IMSI */
+
+struct ofono_sim {
+	const char *imsi;
+};
+
+static struct ofono_sim test_sim;
+static GPtrArray *test_reqs;
+static GString *test_log;
+
+const char *ofono_sim_get_imsi(struct ofono_sim *sim)
+{
+	return sim->imsi;
+}
+
+enum ofono_sim_phase ofono_sim_get_phase(struct ofono_sim *sim)
+{
+	return sim->imsi ? OFONO_SIM_PHASE_3G : OFONO_SIM_PHASE_UNKNOWN;
+}
+
+struct ofono_sim_aid_session *__ofono_sim_get_session_by_aid(
+		struct ofono_sim *sim, const struct sim_aid *aid)
+{
+	return NULL;
+}
+
+unsigned int __ofono_sim_add_session_watch(
+				struct ofono_sim_aid_session *session,
+				ofono_sim_session_event_cb_t notify,
+				void *data, ofono_destroy_func destroy)
+{
+	g_assert_not_reached();
+	return 0;
+}
+
+void __ofono_sim_remove_session_watch(struct ofono_sim_aid_session *session,
+					unsigned int id)
+{
+	g_assert_not_reached();
+}
+
+/* Fake driver, only queues the requests */
+
+static void test_req_add(enum test_req_type type, int id, int arg,
+				int length, gconstpointer cb, void *data)
+{
+	struct test_req *req = g_new0(struct test_req, 1);
+
+	req->type = type;
+	req->id = id;
+	req->arg = arg;
+	req->length = length;
+	req->cb = cb;
+	req->data = data;
+	g_ptr_array_add(test_reqs, req);
+}
+
+static void test_read_file_info(struct ofono_sim *sim, int fileid,
+				const unsigned char *path,
+				unsigned int path_len,
+				ofono_sim_file_info_cb_t cb, void *data)
+{
+	test_req_add(TEST_REQ_INFO, fileid, 0, 0, cb, data);
+}
+
+static void test_read_file_transparent(struct ofono_sim *sim, int fileid,
+					int start, int length,
+					const unsigned char *path,
+					unsigned int path_len,
+					ofono_sim_read_cb_t cb, void *data)
+{
+	test_req_add(TEST_REQ_READ, fileid, start, length, cb, data);
+}
+
+static void test_read_file_linear(struct ofono_sim *sim, int fileid,
+					int record, int length,
+					const unsigned char *path,
+					unsigned int path_len,
+					ofono_sim_read_cb_t cb, void *data)
+{
+	test_req_add(TEST_REQ_RECORD, fileid, record, length, cb, data);
+}
+
+static void test_write_file_transparent(struct ofono_sim *sim, int fileid,
+					int start, int length,
+					const unsigned char *value,
+					const unsigned char *path,
+					unsigned int path_len,
+					ofono_sim_write_cb_t cb, void *data)
+{
+	test_req_add(TEST_REQ_WRITE, fileid, start, length, cb, data);
+}
+
+static const struct ofono_sim_driver test_driver = {
+	.name			= "test",
+	.read_file_info		= test_read_file_info,
+	.read_file_transparent	= test_read_file_transparent,
+	.read_file_linear	= test_read_file_linear,
+	.write_file_transparent	= test_write_file_transparent,
+};
+
+/* Runs whatever sim_fs has scheduled */
+static void test_run(void)
+{
+	while (g_main_context_iteration(NULL, FALSE));
+}
+
+/* The number of requests the driver is working on */
+static guint test_pending(void)
+{
+	test_run();
+	return test_reqs->len;
+}
+
+static struct test_req *test_req_take(enum test_req_type type, int id)
+{
+	guint i;
+
+	test_run();
+
+	for (i = 0; i < test_reqs->len; i++) {
+		struct test_req *req = test_reqs->pdata[i];
+
+		if (req->type == type && req->id == id) {
+			g_ptr_array_remove_index(test_reqs, i);
+			return req;
+		}
+	}
+
+	g_assert_not_reached();
+	return NULL;
+}
+
+static gboolean test_req_exists(enum test_req_type type, int id)
+{
+	guint i;
+
+	test_run();
+
+	for (i = 0; i < test_reqs->len; i++) {
+		struct test_req *req = test_reqs->pdata[i];
+
+		if (req->type == type && req->id == id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void test_error(struct ofono_error *error, gboolean ok)
+{
+	error->type = ok ? OFONO_ERROR_TYPE_NO_ERROR :
+				OFONO_ERROR_TYPE_SIM;
+	error->error = ok ? 0 : 0x6a82;
+}
+
+static void test_complete_info(int id, gboolean ok,
+				enum ofono_sim_file_structure structure,
+				int length, int record_length)
+{
+	/* Only updated by ADM, i.e. cacheable */
+	static const unsigned char access[3] = { 0x04, 0x00, 0x44 };
+	struct test_req *req = test_req_take(TEST_REQ_INFO, id);
+	ofono_sim_file_info_cb_t cb = req->cb;
+	struct ofono_error error;
+
+	test_error(&error, ok);
+	cb(&error, length, structure, record_length, access, 0, req->data);
+	g_free(req);
+	test_run();
+}
+
+/* The data of a block or record is filled with its offset or number */
+static void test_complete_read(enum test_req_type type, int id,
+				gboolean ok)
+{
+	struct test_req *req = test_req_take(type, id);
+	ofono_sim_read_cb_t cb = req->cb;
+	unsigned char *data = g_malloc(req->length);
+	struct ofono_error error;
+
+	memset(data, req->arg, req->length);
+	test_error(&error, ok);
+	cb(&error, ok ? data : NULL, ok ? req->length : 0, req->data);
+	g_free(data);
+	g_free(req);
+	test_run();
+}
+
+static void test_complete_write(int id, gboolean ok)
+{
+	struct test_req *req = test_req_take(TEST_REQ_WRITE, id);
+	ofono_sim_write_cb_t cb = req->cb;
+	struct ofono_error error;
+
+	test_error(&error, ok);
+	cb(&error, req->data);
+	g_free(req);
+	test_run();
+}
+
+/* Callbacks log the EF, the result and the record or the length */
+
+static void test_read_cb(int ok, int total_length, int record,
+				const unsigned char *data, int record_length,
+				void *userdata)
+{
+	if (ok && record == 0)
+		g_string_append_printf(test_log, "%04x:%d:%d ",
+					GPOINTER_TO_INT(userdata), ok,
+					record_length);
+	else
+		g_string_append_printf(test_log, "%04x:%d:#%d ",
+					GPOINTER_TO_INT(userdata), ok, record);
+
+	if (ok && record > 0)
+		g_assert(data[0] == record);
+}
+
+static void test_info_cb(int ok, unsigned char file_status,
+				int total_length, int record_length,
+				void *userdata)
+{
+	g_string_append_printf(test_log, "%04x:%d:i ",
+				GPOINTER_TO_INT(userdata), ok);
+}
+
+static void test_write_cb(int ok, void *userdata)
+{
+	g_string_append_printf(test_log, "%04x:%d:w ",
+				GPOINTER_TO_INT(userdata), ok);
+}
+
+static void test_read(struct ofono_sim_context *context, int id,
+				enum ofono_sim_file_structure structure)
+{
+	g_assert(sim_fs_read(context, id, structure, 0, 0, NULL, 0,
+				test_read_cb, GINT_TO_POINTER(id)) == 0);
+}
+
+static void test_read_info(struct ofono_sim_context *context, int id)
+{
+	g_assert(sim_fs_read_info(context, id,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT,
+				NULL, 0, test_info_cb,
+				GINT_TO_POINTER(id)) == 0);
+}
+
+static void test_write(struct ofono_sim_context *context, int id)
+{
+	static const unsigned char value[4] = { 1, 2, 3, 4 };
+
+	g_assert(sim_fs_write(context, id, test_write_cb,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 0,
+				value, sizeof(value),
+				GINT_TO_POINTER(id)) == 0);
+}
+
+static struct sim_fs *test_init(unsigned int window)
+{
+	struct sim_fs *fs = sim_fs_new(&test_sim, &test_driver);
+
+	test_reqs = g_ptr_array_new();
+	test_log = g_string_new(NULL);
+
+	if (window)
+		sim_fs_set_max_ops(fs, window);
+
+	return fs;
+}
+
+static void test_cleanup(struct sim_fs *fs)
+{
+	g_assert_cmpuint(test_pending(), ==, 0);
+
+	sim_fs_free(fs);
+	g_ptr_array_free(test_reqs, TRUE);
+	g_string_free(test_log, TRUE);
+	test_reqs = NULL;
+	test_log = NULL;
+}
+
+static void test_callback_order(void)
+{
+	struct sim_fs *fs = test_init(4);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+
+	test_read(context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_FIXED);
+	test_read_info(context, TEST_EF_C);
+
+	/* Different EFs are read at the same time */
+	g_assert_cmpuint(test_pending(), ==, 3);
+
+	/* Completed in reverse, nothing is passed on before A is done */
+	test_complete_info(TEST_EF_C, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 5, 0);
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_FIXED, 6, 3);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "");
+
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 9, 0);
+	g_assert_cmpstr(test_log->str, ==, "");
+
+	test_complete_read(TEST_REQ_READ, TEST_EF_A, TRUE);
+	g_assert_cmpstr(test_log->str, ==,
+			"6f07:1:9 6fad:1:#1 6fad:1:#2 6f46:1:i ");
+
+	sim_fs_context_free(context);
+	test_cleanup(fs);
+}
+
+static void test_callback_order_error(void)
+{
+	struct sim_fs *fs = test_init(4);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+
+	test_read(context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	g_assert_cmpuint(test_pending(), ==, 2);
+
+	/* B fails first, the failure still comes after A */
+	test_complete_info(TEST_EF_B, FALSE, 0, 0, 0);
+	g_assert_cmpstr(test_log->str, ==, "");
+
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 4, 0);
+	test_complete_read(TEST_REQ_READ, TEST_EF_A, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:4 6fad:0:#0 ");
+
+	sim_fs_context_free(context);
+	test_cleanup(fs);
+}
+
+static void test_same_ef(void)
+{
+	struct sim_fs *fs = test_init(4);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+
+	test_read(context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read_info(context, TEST_EF_A);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+
+	/* The second operation on A waits, B doesn't */
+	g_assert_cmpuint(test_pending(), ==, 2);
+	g_assert(test_req_exists(TEST_REQ_INFO, TEST_EF_B));
+
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 3, 0);
+	g_assert_cmpuint(test_pending(), ==, 2);
+	g_assert(!test_req_exists(TEST_REQ_INFO, TEST_EF_A));
+
+	test_complete_read(TEST_REQ_READ, TEST_EF_A, TRUE);
+	g_assert(test_req_exists(TEST_REQ_INFO, TEST_EF_A));
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:3 ");
+
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 2, 0);
+	test_complete_read(TEST_REQ_READ, TEST_EF_B, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:3 ");
+
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 3, 0);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:3 6f07:1:i 6fad:1:2 ");
+
+	sim_fs_context_free(context);
+	test_cleanup(fs);
+}
+
+static void test_write_exclusive(void)
+{
+	struct sim_fs *fs = test_init(4);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+
+	test_read_info(context, TEST_EF_A);
+	test_write(context, TEST_EF_B);
+	test_read_info(context, TEST_EF_C);
+
+	/* The write waits for the read, the read after it for the write */
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+
+	g_assert_cmpuint(test_pending(), ==, 1);
+	g_assert(test_req_exists(TEST_REQ_WRITE, TEST_EF_B));
+	test_complete_write(TEST_EF_B, TRUE);
+
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_C, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:i 6fad:1:w 6f46:1:i ");
+
+	/* A write queued first holds back reads of other EFs as well */
+	g_string_truncate(test_log, 0);
+	test_write(context, TEST_EF_A);
+	test_read_info(context, TEST_EF_B);
+	g_assert_cmpuint(test_pending(), ==, 1);
+
+	test_complete_write(TEST_EF_A, FALSE);
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+	g_assert_cmpstr(test_log->str, ==, "6f07:0:w 6fad:1:i ");
+
+	sim_fs_context_free(context);
+	test_cleanup(fs);
+}
+
+static void test_cancel(void)
+{
+	struct sim_fs *fs = test_init(2);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+	struct ofono_sim_context *other = sim_fs_context_new(fs);
+
+	test_read(context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read(other, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read_info(context, TEST_EF_C);
+	g_assert_cmpuint(test_pending(), ==, 2);
+
+	/* A is in flight, C hasn't been started yet */
+	sim_fs_context_free(context);
+
+	/* B is done but has to wait until the driver is done with A */
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 2, 0);
+	test_complete_read(TEST_REQ_READ, TEST_EF_B, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "");
+
+	/* A doesn't go on reading and C never reaches the driver */
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 9, 0);
+	g_assert_cmpuint(test_pending(), ==, 0);
+	g_assert_cmpstr(test_log->str, ==, "6fad:1:2 ");
+
+	sim_fs_context_free(other);
+	test_cleanup(fs);
+}
+
+static void test_window_one(void)
+{
+	struct sim_fs *fs = test_init(0);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+
+	/* One at a time by default, the same as with a window of one */
+	test_read(context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_TRANSPARENT);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_FIXED);
+	test_read_info(context, TEST_EF_C);
+
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 300, 0);
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_read(TEST_REQ_READ, TEST_EF_A, TRUE);
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_read(TEST_REQ_READ, TEST_EF_A, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:300 ");
+
+	/* Records are passed on as they come */
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_FIXED, 4, 2);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:300 6fad:1:#1 ");
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_C, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+	g_assert_cmpstr(test_log->str, ==,
+			"6f07:1:300 6fad:1:#1 6fad:1:#2 6f46:1:i ");
+
+	/* Out of range windows are clamped */
+	sim_fs_set_max_ops(fs, 0);
+	test_read_info(context, TEST_EF_A);
+	test_read_info(context, TEST_EF_B);
+	g_assert_cmpuint(test_pending(), ==, 1);
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_TRANSPARENT, 1, 0);
+
+	sim_fs_context_free(context);
+	test_cleanup(fs);
+}
+
+static void test_shared_cache(void)
+{
+	struct sim_fs *fs = test_init(1);
+	struct sim_fs *isim = sim_fs_new(&test_sim, &test_driver);
+	struct ofono_sim_context *context = sim_fs_context_new(fs);
+	struct ofono_sim_context *isim_context = sim_fs_context_new(isim);
+
+	test_sim.imsi = "001010123456789";
+	sim_fs_cache_flush(fs);
+
+	/* A gets an area and the first of its 3 byte records is cached */
+	test_read(isim_context, TEST_EF_A, OFONO_SIM_FILE_STRUCTURE_FIXED);
+	test_complete_info(TEST_EF_A, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_FIXED, 6, 3);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_A, TRUE);
+
+	/* Flushed through the other sim_fs, B reuses the area of A */
+	sim_fs_cache_flush_file(fs, TEST_EF_A);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_FIXED);
+	test_complete_info(TEST_EF_B, TRUE,
+				OFONO_SIM_FILE_STRUCTURE_FIXED, 4, 1);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_B, TRUE);
+
+	/* The second record of A must not end up in there */
+	test_complete_read(TEST_REQ_RECORD, TEST_EF_A, TRUE);
+	g_assert_cmpstr(test_log->str, ==, "6f07:1:#1 6fad:1:#1 6fad:1:#2 "
+				"6fad:1:#3 6fad:1:#4 6f07:1:#2 ");
+
+	/* B comes from the cache, intact */
+	g_string_truncate(test_log, 0);
+	test_read(context, TEST_EF_B, OFONO_SIM_FILE_STRUCTURE_FIXED);
+	g_assert_cmpuint(test_pending(), ==, 0);
+	g_assert_cmpstr(test_log->str, ==,
+			"6fad:1:#1 6fad:1:#2 6fad:1:#3 6fad:1:#4 ");
+
+	sim_fs_cache_flush(fs);
+	test_sim.imsi = NULL;
+
+	sim_fs_context_free(isim_context);
+	sim_fs_context_free(context);
+	sim_fs_free(isim);
+	test_cleanup(fs);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func(TEST_("callback order"), test_callback_order);
+	g_test_add_func(TEST_("callback order with errors"),
+					test_callback_order_error);
+	g_test_add_func(TEST_("same EF"), test_same_ef);
+	g_test_add_func(TEST_("write exclusive"), test_write_exclusive);
+	g_test_add_func(TEST_("cancel"), test_cancel);
+	g_test_add_func(TEST_("window of one"), test_window_one);
+	g_test_add_func(TEST_("shared cache"), test_shared_cache);
+
+	return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 8
+ * indent-tabs-mode: t
+ * End:
+ */
@@ -415,6 +415,90 @@ static void test_eons(void)
 	sim_eons_free(eons_info);
 }
 
+/* PNN 1 Tux Comm, PNN 2 Solavei, PNN 3 T-Mobile */
+const unsigned char wildcard_efopl[][8] = {
+	/* 246 81, LACs 0x0010 - 0x001f */
+	{ 0x42, 0xf6, 0x18, 0x00, 0x10, 0x00, 0x1f, 0x02 },
+	/* 246 b1, all LACs */
+	{ 0x42, 0xf6, 0x1d, 0x00, 0x00, 0xff, 0xfe, 0x01 },
+	/* 246 81, all LACs, shadowed by the record above */
+	{ 0x42, 0xf6, 0x18, 0x00, 0x00, 0xff, 0xfe, 0x03 },
+	/* 246 82, LACs 0x0100 - 0x01ff */
+	{ 0x42, 0xf6, 0x28, 0x01, 0x00, 0x01, 0xff, 0x03 },
+	/* 24b 82, all LACs */
+	{ 0x42, 0xfd, 0x28, 0x00, 0x00, 0xff, 0xfe, 0x02 },
+	/* 246 82, LACs 0x0150 - 0x0300, shadowed except for the overlap */
+	{ 0x42, 0xf6, 0x28, 0x01, 0x50, 0x03, 0x00, 0x01 },
+	/* 246 81b, all LACs */
+	{ 0x42, 0xd6, 0x18, 0x00, 0x00, 0xff, 0xfe, 0x03 },
+	/* 246 83, all LACs, no name */
+	{ 0x42, 0xf6, 0x38, 0x00, 0x00, 0xff, 0xfe, 0x00 },
+	/* 246 b3, all LACs */
+	{ 0x42, 0xf6, 0x3d, 0x00, 0x00, 0xff, 0xfe, 0x01 },
+};
+
+static void test_eons_wildcards(void)
+{
+	const struct sim_eons_operator_info *op_info;
+	struct sim_eons *eons_info;
+	unsigned int i;
+
+	eons_info = sim_eons_new(3);
+
+	sim_eons_add_pnn_record(eons_info, 1,
+			valid_efpnn[0], sizeof(valid_efpnn[0]));
+	sim_eons_add_pnn_record(eons_info, 2,
+			valid_efpnn_2[0], sizeof(valid_efpnn_2[0]));
+	sim_eons_add_pnn_record(eons_info, 3,
+			valid_efpnn_2[1], sizeof(valid_efpnn_2[1]));
+
+	for (i = 0; i < G_N_ELEMENTS(wildcard_efopl); i++)
+		sim_eons_add_opl_record(eons_info, wildcard_efopl[i],
+					sizeof(wildcard_efopl[i]));
+
+	sim_eons_optimize(eons_info);
+
+	/* The first matching record wins, wildcard or not */
+	op_info = sim_eons_lookup(eons_info, "246", "81");
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Tux Comm"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "81", 0x0015);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "81", 0x0020);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Tux Comm"));
+
+	/* LAC ranges are ignored without a LAC */
+	op_info = sim_eons_lookup(eons_info, "246", "82");
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "82", 0x0180);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "T-Mobile"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "82", 0x0250);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	/* A wildcard digit doesn't match a missing digit */
+	op_info = sim_eons_lookup(eons_info, "246", "812");
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "T-Mobile"));
+
+	op_info = sim_eons_lookup(eons_info, "245", "81");
+	g_assert(op_info == NULL);
+
+	/* Record id 0 stops the search */
+	op_info = sim_eons_lookup(eons_info, "246", "83");
+	g_assert(op_info == NULL);
+
+	sim_eons_free(eons_info);
+}
+
 static void test_ef_db(void)
 {
 	struct sim_ef_info *info;
@@ -715,6 +799,7 @@ int main(int argc, char **argv)
 	g_test_add_func("/testsimutil/ber tlv encode 3G Status response",
 			test_ber_tlv_builder_3g_status);
 	g_test_add_func("/testsimutil/EONS Handling", test_eons);
+	g_test_add_func("/testsimutil/EONS Wildcards", test_eons_wildcards);
 	g_test_add_func("/testsimutil/Elementary File DB", test_ef_db);
 	g_test_add_func("/testsimutil/3G Status response", test_3g_status_data);
 	g_test_add_func("/testsimutil/Application entries decoding",
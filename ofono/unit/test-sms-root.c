@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -88,7 +89,7 @@ static void test_serialize_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -116,12 +117,402 @@ static void test_serialize_assembly(void)
 	sms_assembly_free(assembly);
 }
 
+#define TX_TEST_UUID1 "0123456789ABCDEF0123456789ABCDEF01234567"
+#define TX_TEST_UUID2 "89ABCDEF0123456789ABCDEF0123456789ABCDEF"
+
+static void tx_test_store(const char *imsi, unsigned long id,
+				unsigned long flags, const char *uuid,
+				const char *text)
+{
+	GSList *msgs = sms_text_prepare("+1234567", text, 1, TRUE, FALSE);
+	GSList *l;
+	guint8 seq;
+
+	g_assert(msgs);
+
+	for (l = msgs, seq = 0; l; l = l->next, seq++) {
+		unsigned char pdu[176];
+		int pdu_len, tpdu_len;
+
+		g_assert(sms_encode(l->data, &pdu_len, &tpdu_len, pdu));
+		g_assert(sms_tx_backup_store(imsi, id, flags, uuid, seq,
+						pdu, pdu_len, tpdu_len));
+	}
+
+	g_slist_free_full(msgs, g_free);
+}
+
+static void tx_test_free_queue(GQueue *q)
+{
+	struct txq_backup_entry *entry;
+
+	while ((entry = g_queue_pop_head(q))) {
+		g_slist_free_full(entry->msg_list, g_free);
+		g_free(entry);
+	}
+
+	g_queue_free(q);
+}
+
+static void test_serialize_tx_queue(void)
+{
+	const char *imsi = "1234";
+	const char *text = "This message is long enough to be split into "
+		"three PDUs even though it fits the default alphabet, which "
+		"takes up to 153 characters per PDU of a concatenated message. "
+		"The first PDU is removed once it's been sent and the other two "
+		"have to survive reloading the queue from the backup, with the "
+		"ids of the messages renumbered in the order they were queued.";
+	struct txq_backup_entry *entry;
+	unsigned long id;
+	GQueue *q;
+
+	/* Start from scratch, the ids are renumbered by loading */
+	q = sms_tx_queue_load(imsi);
+	g_assert(q);
+	for (id = 0; (entry = g_queue_peek_nth(q, id)); id++) {
+		char uuid[SMS_MSGID_LEN * 2 + 1];
+
+		encode_hex_own_buf(entry->uuid, SMS_MSGID_LEN, 0, uuid);
+		sms_tx_backup_free(imsi, id, entry->flags, uuid);
+	}
+	tx_test_free_queue(q);
+
+	tx_test_store(imsi, 7, 1, TX_TEST_UUID2, "Hi");
+	tx_test_store(imsi, 3, 8, TX_TEST_UUID1, text);
+
+	/* The first pdu of the first message has been sent */
+	sms_tx_backup_remove(imsi, 3, 8, TX_TEST_UUID1, 0);
+	sms_tx_backup_close(imsi);
+
+	/* Ordered by id, which are renumbered */
+	q = sms_tx_queue_load(imsi);
+	g_assert(q);
+	g_assert_cmpuint(g_queue_get_length(q), == ,2);
+	entry = g_queue_peek_nth(q, 0);
+	g_assert_cmpuint(entry->flags, == ,8);
+	g_assert_cmpuint(g_slist_length(entry->msg_list), == ,2);
+	entry = g_queue_peek_nth(q, 1);
+	g_assert_cmpuint(entry->flags, == ,1);
+	g_assert_cmpuint(g_slist_length(entry->msg_list), == ,1);
+	tx_test_free_queue(q);
+	sms_tx_backup_close(imsi);
+
+	/* The new ids have been stored */
+	sms_tx_backup_free(imsi, 0, 8, TX_TEST_UUID1);
+	sms_tx_backup_close(imsi);
+	q = sms_tx_queue_load(imsi);
+	g_assert_cmpuint(g_queue_get_length(q), == ,1);
+	tx_test_free_queue(q);
+
+	/* Which has moved up to the head of the queue */
+	sms_tx_backup_free(imsi, 0, 1, TX_TEST_UUID2);
+	q = sms_tx_queue_load(imsi);
+	g_assert_cmpuint(g_queue_get_length(q), == ,0);
+	tx_test_free_queue(q);
+	sms_tx_backup_close(imsi);
+}
+
+static void test_migrate_tx_queue(void)
+{
+	const char *imsi = "5678";
+	char *dir = g_strdup_printf(STORAGEDIR "/%s/tx_queue/%d-%d-%s",
+						imsi, 5, 8, TX_TEST_UUID1);
+	char *file = g_strdup_printf("%s/000", dir);
+	GSList *msgs = sms_text_prepare("+1234567", "Hi", 1, TRUE, FALSE);
+	unsigned char buf[177];
+	int pdu_len, tpdu_len;
+	GQueue *q;
+
+	g_assert(msgs);
+	g_assert(sms_encode(msgs->data, &pdu_len, &tpdu_len, buf + 1));
+	buf[0] = tpdu_len;
+	g_slist_free_full(msgs, g_free);
+
+	/* The layout used by older versions */
+	g_assert(!g_mkdir_with_parents(dir, 0700));
+	g_assert(g_file_set_contents(file, (char *) buf, pdu_len + 1, NULL));
+
+	q = sms_tx_queue_load(imsi);
+	g_assert(q);
+	g_assert_cmpuint(g_queue_get_length(q), == ,1);
+	tx_test_free_queue(q);
+
+	/* The old files are gone */
+	g_assert(!g_file_test(file, G_FILE_TEST_EXISTS));
+	g_assert(!g_file_test(dir, G_FILE_TEST_EXISTS));
+	sms_tx_backup_close(imsi);
+
+	/* But the message is still there */
+	q = sms_tx_queue_load(imsi);
+	g_assert_cmpuint(g_queue_get_length(q), == ,1);
+	tx_test_free_queue(q);
+
+	sms_tx_backup_free(imsi, 0, 8, TX_TEST_UUID1);
+	sms_tx_backup_close(imsi);
+
+	g_free(file);
+	g_free(dir);
+}
+
+static void test_migrate_assembly(void)
+{
+	const char *imsi = "9012";
+	const char *pdus[] = { assembly_pdu1, assembly_pdu2 };
+	const int tpdu_lens[] = { assembly_pdu_len1, assembly_pdu_len2 };
+	char *journal = g_strdup_printf(STORAGEDIR "/%s/sms_assembly.journal",
+									imsi);
+	char *dir = NULL;
+	struct sms_assembly *assembly;
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	GSList *l;
+	unsigned int i;
+
+	unlink(journal);
+
+	/* The first two fragments, stored the way older versions did */
+	for (i = 0; i < G_N_ELEMENTS(pdus); i++) {
+		DECLARE_SMS_ADDR_STR(straddr);
+		unsigned char buf[177];
+		char *file;
+
+		decode_hex_own_buf(pdus[i], -1, &pdu_len, 0, buf + 1);
+		buf[0] = tpdu_lens[i];
+		g_assert(sms_decode(buf + 1, pdu_len, FALSE, tpdu_lens[i],
+									&sms));
+		sms_extract_concatenation(&sms, &ref, &max, &seq);
+		g_assert(sms_address_to_hex_string(&sms.deliver.oaddr,
+								straddr));
+
+		g_free(dir);
+		dir = g_strdup_printf(STORAGEDIR "/%s/sms_assembly/%s-%i-%i",
+						imsi, straddr, ref, max);
+		file = g_strdup_printf("%s/%03i", dir, seq);
+		g_assert(!g_mkdir_with_parents(dir, 0700));
+		g_assert(g_file_set_contents(file, (char *) buf, pdu_len + 1,
+								NULL));
+		g_free(file);
+	}
+
+	assembly = sms_assembly_new(imsi);
+	g_assert_cmpuint(g_hash_table_size(assembly->assembly_table), == ,1);
+
+	/* The old files are gone */
+	g_assert(!g_file_test(dir, G_FILE_TEST_EXISTS));
+
+	/* The last fragment completes the migrated ones */
+	decode_hex_own_buf(assembly_pdu3, -1, &pdu_len, 0, pdu);
+	g_assert(sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len3, &sms));
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+					&sms.deliver.oaddr, ref, max, seq);
+	g_assert_cmpuint(g_slist_length(l), == ,3);
+	g_slist_free_full(l, g_free);
+	sms_assembly_free(assembly);
+
+	/* And nothing is left in the journal */
+	assembly = sms_assembly_new(imsi);
+	g_assert_cmpuint(g_hash_table_size(assembly->assembly_table), == ,0);
+	sms_assembly_free(assembly);
+
+	g_free(dir);
+	g_free(journal);
+}
+
+static void test_load_assembly(void)
+{
+	const char *imsi = "5678";
+	static const time_t ts[] = { 300, 100, 200 };
+	char *journal = g_strdup_printf(STORAGEDIR "/%s/sms_assembly.journal",
+									imsi);
+	struct sms_assembly *assembly;
+	struct sms_assembly_node *node;
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	GSList *l;
+	unsigned int i;
+
+	unlink(journal);
+
+	/* Stored in a different order than they've been received */
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	g_assert(sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms));
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+
+	assembly = sms_assembly_new(imsi);
+
+	for (i = 0; i < G_N_ELEMENTS(ts); i++) {
+		l = sms_assembly_add_fragment(assembly, &sms, ts[i],
+					&sms.deliver.oaddr, i + 1, max, seq);
+		g_assert(l == NULL);
+	}
+
+	sms_assembly_free(assembly);
+
+	/* Loaded oldest first, so the limits drop the oldest */
+	assembly = sms_assembly_new(imsi);
+	g_assert_cmpuint(assembly->assembly_queue.length, == ,3);
+
+	node = g_queue_peek_head(&assembly->assembly_queue);
+	g_assert_cmpuint(node->ref, == ,2);
+	node = g_queue_peek_tail(&assembly->assembly_queue);
+	g_assert_cmpuint(node->ref, == ,1);
+
+	sms_assembly_set_limits(assembly, 1, SMS_ASSEMBLY_DEFAULT_MAX_BYTES);
+	g_assert_cmpuint(assembly->assembly_queue.length, == ,1);
+	node = g_queue_peek_head(&assembly->assembly_queue);
+	g_assert_cmpuint(node->ref, == ,1);
+	g_assert(node->link == assembly->assembly_queue.head);
+	sms_assembly_free(assembly);
+
+	/* Only the survivor's backup is left */
+	assembly = sms_assembly_new(imsi);
+	g_assert_cmpuint(assembly->assembly_queue.length, == ,1);
+	node = g_queue_peek_head(&assembly->assembly_queue);
+	g_assert_cmpuint(node->ref, == ,1);
+
+	sms_assembly_set_limits(assembly, 0, 0);
+	sms_assembly_free(assembly);
+
+	g_free(journal);
+}
+
+static char *tx_test_journal(const char *imsi)
+{
+	char *path = g_strdup_printf(STORAGEDIR "/%s/tx_queue.journal", imsi);
+
+	/* Start with an empty queue */
+	sms_tx_backup_close(imsi);
+	unlink(path);
+
+	return path;
+}
+
+static off_t tx_test_journal_size(const char *imsi, const char *path)
+{
+	struct stat st;
+
+	sms_tx_backup_close(imsi);
+	g_assert(stat(path, &st) == 0);
+
+	return st.st_size;
+}
+
+static unsigned int tx_test_load_count(const char *imsi)
+{
+	GQueue *q = sms_tx_queue_load(imsi);
+	unsigned int count;
+
+	g_assert(q);
+	count = g_queue_get_length(q);
+	tx_test_free_queue(q);
+
+	return count;
+}
+
+static void tx_test_corrupt(const char *path, off_t offset)
+{
+	gchar *contents;
+	gsize len;
+
+	g_assert(g_file_get_contents(path, &contents, &len, NULL));
+	g_assert((gsize) offset < len);
+	contents[offset] ^= 0x5a;
+	g_assert(g_file_set_contents(path, contents, len, NULL));
+	g_free(contents);
+}
+
+static void test_recover_tx_queue(void)
+{
+	const char *imsi = "3456";
+	char *path = tx_test_journal(imsi);
+	off_t size1, size2;
+
+	/* Ids match the load order, loading doesn't rename anything */
+	tx_test_store(imsi, 0, 8, TX_TEST_UUID1, "Hi");
+	size1 = tx_test_journal_size(imsi, path);
+	tx_test_store(imsi, 1, 8, TX_TEST_UUID2, "Hi");
+	size2 = tx_test_journal_size(imsi, path);
+	g_assert(size2 > size1);
+
+	/* A torn record is dropped, what precedes it survives */
+	g_assert(truncate(path, size2 - 1) == 0);
+	g_assert_cmpuint(tx_test_load_count(imsi), == ,1);
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,size1);
+
+	/* So is a record failing the CRC check */
+	tx_test_store(imsi, 1, 8, TX_TEST_UUID2, "Hi");
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,size2);
+	tx_test_corrupt(path, size1 + 6);
+	g_assert_cmpuint(tx_test_load_count(imsi), == ,1);
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,size1);
+
+	/* Replay stops there, intact records after it are lost too */
+	tx_test_store(imsi, 1, 8, TX_TEST_UUID2, "Hi");
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,size2);
+	tx_test_corrupt(path, 4 + 6);
+	g_assert_cmpuint(tx_test_load_count(imsi), == ,0);
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,4);
+
+	/* Not a journal at all */
+	g_assert(g_file_set_contents(path, "garbage", -1, NULL));
+	g_assert_cmpuint(tx_test_load_count(imsi), == ,0);
+	g_assert_cmpint(tx_test_journal_size(imsi, path), == ,4);
+
+	unlink(path);
+	g_free(path);
+}
+
+static void test_compact_tx_queue(void)
+{
+	const char *imsi = "7890";
+	char *path = tx_test_journal(imsi);
+	off_t record;
+	int i;
+
+	tx_test_store(imsi, 0, 8, TX_TEST_UUID1, "Hi");
+	record = tx_test_journal_size(imsi, path) - 4;
+
+	/* Without compaction this would append 200 records */
+	for (i = 0; i < 100; i++) {
+		tx_test_store(imsi, 1, 8, TX_TEST_UUID2, "Hi");
+		sms_tx_backup_free(imsi, 1, 8, TX_TEST_UUID2);
+	}
+
+	g_assert_cmpint(tx_test_journal_size(imsi, path), <, 4 + 64 * record);
+	g_assert_cmpuint(tx_test_load_count(imsi), == ,1);
+
+	unlink(path);
+	g_free(path);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/testsms/Test SMS Assembly Serialize",
 			test_serialize_assembly);
+	g_test_add_func("/testsms/Test SMS TX Queue Serialize",
+			test_serialize_tx_queue);
+	g_test_add_func("/testsms/Test SMS TX Queue Migrate",
+			test_migrate_tx_queue);
+	g_test_add_func("/testsms/Test SMS Assembly Migrate",
+			test_migrate_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Load",
+			test_load_assembly);
+	g_test_add_func("/testsms/Test SMS TX Queue Recover",
+			test_recover_tx_queue);
+	g_test_add_func("/testsms/Test SMS TX Queue Compact",
+			test_compact_tx_queue);
 
 	return g_test_run();
 }
@@ -1100,17 +1100,17 @@ static void test_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	sms_assembly_expire(assembly, time(NULL) + 40);
 
-	g_assert(g_slist_length(assembly->assembly_list) == 0);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
 
 	sms_extract_concatenation(&sms, &ref, &max, &seq);
 	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
 					&sms.deliver.oaddr, ref, max, seq);
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -1156,6 +1156,133 @@ static void test_assembly(void)
 	g_free(reencoded);
 }
 
+static void assembly_fragment(struct sms *sms, struct sms_address *addr,
+				unsigned int stream, guint8 seq)
+{
+	memset(sms, 0, sizeof(*sms));
+	sms->type = SMS_TYPE_DELIVER;
+	sms->deliver.udl = 1;
+	sms->deliver.ud[0] = seq;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->number_type = SMS_NUMBER_TYPE_INTERNATIONAL;
+	addr->numbering_plan = SMS_NUMBERING_PLAN_ISDN;
+	sprintf(addr->address, "1555%07u", stream);
+}
+
+static void test_assembly_limits(void)
+{
+	struct sms_assembly *assembly = sms_assembly_new(NULL);
+	struct sms_address addr;
+	struct sms sms;
+	unsigned int i;
+	GSList *l;
+
+	sms_assembly_set_limits(assembly, 4, SMS_ASSEMBLY_DEFAULT_MAX_BYTES);
+
+	/* Start six two part messages, only the last four survive */
+	for (i = 0; i < 6; i++) {
+		assembly_fragment(&sms, &addr, i, 1);
+		l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+						&addr, i, 2, 0);
+		g_assert(l == NULL);
+	}
+
+	g_assert(g_hash_table_size(assembly->assembly_table) == 4);
+
+	/* The evicted ones start over rather than complete */
+	assembly_fragment(&sms, &addr, 0, 2);
+	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+					&addr, 0, 2, 1);
+	g_assert(l == NULL);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 4);
+
+	assembly_fragment(&sms, &addr, 5, 2);
+	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+					&addr, 5, 2, 1);
+	g_assert(l != NULL);
+	g_assert(g_slist_length(l) == 2);
+	g_slist_free_full(l, g_free);
+
+	g_assert(g_hash_table_size(assembly->assembly_table) == 3);
+
+	/* Shrinking the byte limit drops everything but what fits */
+	sms_assembly_set_limits(assembly, 4, 2 * (sizeof(struct sms) +
+					sizeof(struct sms_assembly_node)));
+	g_assert(g_hash_table_size(assembly->assembly_table) == 2);
+	g_assert(assembly->bytes <= assembly->max_bytes);
+
+	sms_assembly_set_limits(assembly, 0, 0);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	g_assert(assembly->bytes == 0);
+
+	sms_assembly_free(assembly);
+}
+
+/*
+ * Interleaves the fragments of many concurrent multipart messages,
+ * delivering each message's fragments out of order.
+ */
+static void test_assembly_interleaved(void)
+{
+	struct sms_assembly *assembly = sms_assembly_new(NULL);
+	unsigned int streams = g_test_perf() ? 100000 : 2000;
+	const guint8 max = 5;
+	static const guint8 order[] = { 3, 0, 4, 2, 1 };
+	struct sms_address addr;
+	struct sms sms;
+	unsigned int completed = 0;
+	unsigned int i;
+	unsigned int j;
+	double elapsed;
+	GSList *l;
+	GSList *f;
+
+	sms_assembly_set_limits(assembly, streams, (size_t) -1);
+
+	g_test_timer_start();
+
+	for (j = 0; j < max; j++) {
+		for (i = 0; i < streams; i++) {
+			guint8 seq = order[(i + j) % max];
+
+			assembly_fragment(&sms, &addr, i, seq + 1);
+			l = sms_assembly_add_fragment(assembly, &sms,
+						time(NULL), &addr,
+						i & 0xffff, max, seq);
+
+			if (j < max - 1) {
+				g_assert(l == NULL);
+				continue;
+			}
+
+			g_assert(l != NULL);
+
+			for (f = l, seq = 1; f; f = f->next, seq++) {
+				struct sms *frag = f->data;
+
+				g_assert(frag->deliver.ud[0] == seq);
+			}
+
+			g_assert(seq == max + 1);
+			g_slist_free_full(l, g_free);
+			completed += 1;
+		}
+	}
+
+	elapsed = g_test_timer_elapsed();
+
+	if (g_test_perf())
+		g_test_minimized_result(elapsed, "%u x %u fragments: %.3f s",
+					streams, max, elapsed);
+
+	g_assert(completed == streams);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	g_assert(assembly->bytes == 0);
+
+	sms_assembly_free(assembly);
+}
+
 static const char *test_no_fragmentation_7bit = "This is testing !";
 static const char *expected_no_fragmentation_7bit = "079153485002020911000C915"
 			"348870420140000A71154747A0E4ACF41F4F29C9E769F4121";
@@ -1866,6 +1993,348 @@ static void test_decode_unicode(void)
 	g_free(decoded);
 }
 
+/*
+ * Stands in for a modem driver: holds the PDUs handed out by the
+ * window and lets the tests complete them in any order.
+ */
+struct tx_test_driver {
+	struct sms_tx_window *window;
+	struct sms_tx_submit *submit[16];
+	void *data[16];
+	guint8 pdu[16];
+	gboolean more[16];
+	unsigned int count;
+};
+
+static char tx_msg_a, tx_msg_b, tx_msg_c;
+
+static unsigned int tx_test_fill(struct tx_test_driver *driver)
+{
+	unsigned int added = 0;
+	struct sms_tx_submit *submit;
+	void *data;
+	guint8 pdu;
+	gboolean more;
+
+	while ((submit = sms_tx_window_next(driver->window, &data, &pdu,
+								&more))) {
+		unsigned int i = driver->count++;
+
+		g_assert(driver->count <= G_N_ELEMENTS(driver->submit));
+		driver->submit[i] = submit;
+		driver->data[i] = data;
+		driver->pdu[i] = pdu;
+		driver->more[i] = more;
+		added += 1;
+	}
+
+	g_assert_cmpuint(driver->count, <=, driver->window->size);
+
+	return added;
+}
+
+static void tx_test_check(struct tx_test_driver *driver, unsigned int i,
+					void *data, guint8 pdu, gboolean more)
+{
+	g_assert(i < driver->count);
+	g_assert(driver->data[i] == data);
+	g_assert_cmpuint(driver->pdu[i], ==, pdu);
+	g_assert(driver->more[i] == more);
+}
+
+static enum sms_tx_window_result tx_test_complete(
+					struct tx_test_driver *driver,
+					unsigned int i, gboolean ok,
+					void *expected)
+{
+	enum sms_tx_window_result result;
+	void *data;
+	guint8 pdu;
+
+	g_assert(i < driver->count);
+
+	result = sms_tx_window_done(driver->submit[i], ok, &data, &pdu);
+	g_assert(data == expected);
+	g_assert_cmpuint(pdu, ==, driver->pdu[i]);
+
+	driver->count -= 1;
+	memmove(driver->submit + i, driver->submit + i + 1,
+			(driver->count - i) * sizeof(driver->submit[0]));
+	memmove(driver->data + i, driver->data + i + 1,
+			(driver->count - i) * sizeof(driver->data[0]));
+	memmove(driver->pdu + i, driver->pdu + i + 1,
+			(driver->count - i) * sizeof(driver->pdu[0]));
+	memmove(driver->more + i, driver->more + i + 1,
+			(driver->count - i) * sizeof(driver->more[0]));
+
+	return result;
+}
+
+static void test_tx_window_single(void)
+{
+	struct tx_test_driver driver = { 0 };
+
+	driver.window = sms_tx_window_new(1, NULL);
+	sms_tx_window_add(driver.window, &tx_msg_a, 2);
+	sms_tx_window_add(driver.window, &tx_msg_b, 1);
+
+	/* One at a time, in order */
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 1);
+	tx_test_check(&driver, 0, &tx_msg_a, 0, TRUE);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_SENT);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 1);
+	tx_test_check(&driver, 0, &tx_msg_a, 1, TRUE);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_DONE);
+	sms_tx_window_remove(driver.window, &tx_msg_a);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 1);
+	tx_test_check(&driver, 0, &tx_msg_b, 0, FALSE);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_b) ==
+							SMS_TX_WINDOW_DONE);
+	sms_tx_window_remove(driver.window, &tx_msg_b);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 0);
+	g_assert(driver.window->pending == NULL);
+
+	sms_tx_window_free(driver.window);
+}
+
+static void test_tx_window_partial_failure(void)
+{
+	struct tx_test_driver driver = { 0 };
+
+	driver.window = sms_tx_window_new(4, NULL);
+	sms_tx_window_add(driver.window, &tx_msg_a, 3);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 3);
+	tx_test_check(&driver, 0, &tx_msg_a, 0, TRUE);
+	tx_test_check(&driver, 1, &tx_msg_a, 1, TRUE);
+	tx_test_check(&driver, 2, &tx_msg_a, 2, FALSE);
+
+	/* The last one completes first, then the first one fails */
+	g_assert(tx_test_complete(&driver, 2, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_SENT);
+	g_assert(tx_test_complete(&driver, 0, FALSE, &tx_msg_a) ==
+							SMS_TX_WINDOW_FAILED);
+
+	/* Only the failed PDU is submitted again */
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 1);
+	tx_test_check(&driver, 1, &tx_msg_a, 0, FALSE);
+	g_assert(sms_tx_window_started(driver.window, &tx_msg_a));
+
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_SENT);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_DONE);
+	g_assert(driver.window->pending == NULL);
+
+	sms_tx_window_free(driver.window);
+}
+
+static void test_tx_window_hold(void)
+{
+	struct tx_test_driver driver = { 0 };
+
+	driver.window = sms_tx_window_new(2, NULL);
+	sms_tx_window_add(driver.window, &tx_msg_a, 1);
+	sms_tx_window_add(driver.window, &tx_msg_b, 1);
+	sms_tx_window_add(driver.window, &tx_msg_c, 1);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 2);
+	tx_test_check(&driver, 0, &tx_msg_a, 0, TRUE);
+	tx_test_check(&driver, 1, &tx_msg_b, 0, TRUE);
+
+	/* A is going to be retried, nothing may overtake it meanwhile */
+	g_assert(tx_test_complete(&driver, 0, FALSE, &tx_msg_a) ==
+							SMS_TX_WINDOW_FAILED);
+	driver.window->hold = TRUE;
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 0);
+
+	/* B was already in flight, it still gets through */
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_b) ==
+							SMS_TX_WINDOW_DONE);
+	sms_tx_window_remove(driver.window, &tx_msg_b);
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 0);
+
+	/* The retry goes first, then the rest of the queue */
+	driver.window->hold = FALSE;
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 2);
+	tx_test_check(&driver, 0, &tx_msg_a, 0, TRUE);
+	tx_test_check(&driver, 1, &tx_msg_c, 0, FALSE);
+
+	g_assert(tx_test_complete(&driver, 1, TRUE, &tx_msg_c) ==
+							SMS_TX_WINDOW_DONE);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_DONE);
+
+	sms_tx_window_free(driver.window);
+}
+
+static void test_tx_window_forget(void)
+{
+	struct tx_test_driver driver = { 0 };
+
+	driver.window = sms_tx_window_new(3, NULL);
+	sms_tx_window_add(driver.window, &tx_msg_a, 2);
+	sms_tx_window_add(driver.window, &tx_msg_b, 1);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 3);
+	tx_test_check(&driver, 2, &tx_msg_b, 0, FALSE);
+
+	/* A gives up on the first failure with its second PDU in flight */
+	g_assert(tx_test_complete(&driver, 0, FALSE, &tx_msg_a) ==
+							SMS_TX_WINDOW_FAILED);
+	sms_tx_window_remove(driver.window, &tx_msg_a);
+	g_assert(!sms_tx_window_started(driver.window, &tx_msg_a));
+
+	/* The late completion is only accounted for */
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 0);
+	g_assert(tx_test_complete(&driver, 0, TRUE, NULL) ==
+							SMS_TX_WINDOW_IGNORED);
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_b) ==
+							SMS_TX_WINDOW_DONE);
+	sms_tx_window_remove(driver.window, &tx_msg_b);
+
+	g_assert(driver.window->pending == NULL);
+	g_assert(g_queue_is_empty(&driver.window->msgs));
+
+	sms_tx_window_free(driver.window);
+}
+
+static void test_tx_window_cancel(void)
+{
+	struct tx_test_driver driver = { 0 };
+
+	driver.window = sms_tx_window_new(3, NULL);
+	sms_tx_window_add(driver.window, &tx_msg_a, 2);
+	sms_tx_window_add(driver.window, &tx_msg_b, 2);
+	sms_tx_window_add(driver.window, &tx_msg_c, 1);
+
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 3);
+	tx_test_check(&driver, 2, &tx_msg_b, 0, TRUE);
+
+	/* Messages partly in flight can't be cancelled, the rest can */
+	g_assert(sms_tx_window_started(driver.window, &tx_msg_a));
+	g_assert(sms_tx_window_started(driver.window, &tx_msg_b));
+	g_assert(!sms_tx_window_started(driver.window, &tx_msg_c));
+	g_assert(!sms_tx_window_started(driver.window, &tx_msg_c + 1));
+
+	sms_tx_window_remove(driver.window, &tx_msg_c);
+
+	g_assert(tx_test_complete(&driver, 1, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_SENT);
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 1);
+	tx_test_check(&driver, 2, &tx_msg_b, 1, FALSE);
+
+	/* Nothing is left for the cancelled message */
+	g_assert(tx_test_complete(&driver, 0, TRUE, &tx_msg_a) ==
+							SMS_TX_WINDOW_DONE);
+	sms_tx_window_remove(driver.window, &tx_msg_a);
+	g_assert_cmpuint(tx_test_fill(&driver), ==, 0);
+
+	/* Removing the window with PDUs in flight */
+	sms_tx_window_free(driver.window);
+}
+
+/*
+ * Drives the window with a fake driver which completes each PDU after
+ * a fixed delay, the way a modem acknowledges submissions, and measures
+ * the message throughput for a given window size.
+ */
+struct tx_perf {
+	GMainLoop *loop;
+	struct sms_tx_window *window;
+	char *msgs;
+	unsigned int count;
+	unsigned int sent;
+	guint delay;
+};
+
+static void tx_perf_fill(struct tx_perf *perf);
+
+static gboolean tx_perf_complete(gpointer user_data)
+{
+	struct sms_tx_submit *submit = user_data;
+	struct tx_perf *perf = submit->window->user_data;
+	void *data;
+
+	if (sms_tx_window_done(submit, TRUE, &data, NULL) ==
+						SMS_TX_WINDOW_DONE) {
+		sms_tx_window_remove(perf->window, data);
+
+		if (++perf->sent == perf->count)
+			g_main_loop_quit(perf->loop);
+	}
+
+	tx_perf_fill(perf);
+
+	return FALSE;
+}
+
+static void tx_perf_fill(struct tx_perf *perf)
+{
+	struct sms_tx_submit *submit;
+
+	while ((submit = sms_tx_window_next(perf->window, NULL, NULL, NULL)))
+		g_timeout_add(perf->delay, tx_perf_complete, submit);
+}
+
+static double tx_perf_run(unsigned int size, unsigned int count,
+					guint8 num_pdus, guint delay)
+{
+	struct tx_perf perf;
+	double elapsed;
+	unsigned int i;
+
+	perf.loop = g_main_loop_new(NULL, FALSE);
+	perf.window = sms_tx_window_new(size, &perf);
+	perf.msgs = g_new0(char, count);
+	perf.count = count;
+	perf.sent = 0;
+	perf.delay = delay;
+
+	for (i = 0; i < count; i++)
+		sms_tx_window_add(perf.window, perf.msgs + i, num_pdus);
+
+	g_test_timer_start();
+	tx_perf_fill(&perf);
+	g_main_loop_run(perf.loop);
+	elapsed = g_test_timer_elapsed();
+
+	g_assert_cmpuint(perf.sent, ==, count);
+	g_assert(perf.window->pending == NULL);
+	g_assert(g_queue_is_empty(&perf.window->msgs));
+
+	sms_tx_window_free(perf.window);
+	g_main_loop_unref(perf.loop);
+	g_free(perf.msgs);
+
+	return count * 60 / elapsed;
+}
+
+static void test_tx_window_throughput(void)
+{
+	const unsigned int size = 4;
+	unsigned int count = g_test_perf() ? 40 : 8;
+	guint delay = g_test_perf() ? 25 : 1;
+	const guint8 num_pdus = 2;
+	double single;
+	double windowed;
+
+	single = tx_perf_run(1, count, num_pdus, delay);
+	windowed = tx_perf_run(size, count, num_pdus, delay);
+
+	if (g_test_perf()) {
+		g_test_maximized_result(single, "window 1: %.0f msg/min",
+								single);
+		g_test_maximized_result(windowed, "window %u: %.0f msg/min",
+							size, windowed);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	char long_string[152*33 + 1];
@@ -1914,6 +2383,9 @@ int main(int argc, char **argv)
 			&ems_udh_test_2, test_ems_udh);
 
 	g_test_add_func("/testsms/Test Assembly", test_assembly);
+	g_test_add_func("/testsms/Test Assembly Limits", test_assembly_limits);
+	g_test_add_func("/testsms/Test Assembly Interleaved",
+			test_assembly_interleaved);
 	g_test_add_func("/testsms/Test Prepare 7Bit", test_prepare_7bit);
 
 	g_test_add_data_func("/testsms/Test Prepare Concat",
@@ -1949,5 +2421,17 @@ int main(int argc, char **argv)
 
 	g_test_add_func("/testsms/Test Decode Unicode", test_decode_unicode);
 
+	g_test_add_func("/testsms/Test TX Window Single",
+			test_tx_window_single);
+	g_test_add_func("/testsms/Test TX Window Partial Failure",
+			test_tx_window_partial_failure);
+	g_test_add_func("/testsms/Test TX Window Hold", test_tx_window_hold);
+	g_test_add_func("/testsms/Test TX Window Forget",
+			test_tx_window_forget);
+	g_test_add_func("/testsms/Test TX Window Cancel",
+			test_tx_window_cancel);
+	g_test_add_func("/testsms/Test TX Window Throughput",
+						test_tx_window_throughput);
+
 	return g_test_run();
 }
@@ -24,6 +24,7 @@
 #endif
 
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
 #include <glib.h>
@@ -1012,6 +1013,431 @@ static void test_unicode_to_gsm(void)
 	}
 }
 
+static const char *bench_text = "Your verification code is 482913. It "
+			"expires in 10 minutes; do not share it (ref #A-77).";
+
+/*
+ * Runs every GSM code of each national language through decoding and
+ * re-encoding, and an ASCII text through each single shift table.
+ * Decoding the re-encoded data must reproduce the first decoding; with
+ * -m perf, reports the combined throughput.
+ */
+static void test_gsm_tables(void)
+{
+	int rounds = g_test_perf() ? 20000 : 10;
+	unsigned char gsm[128 * 3];
+	long gsm_len = 0;
+	long bytes = 0;
+	double elapsed;
+	int lang;
+	int r;
+	int c;
+
+	/* 0x1b on its own and doubled has no stable mapping in all tables */
+	for (c = 0; c < 128; c++) {
+		if (c == 0x1b)
+			continue;
+
+		gsm[gsm_len++] = c;
+		gsm[gsm_len++] = 0x1b;
+		gsm[gsm_len++] = c;
+	}
+
+	g_test_timer_start();
+
+	for (lang = GSM_DIALECT_DEFAULT; lang <= GSM_DIALECT_URDU; lang++) {
+		for (r = 0; r < rounds; r++) {
+			long nread;
+			long nwritten;
+			char *utf8;
+			char *decoded;
+			unsigned char *encoded;
+
+			utf8 = convert_gsm_to_utf8_with_lang(gsm, gsm_len,
+							&nread, NULL, 0,
+							lang, lang);
+			g_assert(utf8);
+			g_assert(nread == gsm_len);
+
+			encoded = convert_utf8_to_gsm_with_lang(utf8, -1,
+							NULL, &nwritten, 0,
+							lang, lang);
+			g_assert(encoded);
+
+			decoded = convert_gsm_to_utf8_with_lang(encoded,
+							nwritten, NULL, NULL,
+							0, lang, lang);
+			g_assert(decoded);
+			g_assert(strcmp(utf8, decoded) == 0);
+
+			g_free(utf8);
+			g_free(encoded);
+			g_free(decoded);
+
+			encoded = convert_utf8_to_gsm_with_lang(bench_text, -1,
+							NULL, &nwritten, 0,
+							GSM_DIALECT_DEFAULT,
+							lang);
+			g_assert(encoded);
+			g_assert(nwritten == (long) strlen(bench_text));
+
+			decoded = convert_gsm_to_utf8_with_lang(encoded,
+							nwritten, NULL, NULL,
+							0, GSM_DIALECT_DEFAULT,
+							lang);
+			g_assert(decoded);
+			g_assert(strcmp(bench_text, decoded) == 0);
+
+			g_free(encoded);
+			g_free(decoded);
+
+			bytes += gsm_len * 2 + nwritten * 2;
+		}
+	}
+
+	elapsed = g_test_timer_elapsed();
+
+	if (g_test_perf())
+		g_test_maximized_result(bytes / elapsed / 1e6,
+					"%.1f MB of GSM per second",
+					bytes / elapsed / 1e6);
+}
+
+/*
+ * Byte-at-a-time versions of the hex and 7-bit kernels, as they were
+ * before util.c learned to work a word at a time.  They serve as the
+ * reference the fast paths are checked against.
+ */
+static unsigned char *ref_decode_hex(const char *in, long len,
+					long *items_written,
+					unsigned char terminator,
+					unsigned char *buf)
+{
+	long i, j;
+	char c;
+	unsigned char b;
+
+	len &= ~0x1;
+
+	for (i = 0, j = 0; i < len; i++, j++) {
+		c = toupper(in[i]);
+
+		if (c >= '0' && c <= '9')
+			b = c - '0';
+		else if (c >= 'A' && c <= 'F')
+			b = 10 + c - 'A';
+		else
+			return NULL;
+
+		i += 1;
+
+		c = toupper(in[i]);
+
+		if (c >= '0' && c <= '9')
+			b = b * 16 + c - '0';
+		else if (c >= 'A' && c <= 'F')
+			b = b * 16 + 10 + c - 'A';
+		else
+			return NULL;
+
+		buf[j] = b;
+	}
+
+	if (terminator)
+		buf[j] = terminator;
+
+	if (items_written)
+		*items_written = j;
+
+	return buf;
+}
+
+static char *ref_encode_hex(const unsigned char *in, long len, char *buf)
+{
+	long i, j;
+	char c;
+
+	for (i = 0, j = 0; i < len; i++, j++) {
+		c = (in[i] >> 4) & 0xf;
+		buf[j] = c <= 9 ? '0' + c : 'A' + c - 10;
+
+		j += 1;
+
+		c = in[i] & 0xf;
+		buf[j] = c <= 9 ? '0' + c : 'A' + c - 10;
+	}
+
+	buf[j] = '\0';
+
+	return buf;
+}
+
+static unsigned char *ref_unpack_7bit(const unsigned char *in, long len,
+					int byte_offset, bool ussd,
+					long max_to_unpack, long *items_written,
+					unsigned char terminator,
+					unsigned char *buf)
+{
+	unsigned char rest = 0;
+	unsigned char *out = buf;
+	int bits = 7 - (byte_offset % 7);
+	long i;
+
+	if (len <= 0)
+		return NULL;
+
+	if (ussd == true)
+		max_to_unpack = len * 8 / 7;
+
+	for (i = 0; (i < len) && ((out-buf) < max_to_unpack); i++) {
+		*out = (in[i] & ((1 << bits) - 1)) << (7 - bits);
+		*out |= rest;
+		rest = (in[i] >> bits) & ((1 << (8-bits)) - 1);
+
+		if (i != 0 || bits == 7)
+			out++;
+
+		if ((out-buf) == max_to_unpack)
+			break;
+
+		if (bits == 1) {
+			*out = rest;
+			out++;
+			bits = 7;
+			rest = 0;
+		} else {
+			bits = bits - 1;
+		}
+	}
+
+	if (ussd && (((out - buf) % 8) == 0) && (*(out - 1) == '\r'))
+		out = out - 1;
+
+	if (terminator)
+		*out = terminator;
+
+	if (items_written)
+		*items_written = out - buf;
+
+	return buf;
+}
+
+static unsigned char *ref_pack_7bit(const unsigned char *in, long len,
+					int byte_offset, bool ussd,
+					long *items_written,
+					unsigned char *buf)
+{
+	int bits = 7 - (byte_offset % 7);
+	unsigned char *out = buf;
+	long i;
+	long total_bits;
+
+	if (len == 0)
+		return NULL;
+
+	total_bits = len * 7;
+
+	if (bits != 7) {
+		total_bits += bits;
+		bits = bits - 1;
+		*out = 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (bits != 7) {
+			*out |= (in[i] & ((1 << (7 - bits)) - 1)) <<
+					(bits + 1);
+			out++;
+		}
+
+		if (bits != 0)
+			*out = in[i] >> (7 - bits);
+
+		if (bits == 0)
+			bits = 7;
+		else
+			bits = bits - 1;
+	}
+
+	if (ussd && ((total_bits % 8) == 1))
+		*out |= '\r' << 1;
+
+	if (bits != 7)
+		out++;
+
+	if (ussd && ((total_bits % 8) == 0) && (in[len - 1] == '\r')) {
+		*out = '\r';
+		out++;
+	}
+
+	if (items_written)
+		*items_written = out - buf;
+
+	return buf;
+}
+
+#define FUZZ_MAX_LEN 200
+
+static void fuzz_fill(unsigned char *data, long len, const char *alphabet)
+{
+	int n = strlen(alphabet);
+	long i;
+
+	for (i = 0; i < len; i++) {
+		if (g_test_rand_int_range(0, 64) == 0)
+			data[i] = g_test_rand_int_range(0, 256);
+		else
+			data[i] = alphabet[g_test_rand_int_range(0, n)];
+	}
+}
+
+static void fuzz_hex(void)
+{
+	unsigned char data[FUZZ_MAX_LEN + 1];
+	unsigned char out[FUZZ_MAX_LEN + 1];
+	unsigned char ref[FUZZ_MAX_LEN + 1];
+	char hex[FUZZ_MAX_LEN * 2 + 1];
+	char ref_hex[FUZZ_MAX_LEN * 2 + 1];
+	long len = g_test_rand_int_range(0, FUZZ_MAX_LEN + 1);
+	long out_len;
+	long ref_len;
+	unsigned char *res;
+	unsigned char *ref_res;
+	long i;
+
+	for (i = 0; i < len; i++)
+		data[i] = g_test_rand_int_range(0, 256);
+
+	encode_hex_own_buf(data, len, 0, hex);
+	ref_encode_hex(data, len, ref_hex);
+	g_assert(strcmp(hex, ref_hex) == 0);
+
+	res = decode_hex_own_buf(hex, -1, &out_len, 0, out);
+	g_assert(res);
+	g_assert(out_len == len);
+	g_assert(memcmp(out, data, len) == 0);
+
+	/* Mixed case, the odd invalid character and odd lengths */
+	fuzz_fill(data, len, "0123456789abcdefABCDEF");
+
+	res = decode_hex_own_buf((char *) data, len, &out_len, 0xff, out);
+	ref_res = ref_decode_hex((char *) data, len, &ref_len, 0xff, ref);
+
+	g_assert((res == NULL) == (ref_res == NULL));
+
+	if (res) {
+		g_assert(out_len == ref_len);
+		g_assert(memcmp(out, ref, out_len + 1) == 0);
+	}
+}
+
+static void fuzz_7bit(void)
+{
+	unsigned char data[FUZZ_MAX_LEN];
+	unsigned char out[FUZZ_MAX_LEN * 2 + 2];
+	unsigned char ref[FUZZ_MAX_LEN * 2 + 2];
+	long len = g_test_rand_int_range(1, FUZZ_MAX_LEN + 1);
+	int offset = g_test_rand_int_range(0, 7);
+	bool ussd = g_test_rand_bit();
+	long max_to_unpack = g_test_rand_int_range(1, len * 8 / 7 + 2);
+	long out_len;
+	long ref_len;
+
+	fuzz_fill(data, len, "Hello\r@ 0123456789abcdefghijklmnopqrstuvwxyz");
+
+	/* The CR rules look one byte behind the output */
+	memset(out, 0xa5, sizeof(out));
+	memset(ref, 0xa5, sizeof(ref));
+
+	pack_7bit_own_buf(data, len, offset, ussd, &out_len, 0, out + 1);
+	ref_pack_7bit(data, len, offset, ussd, &ref_len, ref + 1);
+	g_assert(out_len == ref_len);
+	g_assert(memcmp(out, ref, sizeof(out)) == 0);
+
+	memset(out, 0xa5, sizeof(out));
+	memset(ref, 0xa5, sizeof(ref));
+
+	unpack_7bit_own_buf(data, len, offset, ussd, max_to_unpack,
+				&out_len, 0xff, out + 1);
+	ref_unpack_7bit(data, len, offset, ussd, max_to_unpack,
+				&ref_len, 0xff, ref + 1);
+	g_assert(out_len == ref_len);
+	g_assert(memcmp(out, ref, sizeof(out)) == 0);
+}
+
+/*
+ * Checks the word-at-a-time hex and 7-bit kernels against the byte-wise
+ * reference on random input, including offsets, the USSD CR rules and
+ * invalid hex digits.
+ */
+static void test_kernels_fuzz(void)
+{
+	int rounds = g_test_perf() ? 1000000 : 20000;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		fuzz_hex();
+		fuzz_7bit();
+	}
+}
+
+/*
+ * With -m perf, reports how fast a 64 KiB buffer goes through hex
+ * encoding, decoding, 7-bit packing and unpacking.
+ */
+static void test_kernels_perf(void)
+{
+	const long len = 64 * 1024;
+	unsigned char *data;
+	unsigned char *packed;
+	unsigned char *unpacked;
+	char *hex;
+	long written;
+	double elapsed;
+	long bytes = 0;
+	int rounds = g_test_perf() ? 2000 : 2;
+	int r;
+	long i;
+
+	data = g_new(unsigned char, len);
+	packed = g_new(unsigned char, len);
+	unpacked = g_new(unsigned char, len + 1);
+	hex = g_new(char, len * 2 + 1);
+
+	for (i = 0; i < len; i++)
+		data[i] = bench_text[i % strlen(bench_text)];
+
+	g_test_timer_start();
+
+	for (r = 0; r < rounds; r++) {
+		encode_hex_own_buf(data, len, 0, hex);
+		g_assert(decode_hex_own_buf(hex, len * 2, &written, 0,
+						unpacked));
+		g_assert(written == len);
+
+		pack_7bit_own_buf(data, len, 0, false, &written, 0, packed);
+		unpack_7bit_own_buf(packed, written, 0, false, len,
+					&written, 0, unpacked);
+		g_assert(written == len);
+
+		bytes += len * 4;
+	}
+
+	elapsed = g_test_timer_elapsed();
+
+	g_assert(memcmp(data, unpacked, len) == 0);
+
+	g_free(data);
+	g_free(packed);
+	g_free(unpacked);
+	g_free(hex);
+
+	if (g_test_perf())
+		g_test_maximized_result(bytes / elapsed / 1e6,
+					"%.1f MB per second",
+					bytes / elapsed / 1e6);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -1028,6 +1454,9 @@ int main(int argc, char **argv)
 	g_test_add_func("/testutil/SIM conversions", test_sim);
 	g_test_add_func("/testutil/Valid Unicode to GSM Conversion",
 			test_unicode_to_gsm);
+	g_test_add_func("/testutil/GSM Tables", test_gsm_tables);
+	g_test_add_func("/testutil/Kernels Fuzz", test_kernels_fuzz);
+	g_test_add_func("/testutil/Kernels Perf", test_kernels_perf);
 
 	return g_test_run();
 }